@@ -21,70 +21,76 @@
 
 @class MPQFile;
 
-#pragma options align=packed
-struct mpq_header {
-    uint32_t mpq_magic;
-    uint32_t header_size;
-    uint32_t archive_size;
-    uint16_t version;
-    uint16_t sector_size_shift;
-    uint32_t hash_table_offset;
-    uint32_t block_table_offset;
-    uint32_t hash_table_length;
-    uint32_t block_table_length;
-};
-typedef struct mpq_header mpq_header_t;
+// On-disk structures and the Foundation-free read path
+#import <MPQKit/MPQCore.h>
+#import <MPQKit/MPQSlotTable.h>
+#import <MPQKit/MPQStringArena.h>
 
-struct mpq_extended_header {
-    uint64_t extended_block_offset_table_offset;
-    uint16_t hash_table_offset_high;
-    uint16_t block_table_offset_high;
+/*!
+    @typedef MPQFileInfoFlags
+    @abstract Bits of the info_flags field of MPQFileInfo.
+    @constant MPQFileInfoHasCRC The crc field holds the file's CRC32 from the (attributes) file.
+    @constant MPQFileInfoHasCreationDate The creation_date field holds the file's creation date from the (attributes) file.
+    @constant MPQFileInfoHasMD5 The md5 field holds the file's MD5 digest from the (attributes) file.
+    @constant MPQFileInfoPendingAddition The file will be added when the archive is saved. Its size 
+        and archived_size fields are 0.
+    @constant MPQFileInfoCanOpenWithoutFilename The file can be opened with openFileAtPosition: without recovering 
+        its encryption key.
+*/
+enum {
+    MPQFileInfoHasCRC                   = 0x01,
+    MPQFileInfoHasCreationDate          = 0x02,
+    MPQFileInfoHasMD5                   = 0x04,
+    MPQFileInfoPendingAddition          = 0x100,
+    MPQFileInfoCanOpenWithoutFilename   = 0x200,
 };
-typedef struct mpq_extended_header mpq_extended_header_t;
+typedef uint32_t MPQFileInfoFlags;
 
-struct mpq_hash_table_entry {
+/*!
+    @typedef MPQFileInfo
+    @abstract Information about a file, read directly from the archive's tables.
+    @discussion The counterpart of the file information dictionaries for bulk listing. See 
+        getFileInfo:count:position: and getFileInfo:forPosition:error:.
+    @field hash_position The file's hash table position.
+    @field block_position The file's block table position.
+    @field hash_a The file's A hash.
+    @field hash_b The file's B hash.
+    @field locale The file's locale code.
+    @field platform The file's platform code.
+    @field flags The file's flags. See the MPQFileFlag enum in MPQSharedConstants.h.
+    @field info_flags See MPQFileInfoFlags.
+    @field size The size of the file in bytes.
+    @field archived_size The size of the file in the archive in bytes.
+    @field archive_offset The offset of the file's data from the start of the archive.
+    @field encryption_key The file's encryption key, or 0 if the file is not encrypted or the key is unknown. The key 
+        of a file whose name is unknown is only reported once it has been recovered, for example by opening the file.
+    @field sector_count The number of sectors of the file.
+    @field filename The file's path, or NULL if it is unknown. Owned by the archive and valid until the 
+        archive is released.
+    @field crc The file's CRC32.
+    @field creation_date The file's creation date as a NTFS file time.
+    @field md5 The file's MD5 digest.
+*/
+struct MPQFileInfo {
+    uint32_t hash_position;
+    uint32_t block_position;
     uint32_t hash_a;
     uint32_t hash_b;
     uint16_t locale;
     uint16_t platform;
-    uint32_t block_table_index;
-};
-typedef struct mpq_hash_table_entry mpq_hash_table_entry_t;
-
-struct mpq_block_table_entry {
-    uint32_t offset;
-    uint32_t archived_size;
-    uint32_t size;
     uint32_t flags;
+    MPQFileInfoFlags info_flags;
+    uint32_t size;
+    uint32_t archived_size;
+    off_t archive_offset;
+    uint32_t encryption_key;
+    uint32_t sector_count;
+    const char* filename;
+    uint32_t crc;
+    uint64_t creation_date;
+    uint8_t md5[16];
 };
-typedef struct mpq_block_table_entry mpq_block_table_entry_t;
-
-struct mpq_extended_block_offset_table_entry {
-    uint16_t offset_high;
-};
-typedef struct mpq_extended_block_offset_table_entry mpq_extended_block_offset_table_entry_t;
-
-struct mpq_attributes_header {
-    uint32_t magic;
-    uint32_t attributes;
-};
-typedef struct mpq_attributes_header mpq_attributes_header_t;
-
-#define MPQ_OLD_SIGNATURE_KEY_SIZE 512
-struct mpq_old_signature {
-    uint32_t unknown0;
-    uint32_t unknown4;
-    uint8_t signature[MPQ_OLD_SIGNATURE_KEY_SIZE / 8];
-};
-typedef struct mpq_old_signature mpq_old_signature_t;
-
-struct mpq_shunt {
-    uint32_t shunt_magic;
-    uint32_t unknown04;
-    uint32_t mpq_header_offset;
-};
-typedef struct mpq_shunt mpq_shunt_t;
-#pragma options align=reset
+typedef struct MPQFileInfo MPQFileInfo;
 
 // Internal types and structures for defered operations
 typedef NS_ENUM(unsigned int, MPQDeferredOperationType) {
@@ -115,6 +121,12 @@ struct mpq_deferred_operation_add_context {
     MPQDataSourceProxy* dataSourceProxy;
     uint32_t compressor;
     int32_t compression_quality;
+    
+    // Files merged from another archive have no data source. Their archived data is copied from source_handle.
+    NSFileHandle* source_handle;
+    off_t source_offset;
+    mpq_block_table_entry_t source_block_entry;
+    uint32_t source_key;
 };
 typedef struct mpq_deferred_operation_add_context mpq_deferred_operation_add_context_t;
 
@@ -173,8 +185,13 @@ typedef struct mpq_deferred_operation_delete_context mpq_deferred_operation_dele
     BOOL _fileCountCachesDirty;
     
     off_t* block_offset_table;
-    char** filename_table;
-    NSDictionary** file_info_cache;
+    uint32_t* block_free_map;
+    uint32_t block_free_map_cursor;
+    mpq_slot_table_t filename_table;
+    mpq_string_arena_t filename_arena;
+    mpq_slot_table_t file_info_cache;
+    uint32_t* file_info_cache_ring;
+    uint32_t file_info_cache_ring_index;
     
     void* attributes_data;
     uint32_t attributes_data_size;
@@ -183,19 +200,31 @@ typedef struct mpq_deferred_operation_delete_context mpq_deferred_operation_dele
     uint8_t* strong_signature;
     
     uint32_t open_file_count;
-    uint32_t* open_file_count_table;
-    
-    void* read_buffer;
-    void* compression_buffer;
+    mpq_slot_table_t open_file_count_table;
     
     mpq_deferred_operation_t* last_operation;
-    mpq_deferred_operation_t** operation_hash_table;
+    mpq_slot_table_t operation_hash_table;
     uint32_t deferred_operations_count;
     
-    uint32_t** sector_tables_cache;
-    uint32_t* encryption_keys_cache;
+    // Number of the oldest operations which cannot be undone because the hash table was resized after them
+    uint32_t rehashed_operations_count;
+    
+    mpq_slot_table_t sector_tables_cache;
+    mpq_slot_table_t encryption_keys_cache;
     
     uint32_t default_compressor;
+    MPQCachePolicy cache_policy;
+    NSString* index_cache_directory;
+    double maximum_hash_table_load;
+    
+    MPQCopyMethod last_copy_method;
+    NSTimeInterval last_copy_duration;
+    
+    BOOL journaled_saves;
+    
+    // Set during a journaled save. The structural tables of the committed archive are between these offsets.
+    off_t journal_tables_offset;
+    off_t journal_tables_end;
     
     id delegate;
 }
@@ -269,6 +298,9 @@ typedef struct mpq_deferred_operation_delete_context mpq_deferred_operation_dele
         MPQKit supports version 0 archives (the original format) and version 1
         archives (or extended archives) that were introduced in Burning Crusade. MPQVersion 
         constants are provided for known versions as well.
+        
+        In both cases, a value for the MPQArchiveCachePolicy key sets the instance's file cache policy, and a value 
+        for the MPQArchiveIndexCacheDirectory key enables index caches.
     @param attributes Dictionary of attributes. Cannot be nil.
     @param error Optional pointer to a NSError *.
     @result Returns the newly initialized MPQArchive object or nil on error.
@@ -510,6 +542,34 @@ typedef struct mpq_deferred_operation_delete_context mpq_deferred_operation_dele
 - (BOOL)verifyWarcraft3MapSignature:(NSError**)error;
 - (BOOL)verifyStarcraftMapSignature:(NSError**)error;
 
+#pragma mark verification
+
+/*!
+    @method verifyIntegrityWithOptions:progress:error:
+    @abstract Verifies the integrity of every file stored in the archive.
+    @discussion The checks performed on each file are selected by options. See the MPQVerificationOptions enum in 
+        MPQSharedConstants.h for a list of valid values.
+        
+        Files are verified concurrently on one thread per online processor, in archive offset order, 
+        and the kernel is asked to read ahead of the verification threads. The progress handler is 
+        invoked on the calling thread once per file, also in archive offset order. Its fileInfo argument is the 
+        file's information dictionary, and its error argument is nil if the file passed verification. 
+        The handler can return NO to stop verification, in which case this method fails with errDelegateCancelled.
+        
+        Encrypted files whose encryption key cannot be determined are reported to the progress handler with an 
+        errFilenameRequired error, but do not cause verification to fail. Files which are pending addition 
+        are not verified.
+        
+        This method will fail if the instance is not backed by an archive on disk.
+    @param options The checks to perform.
+    @param progress Optional progress handler.
+    @param error Optional pointer to a NSError *. On failure, will be the error of the first file that failed 
+        verification, in archive offset order. The error's user info dictionary contains the file's information 
+        dictionary under the MPQErrorFileInfo key.
+    @result Returns YES if every verified file passed all the requested checks, NO otherwise.
+*/
+- (BOOL)verifyIntegrityWithOptions:(MPQVerificationOptions)options progress:(BOOL (^)(NSDictionary* fileInfo, NSError* error))progress error:(NSError**)error;
+
 #pragma mark options
 
 /*! 
@@ -551,6 +611,35 @@ typedef struct mpq_deferred_operation_delete_context mpq_deferred_operation_dele
     @param store YES to make the instance save the listfile at save time or NO to prevent it from doing so.
 */
 
+/*! 
+    @method usesJournaledSaves
+    @abstract Returns whether or not in-place saves are journaled.
+    @discussion A regular in-place save writes new file data and the structural tables over the ones the archive 
+        on disk uses, so an interruption can leave an unusable archive. A journaled save appends new file data 
+        and structural tables to the archive file instead, without overwriting anything the archive on disk uses, 
+        and only switches the archive header to them once they are on stable storage. A save journal is kept 
+        next to the archive file (at the archive's path with "-journal" appended) while the save is in progress.
+        
+        If a journaled save is interrupted, the next time the archive is opened with write access, the save is 
+        completed if its data and tables made it to stable storage, or rolled back otherwise. If a journaled save 
+        fails, it is rolled back and the instance is left as it was before the save, like an atomic save.
+        
+        Journaled saves grow the archive file by the size of the structural tables each time. The space used by the 
+        previous tables is reused for file data by later saves.
+        
+        The default is NO, unless MPQArchiveJournaledSaves was specified at initialization time.
+    @result Returns YES if in-place saves are journaled or NO if they are not.
+*/
+@property (nonatomic) BOOL usesJournaledSaves;
+
+/*! 
+    @method setUsesJournaledSaves:
+    @abstract Sets whether or not in-place saves are journaled.
+    @discussion Only non-atomic saves to the instance's archive path are journaled. Atomic saves and save-as 
+        operations write a separate file and are not affected.
+    @param journaled YES to journal in-place saves or NO to overwrite the archive's structural tables directly.
+*/
+
 /*! 
     @method defaultCompressor
     @abstract Returns the current default compressor.
@@ -569,6 +658,25 @@ typedef struct mpq_deferred_operation_delete_context mpq_deferred_operation_dele
 */
 - (BOOL)setDefaultCompressor:(MPQCompressorFlag)compressor;
 
+/*! 
+    @method cachePolicy
+    @abstract Returns the file cache policy of the instance.
+    @discussion The default policy is MPQCachePolicyNoCache on Mac OS X and MPQCachePolicySystem on other systems, 
+        unless another policy was specified with the MPQArchiveCachePolicy key at initialization time.
+    @result A MPQCachePolicy constant. Please refer to the MPQCachePolicy documentation for more information.
+*/
+- (MPQCachePolicy)cachePolicy;
+
+/*! 
+    @method setCachePolicy:
+    @abstract Sets the file cache policy of the instance.
+    @discussion The policy is applied immediately to the archive file, and again whenever the archive file 
+        is re-opened, such as after a save.
+    @param policy A MPQCachePolicy constant.
+    @result YES on sucess or NO if policy is not a valid MPQCachePolicy constant.
+*/
+- (BOOL)setCachePolicy:(MPQCachePolicy)policy;
+
 #pragma mark file list
 
 /*! 
@@ -606,6 +714,35 @@ typedef struct mpq_deferred_operation_delete_context mpq_deferred_operation_dele
 - (BOOL)addArrayToFileList:(NSArray*)listfile;
 - (BOOL)addArrayToFileList:(NSArray*)listfile error:(NSError**)error;
 
+/*! 
+    @method addListfileDataToFileList:error:
+    @abstract Adds the entries of listfile data to the instance's internal list of files.
+    @discussion See the discussion on loadInternalListfile for more details on file lists.
+        
+        The data is parsed in place, without creating an object for each entry. Entries may be separated by 
+        CR, LF or semicolons. Entries which are not ASCII or are too long to be valid paths are ignored. 
+        Large listfiles are hashed on several threads.
+    @param data The listfile data. Must not be nil.
+    @param error Optional pointer to a NSError *.
+    @result YES on sucess or NO on failure.
+*/
+- (BOOL)addListfileDataToFileList:(NSData*)data error:(NSError**)error;
+
+/*! 
+    @method addHashDatabaseToFileList:error:
+    @abstract Resolves the names of the instance's unnamed files against a hash database.
+    @discussion See the discussion on loadInternalListfile for more details on file lists.
+        
+        A hash database holds known names along with their precomputed hashes, and is built from listfiles 
+        with the mpqhashdb tool. Each unnamed file in the archive is looked up in the database directly, 
+        so no name is hashed. The same data can be used with any number of archives, and mapping the 
+        database file (with NSMappedRead) avoids reading the parts of it that are not needed.
+    @param database The hash database data. Must not be nil.
+    @param error Optional pointer to a NSError *.
+    @result YES on sucess or NO if the data is not a valid hash database.
+*/
+- (BOOL)addHashDatabaseToFileList:(NSData*)database error:(NSError**)error;
+
 /*! 
     @method addContentsOfFileToFileList:
     @abstract Adds the entries of an external list of files to the instance's internal list of files.
@@ -630,6 +767,22 @@ typedef struct mpq_deferred_operation_delete_context mpq_deferred_operation_dele
 */
 @property (nonatomic, readonly, copy) NSArray *fileList;
 
+/*!
+    @method writeIndexCache:
+    @abstract Writes the instance's index cache.
+    @discussion The index cache stores the archive's decrypted tables, along with the encryption keys, file paths
+        and sector tables the instance knows about, in the directory specified with the MPQArchiveIndexCacheDirectory
+        key at initialization time. The next MPQArchive instance opened on the same archive with the same directory
+        will load its tables and internal list of files from the index cache, as long as the archive has not changed.
+
+        An index cache is written automatically when an archive is opened without one, and rewritten when the 
+        archive is saved. Call this method after loading external lists of files to have them persisted as well.
+    @param error Optional pointer to a NSError *.
+    @result YES on sucess or NO on failure. Fails if the instance has no index cache directory or if the instance
+        has unsaved changes.
+*/
+- (BOOL)writeIndexCache:(NSError**)error;
+
 #pragma mark file info
 
 /*! 
@@ -697,6 +850,33 @@ typedef struct mpq_deferred_operation_delete_context mpq_deferred_operation_dele
 - (NSDictionary*)fileInfoForPosition:(uint32_t)hash_position;
 - (NSDictionary*)fileInfoForPosition:(uint32_t)hash_position error:(NSError**)error;
 
+/*!
+    @method getFileInfo:count:position:
+    @abstract Fills an array of MPQFileInfo structures with the information of the files found from a hash table position.
+    @discussion This is the allocation-free counterpart of fileInfoEnumerator, meant for listing large archives. Start 
+        with a position of 0 and call the method again until it returns 0. The size of files pending addition is not 
+        reported; those files have the MPQFileInfoPendingAddition info flag.
+        
+        The filename fields point into the archive's name table and stay valid until the archive is released.
+    @param info_array An array of at least count MPQFileInfo structures. Must not be NULL.
+    @param count The number of structures in info_array.
+    @param hash_position The hash table position to start from. Updated to the position following the last file 
+        returned. Must not be NULL.
+    @result The number of structures filled. 0 once every file has been returned.
+*/
+- (uint32_t)getFileInfo:(MPQFileInfo*)info_array count:(uint32_t)count position:(uint32_t*)hash_position;
+
+/*!
+    @method getFileInfo:forPosition:error:
+    @abstract Fills a MPQFileInfo structure with the information of the file at the specified position.
+    @discussion See getFileInfo:count:position:.
+    @param info A pointer to a MPQFileInfo structure. Must not be NULL.
+    @param hash_position An integer specifying the position of the file you wish information about. Must not be out of bounds.
+    @param error Optional pointer to a NSError *.
+    @result YES on success, NO if there is no valid file at that position.
+*/
+- (BOOL)getFileInfo:(MPQFileInfo*)info forPosition:(uint32_t)hash_position error:(NSError**)error;
+
 /*! 
     @method fileInfoForFile:locale:
     @abstract Returns the information dictionary for the specified file.
@@ -774,6 +954,9 @@ typedef struct mpq_deferred_operation_delete_context mpq_deferred_operation_dele
         the archive itself is not modified until writeToSave:atomically: is invoked.
         This method simply calls addFileWithData:filename:attributes:error:.
         
+        If the archive has an (attributes) file, the file's CRC32, MD5 and creation date entries are computed
+        from its data as it is compressed during the save. The creation date is the date of the save.
+        
         The parameters dictionary is used to override the default parameters. It may be nil, or 
         have the following keys:
         
@@ -986,6 +1169,34 @@ typedef struct mpq_deferred_operation_delete_context mpq_deferred_operation_dele
 - (NSData*)copyDataForFile:(NSString*)filename range:(NSRange)dataRange locale:(MPQLocale)locale;
 - (NSData*)copyDataForFile:(NSString*)filename range:(NSRange)dataRange locale:(MPQLocale)locale error:(NSError**)error;
 
+/*! 
+    @method prefetchFiles:locale:error:
+    @abstract Tells the system that the specified files will be read soon.
+    @discussion This method returns immediately. The byte ranges of the files are sorted by offset, ranges 
+        which are close to each other are merged, and the system is asked to start reading them into the file 
+        cache in the background. Reading the files afterwards will then not have to wait on the disk.
+        
+        Files which do not exist or which have not been saved to the archive yet are ignored. Prefetching 
+        has no effect with the MPQCachePolicyNoCache cache policy on Mac OS X.
+    @param filenames An array of NSString objects with the paths of the MPQ files to prefetch. 
+        Note that the path separator MUST be \. Must not be nil.
+    @param locale The files' locale code. See the MPQLocale enum in MPQSharedConstants.h for a list of valid values.
+    @param error Optional pointer to a NSError *.
+    @result YES on sucess or NO on failure.
+*/
+- (BOOL)prefetchFiles:(NSArray*)filenames locale:(MPQLocale)locale error:(NSError**)error;
+
+/*! 
+    @method prefetchFilesAtPositions:count:error:
+    @abstract Tells the system that the files at the specified hash table positions will be read soon.
+    @discussion See prefetchFiles:locale:error:. Positions which are empty or deleted are ignored.
+    @param positions An array of hash table positions. Must not be NULL unless count is 0.
+    @param count The number of positions in the array.
+    @param error Optional pointer to a NSError *.
+    @result YES on sucess or NO on failure.
+*/
+- (BOOL)prefetchFilesAtPositions:(const uint32_t*)positions count:(uint32_t)count error:(NSError**)error;
+
 #pragma mark existence
 
 /*! 
@@ -1035,11 +1246,13 @@ typedef struct mpq_deferred_operation_delete_context mpq_deferred_operation_dele
         In all cases, setting atomically to YES makes the instance close the archive file (if there is one) and 
         create a new temporary archive file which will be moved to path once it has been fully written to disk. 
         Note that the temporary file is actually a copy of the original archive file, so if the archive is embedded 
-        in some other file, all data not belonging to the archive is preserved.
+        in some other file, all data not belonging to the archive is preserved. On file systems which support it, 
+        the copy is a clone which shares its storage with the original and takes constant time to make. 
+        See lastCopyMethod.
         
-        In all cases, if the method returns NO and atomically was YES or path was different from the instance's 
-        initial path, the instance will be exactly as it was prior to the invocation. Otherwise, there are no garantees 
-        on the state of the archive on disk or of the instance.
+        In all cases, if the method returns NO and atomically was YES, path was different from the instance's 
+        initial path or the save was journaled, the instance will be exactly as it was prior to the invocation. 
+        Otherwise, there are no garantees on the state of the archive on disk or of the instance. See usesJournaledSaves.
     @param path The location where to save the archive. Must not be nil.
     @param atomically If atomically is YES, modifications are performed on a copy of the archive which is moved 
         to the final destination only at the end. Requires as much free space as the size of the archive, plus any 
@@ -1051,6 +1264,163 @@ typedef struct mpq_deferred_operation_delete_context mpq_deferred_operation_dele
 - (BOOL)writeToFile:(NSString*)path atomically:(BOOL)atomically;
 - (BOOL)writeToFile:(NSString*)path atomically:(BOOL)atomically error:(NSError**)error;
 
+/*! 
+    @method lastCopyMethod
+    @abstract Returns how the archive file was copied by the last invocation of writeToFile:atomically:error:.
+    @discussion Atomic saves and save-as operations copy the archive file. The copy is a clone when the file system 
+        supports it (APFS on Mac OS X, or Btrfs and XFS on Linux), is made by the kernel with copy_file_range on 
+        Linux when possible, and is otherwise made by reading and writing the file.
+    @result A MPQCopyMethod constant. MPQCopyMethodNone if the last save did not copy the archive file or failed 
+        before doing so.
+*/
+- (MPQCopyMethod)lastCopyMethod;
+
+/*! 
+    @method lastCopyDuration
+    @abstract Returns the time the last invocation of writeToFile:atomically:error: spent copying the archive file.
+    @result A time interval in seconds, or 0 if the last save did not copy the archive file.
+*/
+- (NSTimeInterval)lastCopyDuration;
+
+#pragma mark compaction
+
+/*! 
+    @method compactToPath:error:
+    @abstract Writes a copy of the archive at path which only contains its valid files.
+    @discussion The space of deleted and overwritten files is only reused when a new file fits in it, so archives 
+        which are updated often keep growing. This method writes a new archive with the valid files stored back 
+        to back, in the order they had in the archive, followed by the hash table and a block table without 
+        empty entries. The (attributes) file is rebuilt for the new block table. The weak and strong signatures 
+        are dropped since they would not match the new archive.
+        
+        File data is copied verbatim, without being decompressed. Encrypted files whose key depends on their 
+        offset (MPQFileOffsetAdjustedKey) are decrypted and encrypted again with the key for their new offset, 
+        which requires their encryption key to be known.
+        
+        The archive must have been saved and not modified since, and no file can be open. The new archive is 
+        written to a temporary file which is moved to path at the end, so path can be the path of the archive 
+        itself. Data preceding the archive in its file is preserved. Once the method returns YES, the instance 
+        uses the archive at path, like after a save-as operation. If the method returns NO, the instance is 
+        exactly as it was prior to the invocation.
+    @param path The location where to write the compacted archive. Must not be nil.
+    @param error Optional pointer to a NSError *.
+    @result YES on sucess or NO on failure.
+*/
+- (BOOL)compactToPath:(NSString*)path error:(NSError**)error;
+
+/*! 
+    @method compact:
+    @abstract Compacts the archive in place.
+    @discussion Equivalent to compactToPath:error: with the path of the archive. Requires as much free space 
+        as the size of the valid files of the archive.
+    @param error Optional pointer to a NSError *.
+    @result YES on sucess or NO on failure.
+*/
+- (BOOL)compact:(NSError**)error;
+
+/*! 
+    @method transcodeToPath:compressor:quality:error:
+    @abstract Writes a copy of the archive at path whose compressed files use the given compressor.
+    @discussion This method writes a new archive like compactToPath:error:, but the sectors of compressed files are 
+        decompressed and compressed again with compressor on the way. Sectors which are stored uncompressed, which 
+        are already compressed with compressor alone, or which hold ADPCM audio data are copied as they are. 
+        Sectors are transcoded in parallel on every available processor, while the other files are copied 
+        verbatim. Sector adlers of transcoded files are dropped.
+        
+        Files compressed with MPQFileDiabloCompressed, which can only use the PKWARE compressor, and encrypted 
+        files whose encryption key is unknown are copied verbatim. A compressed file which cannot be decoded makes 
+        the method fail.
+        
+        The requirements and the behavior on success and failure are the same as for compactToPath:error:.
+    @param path The location where to write the transcoded archive. Must not be nil.
+    @param compressor The compressor to use. Cannot be an ADPCM compressor.
+    @param quality The compression quality to use, see MPQCompressorFlag. Invalid values are replaced by the default 
+        compression quality of the compressor.
+    @param error Optional pointer to a NSError *.
+    @result YES on sucess or NO on failure.
+*/
+- (BOOL)transcodeToPath:(NSString*)path compressor:(MPQCompressorFlag)compressor quality:(int32_t)quality error:(NSError**)error;
+
+#pragma mark hash table
+
+/*! 
+    @method resizeHashTable:error:
+    @abstract Changes the number of entries of the archive's hash table.
+    @discussion The hash table length of an archive is set when it is created. Lookups and additions probe the 
+        hash table linearly from the position given by the hash of the file's name, so they slow down as the table 
+        fills up, and additions fail with errHashTableFull once it is full. Deleted entries also lengthen the 
+        probes until the table is rebuilt.
+        
+        This method builds a new hash table of the given length, rounded up to a power of 2, and places every file 
+        in it again from the hash of its name. Deleted entries are dropped. The new table is written to disk at the 
+        next save, like any other modification. Since positions are computed from names, the names of all the 
+        files of the archive must be known (see addArrayToFileList: and addHashDatabaseToFileList:error:). 
+        Otherwise, the method fails with errUnknownFilenames, and the hash table positions of the files with 
+        unknown names are in the error's user info dictionary under the MPQErrorHashPositions key.
+        
+        No file can be open. Pending operations are carried over and will be performed at the next save, but can 
+        no longer be undone. Any MPQFileInfoEnumerator of the instance becomes invalid.
+    @param length The new number of entries of the hash table. Cannot be larger than MPQ_MAX_HASH_TABLE_LENGTH for 
+        MPQOriginalVersion archives or MPQ_MAX_EXTENDED_HASH_TABLE_LENGTH for MPQExtendedVersion archives, and must 
+        be larger than the number of files in the archive.
+    @param error Optional pointer to a NSError *.
+    @result YES on sucess or NO on failure.
+*/
+- (BOOL)resizeHashTable:(uint32_t)length error:(NSError**)error;
+
+/*! 
+    @method maximumHashTableLoad
+    @abstract Returns the fraction of the hash table which may be used before it is grown at save time.
+    @discussion When the maximum load is not 0, saving the archive first resizes its hash table with 
+        resizeHashTable:error: if files and deleted entries use more than the maximum load of the table. The new 
+        length is the smallest power of 2 which brings the load to half the maximum, within the limit for the archive's 
+        version. If the names of some files are unknown or files are open, the hash table is left as it is.
+        
+        The default is 0, unless MPQArchiveMaximumHashTableLoad was specified at initialization time.
+    @result The maximum load, between 0 and 1. 0 disables automatic resizing.
+*/
+- (double)maximumHashTableLoad;
+
+/*! 
+    @method setMaximumHashTableLoad:
+    @abstract Sets the fraction of the hash table which may be used before it is grown at save time.
+    @discussion See maximumHashTableLoad.
+    @param load The maximum load, at least 0 and less than 1. 0 disables automatic resizing.
+    @result YES on sucess or NO if load is out of range.
+*/
+- (BOOL)setMaximumHashTableLoad:(double)load;
+
+#pragma mark merging
+
+/*!
+    @method mergeFilesFromArchive:policy:error:
+    @abstract Adds the files of another archive to the archive, without recompressing them.
+    @discussion Every file of archive is added to the archive under the same name and locale, along with its
+        entries in the (attributes) file. The (listfile), (attributes) and (signature) files of archive are not
+        merged. The delegate is asked about each file with archive:shouldAddFile:, and the files it declines
+        are skipped. When a file of the archive has the same name and locale as a merged file, policy decides
+        which one is kept.
+        
+        Merged files are deferred additions, like files added with addFileWithPath:filename:parameters:error:.
+        They can be opened right away and are written at the next save, when their sector tables and sectors
+        are copied verbatim from the file of archive. Encrypted files whose key depends on their offset
+        (MPQFileOffsetAdjustedKey) are decrypted and encrypted again with the key for their new offset, and
+        lose their sector adlers. The file of archive is kept open until the next save, so archive may be
+        released or saved to another path in the mean time, but must not be modified in place.
+        
+        archive must have been saved and not modified since, and both archives must have the same sector
+        size, or the method fails with errSectorSizeMismatch. The names of all the files of archive must be
+        known. Otherwise, the method fails with errUnknownFilenames, and the hash table positions in archive of
+        the files with unknown names are in the error's user info dictionary under the MPQErrorHashPositions
+        key. If the method fails for another reason part way, the files merged up to that point remain pending
+        additions, which can be undone with undoLastOperation:.
+    @param archive The archive to merge the files of. Must not be nil or the receiver.
+    @param policy What to do when a file already exists in the archive.
+    @param error Optional pointer to a NSError *.
+    @result YES on sucess or NO on failure.
+*/
+- (BOOL)mergeFilesFromArchive:(MPQArchive*)archive policy:(MPQMergePolicy)policy error:(NSError**)error;
+
 @end
 
 /*!
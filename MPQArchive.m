@@ -7,13 +7,24 @@
 //
 
 #import <fcntl.h>
+#import <limits.h>
+#import <pthread.h>
 #import <unistd.h>
 #import <zlib.h>
 #import <aio.h>
 
+#import <sys/ioctl.h>
+#import <sys/mman.h>
 #import <sys/stat.h>
 #import <sys/types.h>
 
+#if defined(__APPLE__)
+#import <sys/clonefile.h>
+#elif defined(__linux__)
+#import <linux/fs.h>
+#import <sys/syscall.h>
+#endif
+
 #import <openssl/bio.h>
 #import <openssl/md5.h>
 #import <openssl/pem.h>
@@ -22,7 +33,9 @@
 #import "SCompression.h"
 
 #import "MPQKitPrivate.h"
+#import "MPQFilePrivate.h"
 #import "MPQFileInfoEnumerator.h"
+#import "NSDateNTFSAdditions.h"
 
 #import "mpqdebug.h"
 #import "PHSErrorMacros.h"
@@ -37,7 +50,6 @@
 
 // magic numbers in big endian
 #define MPQ_MAGIC 0x4D50511A
-#define MPQ_SHUNT_MAGIC 0x4D50511B
 #define ATTRIBUTES_MAGIC 0x64
 #define STRONG_SIGNATURE_MAGIC 0x4E474953
 
@@ -48,8 +60,11 @@
 #define HASH_KEY 3
 
 // Special values for a hash table entry's block table entry index
-#define HASH_TABLE_EMPTY 0xffffffff
-#define HASH_TABLE_DELETED 0xfffffffe
+#define HASH_TABLE_EMPTY MPQ_HASH_TABLE_EMPTY
+#define HASH_TABLE_DELETED MPQ_HASH_TABLE_DELETED
+
+// Hash table position of the operations of files deleted before a hash table resize
+#define DETACHED_OPERATION_POSITION 0xffffffff
 
 // This is the only valid sector size shift factor as of right now
 #define DEFAULT_SECTOR_SIZE_SHIFT 3
@@ -92,7 +107,7 @@ static RSA* starcraft_map_public_rsa        = NULL;
 
 static RSA* blizzard_weak_public_rsa        = NULL;
 
-static int _MPQMakeTempFileInDirectory(NSString* directory, NSString** tempFilePath, NSError** error) {
+int _MPQMakeTempFileInDirectory(NSString* directory, NSString** tempFilePath, NSError** error) {
     char* template = malloc(PATH_MAX + 1);
     if (!template)
         ReturnValueWithError(-1, MPQErrorDomain, errOutOfMemory, nil, error)
@@ -113,13 +128,109 @@ static int _MPQMakeTempFileInDirectory(NSString* directory, NSString** tempFileP
     return fd;
 }
 
-static inline BOOL _MPQFSCopy(NSString* destination, NSString* source, NSError** error) {
-    return [NSFileManager.defaultManager copyItemAtPath:source toPath:destination error:error];
+// Copies the data of the file at source to destination, replacing it if it exists. A clone sharing its storage with the source is made
+// when the file system supports it, which takes constant time. Otherwise the kernel copies the data with copy_file_range when it can,
+// and we fall back to reading and writing the file. The method which ended up being used is returned in method.
+static BOOL _MPQFSCopy(NSString* destination, NSString* source, MPQCopyMethod* method, NSError** error) {
+    *method = MPQCopyMethodNone;
+    
+    int source_fd = open(source.fileSystemRepresentation, O_RDONLY, 0);
+    if (source_fd == -1)
+        ReturnValueWithPOSIXError(NO, nil, error)
+    
+    struct stat sb;
+    if (fstat(source_fd, &sb) == -1) {
+        close(source_fd);
+        ReturnValueWithPOSIXError(NO, nil, error)
+    }
+    
+#if defined(__APPLE__)
+    // Clones can only be created at a path which doesn't exist
+    unlink(destination.fileSystemRepresentation);
+    if (fclonefileat(source_fd, AT_FDCWD, destination.fileSystemRepresentation, 0) == 0) {
+        close(source_fd);
+        *method = MPQCopyMethodClone;
+        return YES;
+    }
+#endif
+    
+    int destination_fd = open(destination.fileSystemRepresentation, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (destination_fd == -1) {
+        close(source_fd);
+        ReturnValueWithPOSIXError(NO, nil, error)
+    }
+    
+    // Temporary files are created with mode 0600
+    fchmod(destination_fd, sb.st_mode & 07777);
+    
+    off_t copied = 0;
+#if defined(FICLONE)
+    if (ioctl(destination_fd, FICLONE, source_fd) == 0) {
+        copied = sb.st_size;
+        *method = MPQCopyMethodClone;
+    }
+#endif
+    
+#if defined(__linux__) && defined(SYS_copy_file_range)
+    // Stops on the first error (EXDEV on older kernels, EOPNOTSUPP, ENOSYS, ...) and lets the read / write loop copy the rest
+    while (copied < sb.st_size) {
+        loff_t source_offset = copied;
+        loff_t destination_offset = copied;
+        ssize_t bytes_copied = syscall(SYS_copy_file_range, source_fd, &source_offset, destination_fd, &destination_offset, (size_t)MIN(sb.st_size - copied, 0x40000000), 0);
+        if (bytes_copied <= 0)
+            break;
+        copied += bytes_copied;
+        *method = MPQCopyMethodCopyRange;
+    }
+#endif
+    
+    if (copied < sb.st_size) {
+        size_t buffer_size = 0x100000;
+        void* buffer = malloc(buffer_size);
+        if (!buffer) {
+            close(source_fd);
+            close(destination_fd);
+            ReturnValueWithError(NO, MPQErrorDomain, errOutOfMemory, nil, error)
+        }
+        
+        while (copied < sb.st_size) {
+            ssize_t bytes_read = pread(source_fd, buffer, (size_t)MIN(sb.st_size - copied, (off_t)buffer_size), copied);
+            
+            // Short writes are retried, a write which makes no progress is an I/O error
+            ssize_t bytes_written = 0;
+            ssize_t result = bytes_read;
+            while (result > 0 && bytes_written < bytes_read) {
+                result = pwrite(destination_fd, (uint8_t*)buffer + bytes_written, bytes_read - bytes_written, copied + bytes_written);
+                if (result > 0)
+                    bytes_written += result;
+            }
+            
+            if (result <= 0) {
+                int saved_errno = (result == 0) ? EIO : errno;
+                free(buffer);
+                close(source_fd);
+                close(destination_fd);
+                errno = saved_errno;
+                ReturnValueWithPOSIXError(NO, nil, error)
+            }
+            copied += bytes_read;
+        }
+        
+        free(buffer);
+        *method = MPQCopyMethodReadWrite;
+    }
+    
+    close(source_fd);
+    if (close(destination_fd) == -1)
+        ReturnValueWithPOSIXError(NO, nil, error)
     return YES;
 }
 
 static inline BOOL _MPQFSMove(NSString* destination, NSString* source, NSError** error) {
-    return [NSFileManager.defaultManager moveItemAtPath:source toPath:destination error:error];
+    // Temporary files are created next to their destination, so this atomically replaces the destination if it exists
+    if (rename(source.fileSystemRepresentation, destination.fileSystemRepresentation) == -1)
+        ReturnValueWithPOSIXError(NO, nil, error)
+    return YES;
 }
 
 char* _MPQCreateASCIIFilename(NSString* filename, NSError** error) {
@@ -139,17 +250,32 @@ char* _MPQCreateASCIIFilename(NSString* filename, NSError** error) {
     return filename_cstring;
 }
 
+static void _MPQApplyCachePolicy(int fd, MPQCachePolicy policy) {
+    if (fd == -1)
+        return;
+#if defined(__APPLE__)
+    fcntl(fd, F_NOCACHE, (policy == MPQCachePolicyNoCache) ? 1 : 0);
+    fcntl(fd, F_RDAHEAD, (policy == MPQCachePolicyRandom) ? 0 : 1);
+#elif defined(POSIX_FADV_NORMAL)
+    // There is no way to bypass the cache for unaligned reads, so MPQCachePolicyNoCache drops pages once they've been used instead
+    int advice = POSIX_FADV_NORMAL;
+    if (policy == MPQCachePolicySequential)
+        advice = POSIX_FADV_SEQUENTIAL;
+    else if (policy == MPQCachePolicyRandom)
+        advice = POSIX_FADV_RANDOM;
+    posix_fadvise(fd, 0, 0, advice);
+#endif
+}
+
 static inline uint32_t _MPQComputeSectorTableLength(uint32_t full_sector_size, uint32_t file_size, uint32_t file_flags) {
-    uint32_t sector_table_length = ((file_size + full_sector_size - 1) / full_sector_size) + 1;
-    if ((file_flags & MPQFileHasSectorAdlers))
-        sector_table_length++;
-    return sector_table_length;
+    return mpq_core_sector_table_length(full_sector_size, file_size, file_flags);
 }
 
 
-@interface MPQFile (Initialization)
-- (id)initForFile:(NSDictionary*)descriptor error:(NSError**)error;
-@end
+// Concrete MPQFile classes, looked up once in +initialize
+static Class _MPQFileDataSourceClass = Nil;
+static Class _MPQFileConcreteMPQClass = Nil;
+static Class _MPQFileConcreteMPQOneSectorClass = Nil;
 
 
 @implementation MPQArchive
@@ -179,6 +305,10 @@ FreeData:
         
         mpq_init_cryptography();
         
+        _MPQFileDataSourceClass = NSClassFromString(@"MPQFileDataSource");
+        _MPQFileConcreteMPQClass = NSClassFromString(@"MPQFileConcreteMPQ");
+        _MPQFileConcreteMPQOneSectorClass = NSClassFromString(@"MPQFileConcreteMPQOneSector");
+        
 #if !defined(GNUSTEP)
         NSBundle* kitBundle = [NSBundle bundleForClass:self];
         NSString* keyPath = [kitBundle pathForResource:@"Blizzard Strong" ofType:@"pem" inDirectory:@"Public RSA Keys"];
@@ -271,15 +401,6 @@ FreeData:
 #endif
 }
 
-+ (void)swap_mpq_shunt:(mpq_shunt_t*)shunt {
-#if defined(__BIG_ENDIAN__)
-    shunt->unknown04 = MPQSwapInt32(shunt->unknown04);
-    shunt->mpq_header_offset = MPQSwapInt32(shunt->mpq_header_offset);
-#else
-    shunt->shunt_magic = MPQSwapInt32(shunt->shunt_magic);
-#endif
-}
-
 + (void)swap_mpq_extended_header:(mpq_extended_header_t*)header {
 #if defined(__BIG_ENDIAN__)
     header->extended_block_offset_table_offset = MPQSwapInt64(header->extended_block_offset_table_offset);
@@ -312,6 +433,45 @@ FreeData:
 #endif
 }
 
+#pragma mark slot tables
+
+// Returns the name of hash_position, or NULL if it is not known
+static inline const char* _MPQGetFilename(const mpq_slot_table_t* filename_table, const mpq_string_arena_t* filename_arena, uint32_t hash_position) {
+    return mpq_string_arena_get(filename_arena, mpq_slot_table_get_uint32(filename_table, hash_position));
+}
+
+// Stores length bytes of name as the name of hash_position if it doesn't have one yet. If *reference is not 0, it is the
+// arena reference of a copy of name stored earlier and is reused; otherwise it is set to the reference of the new copy.
+static inline void _MPQStoreFilename(mpq_slot_table_t* filename_table, mpq_string_arena_t* filename_arena, uint32_t hash_position, const char* name, size_t length, uint32_t* reference) {
+    if (mpq_slot_table_get_uint32(filename_table, hash_position))
+        return;
+    if (*reference == 0)
+        *reference = mpq_string_arena_add(filename_arena, name, length);
+    if (*reference)
+        mpq_slot_table_set_uint32(filename_table, hash_position, *reference);
+}
+
+// Stores a copy of filename_cstring as the name of hash_position if it doesn't have one yet
+static inline void _MPQSetFilename(mpq_slot_table_t* filename_table, mpq_string_arena_t* filename_arena, uint32_t hash_position, const char* filename_cstring) {
+    if (!filename_cstring)
+        return;
+    uint32_t reference = 0;
+    _MPQStoreFilename(filename_table, filename_arena, hash_position, filename_cstring, strlen(filename_cstring), &reference);
+}
+
+// Frees the element of a table of malloc'ed pointers at hash_position
+static inline void _MPQFreeSlotPointer(mpq_slot_table_t* table, uint32_t hash_position) {
+    void* pointer = mpq_slot_table_get_pointer(table, hash_position);
+    if (pointer) {
+        free(pointer);
+        mpq_slot_table_set_pointer(table, hash_position, NULL);
+    }
+}
+
+static void _MPQReleaseSlotObject(void* object) {
+    [(id)object release];
+}
+
 #pragma mark encryption keys
 
 - (uint32_t)getFileEncryptionKey:(uint32_t)hash_position name:(const char*)filename {
@@ -319,7 +479,8 @@ FreeData:
     NSParameterAssert(hash_position < header.hash_table_length);
 
     // Check if we have a cached key
-    if (encryption_keys_cache[hash_position] != 0) return encryption_keys_cache[hash_position];
+    uint32_t cached_key = mpq_slot_table_get_uint32(&encryption_keys_cache, hash_position);
+    if (cached_key != 0) return cached_key;
     
     // Alias to the file table entry
     mpq_hash_table_entry_t* hash_entry = hash_table + hash_position;
@@ -340,7 +501,7 @@ FreeData:
         encryption_key = (encryption_key + (uint32_t)(block_offset_table[hash_entry->block_table_index])) ^ block_entry->size;
     }
         
-    encryption_keys_cache[hash_position] = encryption_key;
+    mpq_slot_table_set_uint32(&encryption_keys_cache, hash_position, encryption_key);
     return encryption_key;
 }
 
@@ -348,10 +509,12 @@ FreeData:
     NSParameterAssert(hash_position < header.hash_table_length);
     
     // Check if we have a cached key.
-    if (encryption_keys_cache[hash_position] != 0) return encryption_keys_cache[hash_position];
+    uint32_t cached_key = mpq_slot_table_get_uint32(&encryption_keys_cache, hash_position);
+    if (cached_key != 0) return cached_key;
     
     // If we have the filename, redirect to the normal method
-    if (filename_table[hash_position]) return [self getFileEncryptionKey:hash_position name:filename_table[hash_position]];
+    const char* filename = _MPQGetFilename(&filename_table, &filename_arena, hash_position);
+    if (filename) return [self getFileEncryptionKey:hash_position name:filename];
     
     // Alias to the block table entry
     mpq_hash_table_entry_t* hash_entry = hash_table + hash_position;
@@ -409,7 +572,7 @@ FreeData:
             ch       = sector_table[1] ^ (seed1 + seed2);
             
             if ((ch - ch2) <= full_sector_size) {
-                encryption_keys_cache[hash_position] = encryption_key;
+                mpq_slot_table_set_uint32(&encryption_keys_cache, hash_position, encryption_key);
                 return encryption_key;
             }
         }
@@ -451,6 +614,149 @@ FreeData:
     return YES;
 }
 
+#pragma mark save journal
+
+static inline NSString* _MPQJournalPath(NSString* archive_path) {
+    return [archive_path stringByAppendingString:@"-journal"];
+}
+
+static int _MPQSyncDirectory(NSString* directory) {
+    int fd = open(directory.fileSystemRepresentation, O_RDONLY, 0);
+    if (fd == -1)
+        return -1;
+    int result = mpq_core_sync(fd);
+    close(fd);
+    return result;
+}
+
+// Completes or rolls back a journaled save which was interrupted. Both the committed and the new archive header are
+// consistent, so the journal only needs to be recovered by instances which can write.
+- (BOOL)_recoverJournal:(NSError**)error {
+    NSString* journal_path = _MPQJournalPath(archive_path);
+    int journal_fd = open(journal_path.fileSystemRepresentation, O_RDONLY, 0);
+    if (journal_fd == -1) {
+        if (errno == ENOENT)
+            return YES;
+        ReturnValueWithPOSIXError(NO, nil, error)
+    }
+    
+    mpq_journal_record_t record;
+    mpq_core_error_t core_error;
+    int result = mpq_core_read_journal(journal_fd, &record, &core_error);
+    close(journal_fd);
+    
+    if (result == 0 && record.type != 0) {
+        MPQDebugLog(@"%@ interrupted save", (record.type == MPQ_JOURNAL_COMMIT) ? @"completing" : @"rolling back");
+        result = mpq_core_apply_journal_record(archive_fd, &record, &core_error);
+    }
+    if (result == -1) {
+        if (error)
+            *error = _MPQErrorWithCoreError(&core_error, nil);
+        return NO;
+    }
+    
+    unlink(journal_path.fileSystemRepresentation);
+    return YES;
+}
+
+// Records the committed archive header and file size in a new journal, and makes the save append to the archive file
+- (BOOL)_beginJournal:(mpq_journal_record_t*)record fd:(int*)journal_fd error:(NSError**)error {
+    struct stat sb;
+    if (fstat(archive_fd, &sb) == -1)
+        ReturnValueWithPOSIXError(NO, nil, error)
+    
+    // The header in memory may have changed since the last save, so use the one on disk
+    memset(record, 0, sizeof(mpq_journal_record_t));
+    record->type = MPQ_JOURNAL_BEGIN;
+    record->archive_offset = archive_offset;
+    record->file_size = sb.st_size;
+    record->header_size = (header.version == 0) ? sizeof(mpq_header_t) : sizeof(mpq_header_t) + sizeof(mpq_extended_header_t);
+    ssize_t bytes_read = pread(archive_fd, record->header, record->header_size, archive_offset);
+    if (bytes_read == -1)
+        ReturnValueWithPOSIXError(NO, nil, error)
+    if (bytes_read < (ssize_t)record->header_size)
+        ReturnValueWithError(NO, MPQErrorDomain, errIO, nil, error)
+    
+    NSString* journal_path = _MPQJournalPath(archive_path);
+    *journal_fd = open(journal_path.fileSystemRepresentation, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (*journal_fd == -1)
+        ReturnValueWithPOSIXError(NO, nil, error)
+    
+    // The journal must be on stable storage before the archive file changes
+    mpq_core_error_t core_error;
+    if (mpq_core_write_journal_record(*journal_fd, record, &core_error) == -1) {
+        if (error)
+            *error = _MPQErrorWithCoreError(&core_error, nil);
+        goto JournalFailed;
+    }
+    if (mpq_core_sync(*journal_fd) == -1 || _MPQSyncDirectory(journal_path.stringByDeletingLastPathComponent) == -1) {
+        if (error)
+            *error = [MPQError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
+        goto JournalFailed;
+    }
+    
+    // New file data and structural tables go after everything in the archive file, including a strong signature.
+    // _buildExtentMap:error: keeps the committed structural tables and files out of the free regions.
+    journal_tables_offset = archive_write_offset;
+    journal_tables_end = sb.st_size - archive_offset;
+    archive_write_offset = journal_tables_end;
+    return YES;
+    
+JournalFailed:
+    close(*journal_fd);
+    *journal_fd = -1;
+    unlink(journal_path.fileSystemRepresentation);
+    return NO;
+}
+
+// Makes the new file data and structural tables durable, then records the header which switches the archive to them
+- (BOOL)_commitJournal:(int)journal_fd error:(NSError**)error {
+    if (mpq_core_sync(archive_fd) == -1)
+        ReturnValueWithPOSIXError(NO, nil, error)
+    
+    struct stat sb;
+    if (fstat(archive_fd, &sb) == -1)
+        ReturnValueWithPOSIXError(NO, nil, error)
+    
+    mpq_journal_record_t record;
+    memset(&record, 0, sizeof(mpq_journal_record_t));
+    record.type = MPQ_JOURNAL_COMMIT;
+    record.archive_offset = archive_offset;
+    record.file_size = sb.st_size;
+    record.header_size = [self _copyArchiveHeader:record.header];
+    
+    mpq_core_error_t core_error;
+    if (mpq_core_write_journal_record(journal_fd, &record, &core_error) == -1) {
+        if (error)
+            *error = _MPQErrorWithCoreError(&core_error, nil);
+        return NO;
+    }
+    if (mpq_core_sync(journal_fd) == -1)
+        ReturnValueWithPOSIXError(NO, nil, error)
+    return YES;
+}
+
+- (void)_finishJournal:(int)journal_fd {
+    close(journal_fd);
+    unlink(_MPQJournalPath(archive_path).fileSystemRepresentation);
+    journal_tables_offset = 0;
+    journal_tables_end = 0;
+}
+
+// Puts the committed header back and cuts what the save appended. If that fails, the journal is left for recovery.
+- (void)_rollBackJournal:(const mpq_journal_record_t*)record fd:(int)journal_fd {
+    mpq_core_error_t core_error;
+    if (mpq_core_apply_journal_record(archive_fd, record, &core_error) == 0) {
+        [self _finishJournal:journal_fd];
+        return;
+    }
+    
+    MPQDebugLog(@"could not roll back journaled save");
+    close(journal_fd);
+    journal_tables_offset = 0;
+    journal_tables_end = 0;
+}
+
 #pragma mark structural tables
 
 - (uint32_t)createHashPosition:(const char*)filename error:(NSError**)error {
@@ -475,32 +781,18 @@ FreeData:
 
 - (uint32_t)findHashPosition:(const char*)filename locale:(uint16_t)locale error:(NSError**)error {
     NSParameterAssert(filename != NULL);
+    
+    mpq_name_key_t key;
+    mpq_core_compute_name_key(filename, &key);
+    return [self findHashPositionWithKey:&key locale:locale error:error];
+}
 
-    // Compute the starting hash table offset, as well as the verification hashes for the specified file.
-    uint32_t initial_position = mpq_hash_cstring(filename, HASH_POSITION) % header.hash_table_length,
-        current_position = initial_position,
-        hash_a = mpq_hash_cstring(filename, HASH_NAME_A),
-        hash_b = mpq_hash_cstring(filename, HASH_NAME_B);
-
-    // Search through the hash table until we either find the file we're looking for, or we find an unused hash table entry, 
-    // indicating the end of the cluster of used hash table entries
-    while (hash_table[current_position].block_table_index != HASH_TABLE_EMPTY) {
-        if (hash_table[current_position].block_table_index != HASH_TABLE_DELETED) {
-            if (hash_table[current_position].hash_a == hash_a && 
-                hash_table[current_position].hash_b == hash_b && 
-                hash_table[current_position].locale == locale)
-            {
-                return current_position;
-            }
-        }
-
-        current_position++;
-        current_position %= header.hash_table_length;
-
-        // It's possible that the entire hash table is full and the file we're looking for simply doesn't exist. Is this the case?
-        if (current_position == initial_position)
-            break;
-    }
+- (uint32_t)findHashPositionWithKey:(const mpq_name_key_t*)key locale:(uint16_t)locale error:(NSError**)error {
+    NSParameterAssert(key != NULL);
+    
+    uint32_t hash_position = mpq_core_find_hash_position_with_key(hash_table, header.hash_table_length, key, locale);
+    if (hash_position != MPQ_NOT_FOUND)
+        return hash_position;
     
     ReturnValueWithError(0xffffffff, MPQErrorDomain, errHashTableEntryNotFound, nil, error)
 }
@@ -511,166 +803,582 @@ FreeData:
     return structural_size;
 }
 
+// Block table entries which have never been used (or have been emptied by a save) can be reused without any storage check
+static inline BOOL _MPQBlockEntryIsEmpty(const mpq_block_table_entry_t* block_entry) {
+    return (block_entry->size == 0 && block_entry->archived_size == 0 && block_entry->flags == 0) ? YES : NO;
+}
+
+// The block table grows by doubling, but at least by this many entries
+#define BLOCK_TABLE_MIN_GROWTH 128
+
+// The block free map has one bit per block table entry, set if the entry may be empty. Bits are only a hint: they are
+// checked against the block table when allocating, and stale bits are cleared then. The map is built on the first
+// allocation and dropped whenever block table entries are moved around.
+- (BOOL)_buildBlockFreeMap {
+    uint32_t word_count = (header.block_table_length + 31) >> 5;
+    uint32_t* map = calloc((word_count) ? word_count : 1, sizeof(uint32_t));
+    if (!map)
+        return NO;
+    
+    uint32_t block_entry_index = 0;
+    for (; block_entry_index < header.block_table_length; block_entry_index++) {
+        if (_MPQBlockEntryIsEmpty(block_table + block_entry_index))
+            map[block_entry_index >> 5] |= 1U << (block_entry_index & 31);
+    }
+    
+    if (block_free_map)
+        free(block_free_map);
+    block_free_map = map;
+    block_free_map_cursor = 0;
+    return YES;
+}
+
+- (void)_invalidateBlockFreeMap {
+    if (block_free_map) {
+        free(block_free_map);
+        block_free_map = NULL;
+    }
+    block_free_map_cursor = 0;
+}
+
+- (void)_markBlockEntryFree:(uint32_t)block_entry_index {
+    if (!block_free_map)
+        return;
+    block_free_map[block_entry_index >> 5] |= 1U << (block_entry_index & 31);
+    if ((block_entry_index >> 5) < block_free_map_cursor)
+        block_free_map_cursor = block_entry_index >> 5;
+}
+
 - (BOOL)_growBlockTable:(NSError**)error {
     if (header.block_table_length == UINT32_MAX)
         ReturnValueWithError(NO, MPQErrorDomain, errBlockTableFull, nil, error)
     
-    // Save the current block table length and the corresponding structural tables size
+    // Save the current block table length and compute the new one. Saving only writes the used part of the block table.
     uint32_t old_block_table_length = header.block_table_length;
-//      off_t old_structural_tables_size = [self _computeSizeOfStructuralTables];
-    
-    // Increase the block table length and compute the corrresponding structural tables size
-    header.block_table_length += 128;
-    if (header.block_table_length < old_block_table_length) header.block_table_length = UINT32_MAX;
-//      off_t new_structural_tables_size = [self _computeSizeOfStructuralTables];
-    
-    // Resize the archive
-//      if (![self _truncateArchiveWithDelta:new_structural_tables_size - old_structural_tables_size error:error]) {
-//          header.block_table_length = old_block_table_length;
-//          return NO;
-//      }
+    uint32_t growth = (old_block_table_length > BLOCK_TABLE_MIN_GROWTH) ? old_block_table_length : BLOCK_TABLE_MIN_GROWTH;
+    uint32_t new_block_table_length = (UINT32_MAX - old_block_table_length < growth) ? UINT32_MAX : old_block_table_length + growth;
     
-    // Attributes
-    uint32_t attributes_data_delta = 0;
+    // Attributes are stored as one column per attribute, each column having one value per block table entry
+    size_t attributes_row_size = 0;
     if (attributes_data) {
         mpq_attributes_header_t* attributes = (mpq_attributes_header_t*)attributes_data;
         
         mpq_file_attribute_t* attribute = mpq_file_attributes;
         while (attribute->flag != 0) {
-            if ((attributes->attributes & attribute->flag)) attributes_data_delta += attribute->size;
+            if ((attributes->attributes & attribute->flag)) attributes_row_size += attribute->size;
             attribute++;
         }
-        attributes_data_delta *= 128;
     }
+    size_t old_columns_end = sizeof(mpq_attributes_header_t) + attributes_row_size * old_block_table_length;
+    size_t new_columns_end = sizeof(mpq_attributes_header_t) + attributes_row_size * new_block_table_length;
+    size_t attributes_trailer_size = (attributes_data_size > old_columns_end) ? attributes_data_size - old_columns_end : 0;
+    size_t new_attributes_data_size = new_columns_end + attributes_trailer_size;
+    if (attributes_data && new_attributes_data_size > UINT32_MAX)
+        ReturnValueWithError(NO, MPQErrorDomain, errBlockTableFull, nil, error)
 
-    // Realloc the block table, the block offset table and the attributes data
-    mpq_block_table_entry_t* new_block_table = realloc(block_table, header.block_table_length * sizeof(mpq_block_table_entry_t));
-    off_t* new_block_offset_table = realloc(block_offset_table, header.block_table_length * sizeof(off_t));
-    if (new_block_table == NULL || new_block_offset_table == NULL) {
-        header.block_table_length = old_block_table_length;
+    // Realloc the block table, the block offset table, the attributes data and the block free map
+    mpq_block_table_entry_t* new_block_table = realloc(block_table, new_block_table_length * sizeof(mpq_block_table_entry_t));
+    if (new_block_table == NULL)
         ReturnValueWithError(NO, MPQErrorDomain, errOutOfMemory, nil, error)
-    }
+    block_table = new_block_table;
     
-    void* new_attributes_data = realloc(attributes_data, attributes_data_size + attributes_data_delta);
-    if (new_attributes_data == NULL) {
-        header.block_table_length = old_block_table_length;
+    off_t* new_block_offset_table = realloc(block_offset_table, new_block_table_length * sizeof(off_t));
+    if (new_block_offset_table == NULL)
         ReturnValueWithError(NO, MPQErrorDomain, errOutOfMemory, nil, error)
+    block_offset_table = new_block_offset_table;
+    
+    if (attributes_data) {
+        void* new_attributes_data = realloc(attributes_data, new_attributes_data_size);
+        if (new_attributes_data == NULL)
+            ReturnValueWithError(NO, MPQErrorDomain, errOutOfMemory, nil, error)
+        attributes_data = new_attributes_data;
     }
     
-    // Swap the pointers
-    block_table = new_block_table;
-    block_offset_table = new_block_offset_table;
-    attributes_data = new_attributes_data;
+    if (block_free_map) {
+        uint32_t new_word_count = (new_block_table_length + 31) >> 5;
+        uint32_t* new_block_free_map = realloc(block_free_map, new_word_count * sizeof(uint32_t));
+        if (new_block_free_map == NULL)
+            ReturnValueWithError(NO, MPQErrorDomain, errOutOfMemory, nil, error)
+        block_free_map = new_block_free_map;
+        
+        uint32_t old_word_count = (old_block_table_length + 31) >> 5;
+        memset(block_free_map + old_word_count, 0, (new_word_count - old_word_count) * sizeof(uint32_t));
+    }
     
     // memset the new entries to be neat
-    memset(block_table + old_block_table_length, 0, 128 * sizeof(mpq_block_table_entry_t));
-    memset(block_offset_table + old_block_table_length, 0, 128 * sizeof(off_t));
-    memset(BUFFER_OFFSET(attributes_data, attributes_data_size), 0, attributes_data_delta);
+    memset(block_table + old_block_table_length, 0, (new_block_table_length - old_block_table_length) * sizeof(mpq_block_table_entry_t));
+    memset(block_offset_table + old_block_table_length, 0, (new_block_table_length - old_block_table_length) * sizeof(off_t));
+    
+    // Spread the attribute columns to the new block table length, starting with the last one. Data following the
+    // columns we know about is moved after them. A short attributes file is padded with zeroes first.
+    if (attributes_data) {
+        mpq_attributes_header_t* attributes = (mpq_attributes_header_t*)attributes_data;
+        if (attributes_data_size < old_columns_end)
+            memset(BUFFER_OFFSET(attributes_data, attributes_data_size), 0, old_columns_end - attributes_data_size);
+        memmove(BUFFER_OFFSET(attributes_data, new_columns_end), BUFFER_OFFSET(attributes_data, old_columns_end), attributes_trailer_size);
+        
+        size_t old_column_offset = old_columns_end;
+        size_t new_column_offset = new_columns_end;
+        int32_t attribute_index = (int32_t)(sizeof(mpq_file_attributes) / sizeof(mpq_file_attribute_t)) - 1;
+        for (; attribute_index >= 0; attribute_index--) {
+            mpq_file_attribute_t* attribute = mpq_file_attributes + attribute_index;
+            if (attribute->flag == 0 || !(attributes->attributes & attribute->flag))
+                continue;
+            
+            old_column_offset -= (size_t)attribute->size * old_block_table_length;
+            new_column_offset -= (size_t)attribute->size * new_block_table_length;
+            memmove(BUFFER_OFFSET(attributes_data, new_column_offset), BUFFER_OFFSET(attributes_data, old_column_offset), (size_t)attribute->size * old_block_table_length);
+            memset(BUFFER_OFFSET(attributes_data, new_column_offset + (size_t)attribute->size * old_block_table_length), 0, (size_t)attribute->size * (new_block_table_length - old_block_table_length));
+        }
+        
+        attributes_data_size = (uint32_t)new_attributes_data_size;
+    }
+    
+    header.block_table_length = new_block_table_length;
     
-    attributes_data_size += attributes_data_delta;
+    // Every new entry is free
+    uint32_t block_entry_index = old_block_table_length;
+    for (; block_entry_index < new_block_table_length; block_entry_index++)
+        [self _markBlockEntryFree:block_entry_index];
     
     return YES;
 }
 
-- (uint32_t)createBlockTablePosition:(uint32_t)size error:(NSError**)error {
-    uint32_t block_entry_index = 0;
-    mpq_block_table_entry_t* block_table_entry = NULL;
-
-    // Simply go until we find an empty slot or come to the end of the block table
-    for (; block_entry_index < header.block_table_length; block_entry_index++) {
-        block_table_entry = block_table + block_entry_index;
-        
-        // If we find an empty block table entry, return it
-        if (block_table_entry->size == 0 && block_table_entry->archived_size == 0 && block_table_entry->flags == 0) {
-            return block_entry_index;
-        }
-        
-        // If we are given the size of the file which will be represented by the new entry, try to recycle deleted entries
-        if (size != 0) {
-            // Adjust the size to include a possible sector table
-            // TODO: should be able to take into account MPQFileHasSectorAdlers
-            uint32_t sector_table_length = _MPQComputeSectorTableLength(full_sector_size, size, 0);
-            // Explicit cast is OK here, MPQ file sizes are 32-bit
-            size += sector_table_length * (uint32_t)sizeof(uint32_t);
-            
-            // If the current entry is invalid and the storage size is greater or equal to what we need
-            if (!(block_table_entry->flags & MPQFileValid) && block_table_entry->archived_size >= size && block_offset_table[block_entry_index] > 0) {
+// Space for the file is found when it is written, see _buildExtentMap:error:
+- (uint32_t)createBlockTablePosition:(NSError**)error {
+    if (!block_free_map && ![self _buildBlockFreeMap])
+        ReturnValueWithError(0xffffffff, MPQErrorDomain, errOutOfMemory, nil, error)
+    
+    // Find the first empty entry from the cursor, clearing stale bits along the way
+    uint32_t word_count = (header.block_table_length + 31) >> 5;
+    for (; block_free_map_cursor < word_count; block_free_map_cursor++) {
+        uint32_t word = block_free_map[block_free_map_cursor];
+        while (word) {
+            uint32_t bit = (uint32_t)__builtin_ctz(word);
+            uint32_t block_entry_index = (block_free_map_cursor << 5) | bit;
+            if (block_entry_index < header.block_table_length && _MPQBlockEntryIsEmpty(block_table + block_entry_index))
                 return block_entry_index;
-            }
+            
+            word &= word - 1;
+            block_free_map[block_free_map_cursor] &= ~(1U << bit);
         }
     }
     
-    // Failed to find an empty entry, so let's try to grow the block table
+    // Failed to find an empty entry, so let's grow the block table. The first new entry is empty.
+    uint32_t old_block_table_length = header.block_table_length;
     if (![self _growBlockTable:error])
         return 0xffffffff;
     
-    return [self createBlockTablePosition:size error:error];
+    return old_block_table_length;
 }
 
-#pragma mark sector table cache
-
-- (void)flushSectorTablesCache {
-    uint32_t current_sector = 0;
-    for (; current_sector < header.hash_table_length; current_sector++) {
-        if (sector_tables_cache[current_sector]) free(sector_tables_cache[current_sector]);
-        sector_tables_cache[current_sector] = NULL;
-    }
+// Moves every non-empty block table entry to the front of the block table, keeping their order, and updates the block
+// offset table, the attributes columns and the hash table accordingly
+- (BOOL)_compactBlockTable:(uint32_t*)used_block_table_length error:(NSError**)error {
+    NSParameterAssert(used_block_table_length != NULL);
+    uint32_t block_table_length = header.block_table_length;
     
-    memset(sector_tables_cache, 0, header.hash_table_length * sizeof(uint32_t*));
-}
-
-- (BOOL)_cacheSectorTableForFile:(uint32_t)hash_position key:(uint32_t)encryptionKey error:(NSError**)error {
-    NSParameterAssert(hash_position < header.hash_table_length);
+    // Build the old to new block table index map, moving entries as we go
+    uint32_t* block_index_map = malloc(((block_table_length) ? block_table_length : 1) * sizeof(uint32_t));
+    if (!block_index_map)
+        ReturnValueWithError(NO, MPQErrorDomain, errOutOfMemory, nil, error)
     
-    // Do nothing if that hash entry is empty or deleted
-    mpq_hash_table_entry_t* hash_entry = hash_table + hash_position;
-    if (hash_entry->block_table_index == HASH_TABLE_EMPTY || hash_entry->block_table_index == HASH_TABLE_DELETED)
-        return YES;
-    mpq_block_table_entry_t* block_entry = block_table + hash_entry->block_table_index;
+    uint32_t new_block_table_length = 0;
+    uint32_t block_entry_index = 0;
+    for (; block_entry_index < block_table_length; block_entry_index++) {
+        if (_MPQBlockEntryIsEmpty(block_table + block_entry_index)) {
+            block_index_map[block_entry_index] = 0xffffffff;
+            continue;
+        }
+        
+        if (new_block_table_length != block_entry_index) {
+            block_table[new_block_table_length] = block_table[block_entry_index];
+            block_offset_table[new_block_table_length] = block_offset_table[block_entry_index];
+        }
+        block_index_map[block_entry_index] = new_block_table_length;
+        new_block_table_length++;
+    }
     
-    // Only compressed, multi-sector files have a sector table
-    if (!(block_entry->flags & (MPQFileCompressed | MPQFileDiabloCompressed)) || (block_entry->flags & MPQFileOneSector))
-        return YES;
-
-    // Calculate the number of sectors for that file and the size of the resulting sector table
-    uint32_t sector_table_length = _MPQComputeSectorTableLength(full_sector_size, block_entry->size, block_entry->flags);
-    // Explicit cast is OK here, sector table sizes are 32-bit
-    uint32_t sector_table_size = sector_table_length * (uint32_t)sizeof(uint32_t);
-
-    // Either we have the sector table for that file in cache, or we don't
-    uint32_t* sectors = sector_tables_cache[hash_position];
-    if (sectors)
+    if (new_block_table_length == block_table_length) {
+        free(block_index_map);
+        *used_block_table_length = block_table_length;
         return YES;
+    }
     
-    // We need to read the block table. Block is allocated and therefore retained
-    sectors = malloc(sector_table_size);
-    if (!sectors) ReturnValueWithError(NO, MPQErrorDomain, errOutOfMemory, nil, error)
+    memset(block_table + new_block_table_length, 0, (block_table_length - new_block_table_length) * sizeof(mpq_block_table_entry_t));
+    memset(block_offset_table + new_block_table_length, 0, (block_table_length - new_block_table_length) * sizeof(off_t));
     
-    // Read the sector table
-    ssize_t bytes_read = pread(archive_fd, sectors, sector_table_size, archive_offset + block_offset_table[hash_entry->block_table_index]);
-    if (bytes_read == -1) {
-        free(sectors);
-        ReturnValueWithPOSIXError(NO, nil, error)
+    // Attributes. Each column is compacted one run of consecutive non-empty entries at a time.
+    if (attributes_data) {
+        mpq_attributes_header_t* attributes = (mpq_attributes_header_t*)attributes_data;
+        size_t column_offset = sizeof(mpq_attributes_header_t);
+        
+        mpq_file_attribute_t* attribute = mpq_file_attributes;
+        for (; attribute->flag != 0; attribute++) {
+            if (!(attributes->attributes & attribute->flag))
+                continue;
+            
+            size_t column_size = (size_t)attribute->size * block_table_length;
+            if (column_offset + column_size > attributes_data_size)
+                break;
+            uint8_t* column = BUFFER_OFFSET(attributes_data, column_offset);
+            
+            uint32_t run_start = 0;
+            while (run_start < block_table_length) {
+                if (block_index_map[run_start] == 0xffffffff) {
+                    run_start++;
+                    continue;
+                }
+                
+                uint32_t run_end = run_start + 1;
+                while (run_end < block_table_length && block_index_map[run_end] != 0xffffffff)
+                    run_end++;
+                
+                if (block_index_map[run_start] != run_start)
+                    memmove(column + (size_t)attribute->size * block_index_map[run_start], column + (size_t)attribute->size * run_start, (size_t)attribute->size * (run_end - run_start));
+                run_start = run_end;
+            }
+            
+            memset(column + (size_t)attribute->size * new_block_table_length, 0, (size_t)attribute->size * (block_table_length - new_block_table_length));
+            column_offset += column_size;
+        }
     }
-    if ((uint32_t)bytes_read < sector_table_size) {
-        free(sectors);
-        ReturnValueWithError(NO, MPQErrorDomain, errIO, nil, error)
+    
+    // Remap the hash table in a single pass. A hash entry using an empty block entry is broken, so it is marked deleted
+    // to keep the probe chain it is in intact.
+    uint32_t hash_position = 0;
+    for (; hash_position < header.hash_table_length; hash_position++) {
+        mpq_hash_table_entry_t* hash_entry = hash_table + hash_position;
+        if (hash_entry->block_table_index >= block_table_length)
+            continue;
+        
+        uint32_t new_block_index = block_index_map[hash_entry->block_table_index];
+        if (new_block_index == 0xffffffff)
+            hash_entry->block_table_index = HASH_TABLE_DELETED;
+        else
+            hash_entry->block_table_index = new_block_index;
     }
     
-    // If the file is encrypted, decrypt the block table and disable output swapping since a block table is just an array of unsigned longs
-    if ((block_entry->flags & MPQFileEncrypted)) mpq_decrypt(sectors, sector_table_size, encryptionKey - 1, YES);
-    else [[self class] swap_uint32_array:sectors length:sector_table_length];
+    free(block_index_map);
     
-    // Cache the sector table
-    sector_tables_cache[hash_position] = sectors;
+    // Entries have moved
+    [self _invalidateBlockFreeMap];
+    
+    *used_block_table_length = new_block_table_length;
     return YES;
 }
 
-- (void)cacheSectorTables {
-    uint32_t hash_position = 0;
-    while (hash_position < header.hash_table_length) {
-        // Make aliases to optimize the code
-        mpq_hash_table_entry_t* hash_entry = &hash_table[hash_position];
+// Returns a copy of the attributes data laid out for a block table of the specified length, ready to be stored in the archive
+- (NSData*)_attributesDataForBlockTableLength:(uint32_t)block_table_length error:(NSError**)error {
+    mpq_attributes_header_t* attributes = (mpq_attributes_header_t*)attributes_data;
+    
+    size_t attributes_row_size = 0;
+    mpq_file_attribute_t* attribute = mpq_file_attributes;
+    for (; attribute->flag != 0; attribute++) {
+        if ((attributes->attributes & attribute->flag))
+            attributes_row_size += attribute->size;
+    }
+    
+    size_t columns_end = sizeof(mpq_attributes_header_t) + attributes_row_size * header.block_table_length;
+    size_t trailer_size = (attributes_data_size > columns_end) ? attributes_data_size - columns_end : 0;
+    size_t packed_size = sizeof(mpq_attributes_header_t) + attributes_row_size * block_table_length + trailer_size;
+    
+    uint8_t* packed = calloc(packed_size, 1);
+    if (!packed)
+        ReturnValueWithError(nil, MPQErrorDomain, errOutOfMemory, nil, error)
+    
+    memcpy(packed, attributes, sizeof(mpq_attributes_header_t));
+    [[self class] swap_uint32_array:(uint32_t*)packed length:2];
+    
+    // Copy as many values as both layouts have, the remaining values are 0
+    uint32_t value_count = (block_table_length < header.block_table_length) ? block_table_length : header.block_table_length;
+    size_t column_offset = sizeof(mpq_attributes_header_t);
+    size_t packed_column_offset = sizeof(mpq_attributes_header_t);
+    for (attribute = mpq_file_attributes; attribute->flag != 0; attribute++) {
+        if (!(attributes->attributes & attribute->flag))
+            continue;
+        
+        size_t copy_size = (size_t)attribute->size * value_count;
+        if (column_offset + copy_size <= attributes_data_size)
+            memcpy(packed + packed_column_offset, BUFFER_OFFSET(attributes_data, column_offset), copy_size);
+        
+        column_offset += (size_t)attribute->size * header.block_table_length;
+        packed_column_offset += (size_t)attribute->size * block_table_length;
+    }
+    
+    if (trailer_size)
+        memcpy(packed + packed_column_offset, BUFFER_OFFSET(attributes_data, columns_end), trailer_size);
+    
+    return [NSData dataWithBytesNoCopy:packed length:packed_size freeWhenDone:YES];
+}
+
+// Stores the attributes of info for the file at block_index. Attributes which info doesn't have, or all of them if info is NULL, are set to 0.
+- (void)_setAttributes:(const MPQFileInfo*)info blockIndex:(uint32_t)block_index {
+    if (!attributes_data)
+        return;
+    mpq_attributes_header_t* attributes = (mpq_attributes_header_t*)attributes_data;
+    
+    size_t column_offset = sizeof(mpq_attributes_header_t);
+    const mpq_file_attribute_t* attribute = mpq_file_attributes;
+    for (; attribute->flag != 0; attribute++) {
+        if (!(attributes->attributes & attribute->flag))
+            continue;
+    
+        size_t value_offset = column_offset + attribute->size * block_index;
+        column_offset += attribute->size * header.block_table_length;
+        if (value_offset + attribute->size > attributes_data_size)
+            continue;
+    
+        void* value = BUFFER_OFFSET(attributes_data, value_offset);
+        memset(value, 0, attribute->size);
+        if (!info || !(info->info_flags & attribute->flag))
+            continue;
+    
+        if (attribute->flag == MPQFileInfoHasCRC) {
+            uint32_t crc = MPQSwapInt32HostToLittle(info->crc);
+            memcpy(value, &crc, sizeof(uint32_t));
+        } else if (attribute->flag == MPQFileInfoHasCreationDate) {
+            uint64_t creation_date = MPQSwapInt64HostToLittle(info->creation_date);
+            memcpy(value, &creation_date, sizeof(uint64_t));
+        } else if (attribute->flag == MPQFileInfoHasMD5) {
+            memcpy(value, info->md5, sizeof(info->md5));
+        }
+    }
+}
+
+// Clears the block table entries which are not valid, such as the entries of files deleted or overwritten since the last
+// save. Their data may have been reused by other files by now, so they are made empty for compaction to drop them and
+// createBlockTablePosition: to reuse them. Only call this while saving, since undoing a deletion needs its block entry
+// to still be there.
+- (void)_clearInvalidBlockEntries {
+    uint32_t block_entry_index = 0;
+    for (; block_entry_index < header.block_table_length; block_entry_index++) {
+        mpq_block_table_entry_t* block_entry = block_table + block_entry_index;
+        if ((block_entry->flags & MPQFileValid) || _MPQBlockEntryIsEmpty(block_entry))
+            continue;
+        
+        memset(block_entry, 0, sizeof(mpq_block_table_entry_t));
+        block_offset_table[block_entry_index] = 0;
+        [self _setAttributes:NULL blockIndex:block_entry_index];
+        [self _markBlockEntryFree:block_entry_index];
+    }
+}
+    
+#pragma mark free space
+
+// Free regions of the archive, between the header and the structural tables. They are sorted by size, then offset, so
+// that the smallest region a file fits in is found with a binary search.
+struct mpq_extent {
+    off_t offset;
+    off_t size;
+};
+typedef struct mpq_extent mpq_extent_t;
+
+struct mpq_extent_map {
+    mpq_extent_t* extents;
+    uint32_t count;
+};
+typedef struct mpq_extent_map mpq_extent_map_t;
+
+static int _MPQCompareExtentOffsets(const void* lhs, const void* rhs) {
+    const mpq_extent_t* left = (const mpq_extent_t*)lhs;
+    const mpq_extent_t* right = (const mpq_extent_t*)rhs;
+    if (left->offset != right->offset)
+        return (left->offset < right->offset) ? -1 : 1;
+    return (left->size < right->size) ? -1 : (left->size > right->size) ? 1 : 0;
+}
+
+static int _MPQCompareExtentSizes(const void* lhs, const void* rhs) {
+    const mpq_extent_t* left = (const mpq_extent_t*)lhs;
+    const mpq_extent_t* right = (const mpq_extent_t*)rhs;
+    if (left->size != right->size)
+        return (left->size < right->size) ? -1 : 1;
+    return (left->offset < right->offset) ? -1 : (left->offset > right->offset) ? 1 : 0;
+}
+
+// Index of the first extent which is not smaller than size (or with the same size, not before offset)
+static uint32_t _MPQExtentMapLowerBound(const mpq_extent_map_t* map, off_t size, off_t offset) {
+    uint32_t low = 0;
+    uint32_t high = map->count;
+    while (low < high) {
+        uint32_t middle = low + ((high - low) >> 1);
+        const mpq_extent_t* extent = map->extents + middle;
+        if (extent->size < size || (extent->size == size && extent->offset < offset))
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+static void _MPQExtentMapDestroy(mpq_extent_map_t* map) {
+    if (map->extents)
+        free(map->extents);
+    map->extents = NULL;
+    map->count = 0;
+}
+
+// Returns the index of the smallest extent of at least size bytes, or 0xffffffff if there is none
+static uint32_t _MPQExtentMapFind(const mpq_extent_map_t* map, off_t size) {
+    uint32_t extent_index = _MPQExtentMapLowerBound(map, size, 0);
+    return (extent_index < map->count) ? extent_index : 0xffffffff;
+}
+
+// Takes size bytes from the beginning of an extent. What is left of it stays in the map.
+static void _MPQExtentMapConsume(mpq_extent_map_t* map, uint32_t extent_index, off_t size) {
+    mpq_extent_t remainder = map->extents[extent_index];
+    remainder.offset += size;
+    remainder.size -= size;
+    
+    memmove(map->extents + extent_index, map->extents + extent_index + 1, (map->count - extent_index - 1) * sizeof(mpq_extent_t));
+    map->count--;
+    if (remainder.size <= 0)
+        return;
+    
+    // The remainder is smaller, so it goes at or before the extent's old index and there is room for it
+    uint32_t remainder_index = _MPQExtentMapLowerBound(map, remainder.size, remainder.offset);
+    memmove(map->extents + remainder_index + 1, map->extents + remainder_index, (map->count - remainder_index) * sizeof(mpq_extent_t));
+    map->extents[remainder_index] = remainder;
+    map->count++;
+}
+
+// Builds the map of the regions which no valid file uses, including the data of files deleted or overwritten since the
+// last save. Block table entries of deleted files are not needed to find these. During a journaled save, the files
+// and structural tables of the committed archive must be preserved, so the regions of the files deleted or overwritten
+// since the last save, which the operations remember, and the committed structural tables are not free.
+- (BOOL)_buildExtentMap:(mpq_extent_map_t*)map error:(NSError**)error {
+    map->extents = NULL;
+    map->count = 0;
+    
+    // Gather the used regions. There is at most one free region before each of them, plus one at the end.
+    uint32_t used_capacity = header.block_table_length + ((journal_tables_end != 0) ? deferred_operations_count + 1 : 0);
+    mpq_extent_t* used = malloc(((used_capacity) ? used_capacity : 1) * sizeof(mpq_extent_t));
+    if (!used)
+        ReturnValueWithError(NO, MPQErrorDomain, errOutOfMemory, nil, error)
+    
+    uint32_t used_count = 0;
+    uint32_t block_entry_index = 0;
+    for (; block_entry_index < header.block_table_length; block_entry_index++) {
+        mpq_block_table_entry_t* block_entry = block_table + block_entry_index;
+        off_t block_offset = block_offset_table[block_entry_index];
+        if (!(block_entry->flags & MPQFileValid) || block_entry->archived_size == 0 || block_offset == 0)
+            continue;
+        used[used_count].offset = block_offset;
+        used[used_count].size = block_entry->archived_size;
+        used_count++;
+    }
+    
+    if (journal_tables_end != 0) {
+        mpq_deferred_operation_t* operation = last_operation;
+        for (; operation && used_count < used_capacity - 1; operation = operation->previous) {
+            const mpq_block_table_entry_t* block_entry = &operation->primary_file_context.block_entry;
+            off_t block_offset = operation->primary_file_context.block_offset;
+            if (!(block_entry->flags & MPQFileValid) || block_entry->archived_size == 0 || block_offset == 0)
+                continue;
+            used[used_count].offset = block_offset;
+            used[used_count].size = block_entry->archived_size;
+            used_count++;
+        }
+        
+        used[used_count].offset = journal_tables_offset;
+        used[used_count].size = journal_tables_end - journal_tables_offset;
+        used_count++;
+    }
+    qsort(used, used_count, sizeof(mpq_extent_t), _MPQCompareExtentOffsets);
+    
+    map->extents = malloc((used_count + 1) * sizeof(mpq_extent_t));
+    if (!map->extents) {
+        free(used);
+        ReturnValueWithError(NO, MPQErrorDomain, errOutOfMemory, nil, error)
+    }
+    
+    // New archives reserve room for the version 1 header, and the structural tables start at the write offset
+    off_t free_offset = MAX((off_t)header.header_size, (off_t)(sizeof(mpq_header_t) + sizeof(mpq_extended_header_t)));
+    uint32_t used_index = 0;
+    for (; used_index <= used_count; used_index++) {
+        off_t used_offset = (used_index < used_count) ? MIN(used[used_index].offset, archive_write_offset) : archive_write_offset;
+        if (used_offset > free_offset) {
+            map->extents[map->count].offset = free_offset;
+            map->extents[map->count].size = used_offset - free_offset;
+            map->count++;
+        }
+        if (used_index < used_count && used[used_index].offset + used[used_index].size > free_offset)
+            free_offset = used[used_index].offset + used[used_index].size;
+    }
+    free(used);
+    
+    qsort(map->extents, map->count, sizeof(mpq_extent_t), _MPQCompareExtentSizes);
+    return YES;
+}
+
+#pragma mark sector table cache
+
+- (void)flushSectorTablesCache {
+    mpq_slot_table_free_pointers(&sector_tables_cache, free);
+}
+
+- (BOOL)_cacheSectorTableForFile:(uint32_t)hash_position key:(uint32_t)encryptionKey error:(NSError**)error {
+    NSParameterAssert(hash_position < header.hash_table_length);
+    
+    // Do nothing if that hash entry is empty or deleted
+    mpq_hash_table_entry_t* hash_entry = hash_table + hash_position;
+    if (hash_entry->block_table_index == HASH_TABLE_EMPTY || hash_entry->block_table_index == HASH_TABLE_DELETED)
+        return YES;
+    mpq_block_table_entry_t* block_entry = block_table + hash_entry->block_table_index;
+    
+    // Only compressed, multi-sector files have a sector table
+    if (!(block_entry->flags & (MPQFileCompressed | MPQFileDiabloCompressed)) || (block_entry->flags & MPQFileOneSector))
+        return YES;
+
+    // Calculate the number of sectors for that file and the size of the resulting sector table
+    uint32_t sector_table_length = _MPQComputeSectorTableLength(full_sector_size, block_entry->size, block_entry->flags);
+    // Explicit cast is OK here, sector table sizes are 32-bit
+    uint32_t sector_table_size = sector_table_length * (uint32_t)sizeof(uint32_t);
+
+    // Either we have the sector table for that file in cache, or we don't
+    uint32_t* sectors = mpq_slot_table_get_pointer(&sector_tables_cache, hash_position);
+    if (sectors)
+        return YES;
+    
+    // Files pending addition are not in the archive yet, but those merged from another archive can be read from it
+    int fd = archive_fd;
+    off_t file_offset = archive_offset + block_offset_table[hash_entry->block_table_index];
+    mpq_deferred_operation_t* operation = mpq_slot_table_get_pointer(&operation_hash_table, hash_position);
+    if (operation && operation->type == MPQDOAdd) {
+        mpq_deferred_operation_add_context_t* context = (mpq_deferred_operation_add_context_t*)operation->context;
+        if (!context->source_handle)
+            return YES;
+        fd = [context->source_handle fileDescriptor];
+        file_offset = context->source_offset;
+        encryptionKey = context->source_key;
+    }
+    
+    // We need to read the block table. Block is allocated and therefore retained
+    sectors = malloc(sector_table_size);
+    if (!sectors) ReturnValueWithError(NO, MPQErrorDomain, errOutOfMemory, nil, error)
+    
+    // Read and decode the sector table
+    mpq_core_error_t core_error;
+    if (mpq_core_read_sector_table(fd, file_offset, block_entry, full_sector_size, encryptionKey, sectors, &core_error) == -1) {
+        free(sectors);
+        if (error)
+            *error = _MPQErrorWithCoreError(&core_error, nil);
+        return NO;
+    }
+    
+    // Cache the sector table
+    if (mpq_slot_table_set_pointer(&sector_tables_cache, hash_position, sectors) == -1) {
+        free(sectors);
+        ReturnValueWithError(NO, MPQErrorDomain, errOutOfMemory, nil, error)
+    }
+    return YES;
+}
+
+- (void)cacheSectorTables {
+    uint32_t hash_position = 0;
+    while (hash_position < header.hash_table_length) {
+        // Make aliases to optimize the code
+        mpq_hash_table_entry_t* hash_entry = &hash_table[hash_position];
         
         // Is this a valid file?
         if (hash_entry->block_table_index != HASH_TABLE_EMPTY && hash_entry->block_table_index != HASH_TABLE_DELETED) {
@@ -709,10 +1417,71 @@ FreeData:
     _fileCountCachesDirty = NO;
 }
 
+#pragma mark file info cache
+
+// File info dictionaries are cached for repeated requests (e.g. stat calls from a file system). The cache keeps at most
+// FILE_INFO_CACHE_CAPACITY dictionaries, evicted in insertion order using a ring of hash positions.
+#define FILE_INFO_CACHE_CAPACITY 4096
+
+- (void)_invalidateFileInfo:(uint32_t)hash_position {
+    NSDictionary* fileInfo = mpq_slot_table_get_pointer(&file_info_cache, hash_position);
+    if (fileInfo) {
+        [fileInfo release];
+        mpq_slot_table_set_pointer(&file_info_cache, hash_position, NULL);
+    }
+}
+
+- (void)_flushFileInfoCache {
+    mpq_slot_table_free_pointers(&file_info_cache, _MPQReleaseSlotObject);
+    if (file_info_cache_ring)
+        memset(file_info_cache_ring, 0xff, FILE_INFO_CACHE_CAPACITY * sizeof(uint32_t));
+    file_info_cache_ring_index = 0;
+}
+
+- (NSDictionary*)_cachedFileInfo:(uint32_t)hash_position {
+    NSDictionary* fileInfo = mpq_slot_table_get_pointer(&file_info_cache, hash_position);
+    if (!fileInfo)
+        return nil;
+    
+    // Names are resolved lazily, so a cached synthetic name may be stale
+    if ([fileInfo[MPQSyntheticFilename] boolValue] && _MPQGetFilename(&filename_table, &filename_arena, hash_position)) {
+        [self _invalidateFileInfo:hash_position];
+        return nil;
+    }
+    
+    return fileInfo;
+}
+
+- (void)_cacheFileInfo:(NSDictionary*)fileInfo position:(uint32_t)hash_position {
+    if (!file_info_cache_ring) {
+        file_info_cache_ring = malloc(FILE_INFO_CACHE_CAPACITY * sizeof(uint32_t));
+        if (!file_info_cache_ring)
+            return;
+        memset(file_info_cache_ring, 0xff, FILE_INFO_CACHE_CAPACITY * sizeof(uint32_t));
+        file_info_cache_ring_index = 0;
+    }
+    
+    // Evict the oldest entry
+    uint32_t evicted_position = file_info_cache_ring[file_info_cache_ring_index];
+    if (evicted_position != 0xffffffff)
+        [self _invalidateFileInfo:evicted_position];
+    
+    [self _invalidateFileInfo:hash_position];
+    NSDictionary* fileInfoCopy = [fileInfo copy];
+    if (mpq_slot_table_set_pointer(&file_info_cache, hash_position, fileInfoCopy) == -1) {
+        [fileInfoCopy release];
+        return;
+    }
+    
+    file_info_cache_ring[file_info_cache_ring_index] = hash_position;
+    file_info_cache_ring_index = (file_info_cache_ring_index + 1) % FILE_INFO_CACHE_CAPACITY;
+}
+
 #pragma mark memory management
 
 static void mpq_deferred_operation_add_context_free(mpq_deferred_operation_add_context_t* context) {
     [context->dataSourceProxy release];
+    [context->source_handle release];
     free(context);
 }
 
@@ -731,7 +1500,8 @@ static deferred_operation_context_free_function dosc_free_functions[] = {
     if (last_operation) {
         // Backup the operation's hash table position
         uint32_t hash_position = last_operation->primary_file_context.hash_position;
-        operation_hash_table[hash_position] = NULL;
+        if (hash_position != DETACHED_OPERATION_POSITION)
+            mpq_slot_table_set_pointer(&operation_hash_table, hash_position, NULL);
         
         // Remove the operation from the operation linked list
         mpq_deferred_operation_t* old = last_operation;
@@ -742,10 +1512,10 @@ static deferred_operation_context_free_function dosc_free_functions[] = {
         free(old);
         
         // Going from newest to oldest, set the hash table position's operation to the first operation matching the position
-        old = last_operation;
+        old = (hash_position != DETACHED_OPERATION_POSITION) ? last_operation : NULL;
         while (old) {
             if (old->primary_file_context.hash_position == hash_position) {
-                operation_hash_table[hash_position] = old;
+                mpq_slot_table_set_pointer(&operation_hash_table, hash_position, old);
                 break;
             }
             
@@ -754,6 +1524,8 @@ static deferred_operation_context_free_function dosc_free_functions[] = {
         
         // Decrease the number of operations
         deferred_operations_count--;
+        if (rehashed_operations_count > deferred_operations_count)
+            rehashed_operations_count = deferred_operations_count;
     }
 }
 
@@ -763,17 +1535,6 @@ static deferred_operation_context_free_function dosc_free_functions[] = {
 
 - (void)freeMemory {    
     NSAutoreleasePool* p = [NSAutoreleasePool new];
-    uint32_t count;
-    
-    if (read_buffer) {
-        free(read_buffer);
-        read_buffer = NULL;
-    }
-    
-    if (compression_buffer) {
-        free(compression_buffer);
-        compression_buffer = NULL;
-    }
     
     if (hash_table) {
         free(hash_table);
@@ -789,62 +1550,27 @@ static deferred_operation_context_free_function dosc_free_functions[] = {
         free(block_offset_table);
         block_offset_table = NULL;
     }
+    [self _invalidateBlockFreeMap];
     
-    if (filename_table) {
-        for (count = 0; count < header.hash_table_length; count++) {
-            if (filename_table[count]) free((filename_table[count]));
-        }
-        
-        free(filename_table);
-        filename_table = NULL;
-    }
+    mpq_slot_table_clear(&filename_table);
+    mpq_string_arena_destroy(&filename_arena);
     
     [self _flushDOS];
-    if (operation_hash_table) {
-        free(operation_hash_table);
-        operation_hash_table = NULL;
-    }
-    
-    if (open_file_count_table) {
-        free(open_file_count_table);
-        open_file_count_table = NULL;
-    }
-    
-    if (encryption_keys_cache) {
-        free(encryption_keys_cache);
-        encryption_keys_cache = NULL;
-    }
-    
-    if (sector_tables_cache) {
-        [self flushSectorTablesCache];
-        free(sector_tables_cache);
-        sector_tables_cache = NULL;
-    }
-    
-    if (file_info_cache) {
-        for (count = 0; count < header.hash_table_length; count++) {
-            if (file_info_cache[count]) [file_info_cache[count] release];
-        }
-        
-        free(file_info_cache);
-        file_info_cache = NULL;
+    mpq_slot_table_clear(&operation_hash_table);
+    mpq_slot_table_clear(&open_file_count_table);
+    mpq_slot_table_clear(&encryption_keys_cache);
+    [self flushSectorTablesCache];
+    mpq_slot_table_free_pointers(&file_info_cache, _MPQReleaseSlotObject);
+    if (file_info_cache_ring) {
+        free(file_info_cache_ring);
+        file_info_cache_ring = NULL;
     }
+    file_info_cache_ring_index = 0;
     
     [p release];
 }
 
 - (BOOL)allocateMemory {
-    // For sector operations, we'll work with full_sector_size * 2 + 1 sized buffers
-    uint32_t sector_buffer_size = (full_sector_size << 1) + 1;
-        
-    // Read buffer
-    read_buffer = malloc(sector_buffer_size);
-    if (!read_buffer) goto AllocateFailure;
-    
-    // Compression buffer
-    compression_buffer = malloc(sector_buffer_size);
-    if (!compression_buffer) goto AllocateFailure;
-        
     // Hash table
     hash_table = malloc(header.hash_table_length * sizeof(mpq_hash_table_entry_t));
     if (!hash_table) goto AllocateFailure;
@@ -857,29 +1583,15 @@ static deferred_operation_context_free_function dosc_free_functions[] = {
     block_offset_table = calloc(header.block_table_length, sizeof(off_t));
     if (!block_offset_table) goto AllocateFailure;
     
-    // Name table
-    filename_table = calloc(header.hash_table_length, sizeof(char*));
-    if (!filename_table) goto AllocateFailure;
-    
-    // Operations table
-    operation_hash_table = calloc(header.hash_table_length, sizeof(mpq_deferred_operation_t*));
-    if (!operation_hash_table) goto AllocateFailure;
-    
-    // MPQFile reference count table
-    open_file_count_table = calloc(header.hash_table_length, sizeof(uint32_t));
-    if (!open_file_count_table) goto AllocateFailure;
-    
-    // Encryption key cache
-    encryption_keys_cache = calloc(header.hash_table_length, sizeof(uint32_t));
-    if (!encryption_keys_cache) goto AllocateFailure;
-    
-    // Sector table cache
-    sector_tables_cache = calloc(header.hash_table_length, sizeof(uint32_t*));
-    if (!sector_tables_cache) goto AllocateFailure;
-    
-    // Attributes cache
-    file_info_cache = calloc(header.hash_table_length, sizeof(NSDictionary*));
-    if (!file_info_cache) goto AllocateFailure;
+    // Per hash table position tables. These are sparse and only allocate memory for the positions that are
+    // actually used, so the writer-only operations table stays empty for read-only archives.
+    mpq_slot_table_init(&filename_table, header.hash_table_length, sizeof(uint32_t));
+    mpq_string_arena_init(&filename_arena);
+    mpq_slot_table_init(&operation_hash_table, header.hash_table_length, sizeof(mpq_deferred_operation_t*));
+    mpq_slot_table_init(&open_file_count_table, header.hash_table_length, sizeof(uint32_t));
+    mpq_slot_table_init(&encryption_keys_cache, header.hash_table_length, sizeof(uint32_t));
+    mpq_slot_table_init(&sector_tables_cache, header.hash_table_length, sizeof(uint32_t*));
+    mpq_slot_table_init(&file_info_cache, header.hash_table_length, sizeof(NSDictionary*));
 
     // Mark every entry in the hash table as empty (0xff everywhere)
     memset(hash_table, 0xff, header.hash_table_length * sizeof(mpq_hash_table_entry_t));
@@ -929,43 +1641,99 @@ AllocateFailure:
     return result;
 }
 
+- (void)_addListfileName:(const char*)name length:(size_t)length key:(const mpq_name_key_t*)key {
+    // Search through ALL possible hash table entries. There may be multiple languages of the specified file.
+    uint32_t current_position = key->position % header.hash_table_length;
+    uint32_t entries_left = header.hash_table_length;
+    
+    // Every locale of the file shares a single copy of the name
+    uint32_t name_reference = 0;
+    while (entries_left > 0 && hash_table[current_position].block_table_index != HASH_TABLE_EMPTY) {
+        // If the hash table entry matches the file we're searching for and we don't already have the filename in the name table, add it.
+        mpq_hash_table_entry_t* hash_entry = hash_table + current_position;
+        if (hash_entry->hash_a == key->hash_a && hash_entry->hash_b == key->hash_b)
+            _MPQStoreFilename(&filename_table, &filename_arena, current_position, name, length, &name_reference);
+        
+        if (++current_position == header.hash_table_length)
+            current_position = 0;
+        entries_left--;
+    }
+}
+
 - (BOOL)_addListfileEntry:(NSString*)filename error:(NSError**)error {
     NSParameterAssert(filename != NULL);
     char* filename_cstring = _MPQCreateASCIIFilename(filename, error);
     if (!filename_cstring)
         return NO;
-    size_t filename_length = strlen(filename_cstring) + 1;
+    size_t filename_length = strlen(filename_cstring);
     
-    // Compute the starting point and the two verification hashes we'll use to see if the file is in the hash table
-    uint32_t initial_position = mpq_hash_cstring(filename_cstring, HASH_POSITION) % header.hash_table_length,
-        current_position = initial_position,
-        hash_a = mpq_hash_cstring(filename_cstring, HASH_NAME_A),
-        hash_b = mpq_hash_cstring(filename_cstring, HASH_NAME_B);
+    mpq_name_key_t key;
+    mpq_core_compute_name_key_with_length(filename_cstring, filename_length, &key);
+    [self _addListfileName:filename_cstring length:filename_length key:&key];
     
-    // Search through ALL possible hash table entries. There may be multiple languages of the specified file.
-    while (hash_table[current_position].block_table_index != HASH_TABLE_EMPTY) {
-        // If the hash table entry matches the file we're searching for and we don't already have the filename in the name table, add it.
-        if (!filename_table[current_position] && hash_table[current_position].hash_a == hash_a && hash_table[current_position].hash_b == hash_b) {
-            filename_table[current_position] = malloc(filename_length);
-            if (filename_table[current_position])
-                memcpy(filename_table[current_position], filename_cstring, filename_length);
-        }
-        
-        current_position++;
-        current_position %= header.hash_table_length;
+    free(filename_cstring);
+    return YES;
+}
 
-        if (current_position == initial_position)
-            break;
+#define LISTFILE_MIN_ENTRIES_PER_THREAD 16384
+#define LISTFILE_MAX_THREADS 16
+
+struct mpq_listfile_hash_batch {
+    const void* data;
+    mpq_listfile_entry_t* entries;
+    size_t count;
+};
+typedef struct mpq_listfile_hash_batch mpq_listfile_hash_batch_t;
+
+static void* _MPQHashListfileThread(void* arg) {
+    mpq_listfile_hash_batch_t* batch = arg;
+    mpq_core_hash_listfile_entries(batch->data, batch->entries, batch->count);
+    return NULL;
+}
+
+static void _MPQHashListfileEntries(const void* data, mpq_listfile_entry_t* entries, size_t count) {
+    long thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (thread_count > LISTFILE_MAX_THREADS)
+        thread_count = LISTFILE_MAX_THREADS;
+    if ((size_t)thread_count > count / LISTFILE_MIN_ENTRIES_PER_THREAD)
+        thread_count = (long)(count / LISTFILE_MIN_ENTRIES_PER_THREAD);
+    if (thread_count <= 1) {
+        mpq_core_hash_listfile_entries(data, entries, count);
+        return;
     }
     
-    free(filename_cstring);
-    return YES;
+    // Split the entries in one batch per thread. This thread hashes the first batch, and any batch we can't start a thread for.
+    mpq_listfile_hash_batch_t batches[LISTFILE_MAX_THREADS];
+    pthread_t threads[LISTFILE_MAX_THREADS];
+    BOOL started[LISTFILE_MAX_THREADS];
+    size_t batch_size = (count + thread_count - 1) / thread_count;
+    long thread_index = 0;
+    for (; thread_index < thread_count; thread_index++) {
+        size_t batch_start = batch_size * thread_index;
+        batches[thread_index].data = data;
+        batches[thread_index].entries = entries + batch_start;
+        batches[thread_index].count = MIN(batch_size, count - batch_start);
+        started[thread_index] = (thread_index > 0 && pthread_create(threads + thread_index, NULL, _MPQHashListfileThread, batches + thread_index) == 0);
+    }
+    
+    for (thread_index = 0; thread_index < thread_count; thread_index++) {
+        if (!started[thread_index])
+            _MPQHashListfileThread(batches + thread_index);
+    }
+    for (thread_index = 1; thread_index < thread_count; thread_index++) {
+        if (started[thread_index])
+            pthread_join(threads[thread_index], NULL);
+    }
 }
 
 #pragma mark private inner table access
 
-- (char**)_filenameTable {
-    return filename_table;
+- (const char*)_filenameAtPosition:(uint32_t)hash_position {
+    return _MPQGetFilename(&filename_table, &filename_arena, hash_position);
+}
+
+- (void)_addFilename:(const char*)filename_cstring position:(uint32_t)hash_position {
+    _MPQSetFilename(&filename_table, &filename_arena, hash_position, filename_cstring);
 }
 
 - (mpq_hash_table_entry_t*)_hashTable {
@@ -976,57 +1744,431 @@ AllocateFailure:
     return block_table;
 }
 
-#pragma mark complementary init
+#pragma mark index cache
 
-- (BOOL)_createNewArchive:(uint32_t)hash_table_length version:(uint16_t)version offset:(off_t)offset error:(NSError**)error {
-    // If this parameter is 0, we set it to 1024 (default value)
-    if (hash_table_length == 0)
-        hash_table_length = 1024;
-        
-    // No hash table should be smaller than MPQ_MIN_HASH_TABLE_LENGTH
-    uint32_t final_hash_table_length = MPQ_MIN_HASH_TABLE_LENGTH;
-    
-    // Hash tables cannot be larger than MPQ_MAX_HASH_TABLE_LENGTH or MPQ_MAX_EXTENDED_HASH_TABLE_LENGTH entries
-    if (version == MPQOriginalVersion) {
-        if (hash_table_length > MPQ_MAX_HASH_TABLE_LENGTH)
-            hash_table_length = MPQ_MAX_HASH_TABLE_LENGTH;
-    } else if (version == MPQExtendedVersion) {
-        if (hash_table_length > MPQ_MAX_EXTENDED_HASH_TABLE_LENGTH)
-            hash_table_length = MPQ_MAX_EXTENDED_HASH_TABLE_LENGTH;
-    }
+#define INDEX_CACHE_MAGIC 0x5844494D
+#define INDEX_CACHE_VERSION 2
+#define INDEX_CACHE_BYTE_ORDER_MARK 0x01020304
+#define INDEX_CACHE_ALIGN(size) (((size) + 7) & ~(size_t)7)
+
+#if defined(__APPLE__)
+#define MPQ_STAT_MTIME_NSEC(sb) ((sb)->st_mtimespec.tv_nsec)
+#else
+#define MPQ_STAT_MTIME_NSEC(sb) ((sb)->st_mtim.tv_nsec)
+#endif
+
+// An index cache file is this header followed by the archive path, the hash table, the block table, the block offset table, 
+// the known encryption keys, the known filenames and the cached sector tables, each starting on an 8 bytes boundary. 
+// The file is in host byte order, and is only valid for an archive with the same path, device, inode, size, modification time 
+// and header. Modification times can be as coarse as a second, so saving the archive also refreshes its index cache.
+struct mpq_index_cache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t byte_order_mark;
+    uint32_t header_checksum;
+    
+    uint64_t file_device;
+    uint64_t file_inode;
+    uint64_t file_size;
+    int64_t file_mtime;
+    int64_t archive_offset;
+    int64_t archive_size;
+    int64_t archive_write_offset;
+    
+    uint32_t path_size;
+    uint32_t hash_table_length;
+    uint32_t block_table_length;
+    uint32_t encryption_key_count;
+    uint32_t filenames_size;
+    uint32_t sector_tables_size;
+};
+typedef struct mpq_index_cache_header mpq_index_cache_header_t;
+
+// Filenames are stored as the hash position, the length and the characters, padded to 4 bytes.
+// Sector tables are stored as the hash position followed by the table, whose length is given by the file's block table entry.
+struct mpq_index_cache_record {
+    uint32_t hash_position;
+    uint32_t value;
+};
+typedef struct mpq_index_cache_record mpq_index_cache_record_t;
+
+static int64_t _MPQIndexCacheFileTime(const struct stat* sb) {
+    return ((int64_t)sb->st_mtime * 1000000000LL) + MPQ_STAT_MTIME_NSEC(sb);
+}
+
+- (uint32_t)_indexCacheHeaderChecksum {
+    uint32_t checksum = (uint32_t)crc32(0L, (const Bytef*)&header, sizeof(mpq_header_t));
+    return (uint32_t)crc32(checksum, (const Bytef*)&extended_header, sizeof(mpq_extended_header_t));
+}
+
+- (NSString*)_indexCachePath {
+    if (!index_cache_directory || !archive_path)
+        return nil;
     
-    // The number of entries in a hash table must be a power of 2. Find the first power of 2 that is >= the specified hash table size.
-    while (final_hash_table_length < hash_table_length)
-        final_hash_table_length <<= 1;
+    // Index caches are named after the digest of the archive's path
+    const char* path_cstring = [archive_path fileSystemRepresentation];
+    uint8_t digest[MD5_DIGEST_LENGTH];
+    MD5((const unsigned char*)path_cstring, strlen(path_cstring), digest);
     
-    // Archive offset
-    archive_offset = offset;
+    char digest_string[(MD5_DIGEST_LENGTH * 2) + 1];
+    uint32_t i = 0;
+    for (; i < MD5_DIGEST_LENGTH; i++)
+        snprintf(digest_string + (i * 2), 3, "%02x", digest[i]);
     
-    // To allow an easy upgrade to version 1, we'll reserve the extra space needed at the beginning for the version 1 header
-    archive_write_offset = sizeof(mpq_header_t) + sizeof(mpq_extended_header_t);
+    return [index_cache_directory stringByAppendingPathComponent:[NSString stringWithFormat:@"%s.mpqindex", digest_string]];
+}
+
+- (BOOL)_loadIndexCache:(const struct stat*)sb {
+    NSString* cache_path = [self _indexCachePath];
+    if (!cache_path)
+        return NO;
     
-    // Pure memory for now
-    archive_path = nil;
-    archive_fd = -1;
+    int fd = open([cache_path fileSystemRepresentation], O_RDONLY, 0);
+    if (fd == -1)
+        return NO;
     
-    // Fill up a (partially) valid header
-    header.mpq_magic = MPQ_MAGIC;
-    // Explicit cast is OK here, header_size is 32-bit
-    header.header_size = (version == MPQOriginalVersion) ? (uint32_t)sizeof(mpq_header_t) : (uint32_t)(sizeof(mpq_header_t) + sizeof(mpq_extended_header_t));
-    header.archive_size = 0;
-    header.version = version;
-    header.sector_size_shift = DEFAULT_SECTOR_SIZE_SHIFT;
+    struct stat cache_sb;
+    if (fstat(fd, &cache_sb) == -1 || (size_t)cache_sb.st_size < sizeof(mpq_index_cache_header_t)) {
+        close(fd);
+        return NO;
+    }
     
-    header.hash_table_offset = 0;
-    header.block_table_offset = 0;
+    size_t cache_size = (size_t)cache_sb.st_size;
+    const uint8_t* cache = mmap(NULL, cache_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (cache == MAP_FAILED)
+        return NO;
     
-    header.hash_table_length = final_hash_table_length;
-    header.block_table_length = final_hash_table_length;
+    BOOL result = NO;
+    const mpq_index_cache_header_t* cache_header = (const mpq_index_cache_header_t*)cache;
+    const char* path_cstring = [archive_path fileSystemRepresentation];
+    
+    // Is the cache for this archive, as it is right now?
+    if (cache_header->magic != INDEX_CACHE_MAGIC || cache_header->version != INDEX_CACHE_VERSION || cache_header->byte_order_mark != INDEX_CACHE_BYTE_ORDER_MARK)
+        goto Cleanup;
+    if (cache_header->file_device != (uint64_t)sb->st_dev || cache_header->file_inode != (uint64_t)sb->st_ino)
+        goto Cleanup;
+    if (cache_header->file_size != (uint64_t)sb->st_size || cache_header->file_mtime != _MPQIndexCacheFileTime(sb))
+        goto Cleanup;
+    if (cache_header->archive_offset != archive_offset || cache_header->header_checksum != [self _indexCacheHeaderChecksum])
+        goto Cleanup;
+    if (cache_header->hash_table_length != header.hash_table_length || cache_header->block_table_length != header.block_table_length)
+        goto Cleanup;
+    if (cache_header->path_size != strlen(path_cstring) || cache_header->encryption_key_count > header.hash_table_length)
+        goto Cleanup;
+    
+    // Compute the section offsets and make sure everything is within the file
+    size_t path_offset = INDEX_CACHE_ALIGN(sizeof(mpq_index_cache_header_t));
+    size_t hash_table_section = path_offset + INDEX_CACHE_ALIGN(cache_header->path_size);
+    size_t block_table_section = hash_table_section + INDEX_CACHE_ALIGN(header.hash_table_length * sizeof(mpq_hash_table_entry_t));
+    size_t block_offset_table_section = block_table_section + INDEX_CACHE_ALIGN(header.block_table_length * sizeof(mpq_block_table_entry_t));
+    size_t keys_section = block_offset_table_section + INDEX_CACHE_ALIGN(header.block_table_length * sizeof(int64_t));
+    size_t filenames_section = keys_section + INDEX_CACHE_ALIGN(cache_header->encryption_key_count * sizeof(mpq_index_cache_record_t));
+    size_t sector_tables_section = filenames_section + INDEX_CACHE_ALIGN(cache_header->filenames_size);
+    if (sector_tables_section + (size_t)cache_header->sector_tables_size > cache_size)
+        goto Cleanup;
+    if (memcmp(cache + path_offset, path_cstring, cache_header->path_size) != 0)
+        goto Cleanup;
+    
+    // Validate the filename and sector table records before touching any of our tables
+    const uint8_t* filenames = cache + filenames_section;
+    size_t record_offset = 0;
+    while (record_offset < cache_header->filenames_size) {
+        if (cache_header->filenames_size - record_offset < sizeof(mpq_index_cache_record_t))
+            goto Cleanup;
+        const mpq_index_cache_record_t* record = (const mpq_index_cache_record_t*)(filenames + record_offset);
+        record_offset += sizeof(mpq_index_cache_record_t);
+        if (record->hash_position >= header.hash_table_length || record->value > cache_header->filenames_size - record_offset)
+            goto Cleanup;
+        record_offset += (record->value + 3) & ~3U;
+    }
     
-    // Zero the version 1 extended header
-    extended_header.hash_table_offset_high = 0;
-    extended_header.block_table_offset_high = 0;
-    extended_header.extended_block_offset_table_offset = 0;
+    // The tables get the same checks as on a normal load, since the rest of the class trusts them
+    const mpq_hash_table_entry_t* cached_hash_table = (const mpq_hash_table_entry_t*)(cache + hash_table_section);
+    const mpq_block_table_entry_t* cached_block_table = (const mpq_block_table_entry_t*)(cache + block_table_section);
+    const int64_t* cached_block_offset_table = (const int64_t*)(cache + block_offset_table_section);
+    if (cache_header->archive_size <= 0 || cache_header->archive_offset + cache_header->archive_size > (int64_t)sb->st_size)
+        goto Cleanup;
+    if (cache_header->archive_write_offset < 0 || cache_header->archive_write_offset > cache_header->archive_size)
+        goto Cleanup;
+    
+    uint32_t i = 0;
+    for (; i < header.hash_table_length; i++) {
+        uint32_t block_table_index = cached_hash_table[i].block_table_index;
+        if (block_table_index != HASH_TABLE_EMPTY && block_table_index != HASH_TABLE_DELETED && block_table_index >= header.block_table_length)
+            goto Cleanup;
+    }
+    for (i = 0; i < header.block_table_length; i++) {
+        if (cached_block_offset_table[i] < 0 || cached_block_offset_table[i] + cached_block_table[i].archived_size >= cache_header->archive_size)
+            goto Cleanup;
+    }
+    
+    // Sector tables are only cached for compressed, multi-sector files, and must pass the same checks as when reading a file
+    const uint8_t* sector_tables = cache + sector_tables_section;
+    mpq_core_error_t core_error;
+    record_offset = 0;
+    while (record_offset < cache_header->sector_tables_size) {
+        if (cache_header->sector_tables_size - record_offset < sizeof(uint32_t))
+            goto Cleanup;
+        uint32_t hash_position = *(const uint32_t*)(sector_tables + record_offset);
+        record_offset += sizeof(uint32_t);
+        if (hash_position >= header.hash_table_length || cached_hash_table[hash_position].block_table_index >= header.block_table_length)
+            goto Cleanup;
+        const mpq_block_table_entry_t* block_entry = cached_block_table + cached_hash_table[hash_position].block_table_index;
+        if (!(block_entry->flags & (MPQFileCompressed | MPQFileDiabloCompressed)) || (block_entry->flags & MPQFileOneSector))
+            goto Cleanup;
+        size_t sector_table_size = _MPQComputeSectorTableLength(full_sector_size, block_entry->size, block_entry->flags) * sizeof(uint32_t);
+        if (sector_table_size > cache_header->sector_tables_size - record_offset)
+            goto Cleanup;
+        if (mpq_core_check_sector_table((const uint32_t*)(sector_tables + record_offset), block_entry, full_sector_size, &core_error) == -1)
+            goto Cleanup;
+        record_offset += sector_table_size;
+    }
+    
+    // The cache is valid, load it
+    memcpy(hash_table, cached_hash_table, header.hash_table_length * sizeof(mpq_hash_table_entry_t));
+    memcpy(block_table, cached_block_table, header.block_table_length * sizeof(mpq_block_table_entry_t));
+    
+    for (i = 0; i < header.block_table_length; i++)
+        block_offset_table[i] = (off_t)cached_block_offset_table[i];
+    
+    const mpq_index_cache_record_t* keys = (const mpq_index_cache_record_t*)(cache + keys_section);
+    for (i = 0; i < cache_header->encryption_key_count; i++) {
+        if (keys[i].hash_position < header.hash_table_length)
+            mpq_slot_table_set_uint32(&encryption_keys_cache, keys[i].hash_position, keys[i].value);
+    }
+    
+    record_offset = 0;
+    while (record_offset < cache_header->filenames_size) {
+        const mpq_index_cache_record_t* record = (const mpq_index_cache_record_t*)(filenames + record_offset);
+        record_offset += sizeof(mpq_index_cache_record_t);
+        uint32_t name_reference = 0;
+        _MPQStoreFilename(&filename_table, &filename_arena, record->hash_position, filenames + record_offset, record->value, &name_reference);
+        record_offset += (record->value + 3) & ~3U;
+    }
+    
+    record_offset = 0;
+    while (record_offset < cache_header->sector_tables_size) {
+        uint32_t hash_position = *(const uint32_t*)(sector_tables + record_offset);
+        record_offset += sizeof(uint32_t);
+        const mpq_block_table_entry_t* block_entry = block_table + hash_table[hash_position].block_table_index;
+        size_t sector_table_size = _MPQComputeSectorTableLength(full_sector_size, block_entry->size, block_entry->flags) * sizeof(uint32_t);
+        if (!mpq_slot_table_get_pointer(&sector_tables_cache, hash_position)) {
+            uint32_t* sector_table = malloc(sector_table_size);
+            if (sector_table) {
+                memcpy(sector_table, sector_tables + record_offset, sector_table_size);
+                if (mpq_slot_table_set_pointer(&sector_tables_cache, hash_position, sector_table) == -1)
+                    free(sector_table);
+            }
+        }
+        record_offset += sector_table_size;
+    }
+    
+    archive_size = cache_header->archive_size;
+    archive_write_offset = cache_header->archive_write_offset;
+    result = YES;
+    
+Cleanup:
+    munmap((void*)cache, cache_size);
+    return result;
+}
+
+static void _MPQIndexCacheAppendPadding(NSMutableData* data) {
+    [data increaseLengthBy:INDEX_CACHE_ALIGN([data length]) - [data length]];
+}
+
+- (BOOL)writeIndexCache:(NSError**)error {
+    NSString* cache_path = [self _indexCachePath];
+    if (!cache_path)
+        ReturnValueWithError(NO, MPQErrorDomain, errOperationNotSupported, nil, error)
+    
+    // The cache must describe the archive on disk
+    if (archive_fd == -1)
+        ReturnValueWithError(NO, MPQErrorDomain, errNoArchiveFile, nil, error)
+    if (is_modified)
+        ReturnValueWithError(NO, MPQErrorDomain, errInvalidOperation, nil, error)
+    
+    struct stat sb;
+    if (fstat(archive_fd, &sb) == -1)
+        ReturnValueWithPOSIXError(NO, nil, error)
+    
+    NSAutoreleasePool* p = [NSAutoreleasePool new];
+    const char* path_cstring = [archive_path fileSystemRepresentation];
+    
+    mpq_index_cache_header_t cache_header;
+    memset(&cache_header, 0, sizeof(mpq_index_cache_header_t));
+    cache_header.magic = INDEX_CACHE_MAGIC;
+    cache_header.version = INDEX_CACHE_VERSION;
+    cache_header.byte_order_mark = INDEX_CACHE_BYTE_ORDER_MARK;
+    cache_header.header_checksum = [self _indexCacheHeaderChecksum];
+    cache_header.file_device = (uint64_t)sb.st_dev;
+    cache_header.file_inode = (uint64_t)sb.st_ino;
+    cache_header.file_size = sb.st_size;
+    cache_header.file_mtime = _MPQIndexCacheFileTime(&sb);
+    cache_header.archive_offset = archive_offset;
+    cache_header.archive_size = archive_size;
+    cache_header.archive_write_offset = archive_write_offset;
+    cache_header.path_size = (uint32_t)strlen(path_cstring);
+    cache_header.hash_table_length = header.hash_table_length;
+    cache_header.block_table_length = header.block_table_length;
+    
+    // Encryption keys
+    NSMutableData* keys = [NSMutableData data];
+    uint32_t hash_position = 0;
+    for (; hash_position < header.hash_table_length; hash_position++) {
+        uint32_t encryption_key = mpq_slot_table_get_uint32(&encryption_keys_cache, hash_position);
+        if (encryption_key == 0)
+            continue;
+        mpq_index_cache_record_t record = {hash_position, encryption_key};
+        [keys appendBytes:&record length:sizeof(mpq_index_cache_record_t)];
+        cache_header.encryption_key_count++;
+    }
+    
+    // Filenames and sector tables
+    NSMutableData* filenames = [NSMutableData data];
+    NSMutableData* sector_tables = [NSMutableData data];
+    for (hash_position = 0; hash_position < header.hash_table_length; hash_position++) {
+        const char* filename = _MPQGetFilename(&filename_table, &filename_arena, hash_position);
+        if (filename) {
+            mpq_index_cache_record_t record = {hash_position, (uint32_t)strlen(filename)};
+            [filenames appendBytes:&record length:sizeof(mpq_index_cache_record_t)];
+            [filenames appendBytes:filename length:record.value];
+            [filenames increaseLengthBy:((record.value + 3) & ~3U) - record.value];
+        }
+        
+        const uint32_t* sector_table = mpq_slot_table_get_pointer(&sector_tables_cache, hash_position);
+        if (sector_table) {
+            mpq_block_table_entry_t* block_entry = block_table + hash_table[hash_position].block_table_index;
+            uint32_t sector_table_length = _MPQComputeSectorTableLength(full_sector_size, block_entry->size, block_entry->flags);
+            [sector_tables appendBytes:&hash_position length:sizeof(uint32_t)];
+            [sector_tables appendBytes:sector_table length:sector_table_length * sizeof(uint32_t)];
+        }
+    }
+    cache_header.filenames_size = (uint32_t)[filenames length];
+    cache_header.sector_tables_size = (uint32_t)[sector_tables length];
+    
+    // Assemble the cache
+    NSMutableData* cache = [NSMutableData dataWithBytes:&cache_header length:sizeof(mpq_index_cache_header_t)];
+    _MPQIndexCacheAppendPadding(cache);
+    [cache appendBytes:path_cstring length:cache_header.path_size];
+    _MPQIndexCacheAppendPadding(cache);
+    [cache appendBytes:hash_table length:header.hash_table_length * sizeof(mpq_hash_table_entry_t)];
+    _MPQIndexCacheAppendPadding(cache);
+    [cache appendBytes:block_table length:header.block_table_length * sizeof(mpq_block_table_entry_t)];
+    _MPQIndexCacheAppendPadding(cache);
+    uint32_t i = 0;
+    for (; i < header.block_table_length; i++) {
+        int64_t block_offset = block_offset_table[i];
+        [cache appendBytes:&block_offset length:sizeof(int64_t)];
+    }
+    [cache appendData:keys];
+    _MPQIndexCacheAppendPadding(cache);
+    [cache appendData:filenames];
+    _MPQIndexCacheAppendPadding(cache);
+    [cache appendData:sector_tables];
+    
+    // Atomically replace the cache file
+    NSString* temp_path = nil;
+    int fd = _MPQMakeTempFileInDirectory(index_cache_directory, &temp_path, error);
+    if (fd == -1) {
+        if (error) [*error retain];
+        [p drain];
+        if (error) [*error autorelease];
+        return NO;
+    }
+    [temp_path retain];
+    
+    BOOL result = YES;
+    const uint8_t* bytes = [cache bytes];
+    size_t bytes_left = [cache length];
+    while (bytes_left > 0) {
+        ssize_t bytes_written = write(fd, bytes, bytes_left);
+        if (bytes_written == -1) {
+            if (errno == EINTR)
+                continue;
+            if (error)
+                *error = [MPQError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
+            result = NO;
+            break;
+        }
+        bytes += bytes_written;
+        bytes_left -= bytes_written;
+    }
+    close(fd);
+    
+    if (result && rename([temp_path fileSystemRepresentation], [cache_path fileSystemRepresentation]) == -1) {
+        if (error)
+            *error = [MPQError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
+        result = NO;
+    }
+    if (!result)
+        unlink([temp_path fileSystemRepresentation]);
+    [temp_path release];
+    
+    if (error && !result) [*error retain];
+    [p drain];
+    if (error && !result) [*error autorelease];
+    return result;
+}
+
+- (void)_refreshIndexCache {
+    // A cache which can't be rewritten must not survive the archive it describes
+    NSString* cache_path = [self _indexCachePath];
+    if (cache_path && ![self writeIndexCache:NULL])
+        unlink([cache_path fileSystemRepresentation]);
+}
+
+#pragma mark complementary init
+
+- (BOOL)_createNewArchive:(uint32_t)hash_table_length version:(uint16_t)version offset:(off_t)offset error:(NSError**)error {
+    // If this parameter is 0, we set it to 1024 (default value)
+    if (hash_table_length == 0)
+        hash_table_length = 1024;
+        
+    // No hash table should be smaller than MPQ_MIN_HASH_TABLE_LENGTH
+    uint32_t final_hash_table_length = MPQ_MIN_HASH_TABLE_LENGTH;
+    
+    // Hash tables cannot be larger than MPQ_MAX_HASH_TABLE_LENGTH or MPQ_MAX_EXTENDED_HASH_TABLE_LENGTH entries
+    if (version == MPQOriginalVersion) {
+        if (hash_table_length > MPQ_MAX_HASH_TABLE_LENGTH)
+            hash_table_length = MPQ_MAX_HASH_TABLE_LENGTH;
+    } else if (version == MPQExtendedVersion) {
+        if (hash_table_length > MPQ_MAX_EXTENDED_HASH_TABLE_LENGTH)
+            hash_table_length = MPQ_MAX_EXTENDED_HASH_TABLE_LENGTH;
+    }
+    
+    // The number of entries in a hash table must be a power of 2. Find the first power of 2 that is >= the specified hash table size.
+    while (final_hash_table_length < hash_table_length)
+        final_hash_table_length <<= 1;
+    
+    // Archive offset
+    archive_offset = offset;
+    
+    // To allow an easy upgrade to version 1, we'll reserve the extra space needed at the beginning for the version 1 header
+    archive_write_offset = sizeof(mpq_header_t) + sizeof(mpq_extended_header_t);
+    
+    // Pure memory for now
+    archive_path = nil;
+    archive_fd = -1;
+    
+    // Fill up a (partially) valid header
+    header.mpq_magic = MPQ_MAGIC;
+    // Explicit cast is OK here, header_size is 32-bit
+    header.header_size = (version == MPQOriginalVersion) ? (uint32_t)sizeof(mpq_header_t) : (uint32_t)(sizeof(mpq_header_t) + sizeof(mpq_extended_header_t));
+    header.archive_size = 0;
+    header.version = version;
+    header.sector_size_shift = DEFAULT_SECTOR_SIZE_SHIFT;
+    
+    header.hash_table_offset = 0;
+    header.block_table_offset = 0;
+    
+    header.hash_table_length = final_hash_table_length;
+    header.block_table_length = final_hash_table_length;
+    
+    // Zero the version 1 extended header
+    extended_header.hash_table_offset_high = 0;
+    extended_header.block_table_offset_high = 0;
+    extended_header.extended_block_offset_table_offset = 0;
     
     // Default sector configuration
     full_sector_size = MPQ_BASE_SECTOR_SIZE << header.sector_size_shift;
@@ -1106,13 +2248,16 @@ AllocateFailure:
     if (archive_fd == -1)
         ReturnValueWithError(NO, NSPOSIXErrorDomain, errno, nil, error)
     
-    // Turn off caching
-    fcntl(archive_fd, F_NOCACHE, 1);
+    // Apply the file cache policy
+    _MPQApplyCachePolicy(archive_fd, cache_policy);
+    
+    // Complete or roll back a journaled save which was interrupted
+    if (!is_read_only && ![self _recoverJournal:error])
+        return NO;
     
     // This function assumes that archive_offset has been initialized
     
     ssize_t bytes_read = 0;
-    uint32_t i = 0;
     
     // Get the archive's size
     struct stat sb;
@@ -1124,171 +2269,39 @@ AllocateFailure:
     if (file_size < 32)
         ReturnValueWithError(NO, MPQErrorDomain, errInvalidArchive, nil, error)
     
-    // MPQ archives can be embedded in files, in which case the MPQ header must be 512 bytes aligned.
-    do {
-        bytes_read = pread(archive_fd, &header, sizeof(mpq_header_t), archive_offset);
-        if (bytes_read == -1)
-            ReturnValueWithPOSIXError(NO, nil, error)
-        if ((size_t)bytes_read == 0)
-            ReturnValueWithError(NO, MPQErrorDomain, errEndOfFile, nil, error)
-        if ((size_t)bytes_read < sizeof(mpq_header_t))
-            ReturnValueWithError(NO, MPQErrorDomain, errIO, nil, error)
-                
-        // Byte swap the header
-        [[self class] swap_mpq_header:&header];
-        
-        // Check the header
-        if (header.mpq_magic == MPQ_MAGIC) {
-            if (header.version == 0 && (header.header_size == sizeof(mpq_header_t) || ignoreHeaderSizeField))
-                break;
-            if (header.version == 1 && (header.header_size == sizeof(mpq_header_t) + sizeof(mpq_extended_header_t) || ignoreHeaderSizeField))
-                break;
-            ReturnValueWithError(NO, MPQErrorDomain, errInvalidArchive, nil, error)
-        }
-        
-        // We may have read an MPQ shunt structure instead
-        union _mpq_header_shunt_union {
-            mpq_header_t* header;
-            mpq_shunt_t* shunt;
-        };
-        union _mpq_header_shunt_union hsu;
-        hsu.header = &header;
-        mpq_shunt_t shunt = *hsu.shunt;
-        
-        // byte swap the shunt
-        [[self class] swap_mpq_shunt:&shunt];
-        
-        // check the shunt
-        if (shunt.shunt_magic == MPQ_SHUNT_MAGIC) {
-            // Set the offset for the next iteration
-            archive_offset = archive_offset + (off_t)(shunt.mpq_header_offset);
-            continue;
-        }
-        
-        // Move to the next possible offset
-        archive_offset += 512;
-    } while (1);
-    
-    // Version 1 archives have an extended header
-    if (header.version == 1) {
-        bytes_read = pread(archive_fd, &extended_header, sizeof(mpq_extended_header_t), archive_offset + sizeof(mpq_header_t));
-        if (bytes_read == -1)
-            ReturnValueWithPOSIXError(NO, nil, error)
-        if ((size_t)bytes_read == 0)
-            ReturnValueWithError(NO, MPQErrorDomain, errEndOfFile, nil, error)
-        if ((size_t)bytes_read < sizeof(mpq_extended_header_t))
-            ReturnValueWithError(NO, MPQErrorDomain, errIO, nil, error)
-        
-        [[self class] swap_mpq_extended_header:&extended_header];
-    } else {
-        // Zero the version 1 extended header
-        extended_header.hash_table_offset_high = 0;
-        extended_header.block_table_offset_high = 0;
-        extended_header.extended_block_offset_table_offset = 0;
+    // Find and read the archive header
+    mpq_archive_info_t archive_info;
+    mpq_core_error_t core_error;
+    archive_info.archive_offset = archive_offset;
+    if (mpq_core_read_header(archive_fd, ignoreHeaderSizeField, &archive_info, &core_error) == -1) {
+        if (error)
+            *error = _MPQErrorWithCoreError(&core_error, nil);
+        return NO;
     }
     
-    // Pre-compute and cache the full sector size
-    full_sector_size = MPQ_BASE_SECTOR_SIZE << header.sector_size_shift;
+    archive_offset = archive_info.archive_offset;
+    header = archive_info.header;
+    extended_header = archive_info.extended_header;
+    full_sector_size = archive_info.full_sector_size;
+    hash_table_offset = archive_info.hash_table_offset;
+    block_table_offset = archive_info.block_table_offset;
     
     // We've got all the information we need to allocate our memory
     if (![self allocateMemory])
         ReturnValueWithError(NO, MPQErrorDomain, errOutOfMemory, nil, error)
     
-    // Compute the size of the hash and block tables
-    size_t hash_table_size = header.hash_table_length * sizeof(mpq_hash_table_entry_t);
-    size_t block_table_size = header.block_table_length * sizeof(mpq_block_table_entry_t);
-    
-    // Compute final offsets for the hash and block tables
-    hash_table_offset = header.hash_table_offset;
-    block_table_offset = header.block_table_offset;
-    if (header.version == 1) {
-        hash_table_offset += ((off_t)(extended_header.hash_table_offset_high)) << 32;
-        block_table_offset += ((off_t)(extended_header.block_table_offset_high)) << 32;
-    }
-    
-    // Read the hash table
-    bytes_read = pread(archive_fd, hash_table, hash_table_size, archive_offset + hash_table_offset);
-    if (bytes_read == -1)
-        ReturnValueWithPOSIXError(NO, nil, error)
-    if ((size_t)bytes_read == 0)
-        ReturnValueWithError(NO, MPQErrorDomain, errEndOfFile, nil, error)
-    if ((size_t)bytes_read < hash_table_size)
-        ReturnValueWithError(NO, MPQErrorDomain, errIO, nil, error)
-    
-    // Decrypt the hash table
-    mpq_decrypt(hash_table, hash_table_size, mpq_hash_cstring(kHashTableEncryptionKey, HASH_KEY), NO);
-    [self swap_hash_table];
-    
-    // Read the block table
-    bytes_read = pread(archive_fd, block_table, block_table_size, archive_offset + block_table_offset);
-    if (bytes_read == -1)
-        ReturnValueWithPOSIXError(NO, nil, error)
-    if ((size_t)bytes_read == 0)
-        ReturnValueWithError(NO, MPQErrorDomain, errEndOfFile, nil, error)
-    if ((size_t)bytes_read < block_table_size)
-        ReturnValueWithError(NO, MPQErrorDomain, errIO, nil, error)
-    
-    // Decrypt the block table. Since it's really a uint32_t array, disable output swapping
-    mpq_decrypt((char*)block_table, block_table_size, mpq_hash_cstring(kBlockTableEncryptionKey, HASH_KEY), YES);
-    
-    // Compute block_offset_table
-    size_t extended_block_offset_table_size = header.block_table_length * sizeof(mpq_extended_block_offset_table_entry_t);
-    if (extended_header.extended_block_offset_table_offset != 0) {
-        mpq_extended_block_offset_table_entry_t* extended_block_offset_table = malloc(header.block_table_length * sizeof(mpq_extended_block_offset_table_entry_t));
-        if (extended_block_offset_table == NULL)
-            ReturnValueWithError(NO, MPQErrorDomain, errOutOfMemory, nil, error)
-            
-        // Read the extended block offset table
-        bytes_read = pread(archive_fd, extended_block_offset_table, extended_block_offset_table_size, archive_offset + extended_header.extended_block_offset_table_offset);
-        if (bytes_read == -1) {
-            free(extended_block_offset_table);
-            ReturnValueWithPOSIXError(NO, nil, error)
-        }
-        if ((size_t)bytes_read < extended_block_offset_table_size) {
-            free(extended_block_offset_table);
-            ReturnValueWithError(NO, MPQErrorDomain, errIO, nil, error)
+    // Read the hash, block and extended block offset tables, unless we have an up to date index cache
+    BOOL loaded_index_cache = [self _loadIndexCache:&sb];
+    if (!loaded_index_cache) {
+        if (mpq_core_read_tables(archive_fd, &archive_info, hash_table, block_table, block_offset_table, &core_error) == -1) {
+            if (error)
+                *error = _MPQErrorWithCoreError(&core_error, nil);
+            return NO;
         }
         
-        // The extended block offset table is not encrypted, so we can just go on to byte swapping
-        [self swap_extended_block_offset_table:extended_block_offset_table length:header.block_table_length];
-        
-        // Compute the block offset table
-        for (i = 0; i < header.block_table_length; i++)
-            block_offset_table[i] = (((off_t)(extended_block_offset_table[i].offset_high)) << 32) + block_table[i].offset;
-        
-        free(extended_block_offset_table);
-    } else {
-        // Simple copy of the offset field, extending it to 64 bits
-        for (i = 0; i < header.block_table_length; i++)
-            block_offset_table[i] = block_table[i].offset;
-    }
-    
-    // We need to compute the archive's size, since that information is no longer valid in version 1 archives
-    archive_size = 0;
-    if (hash_table_offset > block_table_offset)
-        archive_size = hash_table_offset + hash_table_size;
-    else
-        archive_size = block_table_offset + block_table_size;
-    if (header.version == 1 && (off_t)(extended_header.extended_block_offset_table_offset + extended_block_offset_table_size) >= archive_size)
-        archive_size = extended_header.extended_block_offset_table_offset + extended_block_offset_table_size;
-    
-    // If there's a file beyond the structural tables, refuse the archive
-    for (i = 0; i < header.block_table_length; i++) {
-        if (block_offset_table[i] + block_table[i].archived_size >= archive_size)
-            ReturnValueWithError(NO, MPQErrorDomain, errInvalidArchive, nil, error)
+        archive_size = archive_info.archive_size;
+        archive_write_offset = archive_info.archive_write_offset;
     }
-        
-    // Do a consistency check on archive_size for version 0 archives
-    if (header.version == 0 && header.archive_size != archive_size)
-        ReturnValueWithError(NO, MPQErrorDomain, errInvalidArchive, nil, error)
-    
-    // Position the write offset at the beginning of the first structural table
-    if (hash_table_offset < block_table_offset)
-        archive_write_offset = hash_table_offset;
-    else
-        archive_write_offset = block_table_offset;
-    if (header.version == 1 && (off_t)extended_header.extended_block_offset_table_offset < archive_write_offset)
-        archive_write_offset = extended_header.extended_block_offset_table_offset;
     
     // mark the file count caches as dirty
     _fileCountCachesDirty = YES;
@@ -1329,6 +2342,10 @@ AllocateFailure:
     // The archive is not modified at this stage
     is_modified = NO;
     
+    // Create or refresh the index cache, failing to do so is not an error
+    if (!loaded_index_cache && index_cache_directory)
+        [self writeIndexCache:NULL];
+    
     // Checked up and good to go
     return YES;
 }
@@ -1365,12 +2382,29 @@ AllocateFailure:
     // By default, we keep track of the listfile
     save_listfile = YES;
     
+    // By default, keep archive data out of the file cache where that only affects our own reads. Elsewhere, dropping pages 
+    // would also evict them for every other process, so that has to be requested explicitly
+#if defined(__APPLE__)
+    cache_policy = MPQCachePolicyNoCache;
+#else
+    cache_policy = MPQCachePolicySystem;
+#endif
+    
+    // By default, in-place saves are not journaled
+    journaled_saves = NO;
+    journal_tables_offset = 0;
+    journal_tables_end = 0;
+    
     // No delegate initially
     delegate = nil;
     
     // No operations initially
     last_operation = NULL;
     deferred_operations_count = 0;
+    rehashed_operations_count = 0;
+    
+    // By default, the hash table keeps its size
+    maximum_hash_table_load = 0.0;
     
     // No attributes initially
     attributes_data = NULL;
@@ -1394,6 +2428,31 @@ AllocateFailure:
     NSAutoreleasePool* p = [NSAutoreleasePool new];
     [self commonInit];
     
+    // MPQArchiveCachePolicy
+    temp = attributes[MPQArchiveCachePolicy];
+    if (temp) {
+        if (temp.unsignedCharValue > MPQCachePolicyRandom) {
+            [p drain];
+            ReturnFromInitWithError(MPQErrorDomain, errInvalidOperation, nil, error)
+        }
+        cache_policy = temp.unsignedCharValue;
+    }
+    
+    // MPQArchiveIndexCacheDirectory
+    index_cache_directory = [[attributes[MPQArchiveIndexCacheDirectory] stringByStandardizingPath] copy];
+    
+    // MPQArchiveJournaledSaves
+    temp = attributes[MPQArchiveJournaledSaves];
+    if (temp)
+        journaled_saves = temp.boolValue;
+    
+    // MPQArchiveMaximumHashTableLoad
+    temp = attributes[MPQArchiveMaximumHashTableLoad];
+    if (temp && ![self setMaximumHashTableLoad:temp.doubleValue]) {
+        [p drain];
+        ReturnFromInitWithError(MPQErrorDomain, errInvalidOperation, nil, error)
+    }
+    
     NSString* path = attributes[MPQArchivePath];
     if (path) {
         // MPQArchiveOffset
@@ -1492,6 +2551,9 @@ AllocateFailure:
     [archive_path release];
     archive_path = nil;
     
+    [index_cache_directory release];
+    index_cache_directory = nil;
+    
     if (attributes_data) free(attributes_data);
     attributes_data = NULL;
     
@@ -1562,7 +2624,7 @@ AllocateFailure:
 }
 
 - (uint32_t)openFileCountWithPosition:(uint32_t)position {
-    return open_file_count_table[position];
+    return mpq_slot_table_get_uint32(&open_file_count_table, position);
 }
 
 #pragma mark operations
@@ -1576,8 +2638,12 @@ AllocateFailure:
         return YES;
     mpq_deferred_operation_t* operation = last_operation;
     
+    // Operations which precede a hash table resize refer to entries which have moved
+    if (deferred_operations_count <= rehashed_operations_count)
+        ReturnValueWithError(NO, MPQErrorDomain, errInvalidOperation, nil, error)
+    
     // Can't undo a file addition operation if the file is open
-    if (operation->type == MPQDOAdd && open_file_count_table[operation->primary_file_context.hash_position] != 0)
+    if (operation->type == MPQDOAdd && mpq_slot_table_get_uint32(&open_file_count_table, operation->primary_file_context.hash_position) != 0)
         ReturnValueWithError(NO, MPQErrorDomain, errFileIsOpen, nil, error)
     
     // Bail out if we need to restore a filename and we can't do the ASCII convertion
@@ -1589,19 +2655,20 @@ AllocateFailure:
     }
     
     // Invalidate the encryption key, sector table and filename caches
-    encryption_keys_cache[operation->primary_file_context.hash_position] = 0;
-    if (sector_tables_cache[operation->primary_file_context.hash_position])
-        free(sector_tables_cache[operation->primary_file_context.hash_position]);
-    
-    sector_tables_cache[operation->primary_file_context.hash_position] = NULL;
-    if (filename_table[operation->primary_file_context.hash_position])
-        free(filename_table[operation->primary_file_context.hash_position]);
+    mpq_slot_table_set_uint32(&encryption_keys_cache, operation->primary_file_context.hash_position, 0);
+    _MPQFreeSlotPointer(&sector_tables_cache, operation->primary_file_context.hash_position);
+    mpq_slot_table_set_uint32(&filename_table, operation->primary_file_context.hash_position, 0);
+    [self _invalidateFileInfo:operation->primary_file_context.hash_position];
         
     // Restore archive state
-    block_table[hash_table[operation->primary_file_context.hash_position].block_table_index] = operation->primary_file_context.block_entry;
-    block_offset_table[hash_table[operation->primary_file_context.hash_position].block_table_index] = operation->primary_file_context.block_offset;
+    uint32_t block_entry_index = hash_table[operation->primary_file_context.hash_position].block_table_index;
+    block_table[block_entry_index] = operation->primary_file_context.block_entry;
+    block_offset_table[block_entry_index] = operation->primary_file_context.block_offset;
     hash_table[operation->primary_file_context.hash_position] = operation->primary_file_context.hash_entry;
-    filename_table[operation->primary_file_context.hash_position] = filename_cstring;
+    if (_MPQBlockEntryIsEmpty(block_table + block_entry_index))
+        [self _markBlockEntryFree:block_entry_index];
+    _MPQSetFilename(&filename_table, &filename_arena, operation->primary_file_context.hash_position, filename_cstring);
+    free(filename_cstring);
     
     // Delete the operation
     [self _flushLastDO];
@@ -1942,65 +3009,629 @@ AbortDigest:
     return [self verifyStrongSignatureWithKey:starcraft_map_public_rsa digest:digest error:error];
 }
 
-#pragma mark options
-
-- (BOOL)storesListfile {
-    return save_listfile;
-}
+#pragma mark verification
 
-- (void)setStoresListfile:(BOOL)store {
-    save_listfile = store;
-    return;
-}
+// Number of bytes the verification threads ask the kernel to read ahead of the file they are about to verify
+#define VERIFY_READ_AHEAD_WINDOW 0x2000000
+#define VERIFY_MAX_THREADS 16
 
-- (MPQCompressorFlag)defaultCompressor {
-    return default_compressor;
-}
+enum {
+    MPQVerifyResultPending = 0,
+    MPQVerifyResultValid,
+    MPQVerifyResultNoKey,
+    MPQVerifyResultMPQError,
+    MPQVerifyResultPOSIXError,
+};
 
-- (BOOL)setDefaultCompressor:(MPQCompressorFlag)compressor {
-    // Can't set compressor to non-existant compressor
-    if ((compressor & ~MPQCompressorMask)) return NO;
-    
-    // Can't set the default compressor to ADPCM
-    if ((compressor & (MPQMonoADPCMCompression | MPQStereoADPCMCompression))) return NO;
-    
-    default_compressor = compressor;
-    return YES;
+struct mpq_verify_job {
+    // Set up by the calling thread
+    uint32_t hash_position;
+    uint32_t flags;
+    uint32_t size;
+    uint32_t archived_size;
+    off_t offset;
+    uint32_t encryption_key;
+    const uint8_t* expected_crc;
+    const uint8_t* expected_md5;
+    
+    // Set by the verification thread which claimed the job
+    BOOL done;
+    int result;
+    int error_code;
+    uint32_t sector_index;
+    uint32_t computed_checksum;
+    uint32_t expected_checksum;
+    uint8_t computed_md5[MD5_DIGEST_LENGTH];
+};
+typedef struct mpq_verify_job mpq_verify_job_t;
+
+struct mpq_verify_context {
+    int archive_fd;
+    uint32_t full_sector_size;
+    MPQVerificationOptions options;
+    
+    mpq_verify_job_t* jobs;
+    uint32_t job_count;
+    
+    // Protected by lock
+    uint32_t next_job;
+    off_t read_ahead_offset;
+    BOOL cancelled;
+    pthread_mutex_t lock;
+    pthread_cond_t job_done;
+};
+typedef struct mpq_verify_context mpq_verify_context_t;
+
+struct mpq_verify_buffers {
+    void* read_buffer;
+    void* data_buffer;
+    uint32_t* sector_table;
+    uint32_t* sector_adlers;
+    void* raw_sector_adlers;
+};
+typedef struct mpq_verify_buffers mpq_verify_buffers_t;
+
+static void _MPQAdviseWillNeed(int fd, off_t offset, off_t length) {
+#if defined(__APPLE__)
+    struct radvisory advisory;
+    advisory.ra_offset = offset;
+    advisory.ra_count = (int)MIN(length, (off_t)INT_MAX);
+    fcntl(fd, F_RDADVISE, &advisory);
+#elif defined(POSIX_FADV_WILLNEED)
+    posix_fadvise(fd, offset, length, POSIX_FADV_WILLNEED);
+#endif
 }
 
-#pragma mark file list
-
-- (BOOL)loadInternalListfile:(NSError**)error {
-    NSAutoreleasePool* p = [NSAutoreleasePool new];
-    BOOL result = NO;
-    
-    // Try to open the listfile
-    NSData* listfile_data = [self copyDataForFile:kListfileFilename locale:MPQNeutral error:error];
-    if (!listfile_data) {
-        if (error) {
-            [*error retain];
-            [p drain];
-            [*error autorelease];
-        } else
-            [p drain];
+static BOOL _MPQVerifyPread(int fd, void* buffer, size_t size, off_t offset, mpq_verify_job_t* job) {
+    ssize_t bytes_read = pread(fd, buffer, size, offset);
+    if (bytes_read == -1) {
+        job->result = MPQVerifyResultPOSIXError;
+        job->error_code = errno;
         return NO;
     }
-    
-    // Is it big enough to contain anything useful?
-    if (listfile_data.length > 0) {
-        NSArray* listfileArray = [NSArray arrayWithListfileData:listfile_data];
-        result = [self addArrayToFileList:listfileArray error:error];
+    if ((size_t)bytes_read < size) {
+        job->result = MPQVerifyResultMPQError;
+        job->error_code = errEndOfFile;
+        return NO;
     }
-    
-    [listfile_data release];
-    
-    if (!result && error) {
-        [*error retain];
-        [p drain];
-        [*error autorelease];
-    } else
-        [p drain];
-    
+    return YES;
+}
+
+static void _MPQVerifyFailWithCoreError(mpq_verify_job_t* job, const mpq_core_error_t* core_error) {
+    job->result = (core_error->domain == MPQCoreErrorDomainPOSIX) ? MPQVerifyResultPOSIXError : MPQVerifyResultMPQError;
+    job->error_code = core_error->code;
+    job->sector_index = core_error->sector_index;
+    job->computed_checksum = core_error->computed_checksum;
+    job->expected_checksum = core_error->expected_checksum;
+}
+
+static void _MPQVerifyFile(mpq_verify_context_t* context, mpq_verify_job_t* job, mpq_verify_buffers_t* buffers) {
+    uint32_t full_sector_size = context->full_sector_size;
+    BOOL check_adlers = (context->options & MPQVerifySectorChecksums) && (job->flags & MPQFileHasSectorAdlers);
+    BOOL check_crc = job->expected_crc && (context->options & MPQVerifyAttributes);
+    BOOL check_md5 = job->expected_md5 && (context->options & MPQVerifyAttributes);
+    BOOL decompress = (context->options & MPQVerifyDecompression) || check_crc || check_md5;
+    BOOL compressed = (job->flags & (MPQFileCompressed | MPQFileDiabloCompressed)) ? YES : NO;
+    
+    mpq_core_file_t file;
+    file.fd = context->archive_fd;
+    file.file_offset = job->offset;
+    file.block_entry.offset = 0;
+    file.block_entry.archived_size = job->archived_size;
+    file.block_entry.size = job->size;
+    file.block_entry.flags = job->flags;
+    file.encryption_key = job->encryption_key;
+    file.full_sector_size = full_sector_size;
+    file.sector_table = NULL;
+    file.sector_adlers = NULL;
+    mpq_core_error_t core_error;
+    
+    uint32_t crc = 0;
+    MD5_CTX md5_context;
+    mpq_crc32(NULL, 0, &crc, MPQ_CRC_INIT);
+    MD5_Init(&md5_context);
+    
+    if (job->size == 0) {
+        // Nothing to read
+    } else if ((job->flags & MPQFileOneSector)) {
+        void* raw_data = malloc(job->archived_size);
+        void* file_data = malloc(job->size);
+        if (!raw_data || !file_data) {
+            free(raw_data);
+            free(file_data);
+            job->result = MPQVerifyResultMPQError;
+            job->error_code = errOutOfMemory;
+            return;
+        }
+        
+        if (decompress) {
+            if (mpq_core_read_one_sector_file(&file, file_data, raw_data, &core_error) == -1) {
+                free(raw_data);
+                free(file_data);
+                _MPQVerifyFailWithCoreError(job, &core_error);
+                return;
+            }
+            
+            if (check_crc)
+                mpq_crc32(file_data, job->size, &crc, MPQ_CRC_UPDATE);
+            if (check_md5)
+                MD5_Update(&md5_context, file_data, job->size);
+        } else if (!_MPQVerifyPread(context->archive_fd, raw_data, job->archived_size, job->offset, job)) {
+            free(raw_data);
+            free(file_data);
+            return;
+        }
+        
+        free(raw_data);
+        free(file_data);
+    } else {
+        uint32_t sector_count = (job->size + full_sector_size - 1) / full_sector_size;
+        
+        if (compressed) {
+            // Read, decode and check the sector table
+            if (mpq_core_read_sector_table(context->archive_fd, job->offset, &file.block_entry, full_sector_size, job->encryption_key, buffers->sector_table, &core_error) == -1 || 
+                mpq_core_check_sector_table(buffers->sector_table, &file.block_entry, full_sector_size, &core_error) == -1)
+            {
+                _MPQVerifyFailWithCoreError(job, &core_error);
+                return;
+            }
+            file.sector_table = buffers->sector_table;
+            
+            // Sector adlers are stored compressed after the last sector
+            if (check_adlers) {
+                int has_adlers = 0;
+                if (mpq_core_read_sector_adlers(&file, buffers->sector_adlers, buffers->raw_sector_adlers, &has_adlers, &core_error) == -1) {
+                    _MPQVerifyFailWithCoreError(job, &core_error);
+                    return;
+                }
+                check_adlers = (has_adlers) ? YES : NO;
+            }
+        } else {
+            // Uncompressed files are contiguous and have no sector checksums
+            if (job->size > job->archived_size) {
+                job->result = MPQVerifyResultMPQError;
+                job->error_code = errInvalidSectorTable;
+                return;
+            }
+            check_adlers = NO;
+        }
+        
+        // Nothing else to do if we were only asked to check the sector table
+        if (!check_adlers && !decompress) {
+            job->result = MPQVerifyResultValid;
+            return;
+        }
+        
+        // Read runs of up to 16 sectors at a time
+        uint32_t sector_index = 0;
+        while (sector_index < sector_count) {
+            uint32_t run_end = MIN(sector_index + 16, sector_count);
+            uint32_t run_start_offset = mpq_core_sector_offset(&file, sector_index);
+            uint32_t run_end_offset = mpq_core_sector_offset(&file, run_end);
+            if (!_MPQVerifyPread(context->archive_fd, buffers->read_buffer, run_end_offset - run_start_offset, job->offset + run_start_offset, job))
+                return;
+            
+            for (; sector_index < run_end; sector_index++) {
+                uint32_t sector_offset = mpq_core_sector_offset(&file, sector_index);
+                uint32_t sector_size = mpq_core_sector_offset(&file, sector_index + 1) - sector_offset;
+                uint32_t expected_size = (sector_index == sector_count - 1) ? job->size - (sector_index * full_sector_size) : full_sector_size;
+                void* sector = BUFFER_OFFSET(buffers->read_buffer, sector_offset - run_start_offset);
+                
+                // Sector adlers are computed on the raw sector
+                if (check_adlers) {
+                    uint32_t adler = (uint32_t)adler32(0L, sector, sector_size);
+                    if (adler != buffers->sector_adlers[sector_index]) {
+                        job->result = MPQVerifyResultMPQError;
+                        job->error_code = errInvalidSectorChecksum;
+                        job->sector_index = sector_index;
+                        job->computed_checksum = adler;
+                        job->expected_checksum = buffers->sector_adlers[sector_index];
+                        return;
+                    }
+                }
+                
+                if (!decompress)
+                    continue;
+                
+                if (mpq_core_decode_sector(buffers->data_buffer, expected_size, sector, sector_size, job->flags, job->encryption_key + sector_index) == -1) {
+                    job->result = MPQVerifyResultMPQError;
+                    job->error_code = errDecompressionFailed;
+                    job->sector_index = sector_index;
+                    return;
+                }
+                
+                if (check_crc)
+                    mpq_crc32(buffers->data_buffer, expected_size, &crc, MPQ_CRC_UPDATE);
+                if (check_md5)
+                    MD5_Update(&md5_context, buffers->data_buffer, expected_size);
+            }
+        }
+    }
+    
+    mpq_crc32(NULL, 0, &crc, MPQ_CRC_FINALIZE);
+    MD5_Final(job->computed_md5, &md5_context);
+    
+    if (check_crc) {
+        uint32_t expected_crc;
+        memcpy(&expected_crc, job->expected_crc, sizeof(uint32_t));
+        expected_crc = MPQSwapInt32LittleToHost(expected_crc);
+        if (crc != expected_crc) {
+            job->result = MPQVerifyResultMPQError;
+            job->error_code = errInvalidFileCRC;
+            job->computed_checksum = crc;
+            job->expected_checksum = expected_crc;
+            return;
+        }
+    }
+    
+    if (check_md5 && memcmp(job->computed_md5, job->expected_md5, MD5_DIGEST_LENGTH) != 0) {
+        job->result = MPQVerifyResultMPQError;
+        job->error_code = errInvalidFileMD5;
+        return;
+    }
+    
+    job->result = MPQVerifyResultValid;
+}
+
+static void* _MPQVerifyThread(void* arg) {
+    mpq_verify_context_t* context = ((void**)arg)[0];
+    mpq_verify_buffers_t* buffers = ((void**)arg)[1];
+    
+    while (1) {
+        pthread_mutex_lock(&context->lock);
+        if (context->cancelled || context->next_job == context->job_count) {
+            pthread_mutex_unlock(&context->lock);
+            break;
+        }
+        mpq_verify_job_t* job = context->jobs + context->next_job;
+        context->next_job++;
+        
+        // Jobs are sorted by offset, so keep a window of read ahead in front of the dispatch cursor
+        off_t job_end = job->offset + job->archived_size;
+        if (context->read_ahead_offset < job_end + (VERIFY_READ_AHEAD_WINDOW >> 1)) {
+            off_t read_ahead_start = MAX(context->read_ahead_offset, job->offset);
+            context->read_ahead_offset = job_end + VERIFY_READ_AHEAD_WINDOW;
+            _MPQAdviseWillNeed(context->archive_fd, read_ahead_start, context->read_ahead_offset - read_ahead_start);
+        }
+        pthread_mutex_unlock(&context->lock);
+        
+        if (job->result == MPQVerifyResultPending)
+            _MPQVerifyFile(context, job, buffers);
+        
+        pthread_mutex_lock(&context->lock);
+        job->done = YES;
+        pthread_cond_broadcast(&context->job_done);
+        pthread_mutex_unlock(&context->lock);
+    }
+    
+    return NULL;
+}
+
+static int _MPQCompareVerifyJobs(const void* lhs, const void* rhs) {
+    off_t lhs_offset = ((const mpq_verify_job_t*)lhs)->offset;
+    off_t rhs_offset = ((const mpq_verify_job_t*)rhs)->offset;
+    if (lhs_offset < rhs_offset) return -1;
+    if (lhs_offset > rhs_offset) return 1;
+    return 0;
+}
+
+- (NSError*)_errorForVerifyJob:(mpq_verify_job_t*)job {
+    if (job->result == MPQVerifyResultValid)
+        return nil;
+    
+    NSMutableDictionary* userInfo = [NSMutableDictionary dictionaryWithCapacity:4];
+    NSDictionary* fileInfo = [self fileInfoForPosition:job->hash_position error:NULL];
+    if (fileInfo)
+        userInfo[MPQErrorFileInfo] = fileInfo;
+    if (job->sector_index != 0xffffffff)
+        userInfo[MPQErrorSectorIndex] = @(job->sector_index);
+    
+    if (job->result == MPQVerifyResultNoKey)
+        return [MPQError errorWithDomain:MPQErrorDomain code:errFilenameRequired userInfo:userInfo];
+    if (job->result == MPQVerifyResultPOSIXError)
+        return [MPQError errorWithDomain:NSPOSIXErrorDomain code:job->error_code userInfo:userInfo];
+    
+    if (job->error_code == errInvalidSectorChecksum) {
+        userInfo[MPQErrorComputedSectorChecksum] = @(job->computed_checksum);
+        userInfo[MPQErrorExpectedSectorChecksum] = @(job->expected_checksum);
+    } else if (job->error_code == errInvalidFileCRC) {
+        userInfo[MPQErrorComputedFileChecksum] = @(job->computed_checksum);
+        userInfo[MPQErrorExpectedFileChecksum] = @(job->expected_checksum);
+    } else if (job->error_code == errInvalidFileMD5) {
+        userInfo[MPQErrorComputedFileChecksum] = [NSData dataWithBytes:job->computed_md5 length:MD5_DIGEST_LENGTH];
+        userInfo[MPQErrorExpectedFileChecksum] = [NSData dataWithBytes:job->expected_md5 length:MD5_DIGEST_LENGTH];
+    }
+    return [MPQError errorWithDomain:MPQErrorDomain code:job->error_code userInfo:userInfo];
+}
+
+- (BOOL)verifyIntegrityWithOptions:(MPQVerificationOptions)options progress:(BOOL (^)(NSDictionary* fileInfo, NSError* error))progress error:(NSError**)error {
+    if (archive_fd == -1)
+        ReturnValueWithError(NO, MPQErrorDomain, errNoArchiveFile, nil, error)
+    
+    // Locate the CRC and MD5 attribute columns
+    const uint8_t* crc_column = NULL;
+    const uint8_t* md5_column = NULL;
+    if (attributes_data && (options & MPQVerifyAttributes)) {
+        mpq_attributes_header_t* attributes = (mpq_attributes_header_t*)attributes_data;
+        size_t currentOffset = sizeof(mpq_attributes_header_t);
+        
+        const mpq_file_attribute_t* attribute = mpq_file_attributes;
+        while (attribute->flag != 0) {
+            if ((attributes->attributes & attribute->flag)) {
+                size_t column_size = attribute->size * header.block_table_length;
+                if (currentOffset + column_size > attributes_data_size)
+                    break;
+                if (attribute->flag == 0x01)
+                    crc_column = BUFFER_OFFSET(attributes_data, currentOffset);
+                else if (attribute->flag == 0x04)
+                    md5_column = BUFFER_OFFSET(attributes_data, currentOffset);
+                currentOffset += column_size;
+            }
+            attribute++;
+        }
+    }
+    
+    // Build the job list on this thread, since it needs the encryption keys
+    mpq_verify_job_t* jobs = calloc(header.hash_table_length, sizeof(mpq_verify_job_t));
+    if (!jobs)
+        ReturnValueWithError(NO, MPQErrorDomain, errOutOfMemory, nil, error)
+    
+    static const uint8_t zero_md5[MD5_DIGEST_LENGTH] = {0};
+    uint32_t job_count = 0;
+    uint32_t max_file_size = 0;
+    uint32_t hash_position = 0;
+    for (; hash_position < header.hash_table_length; hash_position++) {
+        mpq_hash_table_entry_t* hash_entry = hash_table + hash_position;
+        if (hash_entry->block_table_index == HASH_TABLE_EMPTY || hash_entry->block_table_index == HASH_TABLE_DELETED)
+            continue;
+        
+        // Files pending addition are not in the archive yet
+        mpq_deferred_operation_t* operation = mpq_slot_table_get_pointer(&operation_hash_table, hash_position);
+        if (operation && operation->type == MPQDOAdd)
+            continue;
+        
+        mpq_block_table_entry_t* block_entry = block_table + hash_entry->block_table_index;
+        if (!(block_entry->flags & MPQFileValid))
+            continue;
+        
+        mpq_verify_job_t* job = jobs + job_count;
+        job->hash_position = hash_position;
+        job->flags = block_entry->flags;
+        job->size = block_entry->size;
+        job->archived_size = block_entry->archived_size;
+        job->offset = archive_offset + block_offset_table[hash_entry->block_table_index];
+        job->sector_index = 0xffffffff;
+        
+        if ((block_entry->flags & MPQFileEncrypted)) {
+            job->encryption_key = [self getFileEncryptionKey:hash_position];
+            if (job->encryption_key == 0)
+                job->result = MPQVerifyResultNoKey;
+        }
+        
+        // Attribute columns are not necessarily aligned
+        if (crc_column) {
+            uint32_t crc;
+            memcpy(&crc, crc_column + 4 * hash_entry->block_table_index, sizeof(uint32_t));
+            if (crc != 0)
+                job->expected_crc = crc_column + 4 * hash_entry->block_table_index;
+        }
+        if (md5_column && memcmp(md5_column + MD5_DIGEST_LENGTH * hash_entry->block_table_index, zero_md5, MD5_DIGEST_LENGTH) != 0)
+            job->expected_md5 = md5_column + MD5_DIGEST_LENGTH * hash_entry->block_table_index;
+        
+        if (block_entry->size > max_file_size)
+            max_file_size = block_entry->size;
+        job_count++;
+    }
+    
+    qsort(jobs, job_count, sizeof(mpq_verify_job_t), _MPQCompareVerifyJobs);
+    
+    mpq_verify_context_t context;
+    context.archive_fd = archive_fd;
+    context.full_sector_size = full_sector_size;
+    context.options = options;
+    context.jobs = jobs;
+    context.job_count = job_count;
+    context.next_job = 0;
+    context.read_ahead_offset = 0;
+    context.cancelled = NO;
+    pthread_mutex_init(&context.lock, NULL);
+    pthread_cond_init(&context.job_done, NULL);
+    
+    long thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (thread_count < 1)
+        thread_count = 1;
+    if (thread_count > VERIFY_MAX_THREADS)
+        thread_count = VERIFY_MAX_THREADS;
+    if (thread_count > job_count)
+        thread_count = (job_count > 0) ? job_count : 1;
+    
+    // Allocate every thread's buffers up front so that threads cannot fail
+    uint32_t max_sector_table_length = _MPQComputeSectorTableLength(full_sector_size, max_file_size, MPQFileHasSectorAdlers);
+    mpq_verify_buffers_t buffers[VERIFY_MAX_THREADS];
+    void* thread_args[VERIFY_MAX_THREADS][2];
+    pthread_t threads[VERIFY_MAX_THREADS];
+    long thread_index = 0;
+    long started_threads = 0;
+    uint32_t job_index = 0;
+    BOOL result = YES;
+    NSError* first_error = nil;
+    
+    memset(buffers, 0, sizeof(buffers));
+    for (; thread_index < thread_count; thread_index++) {
+        buffers[thread_index].read_buffer = valloc(MPQ_CORE_READ_BUFFER_SIZE(full_sector_size));
+        buffers[thread_index].data_buffer = malloc(full_sector_size);
+        buffers[thread_index].sector_table = malloc(max_sector_table_length * sizeof(uint32_t));
+        buffers[thread_index].sector_adlers = malloc(max_sector_table_length * sizeof(uint32_t));
+        buffers[thread_index].raw_sector_adlers = malloc(max_sector_table_length * sizeof(uint32_t));
+        if (!buffers[thread_index].read_buffer || !buffers[thread_index].data_buffer || !buffers[thread_index].sector_table || 
+            !buffers[thread_index].sector_adlers || !buffers[thread_index].raw_sector_adlers)
+        {
+            first_error = [MPQError errorWithDomain:MPQErrorDomain code:errOutOfMemory userInfo:nil];
+            result = NO;
+            goto Cleanup;
+        }
+    }
+    
+    // Start the verification threads
+    for (thread_index = 0; thread_index < thread_count; thread_index++) {
+        thread_args[thread_index][0] = &context;
+        thread_args[thread_index][1] = buffers + thread_index;
+        int perr = pthread_create(threads + thread_index, NULL, _MPQVerifyThread, thread_args[thread_index]);
+        if (perr != 0) {
+            if (started_threads == 0) {
+                first_error = [MPQError errorWithDomain:NSPOSIXErrorDomain code:perr userInfo:nil];
+                result = NO;
+                goto Cleanup;
+            }
+            break;
+        }
+        started_threads++;
+    }
+    
+    // Report results in offset order as they come in
+    for (; job_index < job_count; job_index++) {
+        mpq_verify_job_t* job = jobs + job_index;
+        
+        pthread_mutex_lock(&context.lock);
+        while (!job->done)
+            pthread_cond_wait(&context.job_done, &context.lock);
+        pthread_mutex_unlock(&context.lock);
+        
+        NSAutoreleasePool* p = [NSAutoreleasePool new];
+        NSError* job_error = [self _errorForVerifyJob:job];
+        if (job_error && job->result != MPQVerifyResultNoKey && result) {
+            first_error = [job_error retain];
+            result = NO;
+        }
+        
+        BOOL proceed = YES;
+        if (progress) {
+            NSDictionary* fileInfo = (job_error) ? job_error.userInfo[MPQErrorFileInfo] : [self fileInfoForPosition:job->hash_position error:NULL];
+            proceed = progress(fileInfo, job_error);
+        }
+        [p release];
+        
+        if (!proceed) {
+            pthread_mutex_lock(&context.lock);
+            context.cancelled = YES;
+            pthread_mutex_unlock(&context.lock);
+            
+            [first_error release];
+            first_error = [[MPQError errorWithDomain:MPQErrorDomain code:errDelegateCancelled userInfo:nil] retain];
+            result = NO;
+            break;
+        }
+    }
+    
+    for (thread_index = 0; thread_index < started_threads; thread_index++)
+        pthread_join(threads[thread_index], NULL);
+    [first_error autorelease];
+    
+    // Verification reads the whole archive, don't let it push everything else out of the file cache
+    [self _releaseCachedRange:archive_offset length:archive_size];
+    
+Cleanup:
+    for (thread_index = 0; thread_index < thread_count; thread_index++) {
+        free(buffers[thread_index].read_buffer);
+        free(buffers[thread_index].data_buffer);
+        free(buffers[thread_index].sector_table);
+        free(buffers[thread_index].sector_adlers);
+        free(buffers[thread_index].raw_sector_adlers);
+    }
+    pthread_cond_destroy(&context.job_done);
+    pthread_mutex_destroy(&context.lock);
+    free(jobs);
+    
+    if (error)
+        *error = first_error;
+    return result;
+}
+
+#pragma mark options
+
+- (BOOL)storesListfile {
+    return save_listfile;
+}
+
+- (void)setStoresListfile:(BOOL)store {
+    save_listfile = store;
+    return;
+}
+
+- (BOOL)usesJournaledSaves {
+    return journaled_saves;
+}
+
+- (void)setUsesJournaledSaves:(BOOL)journaled {
+    journaled_saves = journaled;
+}
+
+- (MPQCachePolicy)cachePolicy {
+    return cache_policy;
+}
+
+- (BOOL)setCachePolicy:(MPQCachePolicy)policy {
+    if (policy > MPQCachePolicyRandom)
+        return NO;
+    
+    cache_policy = policy;
+    _MPQApplyCachePolicy(archive_fd, cache_policy);
+    return YES;
+}
+
+- (void)_releaseCachedRange:(off_t)offset length:(off_t)length {
+#if !defined(__APPLE__) && defined(POSIX_FADV_DONTNEED)
+    if (cache_policy == MPQCachePolicyNoCache && archive_fd != -1 && length > 0)
+        posix_fadvise(archive_fd, offset, length, POSIX_FADV_DONTNEED);
+#endif
+}
+
+- (MPQCompressorFlag)defaultCompressor {
+    return default_compressor;
+}
+
+- (BOOL)setDefaultCompressor:(MPQCompressorFlag)compressor {
+    // Can't set compressor to non-existant compressor
+    if ((compressor & ~MPQCompressorMask)) return NO;
+    
+    // Can't set the default compressor to ADPCM
+    if ((compressor & (MPQMonoADPCMCompression | MPQStereoADPCMCompression))) return NO;
+    
+    default_compressor = compressor;
+    return YES;
+}
+
+#pragma mark file list
+
+- (BOOL)loadInternalListfile:(NSError**)error {
+    NSAutoreleasePool* p = [NSAutoreleasePool new];
+    BOOL result = NO;
+    
+    // Try to open the listfile
+    NSData* listfile_data = [self copyDataForFile:kListfileFilename locale:MPQNeutral error:error];
+    if (!listfile_data) {
+        if (error) {
+            [*error retain];
+            [p drain];
+            [*error autorelease];
+        } else
+            [p drain];
+        return NO;
+    }
+    
+    // Is it big enough to contain anything useful?
+    if (listfile_data.length > 0)
+        result = [self addListfileDataToFileList:listfile_data error:error];
+    
+    [listfile_data release];
+    
+    if (!result && error) {
+        [*error retain];
+        [p drain];
+        [*error autorelease];
+    } else
+        [p drain];
+    
     return result;
 }
 
@@ -2035,6 +3666,65 @@ AbortDigest:
     return YES;
 }
 
+- (BOOL)addListfileDataToFileList:(NSData*)data error:(NSError**)error {
+    NSParameterAssert(data != nil);
+    const void* bytes = data.bytes;
+    size_t length = data.length;
+    
+    // Entry offsets are 32-bit
+    if (length > UINT32_MAX)
+        ReturnValueWithError(NO, MPQErrorDomain, errInvalidOperation, nil, error)
+    
+    size_t entry_count = mpq_core_parse_listfile(bytes, length, NULL, 0);
+    if (entry_count == 0)
+        return YES;
+    
+    mpq_listfile_entry_t* entries = malloc(entry_count * sizeof(mpq_listfile_entry_t));
+    if (!entries)
+        ReturnValueWithError(NO, MPQErrorDomain, errOutOfMemory, nil, error)
+    
+    // Split and hash every name, then add them to the name table
+    mpq_core_parse_listfile(bytes, length, entries, entry_count);
+    _MPQHashListfileEntries(bytes, entries, entry_count);
+    
+    size_t entry_index = 0;
+    for (; entry_index < entry_count; entry_index++) {
+        mpq_listfile_entry_t* entry = entries + entry_index;
+        [self _addListfileName:(const char*)bytes + entry->offset length:entry->length key:&entry->key];
+    }
+    
+    free(entries);
+    return YES;
+}
+
+- (BOOL)addHashDatabaseToFileList:(NSData*)database error:(NSError**)error {
+    NSParameterAssert(database != nil);
+    
+    mpq_hash_database_t db;
+    mpq_core_error_t core_error;
+    if (mpq_core_open_hash_database(database.bytes, database.length, &db, &core_error) == -1) {
+        if (error)
+            *error = _MPQErrorWithCoreError(&core_error, nil);
+        return NO;
+    }
+    
+    // Look up every used hash table entry we don't have a name for
+    uint32_t hash_position = 0;
+    for (; hash_position < header.hash_table_length; hash_position++) {
+        mpq_hash_table_entry_t* hash_entry = hash_table + hash_position;
+        if (hash_entry->block_table_index == HASH_TABLE_EMPTY || hash_entry->block_table_index == HASH_TABLE_DELETED)
+            continue;
+        if (mpq_slot_table_get_uint32(&filename_table, hash_position))
+            continue;
+        
+        const char* name = mpq_core_hash_database_lookup(&db, hash_entry->hash_a, hash_entry->hash_b);
+        if (name)
+            _MPQSetFilename(&filename_table, &filename_arena, hash_position, name);
+    }
+    
+    return YES;
+}
+
 - (BOOL)addContentsOfFileToFileList:(NSString*)path {
     return [self addContentsOfFileToFileList:path error:(NSError**)NULL];
 }
@@ -2043,7 +3733,7 @@ AbortDigest:
     NSParameterAssert(path != nil);
     NSAutoreleasePool* p = [NSAutoreleasePool new];
 
-    NSData* fileData = [NSData dataWithContentsOfFile:path options:NSUncachedRead error:error];
+    NSData* fileData = [NSData dataWithContentsOfFile:path options:NSMappedRead error:error];
     if (!fileData) {
         if (error) {
             [*error retain];
@@ -2054,7 +3744,7 @@ AbortDigest:
         return NO;
     }
     
-    BOOL result = [self addArrayToFileList:[NSArray arrayWithListfileData:fileData] error:error];
+    BOOL result = [self addListfileDataToFileList:fileData error:error];
     
     if (!result && error) {
         [*error retain];
@@ -2073,8 +3763,9 @@ AbortDigest:
     // Look through the name table and add all the entries to the array
     uint32_t current_file_index = 0;
     for (; current_file_index < header.hash_table_length; current_file_index++) {
-        if (filename_table[current_file_index]) {
-            [tempArray addObject:@(filename_table[current_file_index])];
+        const char* filename = _MPQGetFilename(&filename_table, &filename_arena, current_file_index);
+        if (filename) {
+            [tempArray addObject:@(filename)];
         }
     }
     return tempArray;
@@ -2103,82 +3794,49 @@ AbortDigest:
     return [self fileInfoForPosition:hash_position error:(NSError**)NULL];
 }
 
-- (NSDictionary*)fileInfoForPosition:(uint32_t)hash_position error:(NSError**)error {
-    NSParameterAssert(hash_position < header.hash_table_length);
-    
-    // If the file is invalid, we can't delete it
+// Fills info with the information of the file at hash_position. Returns 0, or the MPQErrorDomain code explaining why there is no valid file there.
+- (int)_getFileInfo:(MPQFileInfo*)info position:(uint32_t)hash_position {
     mpq_hash_table_entry_t* hash_entry = hash_table + hash_position;
     if (hash_entry->block_table_index == HASH_TABLE_DELETED)
-        ReturnValueWithError(nil, MPQErrorDomain, errFileIsDeleted, nil, error)
+        return errFileIsDeleted;
     if (hash_entry->block_table_index == HASH_TABLE_EMPTY)
-        ReturnValueWithError(nil, MPQErrorDomain, errHashTableEntryNotFound, nil, error)
+        return errHashTableEntryNotFound;
     
     mpq_block_table_entry_t* block_entry = block_table + hash_entry->block_table_index;
     if (!(block_entry->flags & MPQFileValid))
-        ReturnValueWithError(nil, MPQErrorDomain, errFileIsInvalid, nil, error)
-    
-    // The info dictionary
-    NSMutableDictionary* tempDict = [NSMutableDictionary dictionaryWithCapacity:0x10];
-    
-    // Hash table position (aka the file's position) and block table position
-    tempDict[MPQFileHashPosition] = @(hash_position);
-    tempDict[MPQFileBlockPosition] = @(hash_entry->block_table_index);
-    
-    // Basic hash table information.
-    tempDict[MPQFileHashA] = @(hash_entry->hash_a);
-    tempDict[MPQFileHashB] = @(hash_entry->hash_b);
-    tempDict[MPQFileLocale] = @(hash_entry->locale);
-    tempDict[@"MPQFilePlatform"] = [NSNumber numberWithUnsignedLong:hash_entry->platform];
-    
-    // Encryption key
-    uint32_t encryption_key = 0;
-    if (block_entry->flags & MPQFileEncrypted)
-        encryption_key = [self getFileEncryptionKey:hash_position];
-    tempDict[MPQFileEncryptionKey] = @(encryption_key);
-    
-    // Filename
-    const char* filename = filename_table[hash_position];
-    if (filename) {
-        tempDict[MPQFileCanOpenWithoutFilename] = @YES;
-        tempDict[MPQFilename] = @(filename);
-        tempDict[MPQSyntheticFilename] = @NO;
-    } else {
-        // synthesize a unique name and determine if we can open the file without the filename anyways
-        NSString* synthName = [NSString stringWithFormat:@"unknown %x", hash_position];
-        uint32_t counter = 0;
-        while ([self localesForFile:synthName] != nil) {
-            synthName = [NSString stringWithFormat:@"unknown-%u %x", counter, hash_position];
-            counter++;
-        }
-        
-        tempDict[MPQFilename] = [NSString stringWithFormat:@"unknown %x", hash_position];
-        tempDict[MPQSyntheticFilename] = @YES;
-        tempDict[MPQFileCanOpenWithoutFilename] = [NSNumber numberWithBool:((block_entry->flags & MPQFileEncrypted) && encryption_key == 0) ? NO : YES];
-    }
-    
-    // If the file is pending addition, we need to get the size from the data source, not the block table entry
-    uint32_t file_size = block_entry->size;
-    
-    mpq_deferred_operation_t* operation = operation_hash_table[hash_position];
-    if (operation && operation->type == MPQDOAdd) {
-        MPQDataSource* dataSource = [((mpq_deferred_operation_add_context_t*)operation->context)->dataSourceProxy createActualDataSource:error];
-        if (!dataSource)
-            return nil;
-        
-        off_t source_length = [dataSource length:error];
-        [dataSource release];
-        if (source_length == -1)
-            return nil;
-        
-        // MPQ files can't be larger than uint32_t, so cast
-        file_size = (uint32_t)source_length;
+        return errFileIsInvalid;
+    
+    // Hash table information
+    info->hash_position = hash_position;
+    info->block_position = hash_entry->block_table_index;
+    info->hash_a = hash_entry->hash_a;
+    info->hash_b = hash_entry->hash_b;
+    info->locale = hash_entry->locale;
+    info->platform = hash_entry->platform;
+    info->info_flags = 0;
+    
+    // Block table information
+    info->flags = block_entry->flags;
+    info->size = block_entry->size;
+    info->archived_size = block_entry->archived_size;
+    info->archive_offset = block_offset_table[hash_entry->block_table_index];
+    
+    // The size of a file pending addition is only known by its data source
+    mpq_deferred_operation_t* operation = mpq_slot_table_get_pointer(&operation_hash_table, hash_position);
+    if (operation && operation->type == MPQDOAdd)
+        info->info_flags |= MPQFileInfoPendingAddition;
+    
+    // Encryption key and filename. Only keys which are cached or follow from the filename are reported, since recovering 
+    // the key of an unnamed file means reading its sector table.
+    info->filename = _MPQGetFilename(&filename_table, &filename_arena, hash_position);
+    info->encryption_key = 0;
+    if ((block_entry->flags & MPQFileEncrypted)) {
+        info->encryption_key = mpq_slot_table_get_uint32(&encryption_keys_cache, hash_position);
+        if (info->encryption_key == 0 && info->filename)
+            info->encryption_key = [self getFileEncryptionKey:hash_position name:info->filename];
     }
-    
-    // block table info
-    tempDict[MPQFileSize] = @(file_size);
-    tempDict[MPQFileArchiveSize] = @(block_entry->archived_size);
-    tempDict[MPQFileFlags] = @(block_entry->flags);
-    tempDict[MPQFileArchiveOffset] = @(block_offset_table[hash_entry->block_table_index]);
+    if (info->filename || !(block_entry->flags & MPQFileEncrypted) || info->encryption_key != 0)
+        info->info_flags |= MPQFileInfoCanOpenWithoutFilename;
     
     // compute the number of sectors based on the file size (so explicitely ignore sector adlers)
     uint32_t sector_table_length;
@@ -2186,27 +3844,152 @@ AbortDigest:
         sector_table_length = 2;
     else
         sector_table_length = _MPQComputeSectorTableLength(full_sector_size, block_entry->size, (block_entry->flags & ~MPQFileHasSectorAdlers));
-    tempDict[MPQFileNumberOfSectors] = @(sector_table_length - 1);
+    info->sector_count = sector_table_length - 1;
     
-    // Attributes
+    // Attributes. The MPQFileInfoHas flags have the values of the attribute flags.
+    info->crc = 0;
+    info->creation_date = 0;
+    memset(info->md5, 0, sizeof(info->md5));
     if (attributes_data) {
         mpq_attributes_header_t* attributes = (mpq_attributes_header_t*)attributes_data;
-        size_t currentOffset = sizeof(mpq_attributes_header_t);
+        size_t column_offset = sizeof(mpq_attributes_header_t);
         
         const mpq_file_attribute_t* attribute = mpq_file_attributes;
-        while (attribute->flag != 0) {
-            if ((attributes->attributes & attribute->flag)) {
-                // We have that attribute
-                NSData * dataWrapper = [NSData dataWithBytesNoCopy:(BUFFER_OFFSET(attributes_data, currentOffset + attribute->size * hash_entry->block_table_index)) 
-                                                            length:attribute->size 
-                                                      freeWhenDone:NO];
-                tempDict[attribute->key] = [MPQFile performSelector:NSSelectorFromString(attribute->getter) withObject:dataWrapper];
-                currentOffset += attribute->size * header.block_table_length;
-            }
-            attribute++;
+        for (; attribute->flag != 0; attribute++) {
+            if (!(attributes->attributes & attribute->flag))
+                continue;
+            
+            size_t value_offset = column_offset + attribute->size * hash_entry->block_table_index;
+            column_offset += attribute->size * header.block_table_length;
+            if (value_offset + attribute->size > attributes_data_size)
+                continue;
+            
+            const void* value = BUFFER_OFFSET(attributes_data, value_offset);
+            if (attribute->flag == MPQFileInfoHasCRC) {
+                memcpy(&info->crc, value, sizeof(uint32_t));
+                info->crc = MPQSwapInt32LittleToHost(info->crc);
+            } else if (attribute->flag == MPQFileInfoHasCreationDate) {
+                memcpy(&info->creation_date, value, sizeof(uint64_t));
+                info->creation_date = MPQSwapInt64LittleToHost(info->creation_date);
+            } else if (attribute->flag == MPQFileInfoHasMD5) {
+                memcpy(info->md5, value, sizeof(info->md5));
+            } else continue;
+            info->info_flags |= attribute->flag;
         }
     }
     
+    return 0;
+}
+
+- (uint32_t)getFileInfo:(MPQFileInfo*)info_array count:(uint32_t)count position:(uint32_t*)hash_position {
+    NSParameterAssert(info_array != NULL);
+    NSParameterAssert(hash_position != NULL);
+    
+    uint32_t filled = 0;
+    while (filled < count && *hash_position < header.hash_table_length) {
+        if ([self _getFileInfo:info_array + filled position:*hash_position] == 0)
+            filled++;
+        (*hash_position)++;
+    }
+    
+    return filled;
+}
+
+- (BOOL)getFileInfo:(MPQFileInfo*)info forPosition:(uint32_t)hash_position error:(NSError**)error {
+    NSParameterAssert(info != NULL);
+    NSParameterAssert(hash_position < header.hash_table_length);
+    
+    int error_code = [self _getFileInfo:info position:hash_position];
+    if (error_code != 0)
+        ReturnValueWithError(NO, MPQErrorDomain, error_code, nil, error)
+    return YES;
+}
+
+- (NSDictionary*)fileInfoForPosition:(uint32_t)hash_position error:(NSError**)error {
+    NSParameterAssert(hash_position < header.hash_table_length);
+    
+    NSDictionary* cachedInfo = [self _cachedFileInfo:hash_position];
+    if (cachedInfo)
+        return [[cachedInfo retain] autorelease];
+    
+    MPQFileInfo info;
+    if (![self getFileInfo:&info forPosition:hash_position error:error])
+        return nil;
+    
+    // Unlike MPQFileInfo, information dictionaries report the encryption key of unnamed files if it can be brute forced
+    if ((info.flags & MPQFileEncrypted) && info.encryption_key == 0) {
+        info.encryption_key = [self getFileEncryptionKey:hash_position];
+        if (info.encryption_key != 0)
+            info.info_flags |= MPQFileInfoCanOpenWithoutFilename;
+    }
+    
+    // The info dictionary
+    NSMutableDictionary* tempDict = [NSMutableDictionary dictionaryWithCapacity:0x10];
+    
+    // Hash table position (aka the file's position) and block table position
+    tempDict[MPQFileHashPosition] = @(info.hash_position);
+    tempDict[MPQFileBlockPosition] = @(info.block_position);
+    
+    // Basic hash table information.
+    tempDict[MPQFileHashA] = @(info.hash_a);
+    tempDict[MPQFileHashB] = @(info.hash_b);
+    tempDict[MPQFileLocale] = @(info.locale);
+    tempDict[@"MPQFilePlatform"] = [NSNumber numberWithUnsignedLong:info.platform];
+    
+    // Encryption key
+    tempDict[MPQFileEncryptionKey] = @(info.encryption_key);
+    
+    // Filename
+    tempDict[MPQFileCanOpenWithoutFilename] = @((info.info_flags & MPQFileInfoCanOpenWithoutFilename) ? YES : NO);
+    if (info.filename) {
+        tempDict[MPQFilename] = @(info.filename);
+        tempDict[MPQSyntheticFilename] = @NO;
+    } else {
+        tempDict[MPQFilename] = [NSString stringWithFormat:@"unknown %x", hash_position];
+        tempDict[MPQSyntheticFilename] = @YES;
+    }
+    
+    // If the file is pending addition, we need to get the size from the data source, not the block table entry. Files
+    // pending a merge have no data source, their size is known.
+    uint32_t file_size = info.size;
+    MPQDataSourceProxy* dataSourceProxy = nil;
+    if ((info.info_flags & MPQFileInfoPendingAddition)) {
+        mpq_deferred_operation_t* operation = mpq_slot_table_get_pointer(&operation_hash_table, hash_position);
+        dataSourceProxy = ((mpq_deferred_operation_add_context_t*)operation->context)->dataSourceProxy;
+    }
+    if (dataSourceProxy) {
+        MPQDataSource* dataSource = [dataSourceProxy createActualDataSource:error];
+        if (!dataSource)
+            return nil;
+        
+        off_t source_length = [dataSource length:error];
+        [dataSource release];
+        if (source_length == -1)
+            return nil;
+        
+        // MPQ files can't be larger than uint32_t, so cast
+        file_size = (uint32_t)source_length;
+    }
+    
+    // block table info
+    tempDict[MPQFileSize] = @(file_size);
+    tempDict[MPQFileArchiveSize] = @(info.archived_size);
+    tempDict[MPQFileFlags] = @(info.flags);
+    tempDict[MPQFileArchiveOffset] = @(info.archive_offset);
+    tempDict[MPQFileNumberOfSectors] = @(info.sector_count);
+    
+    // Attributes
+    if ((info.info_flags & MPQFileInfoHasCRC))
+        tempDict[@"CRC"] = @(info.crc);
+    if ((info.info_flags & MPQFileInfoHasCreationDate))
+        tempDict[@"CreationDate"] = [NSDate dateWithNTFSFiletime:(int64_t)info.creation_date];
+    if ((info.info_flags & MPQFileInfoHasMD5))
+        tempDict[@"MD5Sum"] = [NSData dataWithBytes:info.md5 length:sizeof(info.md5)];
+    
+    // The size of a file pending addition is not cached, since its data source may change
+    if (!(info.info_flags & MPQFileInfoPendingAddition))
+        [self _cacheFileInfo:tempDict position:hash_position];
+    
     return tempDict;
 }
 
@@ -2228,8 +4011,8 @@ AbortDigest:
     }
     
     // Make sure we have the filename in the name table
-    if (!filename_table[hash_position]) filename_table[hash_position] = filename_cstring;
-    else free(filename_cstring);
+    _MPQSetFilename(&filename_table, &filename_arena, hash_position, filename_cstring);
+    free(filename_cstring);
     filename_cstring = NULL;
     
     // Return the info dict
@@ -2274,6 +4057,10 @@ AbortDigest:
     if ([self openFileCountWithPosition:hash_position] > 0)
         ReturnValueWithError(NO, MPQErrorDomain, errFileIsOpen, nil, error)
     
+    // Make sure the operations table has room for the operation
+    if (!mpq_slot_table_slot(&operation_hash_table, hash_position))
+        ReturnValueWithError(NO, MPQErrorDomain, errOutOfMemory, nil, error)
+    
     // Dirty the archive
     is_modified = YES;
     
@@ -2286,14 +4073,14 @@ AbortDigest:
     operation->primary_file_context.hash_entry = *hash_entry;
     operation->primary_file_context.block_entry = *block_entry;
     operation->primary_file_context.block_offset = block_offset_table[hash_entry->block_table_index];
-    operation->primary_file_context.encryption_key = encryption_keys_cache[hash_position];
-    operation->primary_file_context.filename = 
-        (filename_table[hash_position]) ? [[NSString alloc] initWithCString:filename_table[hash_position] encoding:NSASCIIStringEncoding] : nil;
+    operation->primary_file_context.encryption_key = mpq_slot_table_get_uint32(&encryption_keys_cache, hash_position);
+    const char* filename = _MPQGetFilename(&filename_table, &filename_arena, hash_position);
+    operation->primary_file_context.filename = (filename) ? [[NSString alloc] initWithCString:filename encoding:NSASCIIStringEncoding] : nil;
     
     // Insert the deferred operation
     operation->previous = last_operation;
     last_operation = operation;
-    operation_hash_table[hash_position] = operation;
+    mpq_slot_table_set_pointer(&operation_hash_table, hash_position, operation);
     deferred_operations_count++;
     
     // Delete the hash table entry, and mark it as deleted. Note that deleted hash table entries are reused
@@ -2303,17 +4090,13 @@ AbortDigest:
     // Mark the block entry as invalid
     block_entry->flags = 0;
 
-    // Delete the name table entry (if there is one)
-    if (filename_table[hash_position]) {
-        free(filename_table[hash_position]);
-        filename_table[hash_position] = NULL;
-    }
+    // Delete the name table entry (if there is one). The name itself stays in the arena until the archive is closed.
+    mpq_slot_table_set_uint32(&filename_table, hash_position, 0);
+    [self _invalidateFileInfo:hash_position];
     
     // Flush the encrytion key and sector table caches
-    encryption_keys_cache[hash_position] = 0;
-    if (sector_tables_cache[hash_position])
-        free(sector_tables_cache[hash_position]);
-    sector_tables_cache[hash_position] = NULL;
+    mpq_slot_table_set_uint32(&encryption_keys_cache, hash_position, 0);
+    _MPQFreeSlotPointer(&sector_tables_cache, hash_position);
     
     // mark the file count caches as dirty
     _fileCountCachesDirty = YES;
@@ -2357,10 +4140,8 @@ AbortDigest:
     }
     
     // Make sure we have the name in the name table
-    if (!filename_table[hash_position])
-        filename_table[hash_position] = filename_cstring;
-    else
-        free(filename_cstring);
+    _MPQSetFilename(&filename_table, &filename_arena, hash_position, filename_cstring);
+    free(filename_cstring);
     filename_cstring = NULL;
 
     if (![self deleteFileAtPosition:hash_position error:error])
@@ -2371,6 +4152,139 @@ AbortDigest:
     return YES;
 }
 
+#pragma mark raw copy
+
+// Size of the buffer used to copy file data between archives. It is never smaller than a sector.
+#define RAW_COPY_BUFFER_SIZE 0x400000
+
+static BOOL _MPQPreadFully(int fd, void* buffer, size_t size, off_t offset, NSError** error) {
+    ssize_t bytes_read = pread(fd, buffer, size, offset);
+    if (bytes_read == -1)
+        ReturnValueWithPOSIXError(NO, nil, error)
+    if ((size_t)bytes_read != size)
+        ReturnValueWithError(NO, MPQErrorDomain, errEndOfFile, nil, error)
+    return YES;
+}
+
+static BOOL _MPQPwriteFully(int fd, const void* buffer, size_t size, off_t offset, NSError** error) {
+    ssize_t bytes_written = pwrite(fd, buffer, size, offset);
+    if (bytes_written == -1)
+        ReturnValueWithPOSIXError(NO, nil, error)
+    if ((size_t)bytes_written != size)
+        ReturnValueWithError(NO, MPQErrorDomain, errIO, nil, error)
+    return YES;
+}
+
+// Copies size bytes from one file to another through buffer
+static BOOL _MPQCopyRange(int source_fd, off_t source_offset, int destination_fd, off_t destination_offset, off_t size, void* buffer, size_t buffer_size, NSError** error) {
+    while (size > 0) {
+        size_t chunk_size = (size > (off_t)buffer_size) ? buffer_size : (size_t)size;
+        if (!_MPQPreadFully(source_fd, buffer, chunk_size, source_offset, error))
+            return NO;
+        if (!_MPQPwriteFully(destination_fd, buffer, chunk_size, destination_offset, error))
+            return NO;
+        
+        source_offset += chunk_size;
+        destination_offset += chunk_size;
+        size -= chunk_size;
+    }
+    return YES;
+}
+
+// Re-encrypts one sector of a file on its way from one archive file to another
+static BOOL _MPQCopyRawSector(int source_fd, off_t source_offset, int destination_fd, off_t destination_offset, uint32_t sector_size, uint32_t source_key, uint32_t destination_key, void* buffer, NSError** error) {
+    if (!_MPQPreadFully(source_fd, buffer, sector_size, source_offset, error))
+        return NO;
+    mpq_decrypt(buffer, sector_size, source_key, NO);
+    mpq_encrypt(buffer, sector_size, destination_key, NO);
+    return _MPQPwriteFully(destination_fd, buffer, sector_size, destination_offset, error);
+}
+
+// Copies the archived data of an encrypted file from one archive file to another, changing its encryption key from
+// source_key to destination_key. The sector table and the sectors are encrypted, everything else is copied verbatim.
+// buffer must hold buffer_size bytes, and buffer_size must be at least full_sector_size.
+static BOOL _MPQCopyRekeyedFile(int source_fd, off_t source_offset, int destination_fd, off_t destination_offset, const mpq_block_table_entry_t* block_entry, uint32_t full_sector_size, uint32_t source_key, uint32_t destination_key, void* buffer, size_t buffer_size, NSError** error) {
+    // A single sector file is encrypted as a whole
+    if ((block_entry->flags & MPQFileOneSector)) {
+        void* sector = (block_entry->archived_size > buffer_size) ? malloc(block_entry->archived_size) : buffer;
+        if (!sector)
+            ReturnValueWithError(NO, MPQErrorDomain, errOutOfMemory, nil, error)
+        
+        BOOL result = _MPQCopyRawSector(source_fd, source_offset, destination_fd, destination_offset, block_entry->archived_size, source_key, destination_key, sector, error);
+        if (sector != buffer)
+            free(sector);
+        return result;
+    }
+    
+    uint32_t sector_count = (block_entry->size + full_sector_size - 1) / full_sector_size;
+    uint32_t copied_size = 0;
+    
+    if ((block_entry->flags & (MPQFileCompressed | MPQFileDiabloCompressed))) {
+        // Read and check the sector table, then store it with the new key
+        uint32_t sector_table_length = _MPQComputeSectorTableLength(full_sector_size, block_entry->size, block_entry->flags);
+        // Explicit cast is OK here, sector table sizes are 32-bit
+        uint32_t sector_table_size = sector_table_length * (uint32_t)sizeof(uint32_t);
+        uint32_t* sector_table = malloc(sector_table_size * 2);
+        if (!sector_table)
+            ReturnValueWithError(NO, MPQErrorDomain, errOutOfMemory, nil, error)
+        
+        mpq_core_error_t core_error;
+        if (mpq_core_read_sector_table(source_fd, source_offset, block_entry, full_sector_size, source_key, sector_table, &core_error) == -1 || 
+            mpq_core_check_sector_table(sector_table, block_entry, full_sector_size, &core_error) == -1) {
+            free(sector_table);
+            if (error)
+                *error = _MPQErrorWithCoreError(&core_error, nil);
+            return NO;
+        }
+        
+        // The sectors follow the sector table, but not necessarily right after it
+        if (sector_table[0] < sector_table_size) {
+            free(sector_table);
+            ReturnValueWithError(NO, MPQErrorDomain, errInvalidSectorTable, nil, error)
+        }
+        
+        uint32_t* encrypted_sector_table = sector_table + sector_table_length;
+        memcpy(encrypted_sector_table, sector_table, sector_table_size);
+        mpq_encrypt(encrypted_sector_table, sector_table_size, destination_key - 1, YES);
+        if (!_MPQPwriteFully(destination_fd, encrypted_sector_table, sector_table_size, destination_offset, error)) {
+            free(sector_table);
+            return NO;
+        }
+        
+        if (!_MPQCopyRange(source_fd, source_offset + sector_table_size, destination_fd, destination_offset + sector_table_size, sector_table[0] - sector_table_size, buffer, buffer_size, error)) {
+            free(sector_table);
+            return NO;
+        }
+        
+        uint32_t sector_index = 0;
+        for (; sector_index < sector_count; sector_index++) {
+            uint32_t sector_offset = sector_table[sector_index];
+            uint32_t sector_size = sector_table[sector_index + 1] - sector_offset;
+            if (!_MPQCopyRawSector(source_fd, source_offset + sector_offset, destination_fd, destination_offset + sector_offset, sector_size, source_key + sector_index, destination_key + sector_index, buffer, error)) {
+                free(sector_table);
+                return NO;
+            }
+        }
+        
+        copied_size = sector_table[sector_count];
+        free(sector_table);
+    } else {
+        // Sectors of files without a sector table are stored back to back
+        uint32_t sector_index = 0;
+        for (; sector_index < sector_count; sector_index++) {
+            uint32_t sector_size = MIN(full_sector_size, block_entry->size - copied_size);
+            if (copied_size + sector_size > block_entry->archived_size)
+                ReturnValueWithError(NO, MPQErrorDomain, errEndOfFile, nil, error)
+            if (!_MPQCopyRawSector(source_fd, source_offset + copied_size, destination_fd, destination_offset + copied_size, sector_size, source_key + sector_index, destination_key + sector_index, buffer, error))
+                return NO;
+            copied_size += sector_size;
+        }
+    }
+    
+    // Sector adlers and anything else after the last sector are not encrypted
+    return _MPQCopyRange(source_fd, source_offset + copied_size, destination_fd, destination_offset + copied_size, block_entry->archived_size - copied_size, buffer, buffer_size, error);
+}
+
 #pragma mark adding
 
 - (BOOL)addFileWithPath:(NSString*)path filename:(NSString*)filename parameters:(NSDictionary*)parameters {
@@ -2499,25 +4413,37 @@ AbortDigest:
         }
     }
     
+    // Record the addition
+    mpq_deferred_operation_add_context_t add_context;
+    memset(&add_context, 0, sizeof(mpq_deferred_operation_add_context_t));
+    add_context.dataSourceProxy = dataSourceProxy;
+    add_context.compressor = compressor;
+    add_context.compression_quality = compression_quality;
+    
+    BOOL result = [self _recordFileAddition:&add_context filename:filename ASCIIFilename:filename_cstring locale:locale flags:flags size:0 overwrite:overwrite attributes:NULL error:error];
+    free(filename_cstring);
+    return result;
+}
+
+// Records the deferred addition of a file. The add context is copied, and the objects it refers to retained. The
+// file's attributes are taken from info, or cleared if info is NULL.
+- (BOOL)_recordFileAddition:(const mpq_deferred_operation_add_context_t*)add_context filename:(NSString*)filename ASCIIFilename:(const char*)filename_cstring locale:(uint16_t)locale flags:(uint32_t)flags size:(uint32_t)size overwrite:(BOOL)overwrite attributes:(const MPQFileInfo*)info error:(NSError**)error {
     // The requested filename might already be in use
     uint32_t old_hash_position = [self findHashPosition:filename_cstring locale:locale error:error];
     if (old_hash_position != 0xffffffff) {
         if (overwrite) {
             // Make sure the name of the file we are about to delete is in the name table, otherwise, we won't be able to un-delete it!
             // This would normally be done by the delete methods, but to save us a hashing we're going to call deleteFileAtPosition directly.
-            if (!filename_table[old_hash_position])
-                filename_table[old_hash_position] = _MPQCreateASCIIFilename(filename, (NSError**)NULL);
+            _MPQSetFilename(&filename_table, &filename_arena, old_hash_position, filename_cstring);
             
             // Delete the existing file
             MPQDebugLog(@"deleting existing file");
             if (![self deleteFileAtPosition:old_hash_position error:error]) {
                 MPQDebugLog(@"can't delete existing file");
-                free(filename_cstring);
                 return NO;
             }
         } else {
             MPQDebugLog(@"adding failed, file with requested filename exists and not allowed to delete it");
-            free(filename_cstring);
             ReturnValueWithError(NO, MPQErrorDomain, errFileExists, nil, error)
         }
     }
@@ -2526,17 +4452,19 @@ AbortDigest:
     uint32_t hash_position = [self createHashPosition:filename_cstring error:error];
     if (hash_position == 0xffffffff) {
         MPQDebugLog(@"no space in hash table");
-        free(filename_cstring);
         return NO;
     }
     
-    uint32_t block_position = [self createBlockTablePosition:0 error:error];
+    uint32_t block_position = [self createBlockTablePosition:error];
     if (block_position == 0xffffffff) {
         MPQDebugLog(@"no space in block table");
-        free(filename_cstring);
         return NO;
     }
     
+    // Make sure the operations table has room for the operation
+    if (!mpq_slot_table_slot(&operation_hash_table, hash_position))
+        ReturnValueWithError(NO, MPQErrorDomain, errOutOfMemory, nil, error)
+    
     // The file's encryption key is the hash of the filename only
     const char* filename_name_cstring = strrchr(filename_cstring, '\\');
     if (filename_name_cstring)
@@ -2563,23 +4491,25 @@ AbortDigest:
     operation->primary_file_context.encryption_key = encryption_key;
     operation->primary_file_context.filename = [filename copy];
     
-    context->dataSourceProxy = [dataSourceProxy retain];
-    context->compressor = compressor;
-    context->compression_quality = compression_quality;
+    *context = *add_context;
+    [context->dataSourceProxy retain];
+    [context->source_handle retain];
         
     // Insert the deferred operation
     operation->previous = last_operation;
     last_operation = operation;
-    operation_hash_table[hash_position] = operation;
+    mpq_slot_table_set_pointer(&operation_hash_table, hash_position, operation);
     deferred_operations_count++;
 
     // The MPQ is now modified
     is_modified = YES;
 
-    // Add the file to the block table
-    block_table[block_position].size = 0;
+    // Add the file to the block table. It gets a place in the archive when it is written.
+    block_table[block_position].size = size;
     block_table[block_position].archived_size = 0;
     block_table[block_position].flags = (flags & MPQFileFlagsMask) | MPQFileValid;
+    block_offset_table[block_position] = 0;
+    [self _setAttributes:info blockIndex:block_position];
 
     // Add the file to the hash table
     hash_table[hash_position].hash_a = mpq_hash_cstring(filename_cstring, HASH_NAME_A);
@@ -2588,11 +4518,13 @@ AbortDigest:
     hash_table[hash_position].platform = 0;
     hash_table[hash_position].block_table_index = block_position;
 
-    // Give up ownership of the ASCII filename buffer to the filename table
-    filename_table[hash_position] = filename_cstring;
+    // Copy the ASCII filename to the filename table
+    mpq_slot_table_set_uint32(&filename_table, hash_position, 0);
+    [self _invalidateFileInfo:hash_position];
+    _MPQSetFilename(&filename_table, &filename_arena, hash_position, filename_cstring);
         
     // Cache the crypt key
-    encryption_keys_cache[hash_position] = encryption_key;
+    mpq_slot_table_set_uint32(&encryption_keys_cache, hash_position, encryption_key);
     
     // mark the file count caches as dirty
     _fileCountCachesDirty = YES;
@@ -2600,236 +4532,653 @@ AbortDigest:
     return YES;
 }
 
-- (BOOL)_performFileAddOperation:(mpq_deferred_operation_t*)operation error:(NSError**)error {
-    NSParameterAssert(operation != NULL);
-    NSParameterAssert(operation->type == MPQDOAdd);
-    mpq_deferred_operation_add_context_t* context = (mpq_deferred_operation_add_context_t*)operation->context;
-    
-    MPQDebugLog(@"adding %@", operation->primary_file_context.filename);
+// Pending additions are staged by compression threads and written in order by the saving thread. Files are split into
+// chunks of about ADD_CHUNK_SIZE bytes of file data, so that large files are compressed in parallel as well.
+#define ADD_CHUNK_SIZE 0x100000
+#define ADD_MAX_THREADS 16
+
+// Number of chunks the compression threads may stage ahead of the writer, per thread
+#define ADD_STAGED_CHUNKS_PER_THREAD 4
+
+struct mpq_add_file {
+    // Set up by the saving thread
+    mpq_deferred_operation_t* operation;
+    MPQDataSourceProxy* data_source_proxy;
+    NSError* prepare_error;
+    uint32_t file_size;
+    uint32_t flags;
+    uint32_t compressor;
+    int32_t compression_quality;
+    uint32_t first_chunk;
+    uint32_t chunk_count;
+    
+    // Files merged from another archive are copied as they are, and have no chunks
+    BOOL merged;
+    
+    // Protected by the context lock. The data source is opened by the first chunk to be staged and closed by the last.
+    MPQDataSource* data_source;
+    uint32_t unstaged_chunks;
+};
+typedef struct mpq_add_file mpq_add_file_t;
+
+struct mpq_add_chunk {
+    // Set up by the saving thread
+    uint32_t file_index;
+    uint32_t first_sector;
+    uint32_t sector_count;
+    off_t data_offset;
+    uint32_t data_size;
+    
+    // Set by the compression thread which claimed the chunk. The staged sectors are stored back to back in data. crc is
+    // the CRC-32 of the chunk's file data, which is kept in raw_data if the writer needs it for the file's MD5.
+    BOOL done;
+    uint8_t* data;
+    uint32_t* sector_sizes;
+    uint32_t staged_size;
+    uint32_t crc;
+    uint8_t* raw_data;
+    NSError* error;
+};
+typedef struct mpq_add_chunk mpq_add_chunk_t;
+
+struct mpq_add_buffers {
+    size_t buffer_size;
+    char* read_buffer;
+    char* compression_buffer;
+};
+typedef struct mpq_add_buffers mpq_add_buffers_t;
+
+struct mpq_add_context {
+    uint32_t full_sector_size;
+    mpq_add_file_t* files;
+    mpq_add_chunk_t* chunks;
+    uint32_t chunk_count;
+    uint32_t max_staged_chunks;
+    
+    // Attributes of the (attributes) file computed from the file data while staging, and the creation date of the files
+    uint32_t attributes;
+    uint64_t creation_date;
+    
+    // Stages one chunk. Chunks are pending additions, or sectors of existing files when transcoding (see compaction).
+    void (*stage_chunk)(struct mpq_add_context* context, mpq_add_chunk_t* chunk, mpq_add_buffers_t* buffers);
+    struct mpq_transcode_context* transcode;
+    
+    // Only used by the writer. The copy buffer is allocated by the first merged file.
+    mpq_extent_map_t extent_map;
+    void* copy_buffer;
+    
+    // Protected by lock
+    uint32_t next_chunk;
+    uint32_t written_chunks;
+    BOOL cancelled;
+    pthread_mutex_t lock;
+    pthread_cond_t chunk_staged;
+    pthread_cond_t chunk_written;
+};
+typedef struct mpq_add_context mpq_add_context_t;
+
+struct mpq_add_threads {
+    long count;
+    long started;
+    pthread_t threads[ADD_MAX_THREADS];
+    void* args[ADD_MAX_THREADS][2];
+    mpq_add_buffers_t buffers[ADD_MAX_THREADS];
+};
+typedef struct mpq_add_threads mpq_add_threads_t;
+
+static BOOL _MPQReserveAddBuffers(mpq_add_buffers_t* buffers, uint32_t sector_size) {
+    // Compressors may produce up to twice the input size, plus one byte for the Diablo compression workaround
+    size_t buffer_size = ((size_t)sector_size << 1) + 1;
+    if (buffers->buffer_size >= buffer_size)
+        return YES;
     
-    // Get a data source from the data source proxy
-    MPQDataSource* dataSource = [context->dataSourceProxy createActualDataSource:error];
-    if (dataSource == nil)
+    char* read_buffer = realloc(buffers->read_buffer, buffer_size);
+    if (!read_buffer)
         return NO;
+    buffers->read_buffer = read_buffer;
     
-    uint32_t hash_position = operation->primary_file_context.hash_position;
-    uint32_t block_position = hash_table[hash_position].block_table_index;
-    
-    // Get the size of the file to add
-    off_t data_size = [dataSource length:error];
-    if (data_size == -1) {
-        [dataSource release];
+    char* compression_buffer = realloc(buffers->compression_buffer, buffer_size);
+    if (!compression_buffer)
         return NO;
-    }
-    MPQDebugLog2(@"    size of input file: %llu", data_size);
-    
-    // Check for data length overflow
-    if (data_size > UINT32_MAX) {
-        [dataSource release];
-        ReturnValueWithError(NO, MPQErrorDomain, errDataTooLarge, nil, error)
-    }
-    
-    // We now know this cast is safe
-    uint32_t file_size = (uint32_t)data_size;
-    block_table[block_position].size = file_size;
-    
-    // If we have less data than the compression threshold, compression won't be very useful, and will just slow things down
-    if (file_size < COMPRESSION_THRESHOLD) {
-        MPQDebugLog2(@"    less data than compression threshold");
-        block_table[block_position].flags &= ~(MPQFileCompressed | MPQFileDiabloCompressed);
-    }
-    
-    // If we have less than 4 bytes, no encryption and no offset adjusted key
-    if (data_size < 4)
-        block_table[block_position].flags &= ~(MPQFileOffsetAdjustedKey | MPQFileEncrypted);
-    
-    // Copy the file flags for easier access in this method
-    uint32_t flags = block_table[block_position].flags;
-    
-    if ((flags & MPQFileCompressed))
-        MPQDebugLog2(@"    compressor: %u, compression quality: %d", context->compressor, context->compression_quality);
-    
-    // Predicate for needing a sector table
-    BOOL needs_sector_table = ((flags & (MPQFileDiabloCompressed | MPQFileCompressed)) && !(flags & MPQFileOneSector)) ? YES : NO;
-    
-    // Compute the length and size of the sector table
-    uint32_t sector_table_length = (needs_sector_table) ? _MPQComputeSectorTableLength(full_sector_size, file_size, flags) : 0;
-    // Explicit cast is OK here, sector table sizes are 32-bit
-    uint32_t sector_table_size = sector_table_length * (uint32_t)sizeof(uint32_t);
-    MPQDebugLog2(@"    entries in sector table: %u", sector_table_length);
+    buffers->compression_buffer = compression_buffer;
     
-    // Allocate memory for the file's compressed sector table (if we need one)
-    uint32_t* sector_table = NULL;
-    if (needs_sector_table)
-        sector_table = malloc(sector_table_size);
-    if (!sector_table && needs_sector_table) {
-        [dataSource release];
-        ReturnValueWithError(NO, MPQErrorDomain, errOutOfMemory, nil, error)
+    buffers->buffer_size = buffer_size;
+    return YES;
+}
+
+static void _MPQStageAddChunk(mpq_add_context_t* context, mpq_add_chunk_t* chunk, mpq_add_buffers_t* buffers) {
+    mpq_add_file_t* file = context->files + chunk->file_index;
+    NSAutoreleasePool* p = [NSAutoreleasePool new];
+    NSError* local_error = nil;
+    
+    // Open the file's data source if this is the first of its chunks to be staged
+    pthread_mutex_lock(&context->lock);
+    if (!file->data_source)
+        file->data_source = [file->data_source_proxy createActualDataSource:&local_error];
+    MPQDataSource* dataSource = [file->data_source retain];
+    pthread_mutex_unlock(&context->lock);
+    if (!dataSource)
+        goto StageDone;
+    
+    chunk->data = malloc((chunk->data_size) ? chunk->data_size : 1);
+    chunk->sector_sizes = malloc(chunk->sector_count * sizeof(uint32_t));
+    if (!chunk->data || !chunk->sector_sizes) {
+        local_error = [MPQError errorWithDomain:MPQErrorDomain code:errOutOfMemory userInfo:nil];
+        goto StageDone;
     }
     
-    // Compression state
-    uint32_t current_sector_size = 0;
-    uint32_t remaining_data_size = file_size;
-    uint32_t compressed_size = 0;
-    uint32_t current_sector = 0;
-    uint32_t file_compressed_size = 0;
-    off_t data_offset = 0;
-    ssize_t read_sector_size = 0;
-    
-    // Precalculate the offset of the file
-    off_t file_write_offset = block_offset_table[block_position];
-    
-    // If the file write offset is zero, we may need to resize the archive file
-    if (file_write_offset == 0) {
-        // Set the file write offset to the archive write offset
-        file_write_offset = archive_write_offset;
-        
-        struct stat sb;
-        if (fstat(archive_fd, &sb) == -1) {
-            if (sector_table)
-                free(sector_table);
-            [dataSource release];
-            ReturnValueWithError(NO, NSPOSIXErrorDomain, errno, nil, error)
-        }
-        
-        // Compute a few archive space quantities
-        off_t available_space = sb.st_size - file_write_offset;
-        off_t required_space = file_size + sector_table_size;
-        off_t missing_space = required_space - available_space;
-        
-        // If we'll be writing the file data beyond the 4 GB limit, we'll need an EBOT
-        BOOL mustResetEBOTOnFailure = NO;
-        if (file_write_offset > UINT32_MAX && header.version == 1 && extended_header.extended_block_offset_table_offset == 0) {
-            // 1 is enough to have computeSizeOfStructuralTables take an EBOT into account
-            extended_header.extended_block_offset_table_offset = 1;
-            mustResetEBOTOnFailure = YES;
+    // The writer computes the file's MD5 in order from the chunk's data, which is then read in one go and kept
+    if ((context->attributes & MPQFileInfoHasMD5)) {
+        chunk->raw_data = malloc((chunk->data_size) ? chunk->data_size : 1);
+        if (!chunk->raw_data) {
+            local_error = [MPQError errorWithDomain:MPQErrorDomain code:errOutOfMemory userInfo:nil];
+            goto StageDone;
         }
         
-        // We can now take into account the space required by structural tables
-        missing_space += [self _computeSizeOfStructuralTables];
-        
-        // We only need to resize if there is not enough space for the new file
-        if (missing_space > 0) {
-            if (![self _truncateArchiveWithDelta:missing_space error:error]) {
-                if (sector_table)
-                    free(sector_table);
-                [dataSource release];
-                if (mustResetEBOTOnFailure)
-                    extended_header.extended_block_offset_table_offset = 0;
-                return NO;
-            }
+        ssize_t read_size = [dataSource pread:chunk->raw_data size:chunk->data_size offset:chunk->data_offset error:&local_error];
+        if (read_size == -1 || (uint32_t)read_size != chunk->data_size) {
+            if (read_size != -1)
+                local_error = [MPQError errorWithDomain:MPQErrorDomain code:errEndOfFile userInfo:nil];
+            goto StageDone;
         }
     }
     
-    // Get the precalculated encryption key
-    uint32_t encryption_key = encryption_keys_cache[hash_position];
+    chunk->crc = (uint32_t)crc32(0L, Z_NULL, 0);
+    off_t data_offset = chunk->data_offset;
+    uint32_t remaining_data_size = chunk->data_size;
+    uint32_t sector_index = 0;
+    for (; sector_index < chunk->sector_count; sector_index++) {
+        uint32_t current_sector = chunk->first_sector + sector_index;
+        uint32_t current_sector_size = (file->flags & MPQFileOneSector) ? remaining_data_size : MIN(remaining_data_size, context->full_sector_size);
+        if (!_MPQReserveAddBuffers(buffers, current_sector_size)) {
+            local_error = [MPQError errorWithDomain:MPQErrorDomain code:errOutOfMemory userInfo:nil];
+            goto StageDone;
+        }
+        uint32_t compressed_size = (buffers->buffer_size - 1 > UINT32_MAX) ? UINT32_MAX : (uint32_t)(buffers->buffer_size - 1);
         
-    // We can now offset adjust the key properly
-    if ((flags & MPQFileOffsetAdjustedKey)) {
-        encryption_key = (encryption_key + (uint32_t)file_write_offset) ^ file_size;
-        encryption_keys_cache[hash_position] = encryption_key;
-    }
-    
-    // Adjust the file's compressed size for the sector table
-    file_compressed_size += sector_table_size;
-    
-    // First sector table entry is the size of the sector table itself
-    if (needs_sector_table)
-        sector_table[0] = file_compressed_size;
-    
-    // Prime the compression buffer
-    memset(compression_buffer, 0, full_sector_size + 1);
-    
-    // Add the entire file to the end of the MPQ, processing it sector by sector
-    MPQDebugLog2(@"    writing sectors...");
-    while (remaining_data_size > 0) {
-        // Compute the size of the sector
-        current_sector_size = (flags & MPQFileOneSector) ? remaining_data_size : MIN(remaining_data_size, full_sector_size);
-        compressed_size = full_sector_size << 1;
-
-        // Read the current sector
-        read_sector_size = [dataSource pread:read_buffer size:current_sector_size offset:data_offset error:error];
-        if ((uint32_t)read_sector_size != current_sector_size) {
-            if (sector_table)
-                free(sector_table);
-            [dataSource release];
-            return NO;
+        // Read the current sector, unless the whole chunk was read already
+        char* sector_data = buffers->read_buffer;
+        if (chunk->raw_data) {
+            sector_data = (char*)chunk->raw_data + (data_offset - chunk->data_offset);
+        } else {
+            ssize_t read_sector_size = [dataSource pread:sector_data size:current_sector_size offset:data_offset error:&local_error];
+            if (read_sector_size == -1 || (uint32_t)read_sector_size != current_sector_size) {
+                if (read_sector_size != -1)
+                    local_error = [MPQError errorWithDomain:MPQErrorDomain code:errEndOfFile userInfo:nil];
+                goto StageDone;
+            }
         }
-
+        
+        // The CRC of the (attributes) file is the usual CRC-32, which the writer combines across chunks
+        if ((context->attributes & MPQFileInfoHasCRC))
+            chunk->crc = (uint32_t)crc32(chunk->crc, (const Bytef*)sector_data, current_sector_size);
+        
         // This is to correct the idiosynchrosies of the Diablo compression
-        char* buffer_pointer = compression_buffer;
-            
+        char* buffer_pointer = buffers->compression_buffer;
+        
         // Compress the sector with whatever compression method is specified
-        // TODO: stream compression when one sector is set
-        if ((flags & (MPQFileCompressed | MPQFileDiabloCompressed))) {
+        if ((file->flags & (MPQFileCompressed | MPQFileDiabloCompressed))) {
             int compression_error = 0;
-            if ((context->compressor & (MPQMonoADPCMCompression | MPQStereoADPCMCompression))) {
+            if ((file->compressor & (MPQMonoADPCMCompression | MPQStereoADPCMCompression))) {
                 // Make sure to use PKWARE on the first sector to not garble up AIFF / WAV / etc headers. Of course this is a naive workaround...
-                compression_error = SCompCompress(compression_buffer, 
+                compression_error = SCompCompress(buffers->compression_buffer, 
                                                   &compressed_size, 
-                                                  read_buffer, 
+                                                  sector_data, 
                                                   current_sector_size, 
-                                                  (current_sector == 0) ? MPQPKWARECompression : context->compressor, 
+                                                  (current_sector == 0) ? MPQPKWARECompression : file->compressor, 
                                                   0, 
-                                                  context->compression_quality);
-            } else if ((flags & MPQFileDiabloCompressed)) {
+                                                  file->compression_quality);
+            } else if ((file->flags & MPQFileDiabloCompressed)) {
                 // Diablo compression means to assume PKWARE compression, and therefore no compression type byte is prepended to the bitstream
-                compression_error = SCompCompress(compression_buffer, &compressed_size, read_buffer, current_sector_size, context->compressor, 0, 0);
+                compression_error = SCompCompress(buffers->compression_buffer, &compressed_size, sector_data, current_sector_size, file->compressor, 0, 0);
                 if (compression_error && compressed_size < current_sector_size) {
                     buffer_pointer++;
                     compressed_size--;
                 }
-            } else if ((flags & MPQFileCompressed)) {
-                compression_error = SCompCompress(compression_buffer, 
+            } else if ((file->flags & MPQFileCompressed)) {
+                compression_error = SCompCompress(buffers->compression_buffer, 
                                                   &compressed_size, 
-                                                  read_buffer, 
+                                                  sector_data, 
                                                   current_sector_size, 
-                                                  context->compressor, 
+                                                  file->compressor, 
                                                   0, 
-                                                  context->compression_quality);
+                                                  file->compression_quality);
             }
             
             // If the compression failed or we didn't save any bytes, we reject the compressed block
             if (!compression_error || (compressed_size >= (current_sector_size - 1))) {
-                MPQDebugLog2(@"    scrapping compressed sector");
                 compressed_size = current_sector_size;
-                memcpy(compression_buffer, read_buffer, compressed_size);
+                buffer_pointer = sector_data;
             }
         } else {
             // No compression, just do straight copy
             compressed_size = current_sector_size;
-            memcpy(compression_buffer, read_buffer, compressed_size);
-        }
-
-        // Encrypt the sector if necessary
-        if ((flags & MPQFileEncrypted))
-            mpq_encrypt(buffer_pointer, compressed_size, encryption_key + current_sector, NO);
-
-        // Write the sector
-        if (pwrite(archive_fd, buffer_pointer, compressed_size, archive_offset + file_write_offset + file_compressed_size) == -1) {
-            if (sector_table)
-                free(sector_table);
-            [dataSource release];
-            ReturnValueWithError(NO, NSPOSIXErrorDomain, errno, nil, error)
+            buffer_pointer = sector_data;
         }
         
-        // Update the compression state
+        memcpy(chunk->data + chunk->staged_size, buffer_pointer, compressed_size);
+        chunk->sector_sizes[sector_index] = compressed_size;
+        chunk->staged_size += compressed_size;
+        
         data_offset += current_sector_size;
         remaining_data_size -= current_sector_size;
-        file_compressed_size += compressed_size;
-        current_sector++;
-
-        // Add the sector's size to the sector table
-        if (needs_sector_table)
-            sector_table[current_sector] = file_compressed_size;
     }
     
-    // May have a sector table to write
-    if (needs_sector_table) {
-        MPQDebugLog2(@"    writing sector table...");
-        MPQDebugLog2(@"    size of sector table: %u", sector_table_size);
+StageDone:
+    [dataSource release];
+    
+    // Close the data source after the last chunk of the file
+    pthread_mutex_lock(&context->lock);
+    file->unstaged_chunks--;
+    if (file->unstaged_chunks == 0) {
+        [file->data_source release];
+        file->data_source = nil;
+    }
+    pthread_mutex_unlock(&context->lock);
+    
+    chunk->error = [local_error retain];
+    [p drain];
+}
+
+static void* _MPQAddThread(void* arg) {
+    mpq_add_context_t* context = ((void**)arg)[0];
+    mpq_add_buffers_t* buffers = ((void**)arg)[1];
+    
+    while (1) {
+        // Don't get too far ahead of the writer
+        pthread_mutex_lock(&context->lock);
+        while (!context->cancelled && context->next_chunk < context->chunk_count && context->next_chunk - context->written_chunks >= context->max_staged_chunks)
+            pthread_cond_wait(&context->chunk_written, &context->lock);
+        if (context->cancelled || context->next_chunk == context->chunk_count) {
+            pthread_mutex_unlock(&context->lock);
+            break;
+        }
+        mpq_add_chunk_t* chunk = context->chunks + context->next_chunk;
+        context->next_chunk++;
+        pthread_mutex_unlock(&context->lock);
         
-        // If the file is encrypted, we need to encrypt the sector table as well. Since the sector table is just an array
+        context->stage_chunk(context, chunk, buffers);
+        
+        pthread_mutex_lock(&context->lock);
+        chunk->done = YES;
+        pthread_cond_broadcast(&context->chunk_staged);
+        pthread_mutex_unlock(&context->lock);
+    }
+    
+    return NULL;
+}
+
+// Sets up the synchronization of a staging context whose chunks are ready, and picks the number of staging threads
+static void _MPQInitAddContext(mpq_add_context_t* context, mpq_add_threads_t* threads) {
+    context->next_chunk = 0;
+    context->written_chunks = 0;
+    context->cancelled = NO;
+    pthread_mutex_init(&context->lock, NULL);
+    pthread_cond_init(&context->chunk_staged, NULL);
+    pthread_cond_init(&context->chunk_written, NULL);
+    
+    long thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (thread_count < 1)
+        thread_count = 1;
+    if (thread_count > ADD_MAX_THREADS)
+        thread_count = ADD_MAX_THREADS;
+    if (thread_count > context->chunk_count)
+        thread_count = context->chunk_count;
+    context->max_staged_chunks = (uint32_t)MAX(thread_count, 1L) * ADD_STAGED_CHUNKS_PER_THREAD;
+    
+    memset(threads, 0, sizeof(mpq_add_threads_t));
+    threads->count = thread_count;
+}
+
+// Allocates every thread's buffers for a regular sector up front and starts the staging threads. Only fails if no
+// thread could be started.
+static BOOL _MPQStartAddThreads(mpq_add_context_t* context, mpq_add_threads_t* threads, NSError** error) {
+    long thread_index = 0;
+    for (; thread_index < threads->count; thread_index++) {
+        if (!_MPQReserveAddBuffers(threads->buffers + thread_index, context->full_sector_size))
+            ReturnValueWithError(NO, MPQErrorDomain, errOutOfMemory, nil, error)
+    }
+    
+    for (thread_index = 0; thread_index < threads->count; thread_index++) {
+        threads->args[thread_index][0] = context;
+        threads->args[thread_index][1] = threads->buffers + thread_index;
+        int perr = pthread_create(threads->threads + thread_index, NULL, _MPQAddThread, threads->args[thread_index]);
+        if (perr != 0) {
+            if (threads->started == 0)
+                ReturnValueWithError(NO, NSPOSIXErrorDomain, perr, nil, error)
+            break;
+        }
+        threads->started++;
+    }
+    
+    return YES;
+}
+
+// Stops the staging threads, which may be waiting for the writer if it failed, and tears down what _MPQInitAddContext
+// and _MPQStartAddThreads set up. The chunks are left to the caller.
+static void _MPQStopAddThreads(mpq_add_context_t* context, mpq_add_threads_t* threads) {
+    pthread_mutex_lock(&context->lock);
+    context->cancelled = YES;
+    pthread_cond_broadcast(&context->chunk_written);
+    pthread_mutex_unlock(&context->lock);
+    
+    long thread_index = 0;
+    for (; thread_index < threads->started; thread_index++)
+        pthread_join(threads->threads[thread_index], NULL);
+    for (thread_index = 0; thread_index < threads->count; thread_index++) {
+        free(threads->buffers[thread_index].read_buffer);
+        free(threads->buffers[thread_index].compression_buffer);
+    }
+    memset(threads, 0, sizeof(mpq_add_threads_t));
+    
+    pthread_cond_destroy(&context->chunk_written);
+    pthread_cond_destroy(&context->chunk_staged);
+    pthread_mutex_destroy(&context->lock);
+}
+
+// Gets the size of the file to add and settles its flags. Errors are kept in the file, and reported by the writer when it reaches it.
+- (void)_prepareFileAdd:(mpq_add_file_t*)file {
+    mpq_deferred_operation_add_context_t* context = (mpq_deferred_operation_add_context_t*)file->operation->context;
+    uint32_t block_position = hash_table[file->operation->primary_file_context.hash_position].block_table_index;
+    NSError* local_error = nil;
+    
+    // The archived data of files merged from another archive is ready to be copied
+    if (!context->dataSourceProxy) {
+        file->merged = YES;
+        file->file_size = block_table[block_position].size;
+        file->flags = block_table[block_position].flags;
+        return;
+    }
+    
+    file->data_source_proxy = context->dataSourceProxy;
+    file->compressor = context->compressor;
+    file->compression_quality = context->compression_quality;
+    file->flags = block_table[block_position].flags;
+    
+    // Get the size of the file to add
+    MPQDataSource* dataSource = [context->dataSourceProxy createActualDataSource:&local_error];
+    off_t data_size = (dataSource) ? [dataSource length:&local_error] : -1;
+    [dataSource release];
+    if (data_size == -1) {
+        file->prepare_error = [local_error retain];
+        return;
+    }
+    
+    // Check for data length overflow
+    if (data_size > UINT32_MAX) {
+        file->prepare_error = [[MPQError errorWithDomain:MPQErrorDomain code:errDataTooLarge userInfo:nil] retain];
+        return;
+    }
+    
+    // We now know this cast is safe
+    file->file_size = (uint32_t)data_size;
+    
+    // If we have less data than the compression threshold, compression won't be very useful, and will just slow things down
+    if (file->file_size < COMPRESSION_THRESHOLD)
+        file->flags &= ~(MPQFileCompressed | MPQFileDiabloCompressed);
+    
+    // If we have less than 4 bytes, no encryption and no offset adjusted key
+    if (data_size < 4)
+        file->flags &= ~(MPQFileOffsetAdjustedKey | MPQFileEncrypted);
+}
+
+// Finds a place for required_space bytes of file data, the smallest free region they fit in or the end of the archive,
+// which grows if needed. extent_index is set to the free region used, or to 0xffffffff for the end of the archive.
+- (BOOL)_reserveSpace:(off_t)required_space context:(mpq_add_context_t*)context offset:(off_t*)file_write_offset extent:(uint32_t*)extent_index error:(NSError**)error {
+    *extent_index = 0xffffffff;
+    if (required_space > 0)
+        *extent_index = _MPQExtentMapFind(&context->extent_map, required_space);
+    if (*extent_index != 0xffffffff) {
+        *file_write_offset = context->extent_map.extents[*extent_index].offset;
+    
+        // A region beyond the 4 GB limit was used by a file already, but the archive may not have an EBOT anymore
+        if (*file_write_offset > UINT32_MAX && header.version == 1 && extended_header.extended_block_offset_table_offset == 0)
+            extended_header.extended_block_offset_table_offset = 1;
+        return YES;
+    }
+    
+    // Set the file write offset to the archive write offset
+    *file_write_offset = archive_write_offset;
+    
+    struct stat sb;
+    if (fstat(archive_fd, &sb) == -1)
+        ReturnValueWithError(NO, NSPOSIXErrorDomain, errno, nil, error)
+    
+    // Compute a few archive space quantities
+    off_t available_space = sb.st_size - *file_write_offset;
+    off_t missing_space = required_space - available_space;
+    
+    // If we'll be writing the file data beyond the 4 GB limit, we'll need an EBOT
+    BOOL mustResetEBOTOnFailure = NO;
+    if (*file_write_offset > UINT32_MAX && header.version == 1 && extended_header.extended_block_offset_table_offset == 0) {
+        // 1 is enough to have computeSizeOfStructuralTables take an EBOT into account
+        extended_header.extended_block_offset_table_offset = 1;
+        mustResetEBOTOnFailure = YES;
+    }
+    
+    // We can now take into account the space required by structural tables
+    missing_space += [self _computeSizeOfStructuralTables];
+    
+    // We only need to resize if there is not enough space for the new file
+    if (missing_space > 0) {
+        if (![self _truncateArchiveWithDelta:missing_space error:error]) {
+            if (mustResetEBOTOnFailure)
+                extended_header.extended_block_offset_table_offset = 0;
+            return NO;
+        }
+    }
+    
+    return YES;
+}
+
+// Copies the archived data of a file merged from another archive. It is copied verbatim, sector table and sector
+// adlers included, unless its key depends on its offset, in which case its sectors are re-encrypted on the way.
+- (BOOL)_writeMergedFile:(mpq_add_file_t*)file context:(mpq_add_context_t*)context error:(NSError**)error {
+    mpq_deferred_operation_t* operation = file->operation;
+    mpq_deferred_operation_add_context_t* add_context = (mpq_deferred_operation_add_context_t*)operation->context;
+    const mpq_block_table_entry_t* source_block_entry = &add_context->source_block_entry;
+    uint32_t hash_position = operation->primary_file_context.hash_position;
+    uint32_t block_position = hash_table[hash_position].block_table_index;
+    uint32_t archived_size = source_block_entry->archived_size;
+    uint32_t flags = file->flags;
+    
+    MPQDebugLog(@"merging %@", operation->primary_file_context.filename);
+    MPQDebugLog2(@"    size of archived data: %u", archived_size);
+    
+    size_t copy_buffer_size = MAX((size_t)RAW_COPY_BUFFER_SIZE, (size_t)full_sector_size);
+    if (!context->copy_buffer) {
+        context->copy_buffer = malloc(copy_buffer_size);
+        if (!context->copy_buffer)
+            ReturnValueWithError(NO, MPQErrorDomain, errOutOfMemory, nil, error)
+    }
+    
+    off_t file_write_offset = block_offset_table[block_position];
+    uint32_t extent_index = 0xffffffff;
+    if (file_write_offset == 0 && ![self _reserveSpace:archived_size context:context offset:&file_write_offset extent:&extent_index error:error])
+        return NO;
+    
+    // Get the precalculated encryption key, and offset adjust it
+    uint32_t encryption_key = mpq_slot_table_get_uint32(&encryption_keys_cache, hash_position);
+    if ((flags & MPQFileOffsetAdjustedKey)) {
+        encryption_key = (encryption_key + (uint32_t)file_write_offset) ^ file->file_size;
+        mpq_slot_table_set_uint32(&encryption_keys_cache, hash_position, encryption_key);
+    }
+    
+    int source_fd = [add_context->source_handle fileDescriptor];
+    if ((flags & MPQFileEncrypted) && encryption_key != add_context->source_key) {
+        MPQDebugLog2(@"    re-encrypting...");
+        if (!_MPQCopyRekeyedFile(source_fd, add_context->source_offset, archive_fd, archive_offset + file_write_offset, source_block_entry, full_sector_size, add_context->source_key, encryption_key, context->copy_buffer, copy_buffer_size, error))
+            return NO;
+    
+        // Sector adlers are computed over the encrypted sectors
+        flags &= ~MPQFileHasSectorAdlers;
+    } else {
+        MPQDebugLog2(@"    copying...");
+        if (!_MPQCopyRange(source_fd, add_context->source_offset, archive_fd, archive_offset + file_write_offset, archived_size, context->copy_buffer, copy_buffer_size, error))
+            return NO;
+    }
+    
+    // Update the file's entry in the block table
+    block_table[block_position].flags = flags;
+    block_table[block_position].archived_size = archived_size;
+    block_offset_table[block_position] = file_write_offset;
+    
+    // Update the archive write offset if we wrote at the end of the archive, or what is left of the free region we used
+    if (extent_index != 0xffffffff)
+        _MPQExtentMapConsume(&context->extent_map, extent_index, archived_size);
+    else if (archive_write_offset == file_write_offset)
+        archive_write_offset += archived_size;
+    
+    return YES;
+}
+    
+- (BOOL)_writeStagedFile:(mpq_add_file_t*)file context:(mpq_add_context_t*)context error:(NSError**)error {
+    mpq_deferred_operation_t* operation = file->operation;
+    uint32_t hash_position = operation->primary_file_context.hash_position;
+    uint32_t block_position = hash_table[hash_position].block_table_index;
+    uint32_t file_size = file->file_size;
+    uint32_t flags = file->flags;
+    
+    MPQDebugLog(@"adding %@", operation->primary_file_context.filename);
+    MPQDebugLog2(@"    size of input file: %u", file_size);
+    if ((flags & MPQFileCompressed))
+        MPQDebugLog2(@"    compressor: %u, compression quality: %d", file->compressor, file->compression_quality);
+    
+    block_table[block_position].size = file_size;
+    block_table[block_position].flags = flags;
+    
+    // Predicate for needing a sector table
+    BOOL needs_sector_table = ((flags & (MPQFileDiabloCompressed | MPQFileCompressed)) && !(flags & MPQFileOneSector)) ? YES : NO;
+    
+    // Compute the length and size of the sector table
+    uint32_t sector_table_length = (needs_sector_table) ? _MPQComputeSectorTableLength(full_sector_size, file_size, flags) : 0;
+    // Explicit cast is OK here, sector table sizes are 32-bit
+    uint32_t sector_table_size = sector_table_length * (uint32_t)sizeof(uint32_t);
+    MPQDebugLog2(@"    entries in sector table: %u", sector_table_length);
+    
+    // Allocate memory for the file's compressed sector table (if we need one)
+    uint32_t* sector_table = NULL;
+    if (needs_sector_table) {
+        sector_table = malloc(sector_table_size);
+        if (!sector_table)
+            ReturnValueWithError(NO, MPQErrorDomain, errOutOfMemory, nil, error)
+    }
+    
+    // Precalculate the offset of the file
+    off_t file_write_offset = block_offset_table[block_position];
+    uint32_t extent_index = 0xffffffff;
+    
+    // If the file write offset is zero, the file goes in the smallest free region it fits in, or at the end of the archive
+    if (file_write_offset == 0) {
+        // The archived size of the file is known once all its chunks are staged, which we can wait for if they all fit in
+        // the staging window. Otherwise, sectors are never stored larger than they are, which gives an upper bound.
+        off_t required_space = (off_t)file_size + sector_table_size;
+        if (file->chunk_count > 0 && file->chunk_count <= context->max_staged_chunks) {
+            required_space = sector_table_size;
+            
+            pthread_mutex_lock(&context->lock);
+            uint32_t chunk_index = file->first_chunk;
+            for (; chunk_index < file->first_chunk + file->chunk_count; chunk_index++) {
+                while (!context->chunks[chunk_index].done)
+                    pthread_cond_wait(&context->chunk_staged, &context->lock);
+                required_space += context->chunks[chunk_index].staged_size;
+            }
+            pthread_mutex_unlock(&context->lock);
+        }
+        
+        if (![self _reserveSpace:required_space context:context offset:&file_write_offset extent:&extent_index error:error]) {
+            free(sector_table);
+            return NO;
+        }
+    }
+    
+    // Get the precalculated encryption key
+    uint32_t encryption_key = mpq_slot_table_get_uint32(&encryption_keys_cache, hash_position);
+        
+    // We can now offset adjust the key properly
+    if ((flags & MPQFileOffsetAdjustedKey)) {
+        encryption_key = (encryption_key + (uint32_t)file_write_offset) ^ file_size;
+        mpq_slot_table_set_uint32(&encryption_keys_cache, hash_position, encryption_key);
+    }
+    
+    // The file's compressed size starts with the sector table, and its first entry is the size of the sector table itself
+    uint32_t file_compressed_size = sector_table_size;
+    if (needs_sector_table)
+        sector_table[0] = file_compressed_size;
+    
+    // The CRC and MD5 of the file data are computed as the chunks come in
+    uint32_t crc = (uint32_t)crc32(0L, Z_NULL, 0);
+    MD5_CTX md5_context;
+    MD5_Init(&md5_context);
+    
+    // Write the staged chunks of the file as they come in
+    MPQDebugLog2(@"    writing sectors...");
+    uint32_t current_sector = 0;
+    uint32_t chunk_index = file->first_chunk;
+    for (; chunk_index < file->first_chunk + file->chunk_count; chunk_index++) {
+        mpq_add_chunk_t* chunk = context->chunks + chunk_index;
+        
+        pthread_mutex_lock(&context->lock);
+        while (!chunk->done)
+            pthread_cond_wait(&context->chunk_staged, &context->lock);
+        pthread_mutex_unlock(&context->lock);
+        
+        if (chunk->error) {
+            free(sector_table);
+            if (error)
+                *error = [[chunk->error retain] autorelease];
+            return NO;
+        }
+        
+        if ((context->attributes & MPQFileInfoHasCRC))
+            crc = (uint32_t)crc32_combine(crc, chunk->crc, chunk->data_size);
+        if (chunk->raw_data)
+            MD5_Update(&md5_context, chunk->raw_data, chunk->data_size);
+        
+        // Encrypt the sectors if necessary
+        uint32_t sector_index = 0;
+        uint32_t sector_offset = 0;
+        if ((flags & MPQFileEncrypted)) {
+            for (; sector_index < chunk->sector_count; sector_index++) {
+                mpq_encrypt((char*)chunk->data + sector_offset, chunk->sector_sizes[sector_index], encryption_key + current_sector + sector_index, NO);
+                sector_offset += chunk->sector_sizes[sector_index];
+            }
+        }
+        
+        // Write the sectors
+        if (pwrite(archive_fd, chunk->data, chunk->staged_size, archive_offset + file_write_offset + file_compressed_size) == -1) {
+            free(sector_table);
+            ReturnValueWithError(NO, NSPOSIXErrorDomain, errno, nil, error)
+        }
+        
+        // Add the sectors' sizes to the sector table
+        for (sector_index = 0; sector_index < chunk->sector_count; sector_index++) {
+            file_compressed_size += chunk->sector_sizes[sector_index];
+            current_sector++;
+            if (needs_sector_table)
+                sector_table[current_sector] = file_compressed_size;
+        }
+        
+        // Let the compression threads stage another chunk
+        free(chunk->data);
+        chunk->data = NULL;
+        free(chunk->sector_sizes);
+        chunk->sector_sizes = NULL;
+        free(chunk->raw_data);
+        chunk->raw_data = NULL;
+        
+        pthread_mutex_lock(&context->lock);
+        context->written_chunks++;
+        pthread_cond_broadcast(&context->chunk_written);
+        pthread_mutex_unlock(&context->lock);
+    }
+    
+    // May have a sector table to write
+    if (needs_sector_table) {
+        MPQDebugLog2(@"    writing sector table...");
+        MPQDebugLog2(@"    size of sector table: %u", sector_table_size);
+        
+        // If the file is encrypted, we need to encrypt the sector table as well. Since the sector table is just an array
         // of uint32_t, we can disable input swapping on the encrypt function and get the encrypted sector table in
         // little endian. If we are not encrypting, we must explicitely swap the sector table.
         if ((flags & MPQFileEncrypted))
@@ -2839,9 +5188,7 @@ AbortDigest:
 
         // Write the sector table
         if (pwrite(archive_fd, sector_table, sector_table_size, archive_offset + file_write_offset) == -1) {
-            if (sector_table)
-                free(sector_table);
-            [dataSource release];
+            free(sector_table);
             ReturnValueWithError(NO, NSPOSIXErrorDomain, errno, nil, error)
         }
     }
@@ -2850,20 +5197,172 @@ AbortDigest:
     block_offset_table[block_position] = file_write_offset;
     block_table[block_position].archived_size = file_compressed_size;
     MPQDebugLog2(@"    compressed size: %u", file_compressed_size);
+    
+    // Update the file's entries in the (attributes) file
+    if (context->attributes) {
+        MPQFileInfo info;
+        info.info_flags = context->attributes & (MPQFileInfoHasCRC | MPQFileInfoHasCreationDate | MPQFileInfoHasMD5);
+        info.crc = crc;
+        info.creation_date = context->creation_date;
+        MD5_Final(info.md5, &md5_context);
+        [self _setAttributes:&info blockIndex:block_position];
+    }
         
-    // Update the archive write offset if we wrote at the end of the archive
-    if (archive_write_offset == file_write_offset)
+    // Update the archive write offset if we wrote at the end of the archive, or what is left of the free region we used
+    if (extent_index != 0xffffffff)
+        _MPQExtentMapConsume(&context->extent_map, extent_index, file_compressed_size);
+    else if (archive_write_offset == file_write_offset)
         archive_write_offset += file_compressed_size;
     
     MPQDebugLog2(@"    done adding %@", operation->primary_file_context.filename);
     
-    if (sector_table)
-        free(sector_table);
-    [dataSource release];
-    
+    free(sector_table);
     return YES;
 }
 
+- (BOOL)_performFileAddOperations:(mpq_deferred_operation_t**)operations count:(uint32_t)count error:(NSError**)error {
+    NSParameterAssert(operations != NULL || count == 0);
+    if (count == 0)
+        return YES;
+    
+    mpq_add_file_t* files = calloc(count, sizeof(mpq_add_file_t));
+    if (!files)
+        ReturnValueWithError(NO, MPQErrorDomain, errOutOfMemory, nil, error)
+    
+    // Size every file and split it in chunks
+    uint32_t sectors_per_chunk = MAX(ADD_CHUNK_SIZE / full_sector_size, 1U);
+    uint64_t total_chunk_count = 0;
+    uint32_t file_index = 0;
+    for (; file_index < count; file_index++) {
+        mpq_add_file_t* file = files + file_index;
+        file->operation = operations[file_index];
+        [self _prepareFileAdd:file];
+        
+        uint32_t sector_count = 0;
+        if (file->prepare_error || file->merged || file->file_size == 0)
+            sector_count = 0;
+        else if ((file->flags & MPQFileOneSector))
+            sector_count = 1;
+        else
+            sector_count = (uint32_t)(((uint64_t)file->file_size + full_sector_size - 1) / full_sector_size);
+        
+        file->first_chunk = (uint32_t)total_chunk_count;
+        file->chunk_count = (sector_count + sectors_per_chunk - 1) / sectors_per_chunk;
+        file->unstaged_chunks = file->chunk_count;
+        total_chunk_count += file->chunk_count;
+    }
+    
+    mpq_add_chunk_t* chunks = (total_chunk_count < UINT32_MAX) ? calloc(MAX(total_chunk_count, 1ULL), sizeof(mpq_add_chunk_t)) : NULL;
+    if (!chunks) {
+        for (file_index = 0; file_index < count; file_index++)
+            [files[file_index].prepare_error release];
+        free(files);
+        ReturnValueWithError(NO, MPQErrorDomain, errOutOfMemory, nil, error)
+    }
+    
+    for (file_index = 0; file_index < count; file_index++) {
+        mpq_add_file_t* file = files + file_index;
+        uint32_t sector_count = (file->flags & MPQFileOneSector) ? 1 : (uint32_t)(((uint64_t)file->file_size + full_sector_size - 1) / full_sector_size);
+        uint32_t chunk_index = 0;
+        for (; chunk_index < file->chunk_count; chunk_index++) {
+            mpq_add_chunk_t* chunk = chunks + file->first_chunk + chunk_index;
+            chunk->file_index = file_index;
+            chunk->first_sector = chunk_index * sectors_per_chunk;
+            chunk->sector_count = MIN(sectors_per_chunk, sector_count - chunk->first_sector);
+            chunk->data_offset = (file->flags & MPQFileOneSector) ? 0 : (off_t)chunk->first_sector * full_sector_size;
+            if ((file->flags & MPQFileOneSector))
+                chunk->data_size = file->file_size;
+            else
+                chunk->data_size = (uint32_t)MIN((uint64_t)chunk->sector_count * full_sector_size, file->file_size - (uint64_t)chunk->data_offset);
+        }
+    }
+    
+    mpq_add_context_t context;
+    context.full_sector_size = full_sector_size;
+    context.files = files;
+    context.chunks = chunks;
+    context.chunk_count = (uint32_t)total_chunk_count;
+    context.stage_chunk = _MPQStageAddChunk;
+    context.transcode = NULL;
+    context.extent_map.extents = NULL;
+    context.extent_map.count = 0;
+    context.copy_buffer = NULL;
+    
+    // Files added by this save share its date
+    context.attributes = (attributes_data) ? ((mpq_attributes_header_t*)attributes_data)->attributes : 0;
+    context.creation_date = (uint64_t)[[NSDate date] ntfsFiletime];
+    
+    mpq_add_threads_t threads;
+    _MPQInitAddContext(&context, &threads);
+    BOOL result = YES;
+    NSError* local_error = nil;
+    
+    // Find the free regions files can be written in
+    if (![self _buildExtentMap:&context.extent_map error:&local_error]) {
+        result = NO;
+        goto Cleanup;
+    }
+    
+    // Start the compression threads
+    if (!_MPQStartAddThreads(&context, &threads, &local_error)) {
+        result = NO;
+        goto Cleanup;
+    }
+    
+    // Write the files in order, with the delegate callbacks in order
+    for (file_index = 0; file_index < count; file_index++) {
+        mpq_add_file_t* file = files + file_index;
+        NSString* filename = file->operation->primary_file_context.filename;
+        
+        if ([delegate respondsToSelector:@selector(archive:willAddFile:)])
+            [delegate archive:self willAddFile:filename];
+        
+        if (file->prepare_error)
+            local_error = file->prepare_error;
+        if (!local_error) {
+            BOOL written = (file->merged) ? [self _writeMergedFile:file context:&context error:&local_error] : [self _writeStagedFile:file context:&context error:&local_error];
+            if (!written && !local_error)
+                local_error = [MPQError errorWithDomain:MPQErrorDomain code:errUnknown userInfo:nil];
+        }
+        if (local_error) {
+            if ([delegate respondsToSelector:@selector(archive:failedToAddFile:error:)])
+                [delegate archive:self failedToAddFile:filename error:local_error];
+            result = NO;
+            break;
+        }
+        
+        if ([delegate respondsToSelector:@selector(archive:didAddFile:)])
+            [delegate archive:self didAddFile:filename];
+    }
+    
+Cleanup:
+    // Stop the compression threads, they may be waiting for the writer if we failed
+    [local_error retain];
+    _MPQStopAddThreads(&context, &threads);
+    
+    uint32_t chunk_index = 0;
+    for (; chunk_index < context.chunk_count; chunk_index++) {
+        free(chunks[chunk_index].data);
+        free(chunks[chunk_index].sector_sizes);
+        free(chunks[chunk_index].raw_data);
+        [chunks[chunk_index].error release];
+    }
+    for (file_index = 0; file_index < count; file_index++) {
+        [files[file_index].data_source release];
+        [files[file_index].prepare_error release];
+    }
+    
+    _MPQExtentMapDestroy(&context.extent_map);
+    free(context.copy_buffer);
+    free(chunks);
+    free(files);
+    
+    [local_error autorelease];
+    if (error)
+        *error = local_error;
+    return result;
+}
+
 #pragma mark opening
 
 - (MPQFile*)openFileAtPosition:(uint32_t)hash_position error:(NSError**)error {
@@ -2880,121 +5379,90 @@ AbortDigest:
     if (!(block_entry->flags & MPQFileValid))
         ReturnValueWithError(nil, MPQErrorDomain, errFileIsInvalid, nil, error)
     
-    char* filename_cstring = filename_table[hash_position];
+    // Only create the filename object if the delegate needs it, otherwise MPQFile will create it on demand
     NSString* filename = nil;
-    if (filename_cstring) {
-        filename = [[[NSString alloc] initWithBytesNoCopy:filename_cstring 
-                                                   length:strlen(filename_cstring) 
-                                                 encoding:NSASCIIStringEncoding 
-                                             freeWhenDone:NO] autorelease];
-    } else {
-        // Generate a temporary filename for MPQFile
-        filename = [NSString stringWithFormat:@"unknown %x", hash_position];
+    BOOL delegateShouldOpen = [delegate respondsToSelector:@selector(archive:shouldOpenFile:)];
+    BOOL delegateWillOpen = [delegate respondsToSelector:@selector(archive:willOpenFile:)];
+    if (delegateShouldOpen || delegateWillOpen) {
+        const char* filename_cstring = _MPQGetFilename(&filename_table, &filename_arena, hash_position);
+        if (filename_cstring)
+            filename = [[[NSString alloc] initWithCString:filename_cstring encoding:NSASCIIStringEncoding] autorelease];
+        else
+            filename = [NSString stringWithFormat:@"unknown %x", hash_position];
     }
     
     // Ask the delgate if we should proceed
-    if ([delegate respondsToSelector:@selector(archive:shouldOpenFile:)]) {
+    if (delegateShouldOpen) {
         if (![delegate archive:self shouldOpenFile:filename])
             ReturnValueWithError(nil, MPQErrorDomain, errDelegateCancelled, nil, error)
     }
     
     // Notify the delgate we're going ahead
-    if ([delegate respondsToSelector:@selector(archive:willOpenFile:)])
+    if (delegateWillOpen)
         [delegate archive:self willOpenFile:filename];
     
+    mpq_file_descriptor_t descriptor;
+    memset(&descriptor, 0, sizeof(mpq_file_descriptor_t));
+    descriptor.parent = self;
+    descriptor.filename = filename;
+    descriptor.hash_position = hash_position;
+    descriptor.hash_entry = hash_entry;
+    descriptor.block_entry = block_entry;
+    descriptor.archive_fd = archive_fd;
+    
+    Class fileClass = Nil;
+    
     // We need to check the operation table to see if we hit a file that's pending for addition
-    mpq_deferred_operation_t* operation = operation_hash_table[hash_position];
-    if (operation) {
-        if (operation->type == MPQDOAdd) {
-            // Client requested a file pending for addition
-            NSDictionary* config = [[NSDictionary alloc] initWithObjectsAndKeys:
-                self, @"Parent", 
-                @(hash_position), @"Position",
-                [NSValue valueWithPointer:hash_entry], @"HashTableEntry",
-                [NSValue valueWithPointer:block_entry], @"BlockTableEntry",
-                ((mpq_deferred_operation_add_context_t*)operation->context)->dataSourceProxy, @"DataSourceProxy",
-                filename, @"Filename",
-                nil];
+    mpq_deferred_operation_t* operation = mpq_slot_table_get_pointer(&operation_hash_table, hash_position);
+    mpq_deferred_operation_add_context_t* add_context = (operation && operation->type == MPQDOAdd) ? (mpq_deferred_operation_add_context_t*)operation->context : NULL;
+    if (add_context && add_context->dataSourceProxy) {
+        // Client requested a file pending for addition
+        descriptor.data_source_proxy = add_context->dataSourceProxy;
+        fileClass = _MPQFileDataSourceClass;
+    } else {
+        if (add_context) {
+            // Files pending a merge are read from the archive they come from
+            descriptor.archive_fd = [add_context->source_handle fileDescriptor];
+            descriptor.encryption_key = add_context->source_key;
+            descriptor.file_archive_offset = add_context->source_offset;
+        } else {
+            // If the file is encrypted, we need the encryption key
+            if (block_entry->flags & MPQFileEncrypted) {
+                descriptor.encryption_key = [self getFileEncryptionKey:hash_position];
+                // TODO: what if 0 can be a legitimate encryption key?
+                if (descriptor.encryption_key == 0)
+                    ReturnValueWithError(nil, MPQErrorDomain, errFilenameRequired, nil, error)
+            }
             
-            Class fileClass = NSClassFromString(@"MPQFileDataSource");
-            MPQFile* file = [[fileClass alloc] initForFile:config error:error];
+            descriptor.file_archive_offset = archive_offset + block_offset_table[hash_entry->block_table_index];
+        }
+        
+        // We behave differently if the file is a one sector file
+        if ((block_entry->flags & MPQFileOneSector)) {
+            fileClass = _MPQFileConcreteMPQOneSectorClass;
+        } else {
+            // Load the sector table in cache (or do nothing if we already have it)
+            [self _cacheSectorTableForFile:hash_position key:descriptor.encryption_key error:error];
             
-            // Notify the delegate we're done
-            if ([delegate respondsToSelector:@selector(archive:didOpenFile:)])
-                [delegate archive:self didOpenFile:file];
+            // Check that we have a sector table if we need one
+            descriptor.sector_table = mpq_slot_table_get_pointer(&sector_tables_cache, hash_position);
+            if ((block_entry->flags & (MPQFileCompressed | MPQFileDiabloCompressed)) && !descriptor.sector_table) {
+                ReturnValueWithError(nil, MPQErrorDomain, errInvalidSectorTableCache, nil, error)
+            }
             
-            [config release];
-            return file;
+            // Get the sector table length (and explicitely ignore sector adlers)
+            descriptor.sector_table_length = _MPQComputeSectorTableLength(full_sector_size, block_entry->size, (block_entry->flags & ~MPQFileHasSectorAdlers));
+            descriptor.sector_size_shift = header.sector_size_shift;
+            fileClass = _MPQFileConcreteMPQClass;
         }
     }
     
-    // If the file is encrypted, we need the encryption key
-    uint32_t encryption_key = 0;
-    if (block_entry->flags & MPQFileEncrypted) {
-        encryption_key = [self getFileEncryptionKey:hash_position];
-        // TODO: what if 0 can be a legitimate encryption key?
-        if (encryption_key == 0)
-            ReturnValueWithError(nil, MPQErrorDomain, errFilenameRequired, nil, error)
-    }
-    
-    // We behave differently if the file is a one sector file
-    if ((block_entry->flags & MPQFileOneSector)) {
-        NSDictionary* config = [[NSDictionary alloc] initWithObjectsAndKeys:
-            self, @"Parent",
-            filename, @"Filename",
-            @(encryption_key), @"EncryptionKey",
-            @(archive_fd), @"FileDescriptor",
-            @(archive_offset + block_offset_table[hash_entry->block_table_index]), @"FileArchiveOffset",
-            @(hash_position), @"Position",
-            [NSValue valueWithPointer:hash_entry], @"HashTableEntry",
-            [NSValue valueWithPointer:block_entry], @"BlockTableEntry",
-            nil];
-        
-        Class fileClass = NSClassFromString(@"MPQFileConcreteMPQOneSector");
-        MPQFile* file = [[fileClass alloc] initForFile:config error:error];
-        
-        // Notify the delegate we're done
-        if ([delegate respondsToSelector:@selector(archive:didOpenFile:)])
-            [delegate archive:self didOpenFile:file];
-        
-        [config release];
-        return file;
-    }
-    
-    // Load the sector table in cache (or do nothing if we already have it)
-    [self _cacheSectorTableForFile:hash_position key:encryption_key error:error];
-    
-    // Check that we have a sector table if we need one
-    uint32_t* sector_table = sector_tables_cache[hash_position];
-    if ((block_entry->flags & (MPQFileCompressed | MPQFileDiabloCompressed)) && !sector_table) {
-        ReturnValueWithError(nil, MPQErrorDomain, errInvalidSectorTableCache, nil, error)
-    }
-    
-    // Get the sector table length (and explicitely ignore sector adlers)
-    uint32_t sector_table_length = _MPQComputeSectorTableLength(full_sector_size, block_entry->size, (block_entry->flags & ~MPQFileHasSectorAdlers));
-    
-    NSDictionary* config = [[NSDictionary alloc] initWithObjectsAndKeys:
-        self, @"Parent",
-        filename, @"Filename",
-        @(encryption_key), @"EncryptionKey",
-        @(archive_fd), @"FileDescriptor",
-        @(archive_offset + block_offset_table[hash_entry->block_table_index]), @"FileArchiveOffset",
-        @(hash_position), @"Position",
-        [NSValue valueWithPointer:hash_entry], @"HashTableEntry",
-        [NSValue valueWithPointer:block_entry], @"BlockTableEntry",
-        [NSNumber numberWithUnsignedInt:header.sector_size_shift], @"SectorSizeShift",
-        @(sector_table_length), @"SectorTableLength",
-        [NSValue valueWithPointer:sector_table], @"SectorTable",
-        nil];
-    
-    Class fileClass = NSClassFromString(@"MPQFileConcreteMPQ");
-    MPQFile* file = [[fileClass alloc] initForFile:config error:error];
+    MPQFile* file = [[fileClass alloc] initWithDescriptor:&descriptor error:error];
     
     // Notify the delegate we're done
     if ([delegate respondsToSelector:@selector(archive:didOpenFile:)])
         [delegate archive:self didOpenFile:file];
     
-    [config release];
     return file;
 }
 
@@ -3025,10 +5493,8 @@ AbortDigest:
     }
     
     // Make sure we have the name in the name table
-    if (!filename_table[hash_position])
-        filename_table[hash_position] = filename_cstring;
-    else
-        free(filename_cstring);
+    _MPQSetFilename(&filename_table, &filename_arena, hash_position, filename_cstring);
+    free(filename_cstring);
     filename_cstring = NULL;
     
     // openFileAtPosition does the rest
@@ -3037,6 +5503,23 @@ AbortDigest:
 
 #pragma mark reading
 
+// Files closer than this are prefetched together, reading the gap costs less than an extra seek
+#define PREFETCH_COALESCE_GAP 0x10000
+
+struct mpq_prefetch_range {
+    off_t offset;
+    off_t length;
+};
+typedef struct mpq_prefetch_range mpq_prefetch_range_t;
+
+static int _MPQComparePrefetchRanges(const void* lhs, const void* rhs) {
+    off_t lhs_offset = ((const mpq_prefetch_range_t*)lhs)->offset;
+    off_t rhs_offset = ((const mpq_prefetch_range_t*)rhs)->offset;
+    if (lhs_offset < rhs_offset) return -1;
+    if (lhs_offset > rhs_offset) return 1;
+    return 0;
+}
+
 - (NSData*)copyDataForFile:(NSString*)filename {
     return [self copyDataForFile:filename range:NSMakeRange(0, 0) locale:MPQNeutral error:(NSError**)NULL];
 }
@@ -3084,37 +5567,130 @@ AbortDigest:
     return returnData;
 }
 
-#pragma mark existence
-
-- (BOOL)fileExists:(NSString*)filename {
-    return [self fileExists:filename locale:MPQNeutral error:(NSError**)NULL];
-}
-
-- (BOOL)fileExists:(NSString*)filename error:(NSError**)error {
-    return [self fileExists:filename locale:MPQNeutral error:error];
-}
-
-- (BOOL)fileExists:(NSString*)filename locale:(MPQLocale)locale {
-    return [self fileExists:filename locale:locale error:(NSError**)NULL];
-}
-
-- (BOOL)fileExists:(NSString*)filename locale:(MPQLocale)locale error:(NSError**)error {
-    NSParameterAssert(filename != nil);
-
-    char* filename_cstring = _MPQCreateASCIIFilename(filename, error);
-    if (!filename_cstring) return NO;
+- (BOOL)prefetchFiles:(NSArray*)filenames locale:(MPQLocale)locale error:(NSError**)error {
+    NSParameterAssert(filenames != nil);
     
-    // Find the file in the hash table
-    uint32_t hash_position = [self findHashPosition:filename_cstring locale:locale error:error];
-    if (hash_position != 0xffffffff) {
-        if (!filename_table[hash_position]) filename_table[hash_position] = filename_cstring;
-        else free(filename_cstring);
-        return YES;
-    } else {
+    uint32_t* positions = malloc(MAX([filenames count], 1U) * sizeof(uint32_t));
+    if (!positions)
+        ReturnValueWithError(NO, MPQErrorDomain, errOutOfMemory, nil, error)
+    
+    uint32_t count = 0;
+    NSEnumerator* filenameEnumerator = [filenames objectEnumerator];
+    NSString* filename;
+    while ((filename = [filenameEnumerator nextObject])) {
+        char* filename_cstring = _MPQCreateASCIIFilename(filename, error);
+        if (!filename_cstring) {
+            free(positions);
+            return NO;
+        }
+        
+        uint32_t hash_position = [self findHashPosition:filename_cstring locale:locale error:NULL];
         free(filename_cstring);
-        return NO;
+        if (hash_position != 0xffffffff)
+            positions[count++] = hash_position;
     }
-}
+    
+    BOOL result = [self prefetchFilesAtPositions:positions count:count error:error];
+    free(positions);
+    return result;
+}
+
+- (BOOL)prefetchFilesAtPositions:(const uint32_t*)positions count:(uint32_t)count error:(NSError**)error {
+    NSParameterAssert(positions != NULL || count == 0);
+    if (archive_fd == -1)
+        ReturnValueWithError(NO, MPQErrorDomain, errNoArchiveFile, nil, error)
+    if (count == 0)
+        return YES;
+    
+    mpq_prefetch_range_t* ranges = malloc(count * sizeof(mpq_prefetch_range_t));
+    if (!ranges)
+        ReturnValueWithError(NO, MPQErrorDomain, errOutOfMemory, nil, error)
+    
+    // Compute the byte range of every file that is stored in the archive
+    uint32_t range_count = 0;
+    uint32_t i = 0;
+    for (; i < count; i++) {
+        uint32_t hash_position = positions[i];
+        if (hash_position >= header.hash_table_length)
+            continue;
+        
+        mpq_hash_table_entry_t* hash_entry = hash_table + hash_position;
+        if (hash_entry->block_table_index == HASH_TABLE_EMPTY || hash_entry->block_table_index == HASH_TABLE_DELETED)
+            continue;
+        mpq_deferred_operation_t* operation = mpq_slot_table_get_pointer(&operation_hash_table, hash_position);
+        if (operation && operation->type == MPQDOAdd)
+            continue;
+        
+        mpq_block_table_entry_t* block_entry = block_table + hash_entry->block_table_index;
+        if (!(block_entry->flags & MPQFileValid) || block_entry->archived_size == 0)
+            continue;
+        
+        // If we have the sector table, the end of the last sector (or of the sector adlers) is the exact end of the file's data
+        off_t length = block_entry->archived_size;
+        const uint32_t* sector_table = mpq_slot_table_get_pointer(&sector_tables_cache, hash_position);
+        if (sector_table) {
+            uint32_t sector_table_length = _MPQComputeSectorTableLength(full_sector_size, block_entry->size, block_entry->flags);
+            length = MIN(length, (off_t)sector_table[sector_table_length - 1]);
+        }
+        
+        ranges[range_count].offset = archive_offset + block_offset_table[hash_entry->block_table_index];
+        ranges[range_count].length = length;
+        range_count++;
+    }
+    
+    // Sort the ranges by offset and issue one advisory per run of ranges separated by small gaps
+    qsort(ranges, range_count, sizeof(mpq_prefetch_range_t), _MPQComparePrefetchRanges);
+    
+    uint32_t run_start = 0;
+    while (run_start < range_count) {
+        off_t run_offset = ranges[run_start].offset;
+        off_t run_end = run_offset + ranges[run_start].length;
+        
+        uint32_t next = run_start + 1;
+        while (next < range_count && ranges[next].offset <= run_end + PREFETCH_COALESCE_GAP) {
+            run_end = MAX(run_end, ranges[next].offset + ranges[next].length);
+            next++;
+        }
+        
+        _MPQAdviseWillNeed(archive_fd, run_offset, run_end - run_offset);
+        run_start = next;
+    }
+    
+    free(ranges);
+    return YES;
+}
+
+#pragma mark existence
+
+- (BOOL)fileExists:(NSString*)filename {
+    return [self fileExists:filename locale:MPQNeutral error:(NSError**)NULL];
+}
+
+- (BOOL)fileExists:(NSString*)filename error:(NSError**)error {
+    return [self fileExists:filename locale:MPQNeutral error:error];
+}
+
+- (BOOL)fileExists:(NSString*)filename locale:(MPQLocale)locale {
+    return [self fileExists:filename locale:locale error:(NSError**)NULL];
+}
+
+- (BOOL)fileExists:(NSString*)filename locale:(MPQLocale)locale error:(NSError**)error {
+    NSParameterAssert(filename != nil);
+
+    char* filename_cstring = _MPQCreateASCIIFilename(filename, error);
+    if (!filename_cstring) return NO;
+    
+    // Find the file in the hash table
+    uint32_t hash_position = [self findHashPosition:filename_cstring locale:locale error:error];
+    if (hash_position != 0xffffffff) {
+        _MPQSetFilename(&filename_table, &filename_arena, hash_position, filename_cstring);
+        free(filename_cstring);
+        return YES;
+    } else {
+        free(filename_cstring);
+        return NO;
+    }
+}
 
 - (NSArray*)localesForFile:(NSString*)filename {
     NSParameterAssert(filename != nil);
@@ -3127,12 +5703,16 @@ AbortDigest:
         current_hash_position = initial_hash_position,
         hash_a = mpq_hash_cstring(filename_cstring, HASH_NAME_A),
         hash_b = mpq_hash_cstring(filename_cstring, HASH_NAME_B);
-    free(filename_cstring);
-    filename_cstring = NULL;
+    size_t filename_length = strlen(filename_cstring);
 
     // If the first entry we find is empty, we're done
-    if (hash_table[current_hash_position].block_table_index == HASH_TABLE_EMPTY) return nil;
+    if (hash_table[current_hash_position].block_table_index == HASH_TABLE_EMPTY) {
+        free(filename_cstring);
+        return nil;
+    }
     
+    // Every locale of the file shares a single copy of the name
+    uint32_t name_reference = 0;
     NSMutableArray* locales = [[NSMutableArray alloc] initWithCapacity:0x10];
     do {
         if (hash_table[current_hash_position].hash_a == hash_a &&
@@ -3140,13 +5720,14 @@ AbortDigest:
             hash_table[current_hash_position].block_table_index != HASH_TABLE_DELETED)
         {
             // Make sure we have the name in the name table
-            if (!filename_table[current_hash_position]) filename_table[current_hash_position] = _MPQCreateASCIIFilename(filename, (NSError**)NULL);
+            _MPQStoreFilename(&filename_table, &filename_arena, current_hash_position, filename_cstring, filename_length, &name_reference);
             [locales addObject:[NSNumber numberWithUnsignedInt:hash_table[current_hash_position].locale]];
         }
         
         current_hash_position++;
         current_hash_position %= header.hash_table_length;
     } while ((current_hash_position != initial_hash_position) && (hash_table[current_hash_position].block_table_index != HASH_TABLE_EMPTY));
+    free(filename_cstring);
     
     if (locales.count == 0) {
         [locales release];
@@ -3161,6 +5742,35 @@ AbortDigest:
     return [self writeToFile:path atomically:atomically error:(NSError**)NULL];
 }
 
+// Copies the archive header and extended header in archive byte order, and returns their size
+- (uint32_t)_copyArchiveHeader:(uint8_t*)buffer {
+    mpq_header_t swapped_header = header;
+    [[self class] swap_mpq_header:&swapped_header];
+    memcpy(buffer, &swapped_header, sizeof(mpq_header_t));
+    if (header.version == 0)
+        return sizeof(mpq_header_t);
+    
+    mpq_extended_header_t swapped_extended_header = extended_header;
+    [[self class] swap_mpq_extended_header:&swapped_extended_header];
+    memcpy(buffer + sizeof(mpq_header_t), &swapped_extended_header, sizeof(mpq_extended_header_t));
+    return sizeof(mpq_header_t) + sizeof(mpq_extended_header_t);
+}
+
+// Writes the archive header, which makes the structural tables written by _writeStructuralTables: the archive's. The
+// header and extended header are written at once, so that a torn write is less likely.
+- (BOOL)_writeArchiveHeader:(NSError**)error {
+    uint8_t buffer[sizeof(mpq_header_t) + sizeof(mpq_extended_header_t)];
+    uint32_t header_size = [self _copyArchiveHeader:buffer];
+    
+    ssize_t bytes_written = pwrite(archive_fd, buffer, header_size, archive_offset);
+    if (bytes_written == -1)
+        ReturnValueWithPOSIXError(NO, nil, error)
+    if (bytes_written < (ssize_t)header_size)
+        ReturnValueWithError(NO, MPQErrorDomain, errIO, nil, error)
+    return YES;
+}
+
+// Updates the archive header and writes the structural tables. The header itself is written by _writeArchiveHeader:.
 - (BOOL)_writeStructuralTables:(NSError**)error {
     // Quantities to process the structural tables
     ssize_t bytes_written = 0;
@@ -3203,28 +5813,6 @@ AbortDigest:
             block_table[i].offset = (uint32_t)(block_offset_table[i]);
     }
 
-    // Write the header
-    [[self class] swap_mpq_header:&header];
-    bytes_written = pwrite(archive_fd, &header, sizeof(mpq_header_t), archive_offset);
-    if (bytes_written < (ssize_t)sizeof(mpq_header_t)) {
-        if (extended_block_offset_table)
-            free(extended_block_offset_table);
-        ReturnValueWithError(NO, NSPOSIXErrorDomain, errno, nil, error)
-    }
-    [[self class] swap_mpq_header:&header];
-    
-    // Write the extended header
-    if (header.version == 1) {
-        [[self class] swap_mpq_extended_header:&extended_header];
-        bytes_written = pwrite(archive_fd, &extended_header, sizeof(mpq_extended_header_t), archive_offset + sizeof(mpq_header_t));
-        if (bytes_written < (ssize_t)sizeof(mpq_extended_header_t)) {
-            if (extended_block_offset_table)
-                free(extended_block_offset_table);
-            ReturnValueWithError(NO, NSPOSIXErrorDomain, errno, nil, error)
-        }
-        [[self class] swap_mpq_extended_header:&extended_header];
-    }
-
     // Encrypt the hash table
     [self swap_hash_table];
     mpq_encrypt((char*)hash_table, hash_table_size, mpq_hash_cstring(kHashTableEncryptionKey, HASH_KEY), NO);
@@ -3272,31 +5860,148 @@ AbortDigest:
 }
 
 - (BOOL)_processOperations:(NSError**)error {
+    // Collect the pending additions, most recent first
+    uint32_t operation_count = 0;
     mpq_deferred_operation_t* operation = last_operation;
-    while (operation) {
+    for (; operation; operation = operation->previous)
+        operation_count++;
+    
+    mpq_deferred_operation_t** add_operations = malloc(MAX(operation_count, 1U) * sizeof(mpq_deferred_operation_t*));
+    if (!add_operations)
+        ReturnValueWithError(NO, MPQErrorDomain, errOutOfMemory, nil, error)
+    
+    uint32_t add_count = 0;
+    for (operation = last_operation; operation; operation = operation->previous) {
         // Make sure this is the current operation for hash table entry
-        if (operation_hash_table[operation->primary_file_context.hash_position] != operation) {
-            operation = operation->previous;
+        if (operation->primary_file_context.hash_position == DETACHED_OPERATION_POSITION)
             continue;
-        }
-        
-        if (operation->type == MPQDOAdd) {
-            if ([delegate respondsToSelector:@selector(archive:willAddFile:)])
-                [delegate archive:self willAddFile:operation->primary_file_context.filename];
-            
-            if (![self _performFileAddOperation:operation error:error]) {
-                [delegate archive:self failedToAddFile:operation->primary_file_context.filename error:*error];
-                return NO;
-            }
+        if (mpq_slot_table_get_pointer(&operation_hash_table, operation->primary_file_context.hash_position) != operation)
+            continue;
+        if (operation->type == MPQDOAdd)
+            add_operations[add_count++] = operation;
+    }
+    
+    BOOL result = [self _performFileAddOperations:add_operations count:add_count error:error];
+    free(add_operations);
+    return result;
+}
+
+// What a failed save must put back for the instance to be as it was before the save. The block table may grow, be
+// compacted and be cut during a save, which moves block entries and attribute values around, so the tables and the
+// attributes are restored as a whole. Keys of files pending addition get offset adjusted as the files are written.
+struct mpq_save_snapshot {
+    BOOL taken;
+    mpq_hash_table_entry_t* hash_table;
+    mpq_block_table_entry_t* block_table;
+    off_t* block_offset_table;
+    void* attributes_data;
+    uint32_t attributes_data_size;
+    mpq_hash_table_entry_t* weak_signature_hash_entry;
+    mpq_deferred_operation_t* last_operation;
+    uint32_t deferred_operations_count;
+    uint32_t* pending_keys;
+    uint32_t pending_key_count;
+};
+typedef struct mpq_save_snapshot mpq_save_snapshot_t;
+
+static void _MPQFreeSaveSnapshot(mpq_save_snapshot_t* snapshot) {
+    free(snapshot->hash_table);
+    free(snapshot->block_table);
+    free(snapshot->block_offset_table);
+    free(snapshot->attributes_data);
+    free(snapshot->pending_keys);
+    memset(snapshot, 0, sizeof(mpq_save_snapshot_t));
+}
+
+- (BOOL)_takeSaveSnapshot:(mpq_save_snapshot_t*)snapshot error:(NSError**)error {
+    memset(snapshot, 0, sizeof(mpq_save_snapshot_t));
+    
+    size_t hash_table_size = header.hash_table_length * sizeof(mpq_hash_table_entry_t);
+    size_t block_table_length = MAX(header.block_table_length, 1U);
+    snapshot->hash_table = malloc(hash_table_size);
+    snapshot->block_table = malloc(block_table_length * sizeof(mpq_block_table_entry_t));
+    snapshot->block_offset_table = malloc(block_table_length * sizeof(off_t));
+    snapshot->pending_keys = malloc(MAX(deferred_operations_count, 1U) * 2 * sizeof(uint32_t));
+    if (attributes_data)
+        snapshot->attributes_data = malloc(MAX(attributes_data_size, 1U));
+    if (!snapshot->hash_table || !snapshot->block_table || !snapshot->block_offset_table || !snapshot->pending_keys || (attributes_data && !snapshot->attributes_data)) {
+        _MPQFreeSaveSnapshot(snapshot);
+        ReturnValueWithError(NO, MPQErrorDomain, errOutOfMemory, nil, error)
+    }
+    
+    memcpy(snapshot->hash_table, hash_table, hash_table_size);
+    memcpy(snapshot->block_table, block_table, header.block_table_length * sizeof(mpq_block_table_entry_t));
+    memcpy(snapshot->block_offset_table, block_offset_table, header.block_table_length * sizeof(off_t));
+    if (attributes_data)
+        memcpy(snapshot->attributes_data, attributes_data, attributes_data_size);
+    snapshot->attributes_data_size = attributes_data_size;
+    snapshot->weak_signature_hash_entry = weak_signature_hash_entry;
+    snapshot->last_operation = last_operation;
+    snapshot->deferred_operations_count = deferred_operations_count;
+    
+    mpq_deferred_operation_t* operation = last_operation;
+    for (; operation; operation = operation->previous) {
+        uint32_t hash_position = operation->primary_file_context.hash_position;
+        if (operation->type != MPQDOAdd || hash_position == DETACHED_OPERATION_POSITION)
+            continue;
+        if (mpq_slot_table_get_pointer(&operation_hash_table, hash_position) != operation)
+            continue;
+        snapshot->pending_keys[snapshot->pending_key_count * 2] = hash_position;
+        snapshot->pending_keys[snapshot->pending_key_count * 2 + 1] = mpq_slot_table_get_uint32(&encryption_keys_cache, hash_position);
+        snapshot->pending_key_count++;
+    }
+    
+    snapshot->taken = YES;
+    return YES;
+}
+
+- (void)_restoreSaveSnapshot:(mpq_save_snapshot_t*)snapshot {
+    if (!snapshot->taken)
+        return;
+    
+    // Drop the operations the save itself made (listfile, attributes, signature deletion), putting back the cached
+    // state of the files they replaced
+    while (last_operation && last_operation != snapshot->last_operation) {
+        uint32_t hash_position = last_operation->primary_file_context.hash_position;
+        if (hash_position != DETACHED_OPERATION_POSITION) {
+            mpq_slot_table_set_uint32(&encryption_keys_cache, hash_position, last_operation->primary_file_context.encryption_key);
+            _MPQFreeSlotPointer(&sector_tables_cache, hash_position);
             
-            if ([delegate respondsToSelector:@selector(archive:didAddFile:)])
-                [delegate archive:self didAddFile:operation->primary_file_context.filename];
+            char* filename_cstring = (last_operation->primary_file_context.filename) ? _MPQCreateASCIIFilename(last_operation->primary_file_context.filename, NULL) : NULL;
+            mpq_slot_table_set_uint32(&filename_table, hash_position, 0);
+            _MPQSetFilename(&filename_table, &filename_arena, hash_position, filename_cstring);
+            free(filename_cstring);
         }
-        
-        operation = operation->previous;
+        [self _flushLastDO];
+    }
+    NSAssert(deferred_operations_count == snapshot->deferred_operations_count, @"save operations were not rolled back");
+    
+    // The tables may have been reallocated, so the snapshot buffers replace them
+    memcpy(hash_table, snapshot->hash_table, header.hash_table_length * sizeof(mpq_hash_table_entry_t));
+    free(block_table);
+    block_table = snapshot->block_table;
+    snapshot->block_table = NULL;
+    free(block_offset_table);
+    block_offset_table = snapshot->block_offset_table;
+    snapshot->block_offset_table = NULL;
+    if (attributes_data) {
+        free(attributes_data);
+        attributes_data = snapshot->attributes_data;
+        snapshot->attributes_data = NULL;
+        attributes_data_size = snapshot->attributes_data_size;
     }
+    weak_signature_hash_entry = snapshot->weak_signature_hash_entry;
     
-    return YES;
+    // Files pending addition go back to their unadjusted keys, and will be placed and written again
+    uint32_t i = 0;
+    for (; i < snapshot->pending_key_count; i++) {
+        uint32_t hash_position = snapshot->pending_keys[i * 2];
+        mpq_slot_table_set_uint32(&encryption_keys_cache, hash_position, snapshot->pending_keys[i * 2 + 1]);
+        _MPQFreeSlotPointer(&sector_tables_cache, hash_position);
+    }
+    
+    [self _invalidateBlockFreeMap];
+    _fileCountCachesDirty = YES;
 }
 
 - (BOOL)writeToFile:(NSString*)path atomically:(BOOL)atomically error:(NSError**)error {
@@ -3320,6 +6025,14 @@ AbortDigest:
     // Tell the delegate we're about to start saving
     if ([delegate respondsToSelector:@selector(archiveWillSave:)]) [delegate archiveWillSave:self];
     
+    // Grow the hash table first if it is too full, so that it is consistent even if the save fails
+    if (![self _applyHashTableLoadPolicy:error])
+        return NO;
+    
+    // Only report a copy made by this save
+    last_copy_method = MPQCopyMethodNone;
+    last_copy_duration = 0.0;
+    
     // Manage an autorelease pool to kill all temporary objects after this is done
     NSAutoreleasePool* p = [NSAutoreleasePool new];
     
@@ -3337,6 +6050,12 @@ AbortDigest:
     NSString* temp_path = nil;
     int temp_fd = -1;
     
+    // Journal of a journaled save, and what is needed to roll it back
+    BOOL journaled = NO;
+    int journal_fd = -1;
+    mpq_journal_record_t journal_record;
+    void* strong_signature_backup = NULL;
+    
     // Backup instance state in case of failure
     mpq_header_t header_backup = header;
     mpq_extended_header_t extended_header_backup = extended_header;
@@ -3344,6 +6063,8 @@ AbortDigest:
     off_t archive_size_backup = archive_size;
     off_t hash_table_offset_backup = hash_table_offset;
     off_t block_table_offset_backup = block_table_offset;
+    mpq_save_snapshot_t save_snapshot;
+    memset(&save_snapshot, 0, sizeof(mpq_save_snapshot_t));
     
     // Multiple scenarios depending on the options and state of the instance
     if (archive_fd == -1) {
@@ -3355,7 +6076,7 @@ AbortDigest:
                 ReturnValueWithError(NO, NSPOSIXErrorDomain, errno, nil, error)
             }
             
-            fcntl(archive_fd, F_NOCACHE, 1);
+            _MPQApplyCachePolicy(archive_fd, cache_policy);
             
             // Close archive_fd, delete file at path
             pFlags = 0x3;
@@ -3396,8 +6117,11 @@ AbortDigest:
         close(archive_fd);
         
         // Copy the archive to temp_path
-        if (!_MPQFSCopy(temp_path, archive_path, error))
+        NSTimeInterval copy_start = [NSDate timeIntervalSinceReferenceDate];
+        if (!_MPQFSCopy(temp_path, archive_path, &last_copy_method, error))
             goto WriteFailed;
+        last_copy_duration = [NSDate timeIntervalSinceReferenceDate] - copy_start;
+        MPQDebugLog(@"copied the archive with method %u in %f seconds", last_copy_method, last_copy_duration);
         
         // Delete file at temp_path
         pFlags |= 0x4;
@@ -3410,7 +6134,7 @@ AbortDigest:
             goto WriteFailed;
         }
         
-        fcntl(archive_fd, F_NOCACHE, 1);
+        _MPQApplyCachePolicy(archive_fd, cache_policy);
         
         // Close archive_fd
         pFlags |= 0x1;
@@ -3423,7 +6147,8 @@ AbortDigest:
             temp_fd = archive_fd;
 
             // Copy the archive to path
-            if (!_MPQFSCopy(path, archive_path, error)) {
+            NSTimeInterval copy_start = [NSDate timeIntervalSinceReferenceDate];
+            if (!_MPQFSCopy(path, archive_path, &last_copy_method, error)) {
                 archive_fd = temp_fd;
                 if (error) {
                     [*error retain];
@@ -3434,6 +6159,9 @@ AbortDigest:
                 return NO;
             }
                         
+            last_copy_duration = [NSDate timeIntervalSinceReferenceDate] - copy_start;
+            MPQDebugLog(@"copied the archive with method %u in %f seconds", last_copy_method, last_copy_duration);
+            
             // Open the copy, fail if it does not exists
             archive_fd = open(path.fileSystemRepresentation, O_RDWR, 0);
             if (archive_fd == -1) {
@@ -3442,7 +6170,7 @@ AbortDigest:
                 ReturnValueWithError(NO, NSPOSIXErrorDomain, errno, nil, error)
             }
             
-            fcntl(archive_fd, F_NOCACHE, 1);
+            _MPQApplyCachePolicy(archive_fd, cache_policy);
             
             // If the archive is not modified, we're done
             if (!is_modified)
@@ -3456,9 +6184,31 @@ AbortDigest:
                 [p release];
                 ReturnValueWithError(NO, MPQErrorDomain, errReadOnlyArchive, nil, error)
             }
+            
+            // A journaled save appends to the archive file, and keeps what it needs to roll back. Saving blows away
+            // the strong signature, but rolling back doesn't.
+            if (journaled_saves) {
+                journaled = YES;
+                if (strong_signature) {
+                    strong_signature_backup = malloc(MPQ_STRONG_SIGNATURE_SIZE + 4);
+                    if (!strong_signature_backup) {
+                        if (error)
+                            *error = [MPQError errorWithDomain:MPQErrorDomain code:errOutOfMemory userInfo:nil];
+                        goto WriteFailed;
+                    }
+                    memcpy(strong_signature_backup, strong_signature, MPQ_STRONG_SIGNATURE_SIZE + 4);
+                }
+                
+                if (![self _beginJournal:&journal_record fd:&journal_fd error:error])
+                    goto WriteFailed;
+            }
         }
     }
     
+    // A save which can fail without losing the archive must also leave the instance as it was
+    if ((atomically || journaled || ![archive_path isEqualToString:path]) && ![self _takeSaveSnapshot:&save_snapshot error:error])
+        goto WriteFailed;
+    
     // Write out the listfile
     if (save_listfile) {
         if (![self _addListfileToArchive:error])
@@ -3485,56 +6235,19 @@ AbortDigest:
     if (![self _processOperations:error])
         goto WriteFailed;
     
-    // Optimize the block table by removing any empty entries
-    uint32_t block_entry_index = 0;
-    uint32_t free_block_entry_index = 0xFFFFFFFF;
-    mpq_attributes_header_t* attributes = (mpq_attributes_header_t*)attributes_data;
-    while (block_entry_index < header.block_table_length) {
-        mpq_block_table_entry_t* block_table_entry = block_table + block_entry_index;
-        
-        // If there is a free block table entry available, move the current entry into it, empty the current entry and mark it as the first empty entry
-        if (!(block_table_entry->size == 0 && block_table_entry->archived_size == 0 && block_table_entry->flags == 0) && free_block_entry_index != 0xFFFFFFFF) {
-            memcpy(block_table + free_block_entry_index, block_table + block_entry_index, sizeof(mpq_block_table_entry_t));
-            memset(block_table + block_entry_index, 0, sizeof(mpq_block_table_entry_t));
-            
-            // Scan the hash table for the entry using the block table entry we just moved
-            uint32_t hash_entry_index = 0;
-            while (hash_entry_index < header.hash_table_length) {
-                mpq_hash_table_entry_t* hash_table_entry = hash_table + hash_entry_index;
-                if (hash_table_entry->block_table_index == block_entry_index) {
-                    hash_table_entry->block_table_index = free_block_entry_index;
-                    break;
-                }
-                hash_entry_index++;
-            }
-            
-            // Attributes
-            if (attributes_data) {
-                size_t currentOffset = sizeof(mpq_attributes_header_t);
-                mpq_file_attribute_t* attribute = mpq_file_attributes;
-                while (attribute->flag != 0) {
-                    if ((attributes->attributes & attribute->flag)) {
-                        memcpy(BUFFER_OFFSET(attributes_data, currentOffset + attribute->size * free_block_entry_index), 
-                               BUFFER_OFFSET(attributes_data, currentOffset + attribute->size * block_entry_index), 
-                               attribute->size);
-                        memset(BUFFER_OFFSET(attributes_data, currentOffset + attribute->size * block_entry_index), 0, attribute->size);
-                        currentOffset += attribute->size * header.block_table_length;
-                    }
-                    attribute++;
-                }
-            }
-            
-            free_block_entry_index++;
-        } else if ((block_table_entry->size == 0 && block_table_entry->archived_size == 0 && block_table_entry->flags == 0) && free_block_entry_index == 0xFFFFFFFF) {
-            free_block_entry_index = block_entry_index;
-        }
-        
-        block_entry_index++;
-    }
+    // Optimize the block table by removing any empty entries, including those of deleted and overwritten files
+    [self _clearInvalidBlockEntries];
+    uint32_t used_block_table_length = 0;
+    if (![self _compactBlockTable:&used_block_table_length error:error])
+        goto WriteFailed;
     
-    // Write the file attributes
+    // Write the file attributes. The (attributes) file will take the first empty block table entry, so the block table
+    // will have one more entry.
     if (attributes_data) {
-        NSData* attributes_data_object = [NSData dataWithBytesNoCopy:attributes_data length:attributes_data_size freeWhenDone:NO];
+        NSData* attributes_data_object = [self _attributesDataForBlockTableLength:used_block_table_length + 1 error:error];
+        if (!attributes_data_object)
+            goto WriteFailed;
+        
         NSDictionary* params = @{MPQFileLocale: [NSNumber numberWithUnsignedShort:MPQNeutral],
                                 MPQFileFlags: [NSNumber numberWithUnsignedInt:MPQFileCompressed],
                                 MPQOverwrite: @YES};
@@ -3546,9 +6259,10 @@ AbortDigest:
             goto WriteFailed;
     }
     
-    // We can cut the block table at free_block_entry_index
+    // We can cut the block table after its last non-empty entry
     uint32_t old_block_table_length = header.block_table_length;
-    header.block_table_length = free_block_entry_index;
+    while (header.block_table_length > 0 && _MPQBlockEntryIsEmpty(block_table + header.block_table_length - 1))
+        header.block_table_length--;
     
     // We can now compute the exact archive size and resize the archive file
     off_t new_archive_size = archive_write_offset + [self _computeSizeOfStructuralTables];
@@ -3561,6 +6275,25 @@ AbortDigest:
     if (![self _writeStructuralTables:error])
         goto WriteFailed;
     
+    // Switch the archive header to the new tables. A journaled save makes the new data and tables durable and records
+    // the new header first, then makes the new header durable before deleting the journal.
+    if (journal_fd != -1 && ![self _commitJournal:journal_fd error:error])
+        goto WriteFailed;
+    if (![self _writeArchiveHeader:error])
+        goto WriteFailed;
+    if (journal_fd != -1) {
+        if (mpq_core_sync(archive_fd) == -1) {
+            if (error)
+                *error = [MPQError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
+            goto WriteFailed;
+        }
+        
+        [self _finishJournal:journal_fd];
+        journal_fd = -1;
+        free(strong_signature_backup);
+        strong_signature_backup = NULL;
+    }
+    
     // Restore the block table length as it was before the optimization process to not waste the allocated memory
     header.block_table_length = old_block_table_length;
     
@@ -3591,11 +6324,11 @@ AbortDigest:
             else
                 archive_fd = open(archive_path.fileSystemRepresentation, O_RDWR, 0644);
             
-            // If we failed to re-open the original file, we're owned. Otherwise, re-apply the NOCACHE policy
+            // If we failed to re-open the original file, we're owned. Otherwise, re-apply the cache policy
             if (archive_fd == -1)
                 archive_path = nil;
             else
-                fcntl(archive_fd, F_NOCACHE, 1);
+                _MPQApplyCachePolicy(archive_fd, cache_policy);
             
             goto WriteFailed;
         }
@@ -3612,7 +6345,7 @@ AbortDigest:
             goto WriteFailed;
         }
         
-        fcntl(archive_fd, F_NOCACHE, 1);
+        _MPQApplyCachePolicy(archive_fd, cache_policy);
     } else if (temp_fd != -1 && ![archive_path isEqualToString:path]) {
         // Close the original file descriptor which has been backed in temp_fd
         close(temp_fd);
@@ -3622,6 +6355,12 @@ AbortDigest:
     [self _flushDOS];
     
 FinalizeWrite:
+    _MPQFreeSaveSnapshot(&save_snapshot);
+    
+    // Offsets, sizes and attributes may all have changed
+    [self _flushFileInfoCache];
+    [self _invalidateBlockFreeMap];
+    
     // In all cases, path is now the valid archive path
     [archive_path release];
     archive_path = [path copy];
@@ -3630,6 +6369,9 @@ FinalizeWrite:
     is_read_only = NO;
     is_modified = NO;
     
+    // The index cache now describes the previous contents of the file
+    [self _refreshIndexCache];
+    
     // Page the delegate to tell it that we're done
     if ([delegate respondsToSelector:@selector(archiveDidSave:)])
         [delegate archiveDidSave:self];
@@ -3650,20 +6392,38 @@ WriteFailed:
     if (pFlags & 0x8)
         archive_fd = temp_fd;
     
-    // TODO: we should attempt to re-write the structural tables if they were overwritten
+    // TODO: we should attempt to re-write the structural tables if they were overwritten by a non-journaled save
     
-    // Restore the instance's state as it was pre-write if we were atomical or writing elsewhere
-    if (atomically || ![archive_path isEqualToString:path]) {
+    // Put the committed header back and cut what the journaled save appended
+    if (journal_fd != -1)
+        [self _rollBackJournal:&journal_record fd:journal_fd];
+    if (journaled) {
+        if (strong_signature_backup && !strong_signature)
+            strong_signature = strong_signature_backup;
+        else if (strong_signature_backup)
+            free(strong_signature_backup);
+    }
+    
+    [self _flushFileInfoCache];
+    [self _invalidateBlockFreeMap];
+    
+    // Restore the instance's state as it was pre-write if we were atomical, journaled or writing elsewhere
+    if (atomically || journaled || ![archive_path isEqualToString:path]) {
         header = header_backup;
         extended_header = extended_header_backup;
         archive_write_offset = archive_write_offset_backup;
         archive_size = archive_size_backup;
         hash_table_offset = hash_table_offset_backup;
         block_table_offset = block_table_offset_backup;
+        
+        // Tables, attributes and keys go back to their state before the save. In particular, pending additions get their
+        // unplaced block entries and unadjusted keys back, so the next save places and encrypts them from scratch.
+        [self _restoreSaveSnapshot:&save_snapshot];
     } else {
         // Whatever is done is done for good, and whatever else, well, too bad because the archive is likely dead anyways
         [self _flushDOS];
     }
+    _MPQFreeSaveSnapshot(&save_snapshot);
     
     MPQDebugLog(@"writeToFile failed");
     
@@ -3680,4 +6440,1049 @@ WriteFailed:
     return NO;
 }
 
+- (MPQCopyMethod)lastCopyMethod {
+    return last_copy_method;
+}
+
+- (NSTimeInterval)lastCopyDuration {
+    return last_copy_duration;
+}
+
+#pragma mark compaction
+
+struct mpq_compact_file {
+    off_t offset;
+    uint32_t block_index;
+    uint32_t hash_position;
+    uint32_t encryption_key;
+    BOOL rekeyed;
+    
+    // Index of the file in the transcoding context, or 0xffffffff if its data is copied verbatim
+    uint32_t transcode_index;
+};
+typedef struct mpq_compact_file mpq_compact_file_t;
+
+// Files being transcoded are staged by the add threads, one chunk of sectors at a time, and written in order
+struct mpq_transcode_file {
+    off_t offset;
+    uint32_t size;
+    uint32_t flags;
+    uint32_t encryption_key;
+    
+    // Offsets of the sectors relative to the file, plus the end of the last sector
+    uint32_t* sector_table;
+    
+    uint32_t first_chunk;
+    uint32_t chunk_count;
+};
+typedef struct mpq_transcode_file mpq_transcode_file_t;
+
+struct mpq_transcode_context {
+    int source_fd;
+    uint32_t compressor;
+    int32_t compression_quality;
+    mpq_transcode_file_t* files;
+    uint32_t file_count;
+};
+typedef struct mpq_transcode_context mpq_transcode_context_t;
+
+static int _MPQCompareCompactFiles(const void* lhs, const void* rhs) {
+    const mpq_compact_file_t* left = (const mpq_compact_file_t*)lhs;
+    const mpq_compact_file_t* right = (const mpq_compact_file_t*)rhs;
+    if (left->offset != right->offset)
+        return (left->offset < right->offset) ? -1 : 1;
+    return (left->block_index < right->block_index) ? -1 : (left->block_index > right->block_index) ? 1 : 0;
+}
+
+// Decodes the sectors of a chunk of a file being transcoded and compresses them with the target compressor. Sectors
+// which are stored uncompressed, already use the target compressor alone or hold lossy ADPCM data are passed through.
+// The staged sectors are not encrypted, the writer encrypts them with the key for the new offset of the file.
+static void _MPQStageTranscodeChunk(mpq_add_context_t* context, mpq_add_chunk_t* chunk, mpq_add_buffers_t* buffers) {
+    mpq_transcode_context_t* transcode = context->transcode;
+    mpq_transcode_file_t* file = transcode->files + chunk->file_index;
+    NSAutoreleasePool* p = [NSAutoreleasePool new];
+    NSError* local_error = nil;
+    
+    // Read the archived sectors of the chunk at once. They are never larger than the data they decode to.
+    uint32_t run_offset = file->sector_table[chunk->first_sector];
+    uint32_t run_size = file->sector_table[chunk->first_sector + chunk->sector_count] - run_offset;
+    uint8_t* run = malloc((run_size) ? run_size : 1);
+    chunk->data = malloc((chunk->data_size) ? chunk->data_size : 1);
+    chunk->sector_sizes = malloc(chunk->sector_count * sizeof(uint32_t));
+    if (!run || !chunk->data || !chunk->sector_sizes) {
+        local_error = [MPQError errorWithDomain:MPQErrorDomain code:errOutOfMemory userInfo:nil];
+        goto StageDone;
+    }
+    if (!_MPQPreadFully(transcode->source_fd, run, run_size, file->offset + run_offset, &local_error))
+        goto StageDone;
+    
+    uint32_t remaining_data_size = chunk->data_size;
+    uint32_t sector_index = 0;
+    for (; sector_index < chunk->sector_count; sector_index++) {
+        uint32_t current_sector = chunk->first_sector + sector_index;
+        uint32_t current_sector_size = (file->flags & MPQFileOneSector) ? remaining_data_size : MIN(remaining_data_size, context->full_sector_size);
+        uint32_t archived_sector_size = file->sector_table[current_sector + 1] - file->sector_table[current_sector];
+        uint8_t* sector = run + (file->sector_table[current_sector] - run_offset);
+        if (!_MPQReserveAddBuffers(buffers, current_sector_size)) {
+            local_error = [MPQError errorWithDomain:MPQErrorDomain code:errOutOfMemory userInfo:nil];
+            goto StageDone;
+        }
+        
+        if ((file->flags & MPQFileEncrypted))
+            mpq_decrypt(sector, archived_sector_size, file->encryption_key + current_sector, NO);
+        
+        // Compressed sectors start with the mask of the compressors that were applied
+        const void* staged_sector = sector;
+        uint32_t staged_size = archived_sector_size;
+        if (archived_sector_size < current_sector_size && sector[0] != transcode->compressor && !(sector[0] & (MPQMonoADPCMCompression | MPQStereoADPCMCompression))) {
+            if (mpq_core_decode_sector(buffers->read_buffer, current_sector_size, sector, archived_sector_size, file->flags & ~MPQFileEncrypted, 0) == -1) {
+                local_error = [MPQError errorWithDomain:MPQErrorDomain code:errDecompressionFailed userInfo:@{MPQErrorSectorIndex: [NSNumber numberWithUnsignedInt:current_sector]}];
+                goto StageDone;
+            }
+            
+            uint32_t compressed_size = (buffers->buffer_size - 1 > UINT32_MAX) ? UINT32_MAX : (uint32_t)(buffers->buffer_size - 1);
+            int compression_error = SCompCompress(buffers->compression_buffer, 
+                                                  &compressed_size, 
+                                                  buffers->read_buffer, 
+                                                  current_sector_size, 
+                                                  transcode->compressor, 
+                                                  0, 
+                                                  transcode->compression_quality);
+            
+            // Like for new files, the sector is stored uncompressed if the compression failed or didn't save any bytes
+            if (!compression_error || (compressed_size >= (current_sector_size - 1))) {
+                staged_sector = buffers->read_buffer;
+                staged_size = current_sector_size;
+            } else {
+                staged_sector = buffers->compression_buffer;
+                staged_size = compressed_size;
+            }
+        }
+        
+        memcpy(chunk->data + chunk->staged_size, staged_sector, staged_size);
+        chunk->sector_sizes[sector_index] = staged_size;
+        chunk->staged_size += staged_size;
+        remaining_data_size -= current_sector_size;
+    }
+    
+StageDone:
+    free(run);
+    chunk->error = [local_error retain];
+    [p drain];
+}
+
+// Stops the transcoding threads if they were started and frees the transcoding state
+static void _MPQFinishTranscode(mpq_add_context_t* context, mpq_add_threads_t* threads, BOOL started) {
+    if (started)
+        _MPQStopAddThreads(context, threads);
+    
+    uint32_t chunk_index = 0;
+    for (; chunk_index < context->chunk_count; chunk_index++) {
+        free(context->chunks[chunk_index].data);
+        free(context->chunks[chunk_index].sector_sizes);
+        [context->chunks[chunk_index].error release];
+    }
+    free(context->chunks);
+    context->chunks = NULL;
+    context->chunk_count = 0;
+    
+    mpq_transcode_context_t* transcode = context->transcode;
+    uint32_t file_index = 0;
+    for (; file_index < transcode->file_count; file_index++)
+        free(transcode->files[file_index].sector_table);
+    free(transcode->files);
+    transcode->files = NULL;
+    transcode->file_count = 0;
+}
+
+// Picks the compressed files to transcode among files, which must be in the order they will be written, reads their
+// sector tables and splits them in chunks. Encrypted files whose key is unknown are copied verbatim.
+- (BOOL)_prepareTranscode:(mpq_add_context_t*)context files:(mpq_compact_file_t*)files count:(uint32_t)file_count error:(NSError**)error {
+    mpq_transcode_context_t* transcode = context->transcode;
+    transcode->files = calloc((file_count) ? file_count : 1, sizeof(mpq_transcode_file_t));
+    if (!transcode->files)
+        ReturnValueWithError(NO, MPQErrorDomain, errOutOfMemory, nil, error)
+    
+    uint32_t sectors_per_chunk = MAX(ADD_CHUNK_SIZE / full_sector_size, 1U);
+    uint64_t total_chunk_count = 0;
+    uint32_t file_index = 0;
+    for (; file_index < file_count; file_index++) {
+        mpq_compact_file_t* file = files + file_index;
+        const mpq_block_table_entry_t* block_entry = block_table + file->block_index;
+        file->transcode_index = 0xffffffff;
+        
+        // Files compressed the Diablo way have no compression mask and always use PKWARE
+        if (!(block_entry->flags & MPQFileCompressed) || (block_entry->flags & MPQFileDiabloCompressed) || block_entry->size == 0)
+            continue;
+        
+        uint32_t encryption_key = 0;
+        if ((block_entry->flags & MPQFileEncrypted)) {
+            encryption_key = [self getFileEncryptionKey:file->hash_position];
+            if (encryption_key == 0)
+                continue;
+        }
+        
+        mpq_transcode_file_t* transcode_file = transcode->files + transcode->file_count;
+        transcode_file->offset = archive_offset + file->offset;
+        transcode_file->size = block_entry->size;
+        transcode_file->flags = block_entry->flags;
+        transcode_file->encryption_key = encryption_key;
+        
+        uint32_t sector_count = 1;
+        if ((block_entry->flags & MPQFileOneSector)) {
+            if (block_entry->archived_size > block_entry->size)
+                ReturnValueWithError(NO, MPQErrorDomain, errInvalidSectorTable, nil, error)
+            transcode_file->sector_table = malloc(2 * sizeof(uint32_t));
+            if (!transcode_file->sector_table)
+                ReturnValueWithError(NO, MPQErrorDomain, errOutOfMemory, nil, error)
+            transcode_file->sector_table[0] = 0;
+            transcode_file->sector_table[1] = block_entry->archived_size;
+        } else {
+            sector_count = (block_entry->size + full_sector_size - 1) / full_sector_size;
+            transcode_file->sector_table = malloc(_MPQComputeSectorTableLength(full_sector_size, block_entry->size, block_entry->flags) * sizeof(uint32_t));
+            if (!transcode_file->sector_table)
+                ReturnValueWithError(NO, MPQErrorDomain, errOutOfMemory, nil, error)
+            
+            mpq_core_error_t core_error;
+            if (mpq_core_read_sector_table(archive_fd, transcode_file->offset, block_entry, full_sector_size, encryption_key, transcode_file->sector_table, &core_error) == -1 || 
+                mpq_core_check_sector_table(transcode_file->sector_table, block_entry, full_sector_size, &core_error) == -1) {
+                free(transcode_file->sector_table);
+                transcode_file->sector_table = NULL;
+                if (error)
+                    *error = _MPQErrorWithCoreError(&core_error, nil);
+                return NO;
+            }
+        }
+        
+        transcode_file->first_chunk = (uint32_t)total_chunk_count;
+        transcode_file->chunk_count = (sector_count + sectors_per_chunk - 1) / sectors_per_chunk;
+        total_chunk_count += transcode_file->chunk_count;
+        
+        file->transcode_index = transcode->file_count;
+        transcode->file_count++;
+    }
+    
+    context->chunks = (total_chunk_count < UINT32_MAX) ? calloc(MAX(total_chunk_count, 1ULL), sizeof(mpq_add_chunk_t)) : NULL;
+    if (!context->chunks)
+        ReturnValueWithError(NO, MPQErrorDomain, errOutOfMemory, nil, error)
+    context->chunk_count = (uint32_t)total_chunk_count;
+    
+    for (file_index = 0; file_index < transcode->file_count; file_index++) {
+        mpq_transcode_file_t* transcode_file = transcode->files + file_index;
+        uint32_t sector_count = (transcode_file->flags & MPQFileOneSector) ? 1 : (transcode_file->size + full_sector_size - 1) / full_sector_size;
+        uint32_t chunk_index = 0;
+        for (; chunk_index < transcode_file->chunk_count; chunk_index++) {
+            mpq_add_chunk_t* chunk = context->chunks + transcode_file->first_chunk + chunk_index;
+            chunk->file_index = file_index;
+            chunk->first_sector = chunk_index * sectors_per_chunk;
+            chunk->sector_count = MIN(sectors_per_chunk, sector_count - chunk->first_sector);
+            chunk->data_offset = (transcode_file->flags & MPQFileOneSector) ? 0 : (off_t)chunk->first_sector * full_sector_size;
+            if ((transcode_file->flags & MPQFileOneSector))
+                chunk->data_size = transcode_file->size;
+            else
+                chunk->data_size = (uint32_t)MIN((uint64_t)chunk->sector_count * full_sector_size, transcode_file->size - (uint64_t)chunk->data_offset);
+        }
+    }
+    
+    return YES;
+}
+
+// Writes a file being transcoded at offset in fd as its chunks are staged, preceded by a new sector table, and returns
+// its new archived size in archived_size. Sector adlers are not carried over.
+- (BOOL)_writeTranscodedFile:(mpq_transcode_file_t*)file context:(mpq_add_context_t*)context fd:(int)fd offset:(off_t)offset key:(uint32_t)encryption_key archivedSize:(uint32_t*)archived_size error:(NSError**)error {
+    uint32_t flags = file->flags & ~MPQFileHasSectorAdlers;
+    BOOL needs_sector_table = ((flags & MPQFileOneSector)) ? NO : YES;
+    uint32_t sector_table_length = (needs_sector_table) ? _MPQComputeSectorTableLength(full_sector_size, file->size, flags) : 0;
+    // Explicit cast is OK here, sector table sizes are 32-bit
+    uint32_t sector_table_size = sector_table_length * (uint32_t)sizeof(uint32_t);
+    
+    uint32_t* sector_table = NULL;
+    if (needs_sector_table) {
+        sector_table = malloc(sector_table_size);
+        if (!sector_table)
+            ReturnValueWithError(NO, MPQErrorDomain, errOutOfMemory, nil, error)
+        sector_table[0] = sector_table_size;
+    }
+    
+    uint32_t file_compressed_size = sector_table_size;
+    uint32_t current_sector = 0;
+    uint32_t chunk_index = file->first_chunk;
+    for (; chunk_index < file->first_chunk + file->chunk_count; chunk_index++) {
+        mpq_add_chunk_t* chunk = context->chunks + chunk_index;
+        
+        pthread_mutex_lock(&context->lock);
+        while (!chunk->done)
+            pthread_cond_wait(&context->chunk_staged, &context->lock);
+        pthread_mutex_unlock(&context->lock);
+        
+        if (chunk->error) {
+            free(sector_table);
+            if (error)
+                *error = [[chunk->error retain] autorelease];
+            return NO;
+        }
+        
+        uint32_t sector_index = 0;
+        uint32_t sector_offset = 0;
+        if ((flags & MPQFileEncrypted)) {
+            for (; sector_index < chunk->sector_count; sector_index++) {
+                mpq_encrypt((char*)chunk->data + sector_offset, chunk->sector_sizes[sector_index], encryption_key + current_sector + sector_index, NO);
+                sector_offset += chunk->sector_sizes[sector_index];
+            }
+        }
+        
+        if (!_MPQPwriteFully(fd, chunk->data, chunk->staged_size, offset + file_compressed_size, error)) {
+            free(sector_table);
+            return NO;
+        }
+        
+        for (sector_index = 0; sector_index < chunk->sector_count; sector_index++) {
+            file_compressed_size += chunk->sector_sizes[sector_index];
+            current_sector++;
+            if (needs_sector_table)
+                sector_table[current_sector] = file_compressed_size;
+        }
+        
+        // Let the staging threads stage another chunk
+        free(chunk->data);
+        chunk->data = NULL;
+        free(chunk->sector_sizes);
+        chunk->sector_sizes = NULL;
+        
+        pthread_mutex_lock(&context->lock);
+        context->written_chunks++;
+        pthread_cond_broadcast(&context->chunk_written);
+        pthread_mutex_unlock(&context->lock);
+    }
+    
+    if (needs_sector_table) {
+        if ((flags & MPQFileEncrypted))
+            mpq_encrypt((char*)sector_table, sector_table_size, encryption_key - 1, YES);
+        else
+            [[self class] swap_uint32_array:sector_table length:sector_table_length];
+        
+        if (!_MPQPwriteFully(fd, sector_table, sector_table_size, offset, error)) {
+            free(sector_table);
+            return NO;
+        }
+    }
+    
+    free(sector_table);
+    *archived_size = file_compressed_size;
+    return YES;
+}
+
+- (BOOL)compact:(NSError**)error {
+    return [self compactToPath:archive_path error:error];
+}
+
+- (BOOL)compactToPath:(NSString*)path error:(NSError**)error {
+    return [self _rewriteToPath:path compressor:0 quality:0 error:error];
+}
+
+- (BOOL)transcodeToPath:(NSString*)path compressor:(MPQCompressorFlag)compressor quality:(int32_t)quality error:(NSError**)error {
+    NSParameterAssert(path != nil);
+    
+    // Same compressors as setDefaultCompressor:, ADPCM is only suitable for audio data
+    if (compressor == 0 || (compressor & ~MPQCompressorMask) || (compressor & (MPQMonoADPCMCompression | MPQStereoADPCMCompression)))
+        ReturnValueWithError(NO, MPQErrorDomain, errInvalidCompressor, nil, error)
+    
+    // Silently make sure the compression quality is valid for the compressor, like addFileWithPath:filename:parameters:error:
+    if (compressor == MPQZLIBCompression && (quality < -1 || quality > 9))
+        quality = Z_DEFAULT_COMPRESSION;
+    else if (compressor == MPQBZIP2Compression && (quality < 1 || quality > 9))
+        quality = 9;
+    
+    return [self _rewriteToPath:path compressor:compressor quality:quality error:error];
+}
+
+// Writes the valid files of the archive back to back in a new archive file. If compressor is not 0, compressed files
+// are transcoded to it on the way.
+- (BOOL)_rewriteToPath:(NSString*)path compressor:(uint32_t)compressor quality:(int32_t)quality error:(NSError**)error {
+    NSParameterAssert(path != nil);
+    if (compressor)
+        MPQDebugLog(@"transcoding archive to %@ with compressor %u", path, compressor);
+    else
+        MPQDebugLog(@"compacting archive to %@", path);
+    
+    if (archive_fd == -1)
+        ReturnValueWithError(NO, MPQErrorDomain, errNoArchiveFile, nil, error)
+    if (is_modified)
+        ReturnValueWithError(NO, MPQErrorDomain, errArchiveModified, nil, error)
+    if (open_file_count > 0)
+        ReturnValueWithError(NO, MPQErrorDomain, errFileIsOpen, nil, error)
+    if (is_read_only && [archive_path isEqualToString:path])
+        ReturnValueWithError(NO, MPQErrorDomain, errReadOnlyArchive, nil, error)
+    
+    // Manage an autorelease pool to kill all temporary objects after this is done
+    NSAutoreleasePool* p = [NSAutoreleasePool new];
+    
+    // Backup instance state in case of failure. The tables are swapped with working copies.
+    mpq_header_t header_backup = header;
+    mpq_extended_header_t extended_header_backup = extended_header;
+    off_t archive_write_offset_backup = archive_write_offset;
+    off_t archive_size_backup = archive_size;
+    off_t hash_table_offset_backup = hash_table_offset;
+    off_t block_table_offset_backup = block_table_offset;
+    mpq_hash_table_entry_t* hash_table_backup = hash_table;
+    mpq_block_table_entry_t* block_table_backup = block_table;
+    off_t* block_offset_table_backup = block_offset_table;
+    void* attributes_data_backup = attributes_data;
+    mpq_hash_table_entry_t* weak_signature_hash_entry_backup = weak_signature_hash_entry;
+    uint8_t* strong_signature_backup = strong_signature;
+    BOOL is_read_only_backup = is_read_only;
+    int archive_fd_backup = archive_fd;
+    
+    NSString* temp_path = nil;
+    int temp_fd = -1;
+    size_t copy_buffer_size = MAX((size_t)RAW_COPY_BUFFER_SIZE, (size_t)full_sector_size);
+    void* copy_buffer = NULL;
+    mpq_compact_file_t* files = NULL;
+    uint32_t file_count = 0;
+    uint32_t dropped_positions[2] = {0xffffffff, 0xffffffff};
+    uint32_t dropped_index = 0;
+    uint32_t attributes_position = 0xffffffff;
+    uint32_t file_index = 0;
+    
+    // Compressed files are transcoded by the add threads while the other files are copied
+    mpq_transcode_context_t transcode;
+    transcode.source_fd = archive_fd;
+    transcode.compressor = compressor;
+    transcode.compression_quality = quality;
+    transcode.files = NULL;
+    transcode.file_count = 0;
+    mpq_add_context_t transcode_context;
+    memset(&transcode_context, 0, sizeof(mpq_add_context_t));
+    transcode_context.full_sector_size = full_sector_size;
+    transcode_context.stage_chunk = _MPQStageTranscodeChunk;
+    transcode_context.transcode = &transcode;
+    mpq_add_threads_t transcode_threads;
+    BOOL transcoding = NO;
+    
+    hash_table = NULL;
+    block_table = NULL;
+    block_offset_table = NULL;
+    attributes_data = NULL;
+    
+    // The signatures will not match the new archive
+    weak_signature_hash_entry = NULL;
+    strong_signature = NULL;
+    
+    // The (attributes) file is added to the new archive as if it was saved
+    is_read_only = NO;
+    
+    temp_fd = _MPQMakeTempFileInDirectory(path.stringByDeletingLastPathComponent, &temp_path, error);
+    if (temp_fd == -1)
+        goto CompactFailed;
+    _MPQApplyCachePolicy(temp_fd, cache_policy);
+    
+    // Working copies of the tables
+    size_t hash_table_size = header.hash_table_length * sizeof(mpq_hash_table_entry_t);
+    uint32_t block_table_length = header.block_table_length;
+    hash_table = malloc(hash_table_size);
+    block_table = malloc(((block_table_length) ? block_table_length : 1) * sizeof(mpq_block_table_entry_t));
+    block_offset_table = malloc(((block_table_length) ? block_table_length : 1) * sizeof(off_t));
+    if (attributes_data_backup)
+        attributes_data = malloc((attributes_data_size) ? attributes_data_size : 1);
+    copy_buffer = malloc(copy_buffer_size);
+    if (!hash_table || !block_table || !block_offset_table || (attributes_data_backup && !attributes_data) || !copy_buffer) {
+        if (error)
+            *error = [MPQError errorWithDomain:MPQErrorDomain code:errOutOfMemory userInfo:nil];
+        goto CompactFailed;
+    }
+    
+    memcpy(hash_table, hash_table_backup, hash_table_size);
+    memcpy(block_table, block_table_backup, block_table_length * sizeof(mpq_block_table_entry_t));
+    memcpy(block_offset_table, block_offset_table_backup, block_table_length * sizeof(off_t));
+    if (attributes_data)
+        memcpy(attributes_data, attributes_data_backup, attributes_data_size);
+    
+    // Drop the (attributes) file, which will be rebuilt, and the weak signature
+    dropped_positions[0] = [self findHashPosition:[kAttributesFilename UTF8String] locale:MPQNeutral error:NULL];
+    if (weak_signature_hash_entry_backup)
+        dropped_positions[1] = (uint32_t)(weak_signature_hash_entry_backup - hash_table_backup);
+    for (; dropped_index < 2; dropped_index++) {
+        if (dropped_positions[dropped_index] == 0xffffffff)
+            continue;
+        mpq_hash_table_entry_t* hash_entry = hash_table + dropped_positions[dropped_index];
+        if (hash_entry->block_table_index < block_table_length)
+            block_table[hash_entry->block_table_index].flags = 0;
+        memset(hash_entry, 0xff, sizeof(mpq_hash_table_entry_t));
+        hash_entry->block_table_index = HASH_TABLE_DELETED;
+    }
+    
+    // Only keep the block table entries of valid files. The hash table is remapped by _compactBlockTable.
+    uint32_t* block_hash_positions = malloc(((block_table_length) ? block_table_length : 1) * sizeof(uint32_t));
+    if (!block_hash_positions) {
+        if (error)
+            *error = [MPQError errorWithDomain:MPQErrorDomain code:errOutOfMemory userInfo:nil];
+        goto CompactFailed;
+    }
+    memset(block_hash_positions, 0xff, ((block_table_length) ? block_table_length : 1) * sizeof(uint32_t));
+    
+    uint32_t hash_position = 0;
+    for (; hash_position < header.hash_table_length; hash_position++) {
+        uint32_t block_index = hash_table[hash_position].block_table_index;
+        if (block_index < block_table_length && (block_table[block_index].flags & MPQFileValid) && block_hash_positions[block_index] == 0xffffffff)
+            block_hash_positions[block_index] = hash_position;
+    }
+    
+    uint32_t block_index = 0;
+    for (; block_index < block_table_length; block_index++) {
+        if (block_hash_positions[block_index] == 0xffffffff)
+            memset(block_table + block_index, 0, sizeof(mpq_block_table_entry_t));
+        else
+            file_count++;
+    }
+    
+    // Gather the files to copy, in the order of their data
+    files = malloc(((file_count) ? file_count : 1) * sizeof(mpq_compact_file_t));
+    if (!files) {
+        free(block_hash_positions);
+        if (error)
+            *error = [MPQError errorWithDomain:MPQErrorDomain code:errOutOfMemory userInfo:nil];
+        goto CompactFailed;
+    }
+    
+    uint32_t used_block_table_length = 0;
+    for (block_index = 0; block_index < block_table_length; block_index++) {
+        if (block_hash_positions[block_index] == 0xffffffff)
+            continue;
+        files[used_block_table_length].offset = block_offset_table[block_index];
+        files[used_block_table_length].block_index = used_block_table_length;
+        files[used_block_table_length].hash_position = block_hash_positions[block_index];
+        files[used_block_table_length].encryption_key = 0;
+        files[used_block_table_length].rekeyed = NO;
+        files[used_block_table_length].transcode_index = 0xffffffff;
+        used_block_table_length++;
+    }
+    free(block_hash_positions);
+    
+    if (![self _compactBlockTable:&used_block_table_length error:error])
+        goto CompactFailed;
+    qsort(files, file_count, sizeof(mpq_compact_file_t), _MPQCompareCompactFiles);
+    
+    if (compressor) {
+        if (![self _prepareTranscode:&transcode_context files:files count:file_count error:error])
+            goto CompactFailed;
+        _MPQInitAddContext(&transcode_context, &transcode_threads);
+        transcoding = YES;
+        if (!_MPQStartAddThreads(&transcode_context, &transcode_threads, error))
+            goto CompactFailed;
+    }
+    
+    // Preserve whatever precedes the archive in its file
+    if (!_MPQCopyRange(archive_fd, 0, temp_fd, 0, archive_offset, copy_buffer, copy_buffer_size, error))
+        goto CompactFailed;
+    
+    // Copy the files back to back after the header, leaving room for the version 1 header like new archives do.
+    // Files which are adjacent in the archive and don't need a new key are copied in a single run.
+    off_t write_offset = sizeof(mpq_header_t) + sizeof(mpq_extended_header_t);
+    off_t run_source_offset = 0;
+    off_t run_destination_offset = write_offset;
+    off_t run_size = 0;
+    off_t max_file_offset = 0;
+    for (file_index = 0; file_index < file_count; file_index++) {
+        mpq_compact_file_t* file = files + file_index;
+        mpq_block_table_entry_t* block_entry = block_table + file->block_index;
+        mpq_transcode_file_t* transcode_file = (file->transcode_index != 0xffffffff) ? transcode.files + file->transcode_index : NULL;
+        uint32_t source_key = 0;
+        
+        // Offset adjusted keys must be changed if the low 32 bits of the offset change
+        if ((block_entry->flags & MPQFileEncrypted) && (block_entry->flags & MPQFileOffsetAdjustedKey) && (uint32_t)file->offset != (uint32_t)write_offset) {
+            source_key = (transcode_file) ? transcode_file->encryption_key : [self getFileEncryptionKey:file->hash_position];
+            if (source_key == 0) {
+                if (error)
+                    *error = [MPQError errorWithDomain:MPQErrorDomain code:errFilenameRequired userInfo:nil];
+                goto CompactFailed;
+            }
+            
+            uint32_t base_key = (source_key ^ block_entry->size) - (uint32_t)file->offset;
+            file->encryption_key = (base_key + (uint32_t)write_offset) ^ block_entry->size;
+            file->rekeyed = YES;
+        }
+        
+        // Flush the current run if this file can't be a part of it
+        if (run_size > 0 && (file->rekeyed || transcode_file || file->offset != run_source_offset + run_size)) {
+            if (!_MPQCopyRange(archive_fd, archive_offset + run_source_offset, temp_fd, archive_offset + run_destination_offset, run_size, copy_buffer, copy_buffer_size, error))
+                goto CompactFailed;
+            run_size = 0;
+        }
+        
+        if (transcode_file) {
+            uint32_t archived_size = 0;
+            uint32_t destination_key = (file->rekeyed) ? file->encryption_key : transcode_file->encryption_key;
+            if (![self _writeTranscodedFile:transcode_file context:&transcode_context fd:temp_fd offset:archive_offset + write_offset key:destination_key archivedSize:&archived_size error:error])
+                goto CompactFailed;
+            block_entry->archived_size = archived_size;
+            block_entry->flags &= ~MPQFileHasSectorAdlers;
+        } else if (file->rekeyed) {
+            if (!_MPQCopyRekeyedFile(archive_fd, archive_offset + file->offset, temp_fd, archive_offset + write_offset, block_entry, full_sector_size, source_key, file->encryption_key, copy_buffer, copy_buffer_size, error))
+                goto CompactFailed;
+            block_entry->flags &= ~MPQFileHasSectorAdlers;
+        } else {
+            if (run_size == 0) {
+                run_source_offset = file->offset;
+                run_destination_offset = write_offset;
+            }
+            run_size += block_entry->archived_size;
+        }
+        
+        block_offset_table[file->block_index] = write_offset;
+        if (write_offset > max_file_offset)
+            max_file_offset = write_offset;
+        write_offset += block_entry->archived_size;
+    }
+    
+    if (run_size > 0) {
+        if (!_MPQCopyRange(archive_fd, archive_offset + run_source_offset, temp_fd, archive_offset + run_destination_offset, run_size, copy_buffer, copy_buffer_size, error))
+            goto CompactFailed;
+    }
+    
+    // All the transcoded files have been written
+    if (transcoding) {
+        _MPQFinishTranscode(&transcode_context, &transcode_threads, YES);
+        transcoding = NO;
+    }
+    
+    // The archive file ends right after the last file for now
+    if (ftruncate(temp_fd, archive_offset + write_offset) == -1) {
+        if (error)
+            *error = [MPQError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
+        goto CompactFailed;
+    }
+    
+    // Switch to the new archive file
+    archive_fd = temp_fd;
+    archive_write_offset = write_offset;
+    archive_size = write_offset;
+    extended_header.extended_block_offset_table_offset = (header.version == 1 && max_file_offset > UINT32_MAX) ? 1 : 0;
+    
+    // Rebuild the (attributes) file, see writeToFile:atomically:error:
+    if (attributes_data) {
+        NSData* attributes_data_object = [self _attributesDataForBlockTableLength:used_block_table_length + 1 error:error];
+        if (!attributes_data_object)
+            goto CompactFailed;
+        
+        NSDictionary* params = @{MPQFileLocale: [NSNumber numberWithUnsignedShort:MPQNeutral],
+                                MPQFileFlags: [NSNumber numberWithUnsignedInt:MPQFileCompressed],
+                                MPQOverwrite: @YES};
+        if (![self addFileWithData:attributes_data_object filename:kAttributesFilename parameters:params error:error])
+            goto CompactFailed;
+        attributes_position = [self findHashPosition:[kAttributesFilename UTF8String] locale:MPQNeutral error:NULL];
+        if (![self _processOperations:error])
+            goto CompactFailed;
+    }
+    
+    // Write the structural tables, with the block table cut after its last non-empty entry
+    uint32_t allocated_block_table_length = header.block_table_length;
+    while (header.block_table_length > 0 && _MPQBlockEntryIsEmpty(block_table + header.block_table_length - 1))
+        header.block_table_length--;
+    
+    off_t new_archive_size = archive_write_offset + [self _computeSizeOfStructuralTables];
+    if (![self _truncateArchiveWithDelta:(new_archive_size - archive_size) error:error])
+        goto CompactFailed;
+    if (![self _writeStructuralTables:error] || ![self _writeArchiveHeader:error])
+        goto CompactFailed;
+    header.block_table_length = allocated_block_table_length;
+    
+    // Put the new archive in place
+    if (rename(temp_path.fileSystemRepresentation, path.fileSystemRepresentation) == -1) {
+        if (error)
+            *error = [MPQError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
+        goto CompactFailed;
+    }
+    
+    // We're not going to fail anymore
+    close(archive_fd_backup);
+    free(hash_table_backup);
+    free(block_table_backup);
+    free(block_offset_table_backup);
+    if (attributes_data_backup)
+        free(attributes_data_backup);
+    if (strong_signature_backup)
+        free(strong_signature_backup);
+    
+    // Files that moved have a new offset adjusted key
+    for (file_index = 0; file_index < file_count; file_index++) {
+        mpq_compact_file_t* file = files + file_index;
+        if (file->rekeyed)
+            mpq_slot_table_set_uint32(&encryption_keys_cache, file->hash_position, file->encryption_key);
+        else if ((block_table[file->block_index].flags & MPQFileOffsetAdjustedKey) && !(block_table[file->block_index].flags & MPQFileEncrypted))
+            mpq_slot_table_set_uint32(&encryption_keys_cache, file->hash_position, 0);
+        
+        // Transcoded files have a new sector table
+        if (file->transcode_index != 0xffffffff)
+            _MPQFreeSlotPointer(&sector_tables_cache, file->hash_position);
+    }
+    free(files);
+    free(copy_buffer);
+    
+    // Forget about the files that were dropped, unless (attributes) was added back in the same slot
+    for (dropped_index = 0; dropped_index < 2; dropped_index++) {
+        uint32_t dropped_position = dropped_positions[dropped_index];
+        if (dropped_position == 0xffffffff || hash_table[dropped_position].block_table_index != HASH_TABLE_DELETED)
+            continue;
+        mpq_slot_table_set_uint32(&filename_table, dropped_position, 0);
+        mpq_slot_table_set_uint32(&encryption_keys_cache, dropped_position, 0);
+        _MPQFreeSlotPointer(&sector_tables_cache, dropped_position);
+    }
+    
+    [self _flushDOS];
+    [self _flushFileInfoCache];
+    [self _invalidateBlockFreeMap];
+    _fileCountCachesDirty = YES;
+    
+    [archive_path release];
+    archive_path = [path copy];
+    is_read_only = NO;
+    is_modified = NO;
+    [self _refreshIndexCache];
+    
+    [p release];
+    return YES;
+    
+CompactFailed:
+    // Files and chunks are freed even if the threads were never started
+    if (transcoding || transcode.files)
+        _MPQFinishTranscode(&transcode_context, &transcode_threads, transcoding);
+    
+    if (temp_fd != -1) {
+        close(temp_fd);
+        unlink(temp_path.fileSystemRepresentation);
+    }
+    
+    // Drop the (attributes) addition, if we got that far
+    [self _flushDOS];
+    if (attributes_position != 0xffffffff && attributes_position != dropped_positions[0]) {
+        mpq_slot_table_set_uint32(&filename_table, attributes_position, 0);
+        mpq_slot_table_set_uint32(&encryption_keys_cache, attributes_position, 0);
+        _MPQFreeSlotPointer(&sector_tables_cache, attributes_position);
+    }
+    [self _flushFileInfoCache];
+    [self _invalidateBlockFreeMap];
+    
+    if (hash_table)
+        free(hash_table);
+    if (block_table)
+        free(block_table);
+    if (block_offset_table)
+        free(block_offset_table);
+    if (attributes_data)
+        free(attributes_data);
+    if (files)
+        free(files);
+    if (copy_buffer)
+        free(copy_buffer);
+    
+    header = header_backup;
+    extended_header = extended_header_backup;
+    archive_write_offset = archive_write_offset_backup;
+    archive_size = archive_size_backup;
+    hash_table_offset = hash_table_offset_backup;
+    block_table_offset = block_table_offset_backup;
+    hash_table = hash_table_backup;
+    block_table = block_table_backup;
+    block_offset_table = block_offset_table_backup;
+    attributes_data = attributes_data_backup;
+    weak_signature_hash_entry = weak_signature_hash_entry_backup;
+    strong_signature = strong_signature_backup;
+    is_read_only = is_read_only_backup;
+    archive_fd = archive_fd_backup;
+    is_modified = NO;
+    
+    MPQDebugLog(@"rewriteToPath failed");
+    
+    if (error)
+        [*error retain];
+    [p release];
+    if (error) {
+        if (*error == nil)
+            *error = [MPQError errorWithDomain:MPQErrorDomain code:errUnknown userInfo:NULL];
+        else
+            [*error autorelease];
+    }
+    
+    return NO;
+}
+
+
+#pragma mark hash table
+
+- (BOOL)resizeHashTable:(uint32_t)length error:(NSError**)error {
+    uint32_t max_length = (header.version == MPQOriginalVersion) ? MPQ_MAX_HASH_TABLE_LENGTH : MPQ_MAX_EXTENDED_HASH_TABLE_LENGTH;
+    if (length > max_length)
+        ReturnValueWithError(NO, MPQErrorDomain, errOutOfBounds, nil, error)
+    if (open_file_count > 0)
+        ReturnValueWithError(NO, MPQErrorDomain, errFileIsOpen, nil, error)
+    
+    // The number of entries in a hash table must be a power of 2
+    uint32_t new_length = MPQ_MIN_HASH_TABLE_LENGTH;
+    while (new_length < length)
+        new_length <<= 1;
+    uint32_t new_mask = new_length - 1;
+    
+    // Every file is placed again from the hash of its name, so all the names must be known
+    uint32_t live_count = 0;
+    NSMutableArray* unknown_positions = nil;
+    uint32_t hash_position = 0;
+    for (; hash_position < header.hash_table_length; hash_position++) {
+        uint32_t block_table_index = hash_table[hash_position].block_table_index;
+        if (block_table_index == HASH_TABLE_EMPTY || block_table_index == HASH_TABLE_DELETED)
+            continue;
+        live_count++;
+        if (!_MPQGetFilename(&filename_table, &filename_arena, hash_position)) {
+            if (!unknown_positions)
+                unknown_positions = [NSMutableArray array];
+            [unknown_positions addObject:[NSNumber numberWithUnsignedInt:hash_position]];
+        }
+    }
+    
+    if (unknown_positions)
+        ReturnValueWithError(NO, MPQErrorDomain, errUnknownFilenames, @{MPQErrorHashPositions: unknown_positions}, error)
+    
+    // Lookups stop at the first empty entry, so there must be at least one
+    if (live_count >= new_length)
+        ReturnValueWithError(NO, MPQErrorDomain, errHashTableFull, nil, error)
+    
+    mpq_hash_table_entry_t* new_hash_table = malloc(new_length * sizeof(mpq_hash_table_entry_t));
+    uint32_t* position_map = malloc(header.hash_table_length * sizeof(uint32_t));
+    if (!new_hash_table || !position_map) {
+        free(new_hash_table);
+        free(position_map);
+        ReturnValueWithError(NO, MPQErrorDomain, errOutOfMemory, nil, error)
+    }
+    memset(new_hash_table, 0xff, new_length * sizeof(mpq_hash_table_entry_t));
+    
+    mpq_slot_table_t new_filename_table;
+    mpq_slot_table_t new_operation_hash_table;
+    mpq_slot_table_t new_encryption_keys_cache;
+    mpq_slot_table_t new_sector_tables_cache;
+    mpq_slot_table_init(&new_filename_table, new_length, sizeof(uint32_t));
+    mpq_slot_table_init(&new_operation_hash_table, new_length, sizeof(mpq_deferred_operation_t*));
+    mpq_slot_table_init(&new_encryption_keys_cache, new_length, sizeof(uint32_t));
+    mpq_slot_table_init(&new_sector_tables_cache, new_length, sizeof(uint32_t*));
+    
+    // Place every file in the new table, along with the state kept for its position
+    for (hash_position = 0; hash_position < header.hash_table_length; hash_position++) {
+        position_map[hash_position] = 0xffffffff;
+        uint32_t block_table_index = hash_table[hash_position].block_table_index;
+        if (block_table_index == HASH_TABLE_EMPTY || block_table_index == HASH_TABLE_DELETED)
+            continue;
+        
+        const char* filename = _MPQGetFilename(&filename_table, &filename_arena, hash_position);
+        uint32_t new_position = mpq_hash_cstring(filename, HASH_POSITION) & new_mask;
+        while (new_hash_table[new_position].block_table_index != HASH_TABLE_EMPTY)
+            new_position = (new_position + 1) & new_mask;
+        
+        new_hash_table[new_position] = hash_table[hash_position];
+        position_map[hash_position] = new_position;
+        
+        if (mpq_slot_table_set_uint32(&new_filename_table, new_position, mpq_slot_table_get_uint32(&filename_table, hash_position)) == -1 ||
+            mpq_slot_table_set_pointer(&new_operation_hash_table, new_position, mpq_slot_table_get_pointer(&operation_hash_table, hash_position)) == -1 ||
+            mpq_slot_table_set_uint32(&new_encryption_keys_cache, new_position, mpq_slot_table_get_uint32(&encryption_keys_cache, hash_position)) == -1 ||
+            mpq_slot_table_set_pointer(&new_sector_tables_cache, new_position, mpq_slot_table_get_pointer(&sector_tables_cache, hash_position)) == -1)
+        {
+            // The new tables don't own anything yet
+            mpq_slot_table_clear(&new_filename_table);
+            mpq_slot_table_clear(&new_operation_hash_table);
+            mpq_slot_table_clear(&new_encryption_keys_cache);
+            mpq_slot_table_clear(&new_sector_tables_cache);
+            free(new_hash_table);
+            free(position_map);
+            ReturnValueWithError(NO, MPQErrorDomain, errOutOfMemory, nil, error)
+        }
+    }
+    
+    // We're not going to fail anymore. Sector tables of positions which were dropped are not needed anymore.
+    for (hash_position = 0; hash_position < header.hash_table_length; hash_position++) {
+        if (position_map[hash_position] == 0xffffffff)
+            _MPQFreeSlotPointer(&sector_tables_cache, hash_position);
+    }
+    
+    // Operations follow their file. Those of dropped positions (deleted files) are detached, but still remember the
+    // block table entry they replaced.
+    mpq_deferred_operation_t* operation = last_operation;
+    for (; operation; operation = operation->previous) {
+        uint32_t old_position = operation->primary_file_context.hash_position;
+        operation->primary_file_context.hash_position = (old_position < header.hash_table_length) ? position_map[old_position] : DETACHED_OPERATION_POSITION;
+    }
+    
+    if (weak_signature_hash_entry) {
+        uint32_t new_position = position_map[weak_signature_hash_entry - hash_table];
+        weak_signature_hash_entry = (new_position != 0xffffffff) ? new_hash_table + new_position : NULL;
+    }
+    
+    mpq_slot_table_clear(&filename_table);
+    mpq_slot_table_clear(&operation_hash_table);
+    mpq_slot_table_clear(&encryption_keys_cache);
+    mpq_slot_table_clear(&sector_tables_cache);
+    filename_table = new_filename_table;
+    operation_hash_table = new_operation_hash_table;
+    encryption_keys_cache = new_encryption_keys_cache;
+    sector_tables_cache = new_sector_tables_cache;
+    
+    // No file is open and file information is cheap to compute again
+    [self _flushFileInfoCache];
+    mpq_slot_table_clear(&open_file_count_table);
+    mpq_slot_table_init(&open_file_count_table, new_length, sizeof(uint32_t));
+    mpq_slot_table_init(&file_info_cache, new_length, sizeof(NSDictionary*));
+    
+    MPQDebugLog(@"resized the hash table from %u to %u entries, %u files", header.hash_table_length, new_length, live_count);
+    
+    free(hash_table);
+    free(position_map);
+    hash_table = new_hash_table;
+    header.hash_table_length = new_length;
+    
+    // Undoing the pending operations would restore hash table entries at their old positions
+    rehashed_operations_count = deferred_operations_count;
+    
+    _fileCountCachesDirty = YES;
+    is_modified = YES;
+    return YES;
+}
+
+- (double)maximumHashTableLoad {
+    return maximum_hash_table_load;
+}
+
+- (BOOL)setMaximumHashTableLoad:(double)load {
+    if (load < 0.0 || load >= 1.0)
+        return NO;
+    maximum_hash_table_load = load;
+    return YES;
+}
+
+// Grows the hash table when more of it than the maximum load is used. Deleted entries lengthen probe chains as much as
+// files, so they count, and they are dropped by the resize. The table isn't resized if the names of some files are
+// unknown or files are open.
+- (BOOL)_applyHashTableLoadPolicy:(NSError**)error {
+    if (maximum_hash_table_load == 0.0 || open_file_count > 0)
+        return YES;
+    
+    uint32_t used_count = 0;
+    uint32_t live_count = 0;
+    uint32_t hash_position = 0;
+    for (; hash_position < header.hash_table_length; hash_position++) {
+        uint32_t block_table_index = hash_table[hash_position].block_table_index;
+        if (block_table_index == HASH_TABLE_EMPTY)
+            continue;
+        used_count++;
+        if (block_table_index != HASH_TABLE_DELETED)
+            live_count++;
+    }
+    
+    // Saving may add the listfile and the attributes
+    if (used_count + 2 <= maximum_hash_table_load * header.hash_table_length)
+        return YES;
+    
+    // Leave room for as many files again before the next resize, but never shrink
+    uint32_t max_length = (header.version == MPQOriginalVersion) ? MPQ_MAX_HASH_TABLE_LENGTH : MPQ_MAX_EXTENDED_HASH_TABLE_LENGTH;
+    uint32_t new_length = header.hash_table_length;
+    while (new_length < max_length && live_count + 2 > maximum_hash_table_load * 0.5 * new_length)
+        new_length <<= 1;
+    
+    NSError* local_error = nil;
+    if ([self resizeHashTable:new_length error:&local_error])
+        return YES;
+    
+    if ([local_error.domain isEqualToString:MPQErrorDomain] && local_error.code == errUnknownFilenames) {
+        MPQDebugLog(@"not resizing the hash table, %lu files have unknown names", (unsigned long)[local_error.userInfo[MPQErrorHashPositions] count]);
+        return YES;
+    }
+    
+    if (error)
+        *error = local_error;
+    return NO;
+}
+
+#pragma mark merging
+
+- (BOOL)mergeFilesFromArchive:(MPQArchive*)archive policy:(MPQMergePolicy)policy error:(NSError**)error {
+    NSParameterAssert(archive != nil);
+    NSParameterAssert(archive != self);
+    NSParameterAssert(policy <= MPQMergeNewestWins);
+    
+    // The archived data is copied from the file of the other archive, which must be what that archive describes
+    if (archive->archive_fd == -1)
+        ReturnValueWithError(NO, MPQErrorDomain, errNoArchiveFile, nil, error)
+    if (archive->is_modified)
+        ReturnValueWithError(NO, MPQErrorDomain, errArchiveModified, nil, error)
+    
+    // Sectors are copied as they are, so they must have the same size in both archives
+    if (archive->full_sector_size != full_sector_size)
+        ReturnValueWithError(NO, MPQErrorDomain, errSectorSizeMismatch, nil, error)
+    
+    // Files are added under their name, so all the names must be known
+    MPQFileInfo info;
+    NSMutableArray* unknown_positions = nil;
+    uint32_t hash_position = 0;
+    for (; hash_position < archive->header.hash_table_length; hash_position++) {
+        if ([archive _getFileInfo:&info position:hash_position] != 0 || info.filename)
+            continue;
+        if (!unknown_positions)
+            unknown_positions = [NSMutableArray array];
+        [unknown_positions addObject:[NSNumber numberWithUnsignedInt:hash_position]];
+    }
+    
+    if (unknown_positions)
+        ReturnValueWithError(NO, MPQErrorDomain, errUnknownFilenames, @{MPQErrorHashPositions: unknown_positions}, error)
+    
+    // Every merged file keeps the archive file open until it is written, even if the other archive goes away
+    int source_fd = dup(archive->archive_fd);
+    if (source_fd == -1)
+        ReturnValueWithPOSIXError(NO, nil, error)
+    NSFileHandle* source_handle = [[NSFileHandle alloc] initWithFileDescriptor:source_fd closeOnDealloc:YES];
+    
+    BOOL delegateShouldAdd = [delegate respondsToSelector:@selector(archive:shouldAddFile:)];
+    BOOL result = YES;
+    for (hash_position = 0; hash_position < archive->header.hash_table_length; hash_position++) {
+        if ([archive _getFileInfo:&info position:hash_position] != 0)
+            continue;
+        
+        // The special files describe the other archive
+        NSString* filename = [[[NSString alloc] initWithCString:info.filename encoding:NSASCIIStringEncoding] autorelease];
+        if ([filename caseInsensitiveCompare:kListfileFilename] == NSOrderedSame || 
+            [filename caseInsensitiveCompare:kAttributesFilename] == NSOrderedSame || 
+            [filename caseInsensitiveCompare:kSignatureFilename] == NSOrderedSame)
+            continue;
+        
+        if (delegateShouldAdd && ![delegate archive:self shouldAddFile:filename])
+            continue;
+        
+        // Apply the policy if the file exists
+        uint32_t existing_position = [self findHashPosition:info.filename locale:info.locale error:NULL];
+        if (existing_position != 0xffffffff) {
+            if (policy == MPQMergeKeepExisting)
+                continue;
+            
+            MPQFileInfo existing_info;
+            if (policy == MPQMergeNewestWins && [self _getFileInfo:&existing_info position:existing_position] == 0) {
+                uint64_t existing_date = (existing_info.info_flags & MPQFileInfoHasCreationDate) ? existing_info.creation_date : 0;
+                uint64_t merged_date = (info.info_flags & MPQFileInfoHasCreationDate) ? info.creation_date : 0;
+                if (merged_date <= existing_date)
+                    continue;
+            }
+        }
+        
+        MPQDebugLog(@"merging %@", filename);
+        
+        mpq_deferred_operation_add_context_t add_context;
+        memset(&add_context, 0, sizeof(mpq_deferred_operation_add_context_t));
+        add_context.source_handle = source_handle;
+        add_context.source_offset = archive->archive_offset + info.archive_offset;
+        add_context.source_block_entry = archive->block_table[info.block_position];
+        add_context.source_key = info.encryption_key;
+        
+        if (![self _recordFileAddition:&add_context filename:filename ASCIIFilename:info.filename locale:info.locale flags:info.flags size:info.size overwrite:YES attributes:&info error:error]) {
+            result = NO;
+            break;
+        }
+    }
+    
+    [source_handle release];
+    return result;
+}
+
 @end
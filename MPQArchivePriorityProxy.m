@@ -172,14 +172,18 @@ static int _archive_binary_tree_compare(const void* v1, const void* v2) {
     char* filename_cstring = _MPQCreateASCIIFilename(filename, error);
     if (!filename_cstring) return nil;
     
+    // Hash the filename once for all the archives
+    mpq_name_key_t key;
+    mpq_core_compute_name_key(filename_cstring, &key);
+    
     struct _archive_binary_tree* archives = (struct _archive_binary_tree*)_archives;
     struct _archive_binary_tree_node* next = NULL;
     uint32_t hash_position = 0;
-    for (uint32_t i = 0; i < _priority_count; i++) {
+    for (uint32_t i = 0; i < _priority_count && !next; i++) {
         next = archives[i].top;
         while (next) {
             // Find the file in the hash table
-            hash_position = [next->archive findHashPosition:filename_cstring locale:locale error:&local_error];
+            hash_position = [next->archive findHashPositionWithKey:&key locale:locale error:&local_error];
             if (hash_position != 0xffffffff) break;
             else if ([local_error.domain isEqual:MPQErrorDomain] && local_error.code != errHashTableEntryNotFound) {
                 free(filename_cstring);
@@ -203,8 +207,8 @@ static int _archive_binary_tree_compare(const void* v1, const void* v2) {
         return nil;
     }
     
-    if (![next->archive _filenameTable][hash_position]) [next->archive _filenameTable][hash_position] = filename_cstring;
-    else free(filename_cstring);
+    [next->archive _addFilename:filename_cstring position:hash_position];
+    free(filename_cstring);
     
     // openFileAtPosition does the rest
     return [next->archive openFileAtPosition:hash_position error:error];
@@ -276,15 +280,19 @@ static int _archive_binary_tree_compare(const void* v1, const void* v2) {
     char* filename_cstring = _MPQCreateASCIIFilename(filename, error);
     if (!filename_cstring) return NO;
     
+    // Hash the filename once for all the archives
+    mpq_name_key_t key;
+    mpq_core_compute_name_key(filename_cstring, &key);
+    
     struct _archive_binary_tree* archives = (struct _archive_binary_tree*)_archives;
     for (uint32_t i = 0; i < _priority_count; i++) {
         struct _archive_binary_tree_node* next = archives[i].top;
         while (next) {
             // Find the file in the hash table
-            uint32_t hash_position = [next->archive findHashPosition:filename_cstring locale:locale error:&local_error];
+            uint32_t hash_position = [next->archive findHashPositionWithKey:&key locale:locale error:&local_error];
             if (hash_position != 0xffffffff) {
-                if (![next->archive _filenameTable][hash_position]) [next->archive _filenameTable][hash_position] = filename_cstring;
-                else free(filename_cstring);
+                [next->archive _addFilename:filename_cstring position:hash_position];
+                free(filename_cstring);
                 
                 if (([next->archive _blockTable][[next->archive _hashTable][hash_position].block_table_index].flags & MPQFileStopSearchMarker)) {
                     if (error) *error = [NSError errorWithDomain:MPQErrorDomain code:errHashTableEntryNotFound userInfo:nil];
@@ -11,7 +11,10 @@
 
 @interface MPQArchive (MPQArchivePrivate)
 - (uint32_t)findHashPosition:(const char*)filename locale:(uint16_t)locale error:(NSError**)error;
-- (char**)_filenameTable;
+- (uint32_t)findHashPositionWithKey:(const mpq_name_key_t*)key locale:(uint16_t)locale error:(NSError**)error;
+- (const char*)_filenameAtPosition:(uint32_t)hash_position;
+- (void)_addFilename:(const char*)filename_cstring position:(uint32_t)hash_position;
 - (mpq_hash_table_entry_t*)_hashTable;
 - (mpq_block_table_entry_t*)_blockTable;
+- (void)_releaseCachedRange:(off_t)offset length:(off_t)length;
 @end
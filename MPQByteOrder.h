@@ -16,12 +16,29 @@
 extern "C" {
 #endif
 
+#if defined(__APPLE__)
 #include <CoreFoundation/CFByteOrder.h>
 #define MPQ_INLINE CF_INLINE
 
 #define MPQSwapInt16 CFSwapInt16
 #define MPQSwapInt32 CFSwapInt32
 #define MPQSwapInt64 CFSwapInt64
+#else
+// Keep this header free of CoreFoundation so that the C core can be built on its own
+#define MPQ_INLINE static __inline__ __attribute__((always_inline))
+
+#define MPQSwapInt16 __builtin_bswap16
+#define MPQSwapInt32 __builtin_bswap32
+#define MPQSwapInt64 __builtin_bswap64
+
+#if !defined(__LITTLE_ENDIAN__) && !defined(__BIG_ENDIAN__) && defined(__BYTE_ORDER__)
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define __BIG_ENDIAN__ 1
+#else
+#define __LITTLE_ENDIAN__ 1
+#endif
+#endif
+#endif
 
 MPQ_INLINE uint16_t MPQSwapInt16BigToHost(uint16_t arg) {
 #if defined(__BIG_ENDIAN__)
@@ -0,0 +1,752 @@
+/*
+ *  MPQCore.c
+ *  MPQKit
+ *
+ *  Foundation-free MPQ read path. See MPQCore.h.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "MPQByteOrder.h"
+#include "MPQCryptography.h"
+#include "MPQCore.h"
+#include "SCompression.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define BUFFER_OFFSET(buffer, bytes) ((uint8_t*)buffer + (bytes))
+
+// magic numbers in big endian
+#define MPQ_MAGIC 0x4D50511A
+#define MPQ_SHUNT_MAGIC 0x4D50511B
+
+// Hashing mode constants
+#define HASH_POSITION 0
+#define HASH_NAME_A 1
+#define HASH_NAME_B 2
+#define HASH_KEY 3
+
+#define MPQ_CORE_MIN(a, b) (((a) < (b)) ? (a) : (b))
+
+static const char* kBlockTableEncryptionKey = "(block table)";
+static const char* kHashTableEncryptionKey = "(hash table)";
+
+#pragma mark errors
+
+static int mpq_core_fail(mpq_core_error_t* error, int domain, int code) {
+    if (error) {
+        error->domain = domain;
+        error->code = code;
+        error->sector_index = 0xffffffff;
+        error->computed_checksum = 0;
+        error->expected_checksum = 0;
+    }
+    return -1;
+}
+
+static int mpq_core_fail_sector(mpq_core_error_t* error, int code, uint32_t sector_index) {
+    mpq_core_fail(error, MPQCoreErrorDomainMPQ, code);
+    if (error)
+        error->sector_index = sector_index;
+    return -1;
+}
+
+// Reads exactly size bytes. A short read is reported as short_read_code, or errEndOfFile when nothing could be read.
+static int mpq_core_pread(int fd, void* buffer, size_t size, off_t offset, int short_read_code, mpq_core_error_t* error) {
+    ssize_t bytes_read = pread(fd, buffer, size, offset);
+    if (bytes_read == -1)
+        return mpq_core_fail(error, MPQCoreErrorDomainPOSIX, errno);
+    if (bytes_read == 0 && size > 0)
+        return mpq_core_fail(error, MPQCoreErrorDomainMPQ, errEndOfFile);
+    if ((size_t)bytes_read < size)
+        return mpq_core_fail(error, MPQCoreErrorDomainMPQ, short_read_code);
+    return 0;
+}
+
+#pragma mark byte order
+
+static void mpq_core_swap_header(mpq_header_t* header) {
+#if defined(__BIG_ENDIAN__)
+    header->header_size = MPQSwapInt32(header->header_size);
+    header->archive_size = MPQSwapInt32(header->archive_size);
+    header->version = MPQSwapInt16(header->version);
+    header->sector_size_shift = MPQSwapInt16(header->sector_size_shift);
+    header->hash_table_offset = MPQSwapInt32(header->hash_table_offset);
+    header->block_table_offset = MPQSwapInt32(header->block_table_offset);
+    header->hash_table_length = MPQSwapInt32(header->hash_table_length);
+    header->block_table_length = MPQSwapInt32(header->block_table_length);
+#else
+    header->mpq_magic = MPQSwapInt32(header->mpq_magic);
+#endif
+}
+
+static void mpq_core_swap_shunt(mpq_shunt_t* shunt) {
+#if defined(__BIG_ENDIAN__)
+    shunt->unknown04 = MPQSwapInt32(shunt->unknown04);
+    shunt->mpq_header_offset = MPQSwapInt32(shunt->mpq_header_offset);
+#else
+    shunt->shunt_magic = MPQSwapInt32(shunt->shunt_magic);
+#endif
+}
+
+static void mpq_core_swap_extended_header(mpq_extended_header_t* header) {
+#if defined(__BIG_ENDIAN__)
+    header->extended_block_offset_table_offset = MPQSwapInt64(header->extended_block_offset_table_offset);
+    header->hash_table_offset_high = MPQSwapInt16(header->hash_table_offset_high);
+    header->block_table_offset_high = MPQSwapInt16(header->block_table_offset_high);
+#else
+    (void)header;
+#endif
+}
+
+static void mpq_core_swap_hash_table(mpq_hash_table_entry_t* hash_table, uint32_t length) {
+#if defined(__BIG_ENDIAN__)
+    uint32_t i = 0;
+    for (; i < length; i++) {
+        hash_table[i].hash_a = MPQSwapInt32(hash_table[i].hash_a);
+        hash_table[i].hash_b = MPQSwapInt32(hash_table[i].hash_b);
+        hash_table[i].locale = MPQSwapInt16(hash_table[i].locale);
+        hash_table[i].platform = MPQSwapInt16(hash_table[i].platform);
+        hash_table[i].block_table_index = MPQSwapInt32(hash_table[i].block_table_index);
+    }
+#else
+    (void)hash_table;
+    (void)length;
+#endif
+}
+
+#pragma mark archive
+
+int mpq_core_read_header(int fd, int ignore_header_size_field, mpq_archive_info_t* info, mpq_core_error_t* error) {
+    mpq_header_t* header = &info->header;
+
+    // MPQ archives can be embedded in files, in which case the MPQ header must be 512 bytes aligned.
+    while (1) {
+        if (mpq_core_pread(fd, header, sizeof(mpq_header_t), info->archive_offset, errIO, error) == -1)
+            return -1;
+
+        // Byte swap the header
+        mpq_core_swap_header(header);
+
+        // Check the header
+        if (header->mpq_magic == MPQ_MAGIC) {
+            if (header->version == 0 && (header->header_size == sizeof(mpq_header_t) || ignore_header_size_field))
+                break;
+            if (header->version == 1 && (header->header_size == sizeof(mpq_header_t) + sizeof(mpq_extended_header_t) || ignore_header_size_field))
+                break;
+            return mpq_core_fail(error, MPQCoreErrorDomainMPQ, errInvalidArchive);
+        }
+
+        // We may have read an MPQ shunt structure instead
+        mpq_shunt_t shunt;
+        memcpy(&shunt, header, sizeof(mpq_shunt_t));
+        mpq_core_swap_shunt(&shunt);
+        if (shunt.shunt_magic == MPQ_SHUNT_MAGIC) {
+            info->archive_offset += (off_t)shunt.mpq_header_offset;
+            continue;
+        }
+
+        // Move to the next possible offset
+        info->archive_offset += 512;
+    }
+
+    // Version 1 archives have an extended header
+    if (header->version == 1) {
+        if (mpq_core_pread(fd, &info->extended_header, sizeof(mpq_extended_header_t), info->archive_offset + sizeof(mpq_header_t), errIO, error) == -1)
+            return -1;
+        mpq_core_swap_extended_header(&info->extended_header);
+    } else
+        memset(&info->extended_header, 0, sizeof(mpq_extended_header_t));
+
+    info->full_sector_size = MPQ_BASE_SECTOR_SIZE << header->sector_size_shift;
+
+    // Compute final offsets for the hash and block tables
+    info->hash_table_offset = header->hash_table_offset;
+    info->block_table_offset = header->block_table_offset;
+    if (header->version == 1) {
+        info->hash_table_offset += ((off_t)(info->extended_header.hash_table_offset_high)) << 32;
+        info->block_table_offset += ((off_t)(info->extended_header.block_table_offset_high)) << 32;
+    }
+
+    return 0;
+}
+
+int mpq_core_read_tables(int fd, mpq_archive_info_t* info, mpq_hash_table_entry_t* hash_table, mpq_block_table_entry_t* block_table, off_t* block_offset_table, mpq_core_error_t* error) {
+    const mpq_header_t* header = &info->header;
+    const mpq_extended_header_t* extended_header = &info->extended_header;
+    uint32_t i = 0;
+
+    size_t hash_table_size = header->hash_table_length * sizeof(mpq_hash_table_entry_t);
+    size_t block_table_size = header->block_table_length * sizeof(mpq_block_table_entry_t);
+    size_t extended_block_offset_table_size = header->block_table_length * sizeof(mpq_extended_block_offset_table_entry_t);
+
+    // Read and decrypt the hash table
+    if (mpq_core_pread(fd, hash_table, hash_table_size, info->archive_offset + info->hash_table_offset, errIO, error) == -1)
+        return -1;
+    mpq_decrypt(hash_table, hash_table_size, mpq_hash_cstring(kHashTableEncryptionKey, HASH_KEY), false);
+    mpq_core_swap_hash_table(hash_table, header->hash_table_length);
+
+    // Read and decrypt the block table. Since it's really a uint32_t array, disable output swapping
+    if (mpq_core_pread(fd, block_table, block_table_size, info->archive_offset + info->block_table_offset, errIO, error) == -1)
+        return -1;
+    mpq_decrypt(block_table, block_table_size, mpq_hash_cstring(kBlockTableEncryptionKey, HASH_KEY), true);
+
+    if (extended_header->extended_block_offset_table_offset != 0) {
+        // Read the extended block offset table into the tail of block_offset_table, then widen it in place going forward.
+        // Entry i is always read before the 8 bytes of block_offset_table[i] overwrite it (or any entry after it).
+        mpq_extended_block_offset_table_entry_t* extended_block_offset_table = (mpq_extended_block_offset_table_entry_t*)BUFFER_OFFSET(block_offset_table, (header->block_table_length * sizeof(off_t)) - extended_block_offset_table_size);
+        if (mpq_core_pread(fd, extended_block_offset_table, extended_block_offset_table_size, info->archive_offset + extended_header->extended_block_offset_table_offset, errIO, error) == -1)
+            return -1;
+
+        for (i = 0; i < header->block_table_length; i++) {
+            uint16_t offset_high = MPQSwapInt16LittleToHost(extended_block_offset_table[i].offset_high);
+            block_offset_table[i] = (((off_t)offset_high) << 32) + block_table[i].offset;
+        }
+    } else {
+        // Simple copy of the offset field, extending it to 64 bits
+        for (i = 0; i < header->block_table_length; i++)
+            block_offset_table[i] = block_table[i].offset;
+    }
+
+    // We need to compute the archive's size, since that information is no longer valid in version 1 archives
+    if (info->hash_table_offset > info->block_table_offset)
+        info->archive_size = info->hash_table_offset + hash_table_size;
+    else
+        info->archive_size = info->block_table_offset + block_table_size;
+    if (header->version == 1 && (off_t)(extended_header->extended_block_offset_table_offset + extended_block_offset_table_size) >= info->archive_size)
+        info->archive_size = extended_header->extended_block_offset_table_offset + extended_block_offset_table_size;
+
+    // If there's a file beyond the structural tables, refuse the archive
+    for (i = 0; i < header->block_table_length; i++) {
+        if (block_offset_table[i] + block_table[i].archived_size >= info->archive_size)
+            return mpq_core_fail(error, MPQCoreErrorDomainMPQ, errInvalidArchive);
+    }
+
+    // Do a consistency check on archive_size for version 0 archives
+    if (header->version == 0 && header->archive_size != info->archive_size)
+        return mpq_core_fail(error, MPQCoreErrorDomainMPQ, errInvalidArchive);
+
+    // Position the write offset at the beginning of the first structural table
+    if (info->hash_table_offset < info->block_table_offset)
+        info->archive_write_offset = info->hash_table_offset;
+    else
+        info->archive_write_offset = info->block_table_offset;
+    if (header->version == 1 && extended_header->extended_block_offset_table_offset != 0 && (off_t)extended_header->extended_block_offset_table_offset < info->archive_write_offset)
+        info->archive_write_offset = extended_header->extended_block_offset_table_offset;
+
+    return 0;
+}
+
+void mpq_core_compute_name_key(const char* filename, mpq_name_key_t* key) {
+    mpq_hash_name(filename, strlen(filename), &key->position, &key->hash_a, &key->hash_b);
+}
+
+void mpq_core_compute_name_key_with_length(const char* filename, size_t length, mpq_name_key_t* key) {
+    mpq_hash_name(filename, length, &key->position, &key->hash_a, &key->hash_b);
+}
+
+#if defined(__SSE2__)
+// Byte masks of _mm_movemask_epi8 over a 16-bit lane comparison of a hash table entry
+#define PROBE_NAME_LOCALE_MASK 0x03ff
+#define PROBE_EMPTY_MASK 0xf000
+#endif
+
+uint32_t mpq_core_find_hash_position_with_key(const mpq_hash_table_entry_t* hash_table, uint32_t hash_table_length, const mpq_name_key_t* key, uint16_t locale) {
+    // Hash tables are supposed to have a power of 2 length, which lets us wrap around with a mask. Fall back to a modulo otherwise.
+    uint32_t mask = hash_table_length - 1;
+    int is_power_of_2 = (hash_table_length & mask) == 0;
+    uint32_t current_position = (is_power_of_2) ? (key->position & mask) : (key->position % hash_table_length);
+    uint32_t entries_left = hash_table_length;
+
+#if defined(__SSE2__)
+    // Compare the hashes, locale and empty marker of an entry in one go. The platform is ignored, and deleted entries
+    // are weeded out after a match since other tools may leave their hashes intact.
+    mpq_hash_table_entry_t key_entry;
+    key_entry.hash_a = key->hash_a;
+    key_entry.hash_b = key->hash_b;
+    key_entry.locale = locale;
+    key_entry.platform = 0;
+    key_entry.block_table_index = MPQ_HASH_TABLE_EMPTY;
+    __m128i key_vector = _mm_loadu_si128((const __m128i*)&key_entry);
+#endif
+
+    // Search through the hash table until we either find the file we're looking for, or we find an unused hash table entry,
+    // indicating the end of the cluster of used hash table entries. If the entire hash table is full, the file we're looking 
+    // for simply doesn't exist.
+    for (;;) {
+#if defined(__SSE2__)
+        // Probe 4 entries (one cache line) per step, as long as they don't wrap around
+        while (entries_left >= 4 && current_position + 4 <= hash_table_length) {
+            const __m128i* entries = (const __m128i*)(hash_table + current_position);
+            int masks[4];
+            masks[0] = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_loadu_si128(entries), key_vector));
+            masks[1] = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_loadu_si128(entries + 1), key_vector));
+            masks[2] = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_loadu_si128(entries + 2), key_vector));
+            masks[3] = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_loadu_si128(entries + 3), key_vector));
+
+            uint32_t i = 0;
+            for (; i < 4; i++) {
+                if ((masks[i] & PROBE_EMPTY_MASK) == PROBE_EMPTY_MASK)
+                    return MPQ_NOT_FOUND;
+                if ((masks[i] & PROBE_NAME_LOCALE_MASK) == PROBE_NAME_LOCALE_MASK && hash_table[current_position + i].block_table_index != MPQ_HASH_TABLE_DELETED)
+                    return current_position + i;
+            }
+
+            current_position += 4;
+            if (current_position == hash_table_length)
+                current_position = 0;
+            entries_left -= 4;
+        }
+#endif
+
+        if (entries_left == 0 || hash_table[current_position].block_table_index == MPQ_HASH_TABLE_EMPTY)
+            return MPQ_NOT_FOUND;
+
+        if (hash_table[current_position].block_table_index != MPQ_HASH_TABLE_DELETED) {
+            if (hash_table[current_position].hash_a == key->hash_a &&
+                hash_table[current_position].hash_b == key->hash_b &&
+                hash_table[current_position].locale == locale)
+            {
+                return current_position;
+            }
+        }
+
+        current_position++;
+        if (is_power_of_2)
+            current_position &= mask;
+        else if (current_position == hash_table_length)
+            current_position = 0;
+        entries_left--;
+    }
+}
+
+uint32_t mpq_core_find_hash_position(const mpq_hash_table_entry_t* hash_table, uint32_t hash_table_length, const char* filename, uint16_t locale) {
+    mpq_name_key_t key;
+    mpq_core_compute_name_key(filename, &key);
+    return mpq_core_find_hash_position_with_key(hash_table, hash_table_length, &key, locale);
+}
+
+#pragma mark journal
+
+int mpq_core_sync(int fd) {
+#if defined(F_FULLFSYNC)
+    if (fcntl(fd, F_FULLFSYNC) == 0)
+        return 0;
+#endif
+    return fsync(fd);
+}
+
+static void mpq_core_swap_journal_record(mpq_journal_record_t* record) {
+    record->magic = MPQSwapInt32HostToLittle(record->magic);
+    record->type = MPQSwapInt32HostToLittle(record->type);
+    record->archive_offset = MPQSwapInt64HostToLittle(record->archive_offset);
+    record->file_size = MPQSwapInt64HostToLittle(record->file_size);
+    record->header_size = MPQSwapInt32HostToLittle(record->header_size);
+    record->checksum = MPQSwapInt32HostToLittle(record->checksum);
+}
+
+// Computed over the record in little endian
+static uint32_t mpq_core_journal_record_checksum(const mpq_journal_record_t* record) {
+    return (uint32_t)crc32(0, (const Bytef*)record, (uInt)offsetof(mpq_journal_record_t, checksum));
+}
+
+int mpq_core_write_journal_record(int journal_fd, const mpq_journal_record_t* record, mpq_core_error_t* error) {
+    mpq_journal_record_t disk_record = *record;
+    disk_record.magic = MPQ_JOURNAL_MAGIC;
+    mpq_core_swap_journal_record(&disk_record);
+    disk_record.checksum = MPQSwapInt32HostToLittle(mpq_core_journal_record_checksum(&disk_record));
+    
+    off_t record_offset = (off_t)(record->type - 1) * sizeof(mpq_journal_record_t);
+    ssize_t bytes_written = pwrite(journal_fd, &disk_record, sizeof(mpq_journal_record_t), record_offset);
+    if (bytes_written == -1)
+        return mpq_core_fail(error, MPQCoreErrorDomainPOSIX, errno);
+    if (bytes_written < (ssize_t)sizeof(mpq_journal_record_t))
+        return mpq_core_fail(error, MPQCoreErrorDomainMPQ, errIO);
+    return 0;
+}
+
+// Returns 1 if the record of the given type is complete and valid, 0 if it is not, and -1 on failure
+static int mpq_core_read_journal_record(int journal_fd, uint32_t type, mpq_journal_record_t* record, mpq_core_error_t* error) {
+    ssize_t bytes_read = pread(journal_fd, record, sizeof(mpq_journal_record_t), (off_t)(type - 1) * sizeof(mpq_journal_record_t));
+    if (bytes_read == -1)
+        return mpq_core_fail(error, MPQCoreErrorDomainPOSIX, errno);
+    if (bytes_read < (ssize_t)sizeof(mpq_journal_record_t))
+        return 0;
+    
+    uint32_t checksum = mpq_core_journal_record_checksum(record);
+    mpq_core_swap_journal_record(record);
+    if (record->magic != MPQ_JOURNAL_MAGIC || record->type != type || record->checksum != checksum)
+        return 0;
+    if (record->header_size < sizeof(mpq_header_t) || record->header_size > MPQ_JOURNAL_MAX_HEADER_SIZE)
+        return 0;
+    return 1;
+}
+
+int mpq_core_read_journal(int journal_fd, mpq_journal_record_t* record, mpq_core_error_t* error) {
+    memset(record, 0, sizeof(mpq_journal_record_t));
+    
+    mpq_journal_record_t begin_record;
+    int result = mpq_core_read_journal_record(journal_fd, MPQ_JOURNAL_BEGIN, &begin_record, error);
+    if (result == -1)
+        return -1;
+    if (result == 0)
+        return 0;
+    
+    mpq_journal_record_t commit_record;
+    result = mpq_core_read_journal_record(journal_fd, MPQ_JOURNAL_COMMIT, &commit_record, error);
+    if (result == -1)
+        return -1;
+    
+    // A commit record for another archive in the same file can't be ours
+    if (result == 1 && commit_record.archive_offset == begin_record.archive_offset)
+        *record = commit_record;
+    else
+        *record = begin_record;
+    return 0;
+}
+
+int mpq_core_apply_journal_record(int archive_fd, const mpq_journal_record_t* record, mpq_core_error_t* error) {
+    ssize_t bytes_written = pwrite(archive_fd, record->header, record->header_size, (off_t)record->archive_offset);
+    if (bytes_written == -1)
+        return mpq_core_fail(error, MPQCoreErrorDomainPOSIX, errno);
+    if (bytes_written < (ssize_t)record->header_size)
+        return mpq_core_fail(error, MPQCoreErrorDomainMPQ, errIO);
+    if (ftruncate(archive_fd, (off_t)record->file_size) == -1)
+        return mpq_core_fail(error, MPQCoreErrorDomainPOSIX, errno);
+    if (mpq_core_sync(archive_fd) == -1)
+        return mpq_core_fail(error, MPQCoreErrorDomainPOSIX, errno);
+    return 0;
+}
+
+#pragma mark listfiles
+
+static __inline__ int mpq_core_is_listfile_separator(uint8_t c) {
+    return c == '\r' || c == '\n' || c == ';';
+}
+
+size_t mpq_core_parse_listfile(const void* data, size_t length, mpq_listfile_entry_t* entries, size_t max_entries) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    size_t entry_count = 0;
+    size_t offset = 0;
+
+    while (offset < length) {
+        // Skip separators
+        while (offset < length && mpq_core_is_listfile_separator(bytes[offset]))
+            offset++;
+        if (offset == length)
+            break;
+
+        // Find the end of the name, and check that it is a valid ASCII filename
+        size_t name_offset = offset;
+        int is_valid = 1;
+        while (offset < length && !mpq_core_is_listfile_separator(bytes[offset])) {
+            if (bytes[offset] == 0 || bytes[offset] > 0x7f)
+                is_valid = 0;
+            offset++;
+        }
+
+        size_t name_length = offset - name_offset;
+        if (!is_valid || name_length >= MPQ_MAX_PATH)
+            continue;
+
+        if (entries) {
+            if (entry_count == max_entries)
+                break;
+            entries[entry_count].offset = (uint32_t)name_offset;
+            entries[entry_count].length = (uint32_t)name_length;
+        }
+        entry_count++;
+    }
+
+    return entry_count;
+}
+
+void mpq_core_hash_listfile_entries(const void* data, mpq_listfile_entry_t* entries, size_t count) {
+    const char* names = (const char*)data;
+    size_t i = 0;
+    for (; i < count; i++)
+        mpq_hash_name(names + entries[i].offset, entries[i].length, &entries[i].key.position, &entries[i].key.hash_a, &entries[i].key.hash_b);
+}
+
+#pragma mark hash databases
+
+int mpq_core_open_hash_database(const void* data, size_t size, mpq_hash_database_t* db, mpq_core_error_t* error) {
+    if (size < sizeof(mpq_hash_database_header_t))
+        return mpq_core_fail(error, MPQCoreErrorDomainMPQ, errInvalidHashDatabase);
+
+    mpq_hash_database_header_t header;
+    memcpy(&header, data, sizeof(mpq_hash_database_header_t));
+    header.magic = MPQSwapInt32LittleToHost(header.magic);
+    header.version = MPQSwapInt32LittleToHost(header.version);
+    header.entry_count = MPQSwapInt32LittleToHost(header.entry_count);
+    header.index_length = MPQSwapInt32LittleToHost(header.index_length);
+    header.strings_size = MPQSwapInt32LittleToHost(header.strings_size);
+
+    if (header.magic != MPQ_HASH_DATABASE_MAGIC || header.version != MPQ_HASH_DATABASE_VERSION)
+        return mpq_core_fail(error, MPQCoreErrorDomainMPQ, errInvalidHashDatabase);
+
+    // The index must be a power of 2 with at least one empty slot, and every name must be terminated
+    if (header.index_length == 0 || (header.index_length & (header.index_length - 1)) != 0 || header.index_length <= header.entry_count)
+        return mpq_core_fail(error, MPQCoreErrorDomainMPQ, errInvalidHashDatabase);
+
+    uint64_t expected_size = sizeof(mpq_hash_database_header_t) + ((uint64_t)header.entry_count * sizeof(mpq_hash_database_entry_t)) +
+        ((uint64_t)header.index_length * sizeof(uint32_t)) + header.strings_size;
+    if (expected_size > size)
+        return mpq_core_fail(error, MPQCoreErrorDomainMPQ, errInvalidHashDatabase);
+
+    const uint8_t* bytes = (const uint8_t*)data;
+    db->entry_count = header.entry_count;
+    db->index_mask = header.index_length - 1;
+    db->strings_size = header.strings_size;
+    db->entries = (const mpq_hash_database_entry_t*)(bytes + sizeof(mpq_hash_database_header_t));
+    db->index = (const uint32_t*)(db->entries + header.entry_count);
+    db->strings = (const char*)(db->index + header.index_length);
+
+    if (header.strings_size > 0 && db->strings[header.strings_size - 1] != 0)
+        return mpq_core_fail(error, MPQCoreErrorDomainMPQ, errInvalidHashDatabase);
+
+    return 0;
+}
+
+const char* mpq_core_hash_database_lookup(const mpq_hash_database_t* db, uint32_t hash_a, uint32_t hash_b) {
+    uint32_t slot = hash_a & db->index_mask;
+    uint32_t slots_left = db->index_mask + 1;
+
+    for (; slots_left > 0; slots_left--) {
+        uint32_t entry_index = MPQSwapInt32LittleToHost(db->index[slot]);
+        if (entry_index == MPQ_HASH_DATABASE_EMPTY_SLOT || entry_index >= db->entry_count)
+            return NULL;
+
+        const mpq_hash_database_entry_t* entry = db->entries + entry_index;
+        if (MPQSwapInt32LittleToHost(entry->hash_a) == hash_a && MPQSwapInt32LittleToHost(entry->hash_b) == hash_b) {
+            uint32_t name_offset = MPQSwapInt32LittleToHost(entry->name_offset);
+            return (name_offset < db->strings_size) ? db->strings + name_offset : NULL;
+        }
+
+        slot = (slot + 1) & db->index_mask;
+    }
+
+    return NULL;
+}
+
+#pragma mark sectors
+
+int mpq_core_read_sector_table(int fd, off_t file_offset, const mpq_block_table_entry_t* block_entry, uint32_t full_sector_size, uint32_t encryption_key, uint32_t* sector_table, mpq_core_error_t* error) {
+    uint32_t sector_table_length = mpq_core_sector_table_length(full_sector_size, block_entry->size, block_entry->flags);
+    size_t sector_table_size = sector_table_length * sizeof(uint32_t);
+
+    if (mpq_core_pread(fd, sector_table, sector_table_size, file_offset, errIO, error) == -1)
+        return -1;
+
+    // If the file is encrypted, decrypt the sector table and disable output swapping since a sector table is just an array of unsigned longs
+    if ((block_entry->flags & MPQFileEncrypted))
+        mpq_decrypt(sector_table, sector_table_size, encryption_key - 1, true);
+    else {
+        uint32_t i = 0;
+        for (; i < sector_table_length; i++)
+            sector_table[i] = MPQSwapInt32LittleToHost(sector_table[i]);
+    }
+
+    return 0;
+}
+
+int mpq_core_check_sector_table(const uint32_t* sector_table, const mpq_block_table_entry_t* block_entry, uint32_t full_sector_size, mpq_core_error_t* error) {
+    uint32_t sector_count = (block_entry->size + full_sector_size - 1) / full_sector_size;
+    uint32_t sector_table_length = mpq_core_sector_table_length(full_sector_size, block_entry->size, block_entry->flags);
+
+    // The sector table, including the sector adlers entry, must come before the first sector
+    if (sector_table[0] < sector_table_length * sizeof(uint32_t))
+        return mpq_core_fail_sector(error, errInvalidSectorTable, 0);
+
+    // Sectors must be in order and no sector may be larger than its decompressed size
+    uint32_t sector_index = 0;
+    for (; sector_index < sector_count; sector_index++) {
+        uint32_t expected_size = (sector_index == sector_count - 1) ? block_entry->size - (sector_index * full_sector_size) : full_sector_size;
+        if (sector_table[sector_index + 1] <= sector_table[sector_index] || sector_table[sector_index + 1] - sector_table[sector_index] > expected_size)
+            return mpq_core_fail_sector(error, errInvalidSectorTable, sector_index);
+    }
+
+    // Everything has to fit within the file's archived size
+    if (sector_table[sector_count] > block_entry->archived_size)
+        return mpq_core_fail_sector(error, errInvalidSectorTable, sector_count - 1);
+
+    // Sector adlers come after the last sector and are never larger than one adler per sector
+    if ((block_entry->flags & MPQFileHasSectorAdlers)) {
+        if (sector_table[sector_count + 1] < sector_table[sector_count] || sector_table[sector_count + 1] > block_entry->archived_size)
+            return mpq_core_fail(error, MPQCoreErrorDomainMPQ, errInvalidSectorTable);
+        if (sector_table[sector_count + 1] - sector_table[sector_count] > sector_count * sizeof(uint32_t))
+            return mpq_core_fail(error, MPQCoreErrorDomainMPQ, errInvalidSectorTable);
+    }
+
+    return 0;
+}
+
+int mpq_core_read_sector_adlers(const mpq_core_file_t* file, uint32_t* adlers, void* scratch, int* has_adlers, mpq_core_error_t* error) {
+    uint32_t sector_count = (file->block_entry.size + file->full_sector_size - 1) / file->full_sector_size;
+    uint32_t sector_adlers_size = ((file->block_entry.flags & MPQFileHasSectorAdlers)) ? file->sector_table[sector_count + 1] - file->sector_table[sector_count] : 0;
+
+    *has_adlers = 0;
+    if (sector_adlers_size == 0)
+        return 0;
+    if (sector_adlers_size > sector_count * sizeof(uint32_t))
+        return mpq_core_fail(error, MPQCoreErrorDomainMPQ, errInvalidSectorChecksumData);
+
+    if (mpq_core_pread(file->fd, scratch, sector_adlers_size, file->file_offset + file->sector_table[sector_count], errEndOfFile, error) == -1)
+        return -1;
+
+    uint32_t decompressed_adlers_size = sector_count * (uint32_t)sizeof(uint32_t);
+    if (SCompDecompress(adlers, &decompressed_adlers_size, scratch, sector_adlers_size) == 0)
+        return mpq_core_fail(error, MPQCoreErrorDomainMPQ, errInvalidSectorChecksumData);
+    if (decompressed_adlers_size != sector_count * sizeof(uint32_t))
+        return mpq_core_fail(error, MPQCoreErrorDomainMPQ, errInvalidSectorChecksumData);
+
+    *has_adlers = 1;
+    return 0;
+}
+
+uint32_t mpq_core_sector_offset(const mpq_core_file_t* file, uint32_t sector_index) {
+    if (file->sector_table)
+        return file->sector_table[sector_index];
+
+    // Files without a sector table are stored contiguously
+    uint64_t offset = (uint64_t)sector_index * file->full_sector_size;
+    return (offset > file->block_entry.size) ? file->block_entry.size : (uint32_t)offset;
+}
+
+int mpq_core_decode_sector(void* out, uint32_t expected_size, void* sector, uint32_t sector_size, uint32_t flags, uint32_t sector_key) {
+    // If the file is encrypted, decrypt the sector
+    if ((flags & MPQFileEncrypted))
+        mpq_decrypt(sector, sector_size, sector_key, false);
+
+    // Use the proper decompression method
+    uint32_t decompressed_size = expected_size;
+    if ((flags & MPQFileCompressed)) {
+        if (sector_size > expected_size || SCompDecompress(out, &decompressed_size, sector, sector_size) == 0)
+            return -1;
+    } else if ((flags & MPQFileDiabloCompressed) && sector_size < expected_size) {
+        // Decompress_pklib does not report errors, but it will not produce the expected amount of data from a corrupted sector
+        Decompress_pklib(out, &decompressed_size, sector, sector_size);
+    } else {
+        if (sector_size != expected_size)
+            return -1;
+        memcpy(out, sector, sector_size);
+    }
+
+    return (decompressed_size == expected_size) ? 0 : -1;
+}
+
+// Decodes a sector with the acceptance rules MPQFile has always used when reading files, which tolerate sizes that
+// mpq_core_decode_sector rejects. A stored sector larger than expected_size is truncated, and a sector which decodes to
+// fewer than expected_size bytes is zero padded. out is never written past expected_size.
+static int mpq_core_decode_read_sector(void* out, uint32_t expected_size, void* sector, uint32_t sector_size, uint32_t flags, uint32_t sector_key) {
+    if ((flags & MPQFileEncrypted))
+        mpq_decrypt(sector, sector_size, sector_key, false);
+
+    uint32_t decompressed_size = expected_size;
+    if ((flags & MPQFileCompressed)) {
+        if (SCompDecompress(out, &decompressed_size, sector, sector_size) == 0)
+            return -1;
+    } else if ((flags & MPQFileDiabloCompressed) && sector_size < expected_size) {
+        Decompress_pklib(out, &decompressed_size, sector, sector_size);
+    } else {
+        decompressed_size = MPQ_CORE_MIN(sector_size, expected_size);
+        memcpy(out, sector, decompressed_size);
+    }
+
+    if (decompressed_size < expected_size)
+        memset(BUFFER_OFFSET(out, decompressed_size), 0, expected_size - decompressed_size);
+    return 0;
+}
+
+ssize_t mpq_core_read_file(const mpq_core_file_t* file, void* buf, uint32_t offset, uint32_t length, void* read_buffer, void* data_buffer, mpq_core_error_t* error) {
+    uint32_t file_size = file->block_entry.size;
+    uint32_t full_sector_size = file->full_sector_size;
+
+    if (offset >= file_size)
+        return 0;
+    length = MPQ_CORE_MIN(length, file_size - offset);
+    if (length == 0)
+        return 0;
+
+    uint32_t sector_count = (file_size + full_sector_size - 1) / full_sector_size;
+    uint32_t first_sector = offset / full_sector_size;
+    uint32_t last_sector = (uint32_t)(((uint64_t)offset + length - 1) / full_sector_size);
+
+    // Current offset into buf
+    uint32_t data_offset = 0;
+
+    // Read runs of up to 16 sectors at a time
+    uint32_t current_sector = first_sector;
+    while (current_sector <= last_sector) {
+        uint32_t run_end = MPQ_CORE_MIN(current_sector + 16, last_sector + 1);
+        uint32_t run_start_offset = mpq_core_sector_offset(file, current_sector);
+        uint32_t run_end_offset = mpq_core_sector_offset(file, run_end);
+        if (run_end_offset < run_start_offset || run_end_offset - run_start_offset > MPQ_CORE_READ_BUFFER_SIZE(full_sector_size))
+            return mpq_core_fail_sector(error, errInvalidSectorTable, current_sector);
+
+        if (mpq_core_pread(file->fd, read_buffer, run_end_offset - run_start_offset, file->file_offset + run_start_offset, errEndOfFile, error) == -1)
+            return -1;
+
+        for (; current_sector < run_end; current_sector++) {
+            uint32_t sector_start = mpq_core_sector_offset(file, current_sector);
+            uint32_t sector_end = mpq_core_sector_offset(file, current_sector + 1);
+            if (sector_end < sector_start)
+                return mpq_core_fail_sector(error, errInvalidSectorTable, current_sector);
+
+            void* sector = BUFFER_OFFSET(read_buffer, sector_start - run_start_offset);
+            uint32_t sector_size = sector_end - sector_start;
+
+            // if we're processing the last sector of the file, we need to adjust its decompressed size
+            uint32_t decompressed_sector_size = (current_sector == sector_count - 1) ? file_size - (current_sector * full_sector_size) : full_sector_size;
+
+            // If we have sector adlers, checksum the sector and verify
+            if (file->sector_adlers) {
+                uint32_t adler = (uint32_t)adler32(0L, sector, sector_size);
+                if (adler != file->sector_adlers[current_sector]) {
+                    mpq_core_fail_sector(error, errInvalidSectorChecksum, current_sector);
+                    if (error) {
+                        error->computed_checksum = adler;
+                        error->expected_checksum = file->sector_adlers[current_sector];
+                    }
+                    return -1;
+                }
+            }
+
+            // Determine how many bytes we need to skip at the beginning of the sector and how many we need to keep
+            uint32_t bytes_to_skip = (current_sector == first_sector) ? offset - (current_sector * full_sector_size) : 0;
+            uint32_t bytes_to_copy = MPQ_CORE_MIN(decompressed_sector_size - bytes_to_skip, length - data_offset);
+
+            // Normally we decode straight into the client buffer, unless we only need part of the sector
+            void* destination = BUFFER_OFFSET(buf, data_offset);
+            if (bytes_to_skip > 0 || bytes_to_copy < decompressed_sector_size)
+                destination = data_buffer;
+
+            if (mpq_core_decode_read_sector(destination, decompressed_sector_size, sector, sector_size, file->block_entry.flags, file->encryption_key + current_sector) == -1)
+                return mpq_core_fail_sector(error, errDecompressionFailed, current_sector);
+
+            if (destination == data_buffer)
+                memcpy(BUFFER_OFFSET(buf, data_offset), BUFFER_OFFSET(data_buffer, bytes_to_skip), bytes_to_copy);
+            data_offset += bytes_to_copy;
+        }
+    }
+
+    return data_offset;
+}
+
+int mpq_core_read_one_sector_file(const mpq_core_file_t* file, void* buf, void* read_buffer, mpq_core_error_t* error) {
+    if (mpq_core_pread(file->fd, read_buffer, file->block_entry.archived_size, file->file_offset, errIO, error) == -1)
+        return -1;
+
+    if (mpq_core_decode_sector(buf, file->block_entry.size, read_buffer, file->block_entry.archived_size, file->block_entry.flags, file->encryption_key) == -1)
+        return mpq_core_fail_sector(error, errDecompressionFailed, 0);
+
+    return 0;
+}
@@ -0,0 +1,378 @@
+/*
+ *  MPQCore.h
+ *  MPQKit
+ *
+ *  The MPQ read path without Foundation: archive header parsing, save journal recovery, structural 
+ *  table loading, hash table lookup and sector decoding. MPQArchive and MPQFile are built on top of these
+ *  functions, and C and C++ clients can use them directly by linking libMPQCore.
+ *
+ *  The core never allocates memory. Every buffer is provided by the caller, and the functions
+ *  which need one document its minimum size. Functions return -1 on failure and describe the
+ *  failure in an mpq_core_error_t.
+ *
+ *  mpq_init_cryptography() must have been called before any of these functions are used.
+ *
+ */
+
+#if !defined(MPQCore_h)
+#define MPQCore_h
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "MPQSharedConstants.h"
+#include "MPQErrorCodes.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#pragma pack(push, 1)
+struct mpq_header {
+    uint32_t mpq_magic;
+    uint32_t header_size;
+    uint32_t archive_size;
+    uint16_t version;
+    uint16_t sector_size_shift;
+    uint32_t hash_table_offset;
+    uint32_t block_table_offset;
+    uint32_t hash_table_length;
+    uint32_t block_table_length;
+};
+typedef struct mpq_header mpq_header_t;
+
+struct mpq_extended_header {
+    uint64_t extended_block_offset_table_offset;
+    uint16_t hash_table_offset_high;
+    uint16_t block_table_offset_high;
+};
+typedef struct mpq_extended_header mpq_extended_header_t;
+
+struct mpq_hash_table_entry {
+    uint32_t hash_a;
+    uint32_t hash_b;
+    uint16_t locale;
+    uint16_t platform;
+    uint32_t block_table_index;
+};
+typedef struct mpq_hash_table_entry mpq_hash_table_entry_t;
+
+struct mpq_block_table_entry {
+    uint32_t offset;
+    uint32_t archived_size;
+    uint32_t size;
+    uint32_t flags;
+};
+typedef struct mpq_block_table_entry mpq_block_table_entry_t;
+
+struct mpq_extended_block_offset_table_entry {
+    uint16_t offset_high;
+};
+typedef struct mpq_extended_block_offset_table_entry mpq_extended_block_offset_table_entry_t;
+
+struct mpq_attributes_header {
+    uint32_t magic;
+    uint32_t attributes;
+};
+typedef struct mpq_attributes_header mpq_attributes_header_t;
+
+#define MPQ_OLD_SIGNATURE_KEY_SIZE 512
+struct mpq_old_signature {
+    uint32_t unknown0;
+    uint32_t unknown4;
+    uint8_t signature[MPQ_OLD_SIGNATURE_KEY_SIZE / 8];
+};
+typedef struct mpq_old_signature mpq_old_signature_t;
+
+struct mpq_shunt {
+    uint32_t shunt_magic;
+    uint32_t unknown04;
+    uint32_t mpq_header_offset;
+};
+typedef struct mpq_shunt mpq_shunt_t;
+#pragma pack(pop)
+
+// Special values for a hash table entry's block table entry index
+#define MPQ_HASH_TABLE_EMPTY 0xffffffff
+#define MPQ_HASH_TABLE_DELETED 0xfffffffe
+
+// Value returned by mpq_core_find_hash_position when the file is not found
+#define MPQ_NOT_FOUND 0xffffffff
+
+// Precomputed hashes of a filename, for looking up the same file in several hash tables
+struct mpq_name_key {
+    uint32_t position;
+    uint32_t hash_a;
+    uint32_t hash_b;
+};
+typedef struct mpq_name_key mpq_name_key_t;
+
+// A name in a listfile, as an offset and length into the listfile data
+struct mpq_listfile_entry {
+    uint32_t offset;
+    uint32_t length;
+    mpq_name_key_t key;
+};
+typedef struct mpq_listfile_entry mpq_listfile_entry_t;
+
+/*
+    Hash databases map name hashes back to names, so that the names of an archive's files can be resolved without
+    hashing every known name again. A hash database is stored in little endian as a header followed by the entries, 
+    the index and the string arena. Each entry holds the precomputed hashes of a name and the offset of the name, 
+    which is NUL-terminated, in the string arena. The index is an open addressing table of entry indices, looked up 
+    by hash_a with linear probing.
+*/
+#define MPQ_HASH_DATABASE_MAGIC 0x4244484D
+#define MPQ_HASH_DATABASE_VERSION 1
+#define MPQ_HASH_DATABASE_EMPTY_SLOT 0xffffffff
+
+struct mpq_hash_database_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entry_count;
+    
+    // Power of 2, larger than entry_count
+    uint32_t index_length;
+    uint32_t strings_size;
+    uint32_t reserved;
+};
+typedef struct mpq_hash_database_header mpq_hash_database_header_t;
+
+struct mpq_hash_database_entry {
+    uint32_t position;
+    uint32_t hash_a;
+    uint32_t hash_b;
+    uint32_t name_offset;
+};
+typedef struct mpq_hash_database_entry mpq_hash_database_entry_t;
+
+// A validated view of hash database data
+struct mpq_hash_database {
+    uint32_t entry_count;
+    uint32_t index_mask;
+    uint32_t strings_size;
+    const mpq_hash_database_entry_t* entries;
+    const uint32_t* index;
+    const char* strings;
+};
+typedef struct mpq_hash_database mpq_hash_database_t;
+
+/*
+    Journaled saves never overwrite data the committed archive uses. New file data and structural tables are appended to
+    the archive file, and the archive header is only switched to them at the end. A save journal next to the archive file
+    makes this recoverable. It holds up to two records in little endian, each with a CRC32 of its other fields. The begin
+    record is written before the save changes the archive file, and holds the committed archive header and file size. 
+    The commit record follows once the new data and tables are on stable storage, and holds the new header and file size.
+    The journal is deleted once the new header is on stable storage.
+    
+    A journal with a valid commit record is replayed by writing the new header. Otherwise, a journal with a valid begin 
+    record is rolled back by restoring the committed header and file size. A journal without a valid begin record was 
+    torn before the archive file was changed and has nothing to recover.
+*/
+#define MPQ_JOURNAL_MAGIC 0x4A51504D
+#define MPQ_JOURNAL_BEGIN 1
+#define MPQ_JOURNAL_COMMIT 2
+#define MPQ_JOURNAL_MAX_HEADER_SIZE (sizeof(mpq_header_t) + sizeof(mpq_extended_header_t))
+
+#pragma pack(push, 1)
+struct mpq_journal_record {
+    uint32_t magic;
+    uint32_t type;
+    uint64_t archive_offset;
+    uint64_t file_size;
+    uint32_t header_size;
+    
+    // In archive byte order
+    uint8_t header[MPQ_JOURNAL_MAX_HEADER_SIZE];
+    uint32_t checksum;
+};
+typedef struct mpq_journal_record mpq_journal_record_t;
+#pragma pack(pop)
+
+// Error domains of mpq_core_error_t
+enum {
+    MPQCoreErrorDomainMPQ = 1,
+    MPQCoreErrorDomainPOSIX = 2,
+};
+
+struct mpq_core_error {
+    int domain;
+    int code;
+
+    // Only meaningful for sector errors, 0xffffffff otherwise
+    uint32_t sector_index;
+    uint32_t computed_checksum;
+    uint32_t expected_checksum;
+};
+typedef struct mpq_core_error mpq_core_error_t;
+
+struct mpq_archive_info {
+    // Where the header search starts. Set to the offset of the header that was found.
+    off_t archive_offset;
+
+    mpq_header_t header;
+    mpq_extended_header_t extended_header;
+    uint32_t full_sector_size;
+
+    // Relative to archive_offset
+    off_t hash_table_offset;
+    off_t block_table_offset;
+
+    // Set by mpq_core_read_tables
+    off_t archive_size;
+    off_t archive_write_offset;
+};
+typedef struct mpq_archive_info mpq_archive_info_t;
+
+// Describes a file stored in an archive for the sector functions
+struct mpq_core_file {
+    int fd;
+    off_t file_offset;
+    mpq_block_table_entry_t block_entry;
+    uint32_t encryption_key;
+    uint32_t full_sector_size;
+
+    // Required for compressed files which are not single sector files, NULL otherwise
+    const uint32_t* sector_table;
+
+    // Optional, sectors are checked against these when set
+    const uint32_t* sector_adlers;
+};
+typedef struct mpq_core_file mpq_core_file_t;
+
+// Number of entries in a file's sector table, including the sector adlers entry if the file has one
+static __inline__ uint32_t mpq_core_sector_table_length(uint32_t full_sector_size, uint32_t file_size, uint32_t file_flags) {
+    uint32_t sector_table_length = ((file_size + full_sector_size - 1) / full_sector_size) + 1;
+    if ((file_flags & MPQFileHasSectorAdlers))
+        sector_table_length++;
+    return sector_table_length;
+}
+
+// Size of the read buffer mpq_core_read_file needs
+#define MPQ_CORE_READ_BUFFER_SIZE(full_sector_size) ((size_t)(full_sector_size) << 4)
+
+/*
+    Finds the archive header, starting at info->archive_offset and moving forward in 512 bytes
+    increments, following shunts. Fills in the header fields of info.
+*/
+extern int mpq_core_read_header(int fd, int ignore_header_size_field, mpq_archive_info_t* info, mpq_core_error_t* error);
+
+/*
+    Flushes a file to stable storage. Uses F_FULLFSYNC where it is available, since fsync doesn't flush the drive's 
+    cache on Mac OS X.
+*/
+extern int mpq_core_sync(int fd);
+
+/*
+    Writes a journal record, in host byte order, at its place in the journal. The checksum is computed.
+*/
+extern int mpq_core_write_journal_record(int journal_fd, const mpq_journal_record_t* record, mpq_core_error_t* error);
+
+/*
+    Reads a journal and returns the record to apply in record, in host byte order. The type of the record is 
+    MPQ_JOURNAL_COMMIT to replay a save, MPQ_JOURNAL_BEGIN to roll it back, or 0 if there is nothing to recover.
+*/
+extern int mpq_core_read_journal(int journal_fd, mpq_journal_record_t* record, mpq_core_error_t* error);
+
+/*
+    Writes the header of a journal record to the archive file, resizes the archive file to the record's file size 
+    and flushes it to stable storage. Applying a record more than once is harmless.
+*/
+extern int mpq_core_apply_journal_record(int archive_fd, const mpq_journal_record_t* record, mpq_core_error_t* error);
+
+/*
+    Reads, decrypts and validates the hash and block tables, and computes the 64-bit block offset table.
+    hash_table and block_table must hold header.hash_table_length and header.block_table_length entries,
+    block_offset_table header.block_table_length entries. Also fills in the archive size and write offset of info.
+*/
+extern int mpq_core_read_tables(int fd, mpq_archive_info_t* info, mpq_hash_table_entry_t* hash_table, mpq_block_table_entry_t* block_table, off_t* block_offset_table, mpq_core_error_t* error);
+
+/*
+    Returns the hash table position of filename and locale, or MPQ_NOT_FOUND.
+*/
+extern uint32_t mpq_core_find_hash_position(const mpq_hash_table_entry_t* hash_table, uint32_t hash_table_length, const char* filename, uint16_t locale);
+
+/*
+    Computes the name key of filename. Like for mpq_core_find_hash_position, the path separator must be \.
+*/
+extern void mpq_core_compute_name_key(const char* filename, mpq_name_key_t* key);
+
+/*
+    Same as mpq_core_compute_name_key for a name which is not NUL-terminated.
+*/
+extern void mpq_core_compute_name_key_with_length(const char* filename, size_t length, mpq_name_key_t* key);
+
+/*
+    Returns the hash table position of the file with the given name key and locale, or MPQ_NOT_FOUND.
+*/
+extern uint32_t mpq_core_find_hash_position_with_key(const mpq_hash_table_entry_t* hash_table, uint32_t hash_table_length, const mpq_name_key_t* key, uint16_t locale);
+
+/*
+    Splits listfile data into names. Names are separated by CR, LF or semicolons. Names which are not ASCII or which are 
+    MPQ_MAX_PATH bytes or longer are skipped. Fills in the offset and length of at most max_entries entries and returns the 
+    number of names found. Pass NULL entries to only count the names.
+*/
+extern size_t mpq_core_parse_listfile(const void* data, size_t length, mpq_listfile_entry_t* entries, size_t max_entries);
+
+/*
+    Computes the name key of count listfile entries.
+*/
+extern void mpq_core_hash_listfile_entries(const void* data, mpq_listfile_entry_t* entries, size_t count);
+
+/*
+    Validates hash database data and fills in db. The data must outlive db.
+*/
+extern int mpq_core_open_hash_database(const void* data, size_t size, mpq_hash_database_t* db, mpq_core_error_t* error);
+
+/*
+    Returns the name with the given hashes, or NULL if the database doesn't know it.
+*/
+extern const char* mpq_core_hash_database_lookup(const mpq_hash_database_t* db, uint32_t hash_a, uint32_t hash_b);
+
+/*
+    Reads and decodes a file's sector table. sector_table must hold mpq_core_sector_table_length entries.
+*/
+extern int mpq_core_read_sector_table(int fd, off_t file_offset, const mpq_block_table_entry_t* block_entry, uint32_t full_sector_size, uint32_t encryption_key, uint32_t* sector_table, mpq_core_error_t* error);
+
+/*
+    Checks that a sector table is ordered, that no sector is larger than its decompressed size and that
+    everything fits in the file's archived size.
+*/
+extern int mpq_core_check_sector_table(const uint32_t* sector_table, const mpq_block_table_entry_t* block_entry, uint32_t full_sector_size, mpq_core_error_t* error);
+
+/*
+    Reads a file's sector adlers. adlers and scratch must both hold one entry per sector.
+    Returns 0 with *has_adlers set to 0 if the file's sector adlers are empty.
+*/
+extern int mpq_core_read_sector_adlers(const mpq_core_file_t* file, uint32_t* adlers, void* scratch, int* has_adlers, mpq_core_error_t* error);
+
+/*
+    Returns the offset of a sector relative to the beginning of the file's data.
+*/
+extern uint32_t mpq_core_sector_offset(const mpq_core_file_t* file, uint32_t sector_index);
+
+/*
+    Decrypts (in place) and decompresses a sector into out. expected_size is the sector's decompressed size,
+    and sector_key the file's encryption key plus the sector index. Fails unless the sector decodes to exactly 
+    expected_size bytes, which is what the verifier and the transcoder want. mpq_core_read_file is more lenient, 
+    like the MPQFile read path has always been: it truncates oversized stored sectors and zero pads short ones.
+*/
+extern int mpq_core_decode_sector(void* out, uint32_t expected_size, void* sector, uint32_t sector_size, uint32_t flags, uint32_t sector_key);
+
+/*
+    Reads length bytes at offset from a file which is not a single sector file. read_buffer must be
+    MPQ_CORE_READ_BUFFER_SIZE bytes, and data_buffer one sector. Returns the number of bytes read.
+    See mpq_core_decode_sector for the sector sizes this accepts.
+*/
+extern ssize_t mpq_core_read_file(const mpq_core_file_t* file, void* buf, uint32_t offset, uint32_t length, void* read_buffer, void* data_buffer, mpq_core_error_t* error);
+
+/*
+    Reads a whole single sector file. buf must hold the file's size, and read_buffer its archived size.
+*/
+extern int mpq_core_read_one_sector_file(const mpq_core_file_t* file, void* buf, void* read_buffer, mpq_core_error_t* error);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
@@ -11,11 +11,13 @@
 #include <string.h>
 #include <zlib.h>
 
+#if !defined(MPQ_NO_OPENSSL)
 #include <openssl/err.h>
 #include <openssl/evp.h>
 #include <openssl/md5.h>
 #include <openssl/obj_mac.h>
 #include <openssl/sha.h>
+#endif
 
 #include "MPQByteOrder.h"
 #include "MPQCryptography.h"
@@ -30,8 +32,9 @@
 
 static Boolean crypt_table_initialized = FALSE;
 static uint32_t crypt_table[0x500];
-static const uLongf* crc_table;
+static const z_crc_t* crc_table;
 
+#if !defined(MPQ_NO_OPENSSL)
 static void memrev(unsigned char* buf, size_t count) {
     unsigned char* r;
     for (r = buf + count - 1; buf < r; buf++, r--) {
@@ -40,6 +43,7 @@ static void memrev(unsigned char* buf, size_t count) {
         *buf ^= *r;
     }
 }
+#endif
 
 const uint32_t* mpq_get_cryptography_table() {
     assert(crypt_table_initialized);
@@ -71,11 +75,13 @@ void mpq_init_cryptography() {
          }
     }
     
+#if !defined(MPQ_NO_OPENSSL)
     // load up OpenSSL
     OpenSSL_add_all_digests();
     OpenSSL_add_all_algorithms();
     OpenSSL_add_all_ciphers();
     ERR_load_crypto_strings();
+#endif
 	
 	crc_table = get_crc_table();
 }
@@ -176,6 +182,35 @@ uint32_t mpq_hash_cstring(const char* string, uint32_t type) {
     return seed1;
 }
 
+void mpq_hash_name(const char* string, size_t length, uint32_t* position, uint32_t* hash_a, uint32_t* hash_b) {
+    assert(crypt_table_initialized);
+    assert(string);
+    
+    const uint8_t* name = (const uint8_t*)string;
+    const uint8_t* name_end = name + length;
+    
+    uint32_t position_seed1 = 0x7FED7FED, position_seed2 = 0xEEEEEEEE;
+    uint32_t a_seed1 = 0x7FED7FED, a_seed2 = 0xEEEEEEEE;
+    uint32_t b_seed1 = 0x7FED7FED, b_seed2 = 0xEEEEEEEE;
+    uint32_t ch;
+    
+    while (name < name_end) {
+        ch = *name++;
+        if (ch > 0x60 && ch < 0x7b) ch -= 0x20;
+        
+        position_seed1 = crypt_table[(0 << 8) + ch] ^ (position_seed1 + position_seed2);
+        position_seed2 = ch + position_seed1 + position_seed2 + (position_seed2 << 5) + 3;
+        a_seed1 = crypt_table[(1 << 8) + ch] ^ (a_seed1 + a_seed2);
+        a_seed2 = ch + a_seed1 + a_seed2 + (a_seed2 << 5) + 3;
+        b_seed1 = crypt_table[(2 << 8) + ch] ^ (b_seed1 + b_seed2);
+        b_seed2 = ch + b_seed1 + b_seed2 + (b_seed2 << 5) + 3;
+    }
+    
+    *position = position_seed1;
+    *hash_a = a_seed1;
+    *hash_b = b_seed1;
+}
+
 uint32_t mpq_hash_data(const void* data, size_t length, uint32_t type) {
     assert(crypt_table_initialized);
     assert(data);
@@ -219,6 +254,7 @@ void mpq_crc32(const void* buffer, size_t length, uint32_t* crc, uint32_t flags)
     if (crc) *crc = local_crc;
 }
 
+#if !defined(MPQ_NO_OPENSSL)
 int mpq_verify_weak_signature(RSA* public_key, const void* signature, const void* digest) {
     unsigned char reversed_signature[MPQ_WEAK_SIGNATURE_SIZE];
     memcpy(reversed_signature, BUFFER_OFFSET(signature, 8), MPQ_WEAK_SIGNATURE_SIZE);
@@ -245,3 +281,4 @@ int mpq_verify_strong_signature(RSA* public_key, const void* signature, const vo
 
     return (!error && memcmp(reversed_signature, real_digest, MPQ_STRONG_SIGNATURE_SIZE) == 0);
 }
+#endif
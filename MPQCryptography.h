@@ -9,7 +9,11 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+
+// Define MPQ_NO_OPENSSL to build without the signature verification functions (and without OpenSSL)
+#if !defined(MPQ_NO_OPENSSL)
 #include <openssl/rsa.h>
+#endif
 
 #if defined(__cplusplus)
 extern "C" {
@@ -33,13 +37,18 @@ extern void mpq_decrypt(void* data, size_t length, uint32_t key, bool disable_ou
 extern uint32_t mpq_hash_cstring(const char* string, uint32_t type);
 extern uint32_t mpq_hash_data(const void* data, size_t length, uint32_t type);
 
+// Computes the position, name A and name B hashes of a string in a single pass
+extern void mpq_hash_name(const char* string, size_t length, uint32_t* position, uint32_t* hash_a, uint32_t* hash_b);
+
 #define MPQ_CRC_INIT 0x1
 #define MPQ_CRC_UPDATE 0x2
 #define MPQ_CRC_FINALIZE 0x4
 extern void mpq_crc32(const void* buffer, size_t length, uint32_t* crc, uint32_t flags);
 
+#if !defined(MPQ_NO_OPENSSL)
 int mpq_verify_weak_signature(RSA* public_key, const void* signature, const void* digest);
 int mpq_verify_strong_signature(RSA* public_key, const void* signature, const void* digest);
+#endif
 
 #if defined(__cplusplus)
 }
@@ -18,6 +18,9 @@ NSString* const MPQErrorFileInfo = @"MPQErrorFileInfo";
 NSString* const MPQErrorSectorIndex = @"MPQErrorSectorIndex";
 NSString* const MPQErrorComputedSectorChecksum = @"MPQErrorComputedSectorChecksum";
 NSString* const MPQErrorExpectedSectorChecksum = @"MPQErrorExpectedSectorChecksum";
+NSString* const MPQErrorComputedFileChecksum = @"MPQErrorComputedFileChecksum";
+NSString* const MPQErrorExpectedFileChecksum = @"MPQErrorExpectedFileChecksum";
+NSString* const MPQErrorHashPositions = @"MPQErrorHashPositions";
 
 @implementation MPQError
 
@@ -76,6 +79,13 @@ NSString* const MPQErrorExpectedSectorChecksum = @"MPQErrorExpectedSectorChecksu
             case errInvalidSectorChecksumData: return [NSString stringWithFormat:@"%s (%ld)", "invalid sector checksum data", (long)code];
             case errInvalidSectorChecksum: return [NSString stringWithFormat:@"%s (%ld)", "invalid sector checksum", (long)code];
             case errInvalidSignature: return [NSString stringWithFormat:@"%s (%ld)", "invalid signature", (long)code];
+            case errInvalidSectorTable: return [NSString stringWithFormat:@"%s (%ld)", "invalid sector table", (long)code];
+            case errInvalidFileCRC: return [NSString stringWithFormat:@"%s (%ld)", "invalid file CRC", (long)code];
+            case errInvalidFileMD5: return [NSString stringWithFormat:@"%s (%ld)", "invalid file MD5", (long)code];
+            case errInvalidHashDatabase: return [NSString stringWithFormat:@"%s (%ld)", "invalid hash database", (long)code];
+            case errArchiveModified: return [NSString stringWithFormat:@"%s (%ld)", "archive has unsaved changes", (long)code];
+            case errUnknownFilenames: return [NSString stringWithFormat:@"%s (%ld)", "the names of some files are unknown", (long)code];
+            case errSectorSizeMismatch: return [NSString stringWithFormat:@"%s (%ld)", "archives have different sector sizes", (long)code];
             default: abort();
         }
     } else if ([self.domain isEqualToString:NSPOSIXErrorDomain]) {
@@ -86,3 +96,20 @@ NSString* const MPQErrorExpectedSectorChecksum = @"MPQErrorExpectedSectorChecksu
 }
 
 @end
+
+NSError* _MPQErrorWithCoreError(const mpq_core_error_t* core_error, NSDictionary* fileInfo) {
+    if (core_error->domain == MPQCoreErrorDomainPOSIX)
+        return [MPQError errorWithDomain:NSPOSIXErrorDomain code:core_error->code userInfo:nil];
+    
+    NSMutableDictionary* userInfo = [NSMutableDictionary dictionaryWithCapacity:4];
+    if (fileInfo)
+        userInfo[MPQErrorFileInfo] = fileInfo;
+    if (core_error->sector_index != 0xffffffff)
+        userInfo[MPQErrorSectorIndex] = @(core_error->sector_index);
+    if (core_error->code == errInvalidSectorChecksum) {
+        userInfo[MPQErrorComputedSectorChecksum] = @(core_error->computed_checksum);
+        userInfo[MPQErrorExpectedSectorChecksum] = @(core_error->expected_checksum);
+    }
+    
+    return [MPQError errorWithDomain:MPQErrorDomain code:core_error->code userInfo:([userInfo count]) ? userInfo : nil];
+}
@@ -197,11 +197,10 @@
 /*! 
     @method writeToFile:atomically:
     @abstract Writes the entire content of the file to the specified file on disk.
-    @discussion Note that this method simply calls the readDataOfLength: method with the number 
-        of bytes to read set to whatever value will move the file pointer to the end of file.
+    @discussion The file's content is streamed to disk using writeToFileDescriptor:error:, 
+        so the whole file is never held in memory.
         
-        Note that this method simply calls NSData's writeToFile:atomically: method to write 
-        the data to the disk.
+        The file pointer is not modified by this method.
     @param path Path at which the file's content should be written.
     @param atomically Set to YES to write the data to a temporary file and move it to path after.
     @result YES on success and NO on failure.
@@ -209,5 +208,23 @@
 - (BOOL)writeToFile:(NSString*)path atomically:(BOOL)atomically;
 - (BOOL)writeToFile:(NSString*)path atomically:(BOOL)atomically error:(NSError**)error;
 
+/*! 
+    @method writeToFileDescriptor:error:
+    @abstract Writes the entire content of the file to the specified file descriptor.
+    @discussion The file is decompressed a run of sectors at a time into a fixed-size buffer, 
+        and each run is written before the next one is read. Memory use is therefore bounded 
+        regardless of the size of the file.
+        
+        The data is written starting at the current offset of fd, and fd is left positioned 
+        after the data. Descriptors that cannot seek, such as pipes and sockets, are written 
+        to sequentially.
+        
+        The file pointer is not modified by this method.
+    @param fd An open file descriptor, writable.
+    @param error An error object reference that will be set if an error occurs. May be NULL.
+    @result YES on success and NO on failure.
+*/
+- (BOOL)writeToFileDescriptor:(int)fd error:(NSError**)error;
+
 @end
 
@@ -8,6 +8,7 @@
 
 #import <fcntl.h>
 #import <unistd.h>
+#import <sys/stat.h>
 #import <zlib.h>
 #import <aio.h>
 
@@ -22,6 +23,8 @@
 
 #import "SCompression.h"
 #import "NSDateNTFSAdditions.h"
+#import "MPQKitPrivate.h"
+#import "MPQFilePrivate.h"
 
 #if defined(GNUSTEP)
 @interface NSError(GSCategories)
@@ -31,6 +34,13 @@
 
 #define BUFFER_OFFSET(buffer, bytes) ((uint8_t*)buffer + (bytes))
 
+// Size of the buffer used to stream file data to a file descriptor
+#define MPQFILE_STREAM_BUFFER_SIZE 0x100000
+
+@interface MPQFile (MPQFileStreaming)
+- (size_t)_streamBufferSize;
+@end
+
 
 @interface MPQArchive (MPQFilePrivate)
 - (void)decreaseOpenFileCount_:(uint32_t)position;
@@ -41,13 +51,15 @@
 
 - (void)decreaseOpenFileCount_:(uint32_t)position {
     open_file_count--;
-    (open_file_count_table[position])--;
+    uint32_t* file_count = mpq_slot_table_peek(&open_file_count_table, position);
+    if (file_count && *file_count) (*file_count)--;
     if (open_file_count == 0) [self release];
 }
 
 - (void)increaseOpenFileCount_:(uint32_t)position {
     open_file_count++;
-    (open_file_count_table[position])++;
+    uint32_t* file_count = mpq_slot_table_slot(&open_file_count_table, position);
+    if (file_count) (*file_count)++;
     if (open_file_count == 1) [self retain];
 }
 
@@ -85,6 +97,26 @@
         return nil;
     }
     
+    // Dictionary descriptors are only kept for compatibility, unbox into a descriptor structure
+    mpq_file_descriptor_t file_descriptor;
+    memset(&file_descriptor, 0, sizeof(mpq_file_descriptor_t));
+    file_descriptor.parent = descriptor[@"Parent"];
+    file_descriptor.filename = descriptor[@"Filename"];
+    file_descriptor.hash_position = [descriptor[@"Position"] unsignedIntValue];
+    file_descriptor.hash_entry = [descriptor[@"HashTableEntry"] pointerValue];
+    file_descriptor.block_entry = [descriptor[@"BlockTableEntry"] pointerValue];
+    file_descriptor.archive_fd = (descriptor[@"FileDescriptor"]) ? [descriptor[@"FileDescriptor"] intValue] : -1;
+    file_descriptor.file_archive_offset = [descriptor[@"FileArchiveOffset"] longLongValue];
+    file_descriptor.encryption_key = [descriptor[@"EncryptionKey"] unsignedIntValue];
+    file_descriptor.sector_size_shift = [descriptor[@"SectorSizeShift"] unsignedIntValue];
+    file_descriptor.sector_table_length = [descriptor[@"SectorTableLength"] unsignedIntValue];
+    file_descriptor.sector_table = [descriptor[@"SectorTable"] pointerValue];
+    file_descriptor.data_source_proxy = descriptor[@"DataSourceProxy"];
+    
+    return [self initWithDescriptor:&file_descriptor error:error];
+}
+
+- (id)initWithDescriptor:(const mpq_file_descriptor_t*)descriptor error:(NSError**)error {
     if ([self isMemberOfClass:[MPQFile class]]) {
         [self doesNotRecognizeSelector:_cmd];
         ReturnFromInitWithError(MPQErrorDomain, errInvalidClass, nil, error)
@@ -94,15 +126,16 @@
     if (!self)
         return nil;
     
-    filename = [descriptor[@"Filename"] retain];
-    hash_position = [descriptor[@"Position"] unsignedIntValue];
+    // A nil filename is synthesized on demand by name
+    filename = [descriptor->filename retain];
+    hash_position = descriptor->hash_position;
     file_pointer = 0;
     
-    parent = descriptor[@"Parent"];
+    parent = descriptor->parent;
     NSAssert(parent, @"Invalid parent archive reference");
     
-    hash_entry = *(mpq_hash_table_entry_t*)[descriptor[@"HashTableEntry"] pointerValue];
-    block_entry = *(mpq_block_table_entry_t*)[descriptor[@"BlockTableEntry"] pointerValue];
+    hash_entry = *descriptor->hash_entry;
+    block_entry = *descriptor->block_entry;
     
     _checkSectorAdlers = YES;
     
@@ -118,6 +151,13 @@
 }
 
 - (NSString*)name {
+    if (!filename) {
+        const char* filename_cstring = [parent _filenameAtPosition:hash_position];
+        if (filename_cstring)
+            filename = [[NSString alloc] initWithCString:filename_cstring encoding:NSASCIIStringEncoding];
+        else
+            filename = [[NSString alloc] initWithFormat:@"unknown %x", hash_position];
+    }
     return filename;
 }
 
@@ -238,17 +278,99 @@
 }
 
 - (BOOL)writeToFile:(NSString*)path atomically:(BOOL)atomically error:(NSError**)error {
+    NSString* temp_path = nil;
+    int fd;
+    
+    if (atomically) {
+        fd = _MPQMakeTempFileInDirectory(path.stringByDeletingLastPathComponent, &temp_path, error);
+        if (fd == -1)
+            return NO;
+    } else {
+        fd = open(path.fileSystemRepresentation, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd == -1)
+            ReturnValueWithPOSIXError(NO, nil, error)
+    }
+    
+    BOOL result = [self writeToFileDescriptor:fd error:error];
+    
+    if (atomically) {
+        // mkstemp creates files readable only by their owner, give the file the permissions open would have
+        mode_t mask = umask(0);
+        umask(mask);
+        fchmod(fd, 0666 & ~mask);
+    }
+    
+    close(fd);
+    
+    if (atomically) {
+        if (result && rename(temp_path.fileSystemRepresentation, path.fileSystemRepresentation) == -1) {
+            if (error)
+                *error = [MPQError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
+            result = NO;
+        }
+        if (!result)
+            unlink(temp_path.fileSystemRepresentation);
+    }
+    
+    return result;
+}
+
+- (BOOL)writeToFileDescriptor:(int)fd error:(NSError**)error {
+    // Write at the current offset of fd if it has one, otherwise fall back to write (pipes, sockets)
+    off_t write_offset = lseek(fd, 0, SEEK_CUR);
+    BOOL seekable = (write_offset != -1) ? YES : NO;
+    if (!seekable && errno != ESPIPE)
+        ReturnValueWithPOSIXError(NO, nil, error)
+    
+    // The stream buffer is the only memory this method needs, no matter how large the file is
+    size_t buffer_size = [self _streamBufferSize];
+    void* buffer = malloc(buffer_size);
+    if (!buffer)
+        ReturnValueWithError(NO, MPQErrorDomain, errOutOfMemory, nil, error)
+    
     uint32_t old = file_pointer;
     file_pointer = 0;
+    BOOL result = YES;
+    
+    while (result) {
+        ssize_t bytes_read = [self read:buffer size:buffer_size error:error];
+        if (bytes_read == -1) {
+            result = NO;
+            break;
+        }
+        if (bytes_read == 0)
+            break;
+        
+        size_t bytes_written = 0;
+        while (bytes_written < (size_t)bytes_read) {
+            ssize_t write_result = (seekable) ? pwrite(fd, BUFFER_OFFSET(buffer, bytes_written), bytes_read - bytes_written, write_offset) : write(fd, BUFFER_OFFSET(buffer, bytes_written), bytes_read - bytes_written);
+            if (write_result == -1) {
+                if (errno == EINTR)
+                    continue;
+                if (error)
+                    *error = [MPQError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
+                result = NO;
+                break;
+            }
+            
+            bytes_written += write_result;
+            write_offset += write_result;
+        }
+    }
     
-    NSData* fileData = [self copyDataToEndOfFile];
-    BOOL result = [fileData writeToFile:path options:(atomically) ? NSAtomicWrite : 0 error:error];
+    // Leave the descriptor positioned after the data, like write would have
+    if (result && seekable)
+        lseek(fd, write_offset, SEEK_SET);
     
     file_pointer = old;
-    [fileData release];
+    free(buffer);
     return result;
 }
 
+- (size_t)_streamBufferSize {
+    return MPQFILE_STREAM_BUFFER_SIZE;
+}
+
 @end
 
 #pragma mark -
@@ -260,12 +382,12 @@
 
 @implementation MPQFileDataSource
 
-- (id)initForFile:(NSDictionary*)descriptor error:(NSError**)error {
-    self = [super initForFile:descriptor error:error];
+- (id)initWithDescriptor:(const mpq_file_descriptor_t*)descriptor error:(NSError**)error {
+    self = [super initWithDescriptor:descriptor error:error];
     if (!self)
         return nil;
     
-    dataSource = [(MPQDataSourceProxy*)descriptor[@"DataSourceProxy"] createActualDataSource:error];
+    dataSource = [descriptor->data_source_proxy createActualDataSource:error];
     NSAssert(dataSource, @"Invalid data object");
     
     return self;
@@ -313,17 +435,11 @@
 #pragma mark -
 
 @interface MPQFileConcreteMPQ : MPQFile {
-    int archive_fd;
-    off_t file_archive_offset;
-    
-    uint32_t encryption_key;
-    
-    uint32_t sector_size_shift;
-    uint32_t full_sector_size;
+    mpq_core_file_t core_file;
     
     uint32_t sector_table_length;
-    uint32_t* sector_table;
     uint32_t* _sector_adlers;
+    BOOL _sector_adlers_loaded;
     
     void* buffer_;
     void* read_buffer;
@@ -333,284 +449,88 @@
 
 @implementation MPQFileConcreteMPQ
 
-- (id)initForFile:(NSDictionary*)descriptor error:(NSError**)error {
-    self = [super initForFile:descriptor error:error];
+- (id)initWithDescriptor:(const mpq_file_descriptor_t*)descriptor error:(NSError**)error {
+    self = [super initWithDescriptor:descriptor error:error];
     if (!self)
         return nil;
     
-    archive_fd = [descriptor[@"FileDescriptor"] intValue];
-    NSAssert(archive_fd >= 0, @"Invalid archive file descriptor");
-    
-    sector_size_shift = [descriptor[@"SectorSizeShift"] unsignedIntValue];
-    full_sector_size = MPQ_BASE_SECTOR_SIZE << sector_size_shift;
-    NSAssert(sector_size_shift > 0, @"Invalid sector size shift");
+    NSAssert(descriptor->archive_fd >= 0, @"Invalid archive file descriptor");
+    NSAssert(descriptor->sector_size_shift > 0, @"Invalid sector size shift");
     
-    file_archive_offset = [descriptor[@"FileArchiveOffset"] longLongValue];
-    encryption_key = [descriptor[@"EncryptionKey"] unsignedIntValue];
+    core_file.fd = descriptor->archive_fd;
+    core_file.file_offset = descriptor->file_archive_offset;
+    core_file.block_entry = block_entry;
+    core_file.encryption_key = descriptor->encryption_key;
+    core_file.full_sector_size = MPQ_BASE_SECTOR_SIZE << descriptor->sector_size_shift;
+    core_file.sector_adlers = NULL;
     
-    sector_table_length = [descriptor[@"SectorTableLength"] unsignedIntValue];
-    sector_table = [descriptor[@"SectorTable"] pointerValue];
+    // Files which are not compressed are stored contiguously and don't have a sector table
+    sector_table_length = descriptor->sector_table_length;
     if (block_entry.flags & (MPQFileCompressed | MPQFileDiabloCompressed)) {
         NSAssert(sector_table_length > 0, @"Invalid sector table length");
-        NSAssert(sector_table, @"Invalid sector table");
-    } else if (sector_table_length > 1) {
-        // Synthesize a sector table to have a unified read method
-        sector_table = malloc(sizeof(uint32_t) * sector_table_length);
-        for (uint32_t sector_index = 0; sector_index < sector_table_length - 1; sector_index++) sector_table[sector_index] = sector_index * full_sector_size;
-        sector_table[sector_table_length - 1] = block_entry.size;
-        assert(sector_table[sector_table_length - 1] - sector_table[sector_table_length - 2] <= full_sector_size);
+        NSAssert(descriptor->sector_table, @"Invalid sector table");
+        core_file.sector_table = descriptor->sector_table;
     } else
-        sector_table = NULL;
+        core_file.sector_table = NULL;
     
     _sector_adlers = NULL;
+    _sector_adlers_loaded = NO;
     
     // Memory for compression/decompression operations
-    buffer_ = valloc(full_sector_size + (full_sector_size << 4));
+    buffer_ = valloc(core_file.full_sector_size + MPQ_CORE_READ_BUFFER_SIZE(core_file.full_sector_size));
     if (!buffer_)
         ReturnFromInitWithError(MPQErrorDomain, errOutOfMemory, nil, error)
     
     read_buffer = buffer_;
-    data_buffer = BUFFER_OFFSET(buffer_, full_sector_size << 4);
+    data_buffer = BUFFER_OFFSET(buffer_, MPQ_CORE_READ_BUFFER_SIZE(core_file.full_sector_size));
     
     return self;
 }
 
 - (void)dealloc {
+    [parent _releaseCachedRange:core_file.file_offset length:block_entry.archived_size];
     if (buffer_)
         free(buffer_);
-    if (!(block_entry.flags & (MPQFileCompressed | MPQFileDiabloCompressed)) && sector_table)
-        free(sector_table);
     if (_sector_adlers)
         free(_sector_adlers);
     [super dealloc];
 }
 
-- (ssize_t)_readSectors:(void*)buf range:(NSRange)which keeping:(NSRange)bytesToKeep error:(NSError**)error {
-    int perr = 0;
-    int stage = 0;
-    
-    // Make sure the first sector is within bounds. Remember, sector_table_length - 2 is the index of the last sector.
-    if (which.location > sector_table_length - 2)
-        ReturnValueWithError(-1, MPQErrorDomain, errOutOfBounds, nil, error);
-    
-    // Make sure the last sector is within bounds.
-    // which.location + which.length - 1 is the index of the last sector to be read.
-    if (which.location + which.length > sector_table_length - 1)
-        ReturnValueWithError(-1, MPQErrorDomain, errOutOfBounds, nil, error);
-    
-    // Current offset into buf
-    size_t data_offset = 0;
-    
-    // Read state
-    uint32_t last_sector = sector_table_length - 2;
-    uint32_t decompressed_sector_size = full_sector_size;
-    // Explicit cast is OK here, MPQ file sizes are 32-bit
-    size_t bytes_left = bytesToKeep.length;
-    uint32_t read_size = full_sector_size << 4;
-    if (read_size > block_entry.archived_size) read_size = full_sector_size;
-    ssize_t bytes_read;
-    
-    BOOL encrypted = (block_entry.flags & MPQFileEncrypted) ? YES : NO;
-    
-    // If live sector checksum validation is enabled, read the sector adlers (if we have them)
-    if (_checkSectorAdlers && (block_entry.flags & MPQFileHasSectorAdlers) && !_sector_adlers) {
-        size_t sector_adlers_size = sector_table[sector_table_length] - sector_table[sector_table_length - 1];
-        if (sector_adlers_size) {
-            void* compressed_adlers = malloc(sector_adlers_size);
-            if (!compressed_adlers)
-                ReturnValueWithError(-1, MPQErrorDomain, errOutOfMemory, nil, error)
-            
-            bytes_read = pread(archive_fd, compressed_adlers, sector_adlers_size, file_archive_offset + sector_table[sector_table_length - 1]);
-            if (bytes_read == -1) {
-                free(compressed_adlers);
-                ReturnValueWithPOSIXError(-1, nil, error)
-            }
-            if ((size_t)bytes_read < sector_adlers_size) {
-                free(compressed_adlers);
-                ReturnValueWithError(-1, MPQErrorDomain, errEndOfFile, nil, error)
-            }
-            
-            uint32_t decompressed_adlers_size = (sector_table_length - 1) * (uint32_t)sizeof(uint32_t);
-            _sector_adlers = malloc(decompressed_adlers_size);
-            if (!compressed_adlers) {
-                free(compressed_adlers);
-                ReturnValueWithError(-1, MPQErrorDomain, errOutOfMemory, nil, error)
-            }
-            
-            perr = SCompDecompress(_sector_adlers, &decompressed_adlers_size, compressed_adlers, (uint32_t)sector_adlers_size);
-            free(compressed_adlers);
-            if (perr == 0)
-                ReturnValueWithError(-1, MPQErrorDomain, errInvalidSectorChecksumData, nil, error)
-        }
+- (BOOL)_loadSectorAdlers:(NSError**)error {
+    if (!(block_entry.flags & MPQFileHasSectorAdlers)) {
+        _sector_adlers_loaded = YES;
+        return YES;
     }
     
-#if defined(MPQFILE_PREAD_CHECK)
-    // memcmp and decompression buffer
-    void* memcmp_buffer = malloc(full_sector_size << 1);
-#endif
-    
-    // This will keep track of which aiocb we're going to read from (and suspend on) next
-    uint8_t current_iocb = 0;
-    
-    // Keep track of left-overs
-    size_t bytes_available[2] = {0, 0};
-    
-    // Explicit cast is OK here, there cannot be more sectors than the 32-bit integer range
-    uint32_t current_sector = (uint32_t)which.location;
-    uint32_t last_needed_sector_plus_one = (uint32_t)(which.location + which.length);
-    uint32_t last_needed_sector = last_needed_sector_plus_one - 1;
-    while (current_sector < last_needed_sector_plus_one) {
-        bytes_read = pread(archive_fd, read_buffer, read_size, file_archive_offset + sector_table[current_sector]);
-        if (bytes_read == -1) {
-            perr = -1;
-            if (error)
-                *error = [MPQError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
-            goto ErrorExit;
-        } else if (bytes_read == 0) {
-            if (error)
-                *error = [MPQError errorWithDomain:MPQErrorDomain code:errEndOfFile userInfo:nil];
-            goto ErrorExit;
-        }
-        
-        void* sector_buffer = read_buffer;
-        uint32_t sector_buffer_offset = 0;
-        bytes_available[current_iocb] = bytes_read;
-        
-        // Compute sector_size for the first iteration
-        uint32_t sector_size = sector_table[current_sector + 1] - sector_table[current_sector];
-        
-        // Process as many sectors as possible with the current aio buffer
-        stage = 2;
-        while (bytes_available[current_iocb] >= sector_size) {
-#if defined(MPQFILE_PREAD_CHECK)
-            NSLog(@"Doing pread check...");
-            perr = pread(archive_fd, memcmp_buffer, sector_size, file_archive_offset + sector_table[current_sector]);
-            if (perr == -1) {
-                if (error)
-                    *error = [MPQError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
-                goto ErrorExit;
-            }
-            
-            perr = memcmp(memcmp_buffer, sector_buffer + sector_buffer_offset, sector_size);
-            if (perr) {
-                NSLog(@"memcmp failed!");
-                perr = 0;
-                if (error)
-                    *error = [MPQError errorWithDomain:MPQErrorDomain code:0xBABE userInfo:nil];
-                goto ErrorExit;
-            }
-            
-            sector_buffer = memcmp_buffer;
-            sector_buffer_offset = 0;
-#endif
-            // If we have sector adlers, checksum the sector and verify
-            if (_sector_adlers) {
-                uLong adler = adler32(0L, BUFFER_OFFSET(sector_buffer, sector_buffer_offset), sector_size);
-                if (adler != (uLong)_sector_adlers[current_sector]) {
-                    if (error) {
-                        NSDictionary* userInfo = [[NSDictionary alloc] initWithObjectsAndKeys:
-                            [self fileInfo], MPQErrorFileInfo, 
-                            @(current_sector), MPQErrorSectorIndex, 
-                            @(adler), MPQErrorComputedSectorChecksum, 
-                            @(_sector_adlers[current_sector]), MPQErrorExpectedSectorChecksum, 
-                            nil];
-                        *error = [MPQError errorWithDomain:MPQErrorDomain code:errInvalidSectorChecksum userInfo:userInfo];
-                        [userInfo release];
-                    }
-                    goto ErrorExit;
-                }
-            }
-            
-            // If the file is encrypted, decrypt the sector
-            if (encrypted)
-                mpq_decrypt(BUFFER_OFFSET(sector_buffer, sector_buffer_offset), sector_size, encryption_key + current_sector, NO);
-            
-            // if we're processing the last sector of the file, we need to adjust its decompressed size
-            if (current_sector == last_sector)
-                decompressed_sector_size = block_entry.size - (last_sector * full_sector_size);
-            
-            // normally we just decompress into the client buffer at the proper offset
-            void* decompression_destination_buffer = BUFFER_OFFSET(buf, data_offset);
-            
-            // however if we're processing the last needed sector or if the client buffer is just too small, we need to use a temporary buffer
-            if (current_sector == last_needed_sector || bytesToKeep.length < decompressed_sector_size)
-                decompression_destination_buffer = data_buffer;
-            
-            // Use the proper decompression method
-            if (block_entry.flags & MPQFileCompressed) {
-                perr = SCompDecompress(decompression_destination_buffer, &decompressed_sector_size, BUFFER_OFFSET(sector_buffer, sector_buffer_offset), sector_size);
-                if (perr == 0) {
-                    if (error)
-                        *error = [MPQError errorWithDomain:MPQErrorDomain code:errDecompressionFailed userInfo:nil];
-                    goto ErrorExit;
-                }
-            } else if ((block_entry.flags & MPQFileDiabloCompressed) && (sector_size < decompressed_sector_size)) {
-                // FIXME: handle Decompress_pklib errors
-                Decompress_pklib(decompression_destination_buffer, &decompressed_sector_size, BUFFER_OFFSET(sector_buffer, sector_buffer_offset), sector_size);
-            } else {
-                decompressed_sector_size = sector_size;
-                memcpy(decompression_destination_buffer, BUFFER_OFFSET(sector_buffer, sector_buffer_offset), decompressed_sector_size);
-            }
-            
-            // need to handle the first and last needed sectors a bit differently
-            if (current_sector == which.location) {
-                assert(data_offset == 0);
-                
-                // determime how many bytes we need to skip from the beginning of the sector (bytesToKeep is w/r to the whole file)
-                // explicit cast is OK here, sector sizes are 32-bit
-                uint32_t bytes_to_skip = (uint32_t)bytesToKeep.location % full_sector_size;
-                
-                // determine how many bytes we need to copy (either the full sector minus skipped bytes, or just the number of bytes left if we only need one sector)
-                size_t bytes_to_copy = MIN(bytes_left, decompressed_sector_size - bytes_to_skip);
-                
-                // must use memmove because decompression_destination_buffer may be == buf
-                memmove(buf, BUFFER_OFFSET(decompression_destination_buffer, bytes_to_skip), bytes_to_copy);
-                data_offset += bytes_to_copy;
-            } else if (current_sector == last_needed_sector) {
-                memcpy(BUFFER_OFFSET(buf, data_offset), decompression_destination_buffer, bytes_left);
-                data_offset += bytes_left;
-            } else
-                data_offset += decompressed_sector_size;
-            
-            // Update bytes_left
-            assert(data_offset <= bytesToKeep.length);
-            bytes_left = (data_offset > bytesToKeep.length) ? 0 : bytesToKeep.length - data_offset;
-            
-            // Move on the the next sector
-            current_sector++;
-            if (current_sector == last_needed_sector_plus_one)
-                break;
-            
-            // Update the number of bytes available from the current aio buffer and update sector_size for the next sector
-            bytes_available[current_iocb] -= sector_size;
-            sector_buffer_offset += sector_size;
-            sector_size = sector_table[current_sector + 1] - sector_table[current_sector];
-        }
-        
-        // Immediatly exit if we're done
-        if (current_sector == last_needed_sector_plus_one)
-            break;
+    // One adler per sector
+    size_t sector_adlers_size = (sector_table_length - 1) * sizeof(uint32_t);
+    _sector_adlers = malloc(sector_adlers_size);
+    void* compressed_adlers = malloc(sector_adlers_size);
+    if (!_sector_adlers || !compressed_adlers) {
+        free(compressed_adlers);
+        free(_sector_adlers);
+        _sector_adlers = NULL;
+        ReturnValueWithError(NO, MPQErrorDomain, errOutOfMemory, nil, error)
     }
     
-#if defined(MPQFILE_PREAD_CHECK)
-    free(memcmp_buffer);
-#endif
-    
-    // Make sure we respected our contract
-    assert(bytes_left == 0);
-    assert(data_offset == bytesToKeep.length);
-    return data_offset;
-        
-ErrorExit:
-    MPQDebugLog(@"%@ error occured at stage %d in readSectors", (error) ? (*error).localizedDescription : nil, stage);
-    if (perr == -1)
-        MPQDebugLog(@"errno is %d", errno);
+    int has_adlers = 0;
+    mpq_core_error_t core_error;
+    int result = mpq_core_read_sector_adlers(&core_file, _sector_adlers, compressed_adlers, &has_adlers, &core_error);
+    free(compressed_adlers);
+    if (result == -1 || !has_adlers) {
+        free(_sector_adlers);
+        _sector_adlers = NULL;
+    }
     
-#if defined(MPQFILE_PREAD_CHECK)
-    free(memcmp_buffer);
-#endif
+    // Only remember the adlers as loaded on success, so that a failed read is retried rather than silently disabling validation
+    if (result == -1) {
+        if (error)
+            *error = _MPQErrorWithCoreError(&core_error, nil);
+        return NO;
+    }
     
-    return -1;
+    _sector_adlers_loaded = YES;
+    return YES;
 }
 
 - (ssize_t)read:(void*)buf size:(size_t)size error:(NSError**)error {
@@ -621,23 +541,44 @@ ErrorExit:
     if (size == 0)
         return 0;
     
-    uint32_t location = file_pointer / full_sector_size;
-    NSRange sectors_range = NSMakeRange(location, ((file_pointer + size + full_sector_size - 1) / full_sector_size) - location);
-    NSRange data_range = NSMakeRange(file_pointer, size);
-        
-    ssize_t bytes_read = [self _readSectors:buf range:sectors_range keeping:data_range error:error];
+    // If live sector checksum validation is enabled, read the sector adlers (if we have them)
+    if (_checkSectorAdlers && !_sector_adlers_loaded) {
+        if (![self _loadSectorAdlers:error])
+            return -1;
+    }
+    core_file.sector_adlers = (_checkSectorAdlers) ? _sector_adlers : NULL;
+    
     // Explicit cast is OK here, MPQ file sizes are 32-bit
-    if (bytes_read != -1)
-        file_pointer += (uint32_t)bytes_read;
+    mpq_core_error_t core_error;
+    ssize_t bytes_read = mpq_core_read_file(&core_file, buf, file_pointer, (uint32_t)size, read_buffer, data_buffer, &core_error);
+    if (bytes_read == -1) {
+        MPQDebugLog(@"read failed with core error %d in domain %d at sector %u", core_error.code, core_error.domain, core_error.sector_index);
+        if (error)
+            *error = _MPQErrorWithCoreError(&core_error, [self fileInfo]);
+        return -1;
+    }
+    
+    // Explicit cast is OK here, MPQ file sizes are 32-bit
+    file_pointer += (uint32_t)bytes_read;
     return bytes_read;
 }
 
+- (size_t)_streamBufferSize {
+    // Stream whole sector runs so that no sector is ever decompressed twice
+    size_t run_size = MPQ_CORE_READ_BUFFER_SIZE(core_file.full_sector_size);
+    return (run_size > MPQFILE_STREAM_BUFFER_SIZE) ? run_size : MPQFILE_STREAM_BUFFER_SIZE - (MPQFILE_STREAM_BUFFER_SIZE % run_size);
+}
+
 - (NSData*)_copyRawSector:(uint32_t)index error:(NSError**)error {
     if (index > sector_table_length - 2)
         ReturnValueWithError(nil, MPQErrorDomain, errOutOfBounds, nil, error)
     
-    size_t sector_size = sector_table[index + 1] - sector_table[index];
-    ssize_t bytes_read = pread(archive_fd, read_buffer, sector_size, file_archive_offset + sector_table[index]);
+    uint32_t sector_offset = mpq_core_sector_offset(&core_file, index);
+    size_t sector_size = mpq_core_sector_offset(&core_file, index + 1) - sector_offset;
+    if (sector_size > MPQ_CORE_READ_BUFFER_SIZE(core_file.full_sector_size))
+        ReturnValueWithError(nil, MPQErrorDomain, errInvalidSectorTable, nil, error)
+    
+    ssize_t bytes_read = pread(core_file.fd, read_buffer, sector_size, core_file.file_offset + sector_offset);
     if (bytes_read == -1)
         ReturnValueWithPOSIXError(nil, nil, error)
     if ((size_t)bytes_read < sector_size)
@@ -651,9 +592,7 @@ ErrorExit:
 #pragma mark -
 
 @interface MPQFileConcreteMPQOneSector : MPQFile {
-    int archive_fd;
-    off_t file_archive_offset;
-    uint32_t encryption_key;
+    mpq_core_file_t core_file;
     
     void* data_cache_;
 }
@@ -661,21 +600,24 @@ ErrorExit:
 
 @implementation MPQFileConcreteMPQOneSector
 
-- (id)initForFile:(NSDictionary*)descriptor error:(NSError**)error {
-    self = [super initForFile:descriptor error:error];
+- (id)initWithDescriptor:(const mpq_file_descriptor_t*)descriptor error:(NSError**)error {
+    self = [super initWithDescriptor:descriptor error:error];
     if (!self)
         return nil;
     
-    archive_fd = [descriptor[@"FileDescriptor"] intValue];
-    NSAssert(archive_fd, @"Invalid archive file descriptor");
+    NSAssert(descriptor->archive_fd >= 0, @"Invalid archive file descriptor");
     
-    file_archive_offset = [descriptor[@"FileArchiveOffset"] longLongValue];
-    encryption_key = [descriptor[@"EncryptionKey"] unsignedIntValue];
+    memset(&core_file, 0, sizeof(mpq_core_file_t));
+    core_file.fd = descriptor->archive_fd;
+    core_file.file_offset = descriptor->file_archive_offset;
+    core_file.block_entry = block_entry;
+    core_file.encryption_key = descriptor->encryption_key;
     
     return self;
 }
 
 - (void)dealloc {
+    [parent _releaseCachedRange:core_file.file_offset length:block_entry.archived_size];
     if (data_cache_)
         free(data_cache_);
     [super dealloc];
@@ -697,44 +639,22 @@ ErrorExit:
             ReturnValueWithError(-1, MPQErrorDomain, errOutOfMemory, nil, error)
         
         void* read_buffer = malloc(block_entry.archived_size);
-        if (!read_buffer)
+        if (!read_buffer) {
+            free(data_cache_);
+            data_cache_ = NULL;
             ReturnValueWithError(-1, MPQErrorDomain, errOutOfMemory, nil, error)
-                    
-        // Read the data
-        ssize_t bytes_read = pread(archive_fd, read_buffer, block_entry.archived_size, file_archive_offset);
-        if (bytes_read == -1) {
-            free(read_buffer);
-            ReturnValueWithPOSIXError(-1, nil, error)
-        }
-        if ((uint32_t)bytes_read < block_entry.archived_size) {
-            free(read_buffer);
-            ReturnValueWithError(-1, MPQErrorDomain, errIO, nil, error)
-        }
-        
-        // If the file is encrypted, decrypt it
-        if (block_entry.flags & MPQFileEncrypted)
-            mpq_decrypt(read_buffer, block_entry.archived_size, encryption_key, NO);
-        
-        // Decompress the file or do a straight memory copy
-        uint32_t decompressed_size = block_entry.size;
-        if (block_entry.flags & MPQFileCompressed) {
-            if (SCompDecompress(data_cache_, &decompressed_size, read_buffer, block_entry.archived_size) == 0) {
-                free(read_buffer);
-                ReturnValueWithError(-1, MPQErrorDomain, errDecompressionFailed, nil, error)
-            }
-        } else if ((block_entry.flags & MPQFileDiabloCompressed) && (block_entry.archived_size < decompressed_size)) {
-            Decompress_pklib(data_cache_, &decompressed_size, read_buffer, block_entry.archived_size);
-        } else {
-            memcpy(data_cache_, read_buffer, block_entry.archived_size);
-            decompressed_size = block_entry.archived_size;
-        }
-        
-        if (decompressed_size != block_entry.size) {
-            free(read_buffer);
-            ReturnValueWithError(-1, MPQErrorDomain, errDecompressionFailed, nil, error)
         }
         
+        mpq_core_error_t core_error;
+        int result = mpq_core_read_one_sector_file(&core_file, data_cache_, read_buffer, &core_error);
         free(read_buffer);
+        if (result == -1) {
+            free(data_cache_);
+            data_cache_ = NULL;
+            if (error)
+                *error = _MPQErrorWithCoreError(&core_error, nil);
+            return -1;
+        }
     }
     
     memcpy(buf, BUFFER_OFFSET(data_cache_, file_pointer), size);
@@ -752,7 +672,7 @@ ErrorExit:
     if (!read_buffer)
         ReturnValueWithError(nil, MPQErrorDomain, errOutOfMemory, nil, error)
     
-    ssize_t bytes_read = pread(archive_fd, read_buffer, block_entry.archived_size, file_archive_offset);
+    ssize_t bytes_read = pread(core_file.fd, read_buffer, block_entry.archived_size, core_file.file_offset);
     if (bytes_read == -1) {
         free(read_buffer);
         ReturnValueWithPOSIXError(nil, nil, error)
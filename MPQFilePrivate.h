@@ -8,7 +8,32 @@
 
 #import <MPQKit/MPQFile.h>
 
+@class MPQDataSourceProxy;
+
+// Everything an MPQFile subclass needs to initialize itself. Pointers are borrowed from the parent archive.
+struct mpq_file_descriptor {
+    MPQArchive* parent;
+    NSString* filename;
+    uint32_t hash_position;
+    const mpq_hash_table_entry_t* hash_entry;
+    const mpq_block_table_entry_t* block_entry;
+    
+    // Files stored in the archive
+    int archive_fd;
+    off_t file_archive_offset;
+    uint32_t encryption_key;
+    uint32_t sector_size_shift;
+    uint32_t sector_table_length;
+    uint32_t* sector_table;
+    
+    // Files pending addition
+    MPQDataSourceProxy* data_source_proxy;
+};
+typedef struct mpq_file_descriptor mpq_file_descriptor_t;
+
 @interface MPQFile (MPQFilePrivate)
+- (id)initForFile:(NSDictionary*)descriptor error:(NSError**)error;
+- (id)initWithDescriptor:(const mpq_file_descriptor_t*)descriptor error:(NSError**)error;
 - (NSData*)_copyRawSector:(uint32_t)index error:(NSError**)error;
 @end
 
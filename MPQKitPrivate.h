@@ -20,3 +20,5 @@
 #import <MPQKit/MPQArchivePrivate.h>
 
 extern char* _MPQCreateASCIIFilename(NSString* filename, NSError** error);
+extern int _MPQMakeTempFileInDirectory(NSString* directory, NSString** tempFilePath, NSError** error);
+extern NSError* _MPQErrorWithCoreError(const mpq_core_error_t* core_error, NSDictionary* fileInfo);
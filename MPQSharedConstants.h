@@ -279,6 +279,44 @@
 */
 #define MPQIgnoreHeaderSizeField		@"MPQIgnoreHeaderSizeField"
 
+/*!
+	@defined MPQArchiveCachePolicy
+	@discussion Key to specify how the archive file should interact with the system's file cache. 
+		The default is MPQCachePolicyNoCache on Mac OS X and MPQCachePolicySystem on other systems. See the MPQCachePolicy enum page for documentation on valid values.
+	
+	NSNumber objects wrapping a MPQCachePolicy scalar are expected as the value of this key.
+*/
+#define MPQArchiveCachePolicy			@"MPQArchiveCachePolicy"
+
+/*!
+	@defined MPQArchiveIndexCacheDirectory
+	@discussion Key to specify a directory in which to keep index caches. An index cache holds an archive's decrypted 
+		tables, known encryption keys, known filenames and cached sector tables, and lets the archive be opened again 
+		without reading and decrypting its tables. Index caches are only used if the archive's path, size, modification 
+		date and header match. See -[MPQArchive writeIndexCache:].
+	
+	NSString objects are expected as the value of this key.
+*/
+#define MPQArchiveIndexCacheDirectory	@"MPQArchiveIndexCacheDirectory"
+
+/*!
+	@defined MPQArchiveJournaledSaves
+	@discussion Key to specify if in-place saves should be journaled. The default is NO. See 
+		-[MPQArchive setUsesJournaledSaves:].
+	
+	NSNumber objects wrapping a BOOL scalar are expected as the value of this key.
+*/
+#define MPQArchiveJournaledSaves		@"MPQArchiveJournaledSaves"
+
+/*!
+	@defined MPQArchiveMaximumHashTableLoad
+	@discussion Key to specify the fraction of the hash table which may be used before it is grown at save time. 
+		The default is 0, which disables automatic resizing. See -[MPQArchive setMaximumHashTableLoad:].
+	
+	NSNumber objects wrapping a double scalar are expected as the value of this key.
+*/
+#define MPQArchiveMaximumHashTableLoad	@"MPQArchiveMaximumHashTableLoad"
+
 
 
 #pragma mark Flags
@@ -429,6 +467,83 @@ enum {
 };
 typedef uint8_t MPQADPCMQuality;
 
+/*!
+	@typedef MPQVerificationOptions
+	@abstract Checks performed by -[MPQArchive verifyIntegrityWithOptions:progress:error:].
+	@discussion Sector tables are always validated before any sector is read, so MPQVerifySectorChecksums, 
+		MPQVerifyDecompression and MPQVerifyAttributes imply MPQVerifySectorTables. MPQVerifyAttributes 
+		decompresses every file to compute its checksums, and therefore implies MPQVerifyDecompression.
+	@constant MPQVerifySectorTables Check that sector tables are ordered and fit within the file's archived size.
+	@constant MPQVerifySectorChecksums Check the sector adlers of files which have the MPQFileHasSectorAdlers flag.
+	@constant MPQVerifyDecompression Check that every sector decrypts and decompresses to its expected size.
+	@constant MPQVerifyAttributes Check the CRC32 and MD5 checksums stored in the (attributes) file, if any. 
+		Checksums which are stored as 0 are not checked.
+	@constant MPQVerifyAll All of the above.
+*/
+enum {
+	MPQVerifySectorTables		= 0x01,
+	MPQVerifySectorChecksums	= 0x02,
+	MPQVerifyDecompression		= 0x04,
+	MPQVerifyAttributes			= 0x08,
+	MPQVerifyAll				= 0x0F
+};
+typedef uint32_t MPQVerificationOptions;
+
+/*!
+	@typedef MPQCachePolicy
+	@abstract How an archive's file interacts with the system's file cache.
+	@constant MPQCachePolicySystem Let the system manage caching and read ahead.
+	@constant MPQCachePolicyNoCache Keep archive data out of the file cache. On Mac OS X, this uses F_NOCACHE. 
+		On other systems, the pages of a file are dropped from the cache with POSIX_FADV_DONTNEED once the MPQFile 
+		instance that read it is released, and the whole archive is dropped after an integrity verification. Since 
+		this also evicts pages other processes may be using, it is only the default on Mac OS X.
+	@constant MPQCachePolicySequential Hint that the archive will be read mostly in order, such as when 
+		extracting every file. Enables aggressive read ahead.
+	@constant MPQCachePolicyRandom Hint that the archive will be read in no particular order, such as when 
+		a game loads individual files. Disables read ahead.
+*/
+enum {
+	MPQCachePolicySystem		= 0,
+	MPQCachePolicyNoCache		= 1,
+	MPQCachePolicySequential	= 2,
+	MPQCachePolicyRandom		= 3
+};
+typedef uint8_t MPQCachePolicy;
+
+/*!
+	@typedef MPQCopyMethod
+	@abstract How the archive file was copied by a save operation.
+	@constant MPQCopyMethodNone The archive file was not copied.
+	@constant MPQCopyMethodClone The copy is a clone which shares its storage with the original until either is 
+		modified. Made with clonefile on Mac OS X and the FICLONE ioctl on Linux.
+	@constant MPQCopyMethodCopyRange The data was copied by the kernel with copy_file_range, which some file 
+		systems implement as a server-side copy or a partial clone.
+	@constant MPQCopyMethodReadWrite The data was read from the original and written to the copy.
+*/
+enum {
+	MPQCopyMethodNone			= 0,
+	MPQCopyMethodClone			= 1,
+	MPQCopyMethodCopyRange		= 2,
+	MPQCopyMethodReadWrite		= 3
+};
+typedef uint8_t MPQCopyMethod;
+
+/*!
+	@typedef MPQMergePolicy
+	@abstract What to do when a file merged from another archive has the same name and locale as a file of the
+		archive.
+	@constant MPQMergeKeepExisting The file of the archive is kept, and the merged file is skipped.
+	@constant MPQMergeReplaceExisting The merged file replaces the file of the archive.
+	@constant MPQMergeNewestWins The merged file replaces the file of the archive if its creation date in the
+		(attributes) file is more recent. A file without a creation date is older than any file with one.
+*/
+enum {
+	MPQMergeKeepExisting		= 0,
+	MPQMergeReplaceExisting		= 1,
+	MPQMergeNewestWins			= 2
+};
+typedef uint8_t MPQMergePolicy;
+
 /*!
 	@typedef MPQFileDisplacementMode
 	@abstract Valid MPQFile file seeking constants.
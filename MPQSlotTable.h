@@ -0,0 +1,157 @@
+/*
+ *  MPQSlotTable.h
+ *  MPQKit
+ *
+ *  Sparse tables indexed by hash table position. MPQArchive keeps several pieces of state per
+ *  hash table slot (filenames, encryption keys, sector tables, deferred operations, open file
+ *  counts), but only a small fraction of the slots of a large archive ever get any. A slot table
+ *  splits its slots into pages of MPQ_SLOT_TABLE_PAGE_LENGTH elements and only allocates the
+ *  pages that hold a non-zero element, and the page directory itself on the first such store.
+ *
+ *  Unallocated elements read as zero. Storing zero in an unallocated page does not allocate it.
+ *
+ */
+
+#if !defined(MPQSlotTable_h)
+#define MPQSlotTable_h
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#define MPQ_SLOT_TABLE_PAGE_SHIFT 8
+#define MPQ_SLOT_TABLE_PAGE_LENGTH (1U << MPQ_SLOT_TABLE_PAGE_SHIFT)
+#define MPQ_SLOT_TABLE_PAGE_MASK (MPQ_SLOT_TABLE_PAGE_LENGTH - 1)
+
+struct mpq_slot_table {
+    uint32_t length;
+    uint32_t element_size;
+
+    // Number of allocated pages
+    uint32_t page_count;
+
+    // NULL until the first non-zero element is stored
+    uint8_t** pages;
+};
+typedef struct mpq_slot_table mpq_slot_table_t;
+
+typedef void (*mpq_slot_table_free_function)(void*);
+
+static __inline__ uint32_t mpq_slot_table_directory_length(const mpq_slot_table_t* table) {
+    return (table->length + MPQ_SLOT_TABLE_PAGE_MASK) >> MPQ_SLOT_TABLE_PAGE_SHIFT;
+}
+
+static __inline__ void mpq_slot_table_init(mpq_slot_table_t* table, uint32_t length, uint32_t element_size) {
+    table->length = length;
+    table->element_size = element_size;
+    table->page_count = 0;
+    table->pages = NULL;
+}
+
+// Frees every page, but not the elements they hold. The table can be used again afterwards.
+static __inline__ void mpq_slot_table_clear(mpq_slot_table_t* table) {
+    if (!table->pages)
+        return;
+
+    uint32_t directory_length = mpq_slot_table_directory_length(table);
+    uint32_t page_index = 0;
+    for (; page_index < directory_length; page_index++) {
+        if (table->pages[page_index])
+            free(table->pages[page_index]);
+    }
+
+    free(table->pages);
+    table->pages = NULL;
+    table->page_count = 0;
+}
+
+// Returns the address of an element, or NULL if its page is not allocated
+static __inline__ void* mpq_slot_table_peek(const mpq_slot_table_t* table, uint32_t position) {
+    if (!table->pages)
+        return NULL;
+
+    uint8_t* page = table->pages[position >> MPQ_SLOT_TABLE_PAGE_SHIFT];
+    if (!page)
+        return NULL;
+
+    return page + ((position & MPQ_SLOT_TABLE_PAGE_MASK) * table->element_size);
+}
+
+// Returns the address of an element, allocating its page if needed. Returns NULL if out of memory.
+static __inline__ void* mpq_slot_table_slot(mpq_slot_table_t* table, uint32_t position) {
+    if (!table->pages) {
+        table->pages = (uint8_t**)calloc(mpq_slot_table_directory_length(table), sizeof(uint8_t*));
+        if (!table->pages)
+            return NULL;
+    }
+
+    uint8_t** page = table->pages + (position >> MPQ_SLOT_TABLE_PAGE_SHIFT);
+    if (!*page) {
+        *page = (uint8_t*)calloc(MPQ_SLOT_TABLE_PAGE_LENGTH, table->element_size);
+        if (!*page)
+            return NULL;
+        table->page_count++;
+    }
+
+    return *page + ((position & MPQ_SLOT_TABLE_PAGE_MASK) * table->element_size);
+}
+
+static __inline__ void* mpq_slot_table_get_pointer(const mpq_slot_table_t* table, uint32_t position) {
+    void** element = (void**)mpq_slot_table_peek(table, position);
+    return (element) ? *element : NULL;
+}
+
+static __inline__ int mpq_slot_table_set_pointer(mpq_slot_table_t* table, uint32_t position, void* value) {
+    void** element = (void**)((value) ? mpq_slot_table_slot(table, position) : mpq_slot_table_peek(table, position));
+    if (element) {
+        *element = value;
+        return 0;
+    }
+    return (value) ? -1 : 0;
+}
+
+static __inline__ uint32_t mpq_slot_table_get_uint32(const mpq_slot_table_t* table, uint32_t position) {
+    uint32_t* element = (uint32_t*)mpq_slot_table_peek(table, position);
+    return (element) ? *element : 0;
+}
+
+static __inline__ int mpq_slot_table_set_uint32(mpq_slot_table_t* table, uint32_t position, uint32_t value) {
+    uint32_t* element = (uint32_t*)((value) ? mpq_slot_table_slot(table, position) : mpq_slot_table_peek(table, position));
+    if (element) {
+        *element = value;
+        return 0;
+    }
+    return (value) ? -1 : 0;
+}
+
+// Calls free_function on every non-NULL element of a table of pointers, then frees every page
+static __inline__ void mpq_slot_table_free_pointers(mpq_slot_table_t* table, mpq_slot_table_free_function free_function) {
+    if (!table->pages)
+        return;
+
+    uint32_t directory_length = mpq_slot_table_directory_length(table);
+    uint32_t page_index = 0;
+    for (; page_index < directory_length; page_index++) {
+        void** page = (void**)table->pages[page_index];
+        if (!page)
+            continue;
+
+        uint32_t element_index = 0;
+        for (; element_index < MPQ_SLOT_TABLE_PAGE_LENGTH; element_index++) {
+            if (page[element_index])
+                free_function(page[element_index]);
+        }
+    }
+
+    mpq_slot_table_clear(table);
+}
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
@@ -0,0 +1,99 @@
+/*
+ *  MPQStringArena.h
+ *  MPQKit
+ *
+ *  Append-only storage for NUL-terminated strings. Strings are copied into large chunks which are never
+ *  moved, so pointers to stored strings remain valid until the arena is destroyed. Strings are identified
+ *  by a 32-bit reference, 0 meaning no string, which makes them cheap to keep in a slot table.
+ *
+ *  Strings cannot be removed individually. The whole arena is freed at once.
+ *
+ */
+
+#if !defined(MPQStringArena_h)
+#define MPQStringArena_h
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#define MPQ_STRING_ARENA_CHUNK_SHIFT 16
+#define MPQ_STRING_ARENA_CHUNK_SIZE (1U << MPQ_STRING_ARENA_CHUNK_SHIFT)
+#define MPQ_STRING_ARENA_MAX_CHUNKS 0xffff
+
+struct mpq_string_arena {
+    char** chunks;
+    uint32_t chunk_count;
+    uint32_t chunk_capacity;
+
+    // Bytes used in the last chunk
+    uint32_t chunk_used;
+};
+typedef struct mpq_string_arena mpq_string_arena_t;
+
+static __inline__ void mpq_string_arena_init(mpq_string_arena_t* arena) {
+    memset(arena, 0, sizeof(mpq_string_arena_t));
+}
+
+static __inline__ void mpq_string_arena_destroy(mpq_string_arena_t* arena) {
+    uint32_t chunk_index = 0;
+    for (; chunk_index < arena->chunk_count; chunk_index++)
+        free(arena->chunks[chunk_index]);
+    free(arena->chunks);
+    mpq_string_arena_init(arena);
+}
+
+// Copies length bytes of string and a NUL terminator into the arena. Returns the reference of the copy, or 0 on failure.
+static __inline__ uint32_t mpq_string_arena_add(mpq_string_arena_t* arena, const char* string, size_t length) {
+    if (length >= MPQ_STRING_ARENA_CHUNK_SIZE)
+        return 0;
+
+    // Start a new chunk if the string doesn't fit in the last one
+    if (arena->chunk_count == 0 || arena->chunk_used + length + 1 > MPQ_STRING_ARENA_CHUNK_SIZE) {
+        if (arena->chunk_count == MPQ_STRING_ARENA_MAX_CHUNKS)
+            return 0;
+
+        if (arena->chunk_count == arena->chunk_capacity) {
+            uint32_t chunk_capacity = (arena->chunk_capacity) ? arena->chunk_capacity * 2 : 16;
+            char** chunks = (char**)realloc(arena->chunks, chunk_capacity * sizeof(char*));
+            if (!chunks)
+                return 0;
+            arena->chunks = chunks;
+            arena->chunk_capacity = chunk_capacity;
+        }
+
+        char* chunk = (char*)malloc(MPQ_STRING_ARENA_CHUNK_SIZE);
+        if (!chunk)
+            return 0;
+        arena->chunks[arena->chunk_count] = chunk;
+        arena->chunk_count++;
+        arena->chunk_used = 0;
+    }
+
+    uint32_t chunk_index = arena->chunk_count - 1;
+    uint32_t offset = arena->chunk_used;
+    char* copy = arena->chunks[chunk_index] + offset;
+    memcpy(copy, string, length);
+    copy[length] = 0;
+    arena->chunk_used += (uint32_t)length + 1;
+
+    return ((chunk_index << MPQ_STRING_ARENA_CHUNK_SHIFT) | offset) + 1;
+}
+
+// Returns the string with the given reference, or NULL for reference 0
+static __inline__ const char* mpq_string_arena_get(const mpq_string_arena_t* arena, uint32_t reference) {
+    if (reference == 0)
+        return NULL;
+    reference--;
+    return arena->chunks[reference >> MPQ_STRING_ARENA_CHUNK_SHIFT] + (reference & (MPQ_STRING_ARENA_CHUNK_SIZE - 1));
+}
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
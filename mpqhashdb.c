@@ -0,0 +1,184 @@
+//
+//  mpqhashdb.c
+//  MPQKit
+//
+//  Builds a hash database from one or more listfiles. See MPQCore.h for the format.
+//
+//  usage: mpqhashdb <output> <listfile> [<listfile> ...]
+//
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "MPQByteOrder.h"
+#include "MPQCore.h"
+#include "MPQCryptography.h"
+
+struct listfile_buffer {
+    char* data;
+    size_t size;
+    mpq_listfile_entry_t* entries;
+    size_t entry_count;
+};
+
+static int read_file(const char* path, char** data, size_t* size) {
+    FILE* file = fopen(path, "rb");
+    if (!file)
+        return -1;
+
+    if (fseek(file, 0, SEEK_END) == -1) {
+        fclose(file);
+        return -1;
+    }
+    long file_size = ftell(file);
+    rewind(file);
+
+    *data = malloc((file_size > 0) ? (size_t)file_size : 1);
+    if (!*data) {
+        fclose(file);
+        return -1;
+    }
+
+    *size = fread(*data, 1, (size_t)file_size, file);
+    fclose(file);
+    return 0;
+}
+
+static void write_uint32(uint32_t value, FILE* file) {
+    value = MPQSwapInt32HostToLittle(value);
+    fwrite(&value, sizeof(uint32_t), 1, file);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s <output> <listfile> [<listfile> ...]\n", argv[0]);
+        return 1;
+    }
+
+    mpq_init_cryptography();
+
+    // Read, split and hash every listfile
+    int listfile_count = argc - 2;
+    struct listfile_buffer* listfiles = calloc(listfile_count, sizeof(struct listfile_buffer));
+    size_t total_entry_count = 0;
+    int i = 0;
+    for (; i < listfile_count; i++) {
+        struct listfile_buffer* listfile = listfiles + i;
+        if (read_file(argv[i + 2], &listfile->data, &listfile->size) == -1) {
+            fprintf(stderr, "could not read %s: %s\n", argv[i + 2], strerror(errno));
+            return 1;
+        }
+
+        listfile->entry_count = mpq_core_parse_listfile(listfile->data, listfile->size, NULL, 0);
+        listfile->entries = malloc((listfile->entry_count + 1) * sizeof(mpq_listfile_entry_t));
+        if (!listfile->entries) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+
+        mpq_core_parse_listfile(listfile->data, listfile->size, listfile->entries, listfile->entry_count);
+        mpq_core_hash_listfile_entries(listfile->data, listfile->entries, listfile->entry_count);
+        total_entry_count += listfile->entry_count;
+    }
+
+    if (total_entry_count >= 0x40000000) {
+        fprintf(stderr, "too many names\n");
+        return 1;
+    }
+
+    // The index is at most half full
+    uint32_t index_length = 1;
+    while (index_length < total_entry_count * 2)
+        index_length <<= 1;
+    uint32_t index_mask = index_length - 1;
+
+    uint32_t* index = malloc(index_length * sizeof(uint32_t));
+    mpq_hash_database_entry_t* entries = malloc((total_entry_count + 1) * sizeof(mpq_hash_database_entry_t));
+    const mpq_listfile_entry_t** entry_names = malloc((total_entry_count + 1) * sizeof(mpq_listfile_entry_t*));
+    const char** entry_listfiles = malloc((total_entry_count + 1) * sizeof(char*));
+    if (!index || !entries || !entry_names || !entry_listfiles) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    memset(index, 0xff, index_length * sizeof(uint32_t));
+
+    // Insert every name which isn't already in the database. Names differing only by case have the same hashes.
+    uint32_t entry_count = 0;
+    uint64_t strings_size = 0;
+    for (i = 0; i < listfile_count; i++) {
+        struct listfile_buffer* listfile = listfiles + i;
+        size_t entry_index = 0;
+        for (; entry_index < listfile->entry_count; entry_index++) {
+            mpq_listfile_entry_t* listfile_entry = listfile->entries + entry_index;
+
+            uint32_t slot = listfile_entry->key.hash_a & index_mask;
+            while (index[slot] != MPQ_HASH_DATABASE_EMPTY_SLOT) {
+                mpq_hash_database_entry_t* entry = entries + index[slot];
+                if (entry->hash_a == listfile_entry->key.hash_a && entry->hash_b == listfile_entry->key.hash_b)
+                    break;
+                slot = (slot + 1) & index_mask;
+            }
+            if (index[slot] != MPQ_HASH_DATABASE_EMPTY_SLOT)
+                continue;
+
+            // Names are stored in the string arena in entry order
+            index[slot] = entry_count;
+            entries[entry_count].position = listfile_entry->key.position;
+            entries[entry_count].hash_a = listfile_entry->key.hash_a;
+            entries[entry_count].hash_b = listfile_entry->key.hash_b;
+            entries[entry_count].name_offset = (uint32_t)strings_size;
+            entry_names[entry_count] = listfile_entry;
+            entry_listfiles[entry_count] = listfile->data;
+            strings_size += listfile_entry->length + 1;
+            entry_count++;
+        }
+    }
+
+    if (strings_size > UINT32_MAX) {
+        fprintf(stderr, "names too large\n");
+        return 1;
+    }
+
+    FILE* output = fopen(argv[1], "wb");
+    if (!output) {
+        fprintf(stderr, "could not create %s: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+
+    // Header
+    write_uint32(MPQ_HASH_DATABASE_MAGIC, output);
+    write_uint32(MPQ_HASH_DATABASE_VERSION, output);
+    write_uint32(entry_count, output);
+    write_uint32(index_length, output);
+    write_uint32((uint32_t)strings_size, output);
+    write_uint32(0, output);
+
+    // Entries and index
+    uint32_t entry_index = 0;
+    for (; entry_index < entry_count; entry_index++) {
+        write_uint32(entries[entry_index].position, output);
+        write_uint32(entries[entry_index].hash_a, output);
+        write_uint32(entries[entry_index].hash_b, output);
+        write_uint32(entries[entry_index].name_offset, output);
+    }
+
+    uint32_t slot = 0;
+    for (; slot < index_length; slot++)
+        write_uint32(index[slot], output);
+
+    // String arena
+    for (entry_index = 0; entry_index < entry_count; entry_index++) {
+        fwrite(entry_listfiles[entry_index] + entry_names[entry_index]->offset, 1, entry_names[entry_index]->length, output);
+        fputc(0, output);
+    }
+
+    if (fclose(output) != 0) {
+        fprintf(stderr, "could not write %s: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+
+    printf("%u names\n", entry_count);
+    return 0;
+}
@@ -0,0 +1,390 @@
+//
+//  mpqsavetest.m
+//  MPQKit
+//
+//  Saves archives in a scratch directory and checks the results: the order and contents of files added by the
+//  parallel compression pipeline, the reuse of the space of deleted files, the rollback of a failed journaled save
+//  and the recovery of an interrupted one. Exits with status 1 if any check fails.
+//
+
+#import <Foundation/Foundation.h>
+#import <MPQKit/MPQKit.h>
+#import <MPQKit/MPQCore.h>
+
+#import <fcntl.h>
+#import <unistd.h>
+#import <signal.h>
+#import <sys/resource.h>
+#import <sys/stat.h>
+
+#define MPQTestAssert(condition, ...) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: ", __FUNCTION__, __LINE__); \
+            fprintf(stderr, __VA_ARGS__); \
+            fprintf(stderr, "\n"); \
+            return NO; \
+        } \
+    } while (0)
+
+// Records the files the archive reports adding, in order
+@interface MPQSaveTestDelegate : NSObject {
+    NSMutableArray* addedFiles;
+}
+- (NSArray*)addedFiles;
+@end
+
+@implementation MPQSaveTestDelegate
+
+- (id)init {
+    self = [super init];
+    if (!self)
+        return nil;
+    addedFiles = [[NSMutableArray alloc] initWithCapacity:0x10];
+    return self;
+}
+
+- (void)dealloc {
+    [addedFiles release];
+    [super dealloc];
+}
+
+- (NSArray*)addedFiles {
+    return addedFiles;
+}
+
+- (void)archive:(MPQArchive*)archive didAddFile:(NSString*)filename {
+    [addedFiles addObject:filename];
+}
+
+@end
+
+// Alternates runs of compressible and random bytes, so files have both compressed and stored sectors
+static NSData* _MPQTestData(uint32_t length, uint32_t seed) {
+    NSMutableData* data = [NSMutableData dataWithLength:length];
+    uint8_t* bytes = [data mutableBytes];
+    uint32_t state = seed | 1;
+    uint32_t i = 0;
+    for (; i < length; i++) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        bytes[i] = ((i >> 12) & 1) ? (uint8_t)state : (uint8_t)((i + seed) % 251);
+    }
+    return data;
+}
+
+static BOOL _MPQTestFileContents(MPQArchive* archive, NSString* filename, NSData* expected) {
+    NSError* error = nil;
+    NSData* data = [archive copyDataForFile:filename error:&error];
+    MPQTestAssert(data != nil, "could not read %s: %s", [filename UTF8String], [[error description] UTF8String]);
+    BOOL equal = [data isEqualToData:expected];
+    [data release];
+    MPQTestAssert(equal, "%s does not have the data it was added with", [filename UTF8String]);
+    return YES;
+}
+
+static off_t _MPQTestFileOffset(MPQArchive* archive, NSString* filename) {
+    NSDictionary* fileInfo = [archive fileInfoForFile:filename locale:MPQNeutral];
+    return (fileInfo) ? (off_t)[[fileInfo objectForKey:MPQFileArchiveOffset] unsignedLongLongValue] : -1;
+}
+
+static off_t _MPQTestFileSize(NSString* path) {
+    struct stat sb;
+    if (stat([path fileSystemRepresentation], &sb) == -1)
+        return -1;
+    return sb.st_size;
+}
+
+// Reads the archive header on disk, both in host byte order and as the raw bytes a journal record holds
+static BOOL _MPQTestReadHeader(NSString* path, mpq_archive_info_t* info, mpq_journal_record_t* record) {
+    int fd = open([path fileSystemRepresentation], O_RDONLY, 0);
+    MPQTestAssert(fd != -1, "could not open %s", [path fileSystemRepresentation]);
+
+    mpq_core_error_t core_error;
+    memset(info, 0, sizeof(mpq_archive_info_t));
+    int result = mpq_core_read_header(fd, 0, info, &core_error);
+
+    struct stat sb;
+    if (result == 0 && record) {
+        memset(record, 0, sizeof(mpq_journal_record_t));
+        record->archive_offset = info->archive_offset;
+        record->header_size = (info->header.version == 0) ? sizeof(mpq_header_t) : sizeof(mpq_header_t) + sizeof(mpq_extended_header_t);
+        if (pread(fd, record->header, record->header_size, info->archive_offset) != (ssize_t)record->header_size || fstat(fd, &sb) == -1)
+            result = -1;
+        else
+            record->file_size = sb.st_size;
+    }
+    close(fd);
+
+    MPQTestAssert(result == 0, "could not read the header of %s", [path fileSystemRepresentation]);
+    return YES;
+}
+
+static BOOL _MPQTestWriteJournal(NSString* path, const mpq_journal_record_t* begin, const mpq_journal_record_t* commit) {
+    NSString* journal_path = [path stringByAppendingString:@"-journal"];
+    int fd = open([journal_path fileSystemRepresentation], O_RDWR | O_CREAT | O_TRUNC, 0644);
+    MPQTestAssert(fd != -1, "could not create %s", [journal_path fileSystemRepresentation]);
+
+    mpq_core_error_t core_error;
+    int result = mpq_core_write_journal_record(fd, begin, &core_error);
+    if (result == 0 && commit)
+        result = mpq_core_write_journal_record(fd, commit, &core_error);
+    close(fd);
+
+    MPQTestAssert(result == 0, "could not write %s", [journal_path fileSystemRepresentation]);
+    return YES;
+}
+
+#pragma mark tests
+
+// Files of all sizes and kinds, including multi-chunk ones, must be written in the order they were added and read back
+// exactly. The archive is new, so the files are laid out one after the other in that order.
+static BOOL _MPQTestPipelineOrder(NSString* directory) {
+    NSString* path = [directory stringByAppendingPathComponent:@"pipeline.mpq"];
+    NSError* error = nil;
+
+    static const uint32_t sizes[] = {1, 3, 511, 4096, 70000, 0x300000, 12345, 0x120000, 2};
+    static const uint32_t flags[] = {
+        MPQFileCompressed,
+        MPQFileCompressed | MPQFileEncrypted,
+        MPQFileCompressed | MPQFileEncrypted | MPQFileOffsetAdjustedKey,
+        0,
+        MPQFileEncrypted | MPQFileOffsetAdjustedKey,
+    };
+    uint32_t count = sizeof(sizes) / sizeof(uint32_t);
+
+    MPQArchive* archive = [MPQArchive archiveWithFileLimit:64 error:&error];
+    MPQTestAssert(archive != nil, "could not create an archive: %s", [[error description] UTF8String]);
+    MPQSaveTestDelegate* delegate = [[MPQSaveTestDelegate new] autorelease];
+    [archive setDelegate:delegate];
+
+    NSMutableArray* filenames = [NSMutableArray arrayWithCapacity:count];
+    NSMutableArray* contents = [NSMutableArray arrayWithCapacity:count];
+    uint32_t i = 0;
+    for (; i < count; i++) {
+        NSString* filename = [NSString stringWithFormat:@"pipeline\\file%u.bin", i];
+        NSData* data = _MPQTestData(sizes[i], i + 1);
+        NSDictionary* parameters = [NSDictionary dictionaryWithObject:[NSNumber numberWithUnsignedInt:flags[i % (sizeof(flags) / sizeof(uint32_t))]] forKey:MPQFileFlags];
+        MPQTestAssert([archive addFileWithData:data filename:filename parameters:parameters error:&error], "could not add %s: %s", [filename UTF8String], [[error description] UTF8String]);
+        [filenames addObject:filename];
+        [contents addObject:data];
+    }
+
+    MPQTestAssert([archive writeToFile:path atomically:NO error:&error], "could not save: %s", [[error description] UTF8String]);
+    [archive setDelegate:nil];
+
+    // The files were added in order, with the listfile and attributes after them
+    NSArray* addedFiles = [delegate addedFiles];
+    MPQTestAssert([addedFiles count] >= count, "only %u files were reported added", (uint32_t)[addedFiles count]);
+    MPQTestAssert([[addedFiles subarrayWithRange:NSMakeRange(0, count)] isEqualToArray:filenames], "the files were not reported added in order");
+
+    archive = [MPQArchive archiveWithPath:path error:&error];
+    MPQTestAssert(archive != nil, "could not open the saved archive: %s", [[error description] UTF8String]);
+
+    off_t previous_offset = 0;
+    for (i = 0; i < count; i++) {
+        NSString* filename = [filenames objectAtIndex:i];
+        if (!_MPQTestFileContents(archive, filename, [contents objectAtIndex:i]))
+            return NO;
+
+        off_t offset = _MPQTestFileOffset(archive, filename);
+        MPQTestAssert(offset > previous_offset, "%s was not written after the file added before it", [filename UTF8String]);
+        previous_offset = offset;
+    }
+
+    MPQTestAssert([archive verifyIntegrityWithOptions:MPQVerifyAll progress:nil error:&error], "the saved archive does not verify: %s", [[error description] UTF8String]);
+    return YES;
+}
+
+// A file added after another was deleted must go in the space the deleted file used, and the block table entry of the
+// deleted file must not be kept.
+static BOOL _MPQTestExtentReuse(NSString* directory) {
+    NSString* path = [directory stringByAppendingPathComponent:@"extents.mpq"];
+    NSError* error = nil;
+    NSDictionary* stored = [NSDictionary dictionaryWithObject:[NSNumber numberWithUnsignedInt:0] forKey:MPQFileFlags];
+
+    MPQArchive* archive = [MPQArchive archiveWithFileLimit:64 error:&error];
+    MPQTestAssert(archive != nil, "could not create an archive: %s", [[error description] UTF8String]);
+    NSData* deleted_data = _MPQTestData(0x10000, 101);
+    NSData* kept_data = _MPQTestData(0x1000, 102);
+    MPQTestAssert([archive addFileWithData:deleted_data filename:@"deleted.bin" parameters:stored error:&error], "could not add deleted.bin: %s", [[error description] UTF8String]);
+    MPQTestAssert([archive addFileWithData:kept_data filename:@"kept.bin" parameters:stored error:&error], "could not add kept.bin: %s", [[error description] UTF8String]);
+    MPQTestAssert([archive writeToFile:path atomically:NO error:&error], "could not save: %s", [[error description] UTF8String]);
+
+    off_t deleted_offset = _MPQTestFileOffset(archive, @"deleted.bin");
+    MPQTestAssert(deleted_offset > 0, "could not get the offset of deleted.bin");
+
+    NSData* added_data = _MPQTestData(0x8000, 103);
+    MPQTestAssert([archive deleteFile:@"deleted.bin" error:&error], "could not delete deleted.bin: %s", [[error description] UTF8String]);
+    MPQTestAssert([archive addFileWithData:added_data filename:@"added.bin" parameters:stored error:&error], "could not add added.bin: %s", [[error description] UTF8String]);
+    MPQTestAssert([archive writeToFile:path atomically:NO error:&error], "could not save in place: %s", [[error description] UTF8String]);
+
+    archive = [MPQArchive archiveWithPath:path error:&error];
+    MPQTestAssert(archive != nil, "could not open the saved archive: %s", [[error description] UTF8String]);
+    MPQTestAssert(![archive fileExists:@"deleted.bin"], "deleted.bin is still in the archive");
+    MPQTestAssert(_MPQTestFileOffset(archive, @"added.bin") == deleted_offset, "added.bin was not written where deleted.bin was");
+    if (!_MPQTestFileContents(archive, @"kept.bin", kept_data) || !_MPQTestFileContents(archive, @"added.bin", added_data))
+        return NO;
+
+    mpq_archive_info_t info;
+    if (!_MPQTestReadHeader(path, &info, NULL))
+        return NO;
+    uint32_t valid_files = [[[archive archiveInfo] objectForKey:MPQNumberOfValidFiles] unsignedIntValue];
+    MPQTestAssert(info.header.block_table_length == valid_files, "the block table has %u entries for %u files", info.header.block_table_length, valid_files);
+    return YES;
+}
+
+// A journaled save which fails must leave both the archive file and the instance as they were, so that saving again
+// once the cause is gone writes every file correctly, including encrypted files with an offset adjusted key. The save
+// is made to fail part way by a file size limit.
+static BOOL _MPQTestFailedSaveRollback(NSString* directory) {
+    NSString* path = [directory stringByAppendingPathComponent:@"rollback.mpq"];
+    NSError* error = nil;
+
+    MPQArchive* archive = [MPQArchive archiveWithFileLimit:64 error:&error];
+    MPQTestAssert(archive != nil, "could not create an archive: %s", [[error description] UTF8String]);
+    NSData* committed_data = _MPQTestData(50000, 201);
+    MPQTestAssert([archive addFileWithData:committed_data filename:@"committed.bin" parameters:nil error:&error], "could not add committed.bin: %s", [[error description] UTF8String]);
+    MPQTestAssert([archive writeToFile:path atomically:NO error:&error], "could not save: %s", [[error description] UTF8String]);
+    [archive setUsesJournaledSaves:YES];
+    off_t committed_size = _MPQTestFileSize(path);
+
+    NSData* encrypted_data = _MPQTestData(90000, 202);
+    NSDictionary* encrypted = [NSDictionary dictionaryWithObject:[NSNumber numberWithUnsignedInt:MPQFileCompressed | MPQFileEncrypted | MPQFileOffsetAdjustedKey] forKey:MPQFileFlags];
+    MPQTestAssert([archive addFileWithData:encrypted_data filename:@"encrypted.bin" parameters:encrypted error:&error], "could not add encrypted.bin: %s", [[error description] UTF8String]);
+
+    // The last addition doesn't fit under the limit, so the save fails after writing encrypted.bin
+    NSData* large_data = _MPQTestData(0x200000, 203);
+    NSDictionary* stored = [NSDictionary dictionaryWithObject:[NSNumber numberWithUnsignedInt:0] forKey:MPQFileFlags];
+    MPQTestAssert([archive addFileWithData:large_data filename:@"large.bin" parameters:stored error:&error], "could not add large.bin: %s", [[error description] UTF8String]);
+
+    struct rlimit file_size_limit;
+    MPQTestAssert(getrlimit(RLIMIT_FSIZE, &file_size_limit) == 0, "could not get the file size limit");
+    struct rlimit save_limit = file_size_limit;
+    save_limit.rlim_cur = committed_size + 0x40000;
+    MPQTestAssert(setrlimit(RLIMIT_FSIZE, &save_limit) == 0, "could not set the file size limit");
+
+    uint32_t operation_count = [archive operationCount];
+    BOOL saved = [archive writeToFile:path atomically:NO error:&error];
+    setrlimit(RLIMIT_FSIZE, &file_size_limit);
+    MPQTestAssert(!saved, "the save did not fail");
+    MPQTestAssert([archive operationCount] == operation_count, "the failed save left %u operations instead of %u", [archive operationCount], operation_count);
+    MPQTestAssert(_MPQTestFileSize(path) == committed_size, "the failed save changed the size of the archive file");
+    MPQTestAssert(_MPQTestFileSize([path stringByAppendingString:@"-journal"]) == -1, "the failed save left its journal");
+
+    MPQArchive* committed = [MPQArchive archiveWithPath:path error:&error];
+    MPQTestAssert(committed != nil, "could not open the archive after the failed save: %s", [[error description] UTF8String]);
+    MPQTestAssert(![committed fileExists:@"encrypted.bin"], "the failed save added encrypted.bin");
+    if (!_MPQTestFileContents(committed, @"committed.bin", committed_data))
+        return NO;
+
+    // Without the limit, the same operations save correctly
+    MPQTestAssert([archive writeToFile:path atomically:NO error:&error], "could not save again: %s", [[error description] UTF8String]);
+
+    archive = [MPQArchive archiveWithPath:path error:&error];
+    MPQTestAssert(archive != nil, "could not open the saved archive: %s", [[error description] UTF8String]);
+    if (!_MPQTestFileContents(archive, @"committed.bin", committed_data) || !_MPQTestFileContents(archive, @"encrypted.bin", encrypted_data) || !_MPQTestFileContents(archive, @"large.bin", large_data))
+        return NO;
+    MPQTestAssert([archive verifyIntegrityWithOptions:MPQVerifyAll progress:nil error:&error], "the saved archive does not verify: %s", [[error description] UTF8String]);
+    return YES;
+}
+
+// Opening an archive whose journaled save was interrupted must complete the save if its commit record was written, and
+// roll it back otherwise. Both cases are staged from the headers and sizes of the archive file before and after a save.
+static BOOL _MPQTestInterruptedSaveRecovery(NSString* directory) {
+    NSString* path = [directory stringByAppendingPathComponent:@"recovery.mpq"];
+    NSError* error = nil;
+
+    MPQArchive* archive = [MPQArchive archiveWithFileLimit:64 error:&error];
+    MPQTestAssert(archive != nil, "could not create an archive: %s", [[error description] UTF8String]);
+    NSData* committed_data = _MPQTestData(30000, 301);
+    MPQTestAssert([archive addFileWithData:committed_data filename:@"committed.bin" parameters:nil error:&error], "could not add committed.bin: %s", [[error description] UTF8String]);
+    MPQTestAssert([archive writeToFile:path atomically:NO error:&error], "could not save: %s", [[error description] UTF8String]);
+
+    mpq_archive_info_t info;
+    mpq_journal_record_t begin_record;
+    if (!_MPQTestReadHeader(path, &info, &begin_record))
+        return NO;
+    begin_record.type = MPQ_JOURNAL_BEGIN;
+
+    NSData* pending_data = _MPQTestData(40000, 302);
+    NSDictionary* encrypted = [NSDictionary dictionaryWithObject:[NSNumber numberWithUnsignedInt:MPQFileCompressed | MPQFileEncrypted | MPQFileOffsetAdjustedKey] forKey:MPQFileFlags];
+    [archive setUsesJournaledSaves:YES];
+    MPQTestAssert([archive addFileWithData:pending_data filename:@"pending.bin" parameters:encrypted error:&error], "could not add pending.bin: %s", [[error description] UTF8String]);
+    MPQTestAssert([archive writeToFile:path atomically:NO error:&error], "could not save: %s", [[error description] UTF8String]);
+
+    mpq_journal_record_t commit_record;
+    if (!_MPQTestReadHeader(path, &info, &commit_record))
+        return NO;
+    commit_record.type = MPQ_JOURNAL_COMMIT;
+    MPQTestAssert(commit_record.file_size > begin_record.file_size, "the journaled save did not append to the archive file");
+
+    // Interrupted after the commit record, before the new header was written: the save is completed
+    int fd = open([path fileSystemRepresentation], O_RDWR, 0);
+    MPQTestAssert(fd != -1, "could not open %s", [path fileSystemRepresentation]);
+    ssize_t bytes_written = pwrite(fd, begin_record.header, begin_record.header_size, (off_t)begin_record.archive_offset);
+    close(fd);
+    MPQTestAssert(bytes_written == (ssize_t)begin_record.header_size, "could not write the committed header");
+    if (!_MPQTestWriteJournal(path, &begin_record, &commit_record))
+        return NO;
+
+    archive = [MPQArchive archiveWithPath:path error:&error];
+    MPQTestAssert(archive != nil, "could not open the archive with a commit record: %s", [[error description] UTF8String]);
+    MPQTestAssert(_MPQTestFileSize([path stringByAppendingString:@"-journal"]) == -1, "the completed journal was not deleted");
+    if (!_MPQTestFileContents(archive, @"committed.bin", committed_data) || !_MPQTestFileContents(archive, @"pending.bin", pending_data))
+        return NO;
+
+    // Interrupted before the commit record: the save is rolled back
+    if (!_MPQTestWriteJournal(path, &begin_record, NULL))
+        return NO;
+
+    archive = [MPQArchive archiveWithPath:path error:&error];
+    MPQTestAssert(archive != nil, "could not open the archive with a begin record: %s", [[error description] UTF8String]);
+    MPQTestAssert(_MPQTestFileSize([path stringByAppendingString:@"-journal"]) == -1, "the rolled back journal was not deleted");
+    MPQTestAssert(_MPQTestFileSize(path) == (off_t)begin_record.file_size, "the archive file was not cut back to its committed size");
+    MPQTestAssert(![archive fileExists:@"pending.bin"], "the rolled back save left pending.bin");
+    if (!_MPQTestFileContents(archive, @"committed.bin", committed_data))
+        return NO;
+    return YES;
+}
+
+int main(int argc, char* argv[]) {
+    NSAutoreleasePool* p = [NSAutoreleasePool new];
+
+    // Writes past a file size limit must fail with EFBIG instead of killing the process
+    signal(SIGXFSZ, SIG_IGN);
+
+    char directory_template[] = "/tmp/mpqsavetest.XXXXXX";
+    if (!mkdtemp(directory_template)) {
+        perror("mpqsavetest");
+        [p release];
+        return 2;
+    }
+    NSString* directory = [[NSFileManager defaultManager] stringWithFileSystemRepresentation:directory_template length:strlen(directory_template)];
+
+    static const struct {
+        const char* name;
+        BOOL (*function)(NSString* directory);
+    } tests[] = {
+        { "pipeline order", _MPQTestPipelineOrder },
+        { "extent reuse", _MPQTestExtentReuse },
+        { "failed save rollback", _MPQTestFailedSaveRollback },
+        { "interrupted save recovery", _MPQTestInterruptedSaveRecovery },
+    };
+
+    int status = 0;
+    size_t i = 0;
+    for (; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        NSAutoreleasePool* tp = [NSAutoreleasePool new];
+        BOOL passed = tests[i].function(directory);
+        printf("%s: %s\n", tests[i].name, (passed) ? "OK" : "FAILED");
+        if (!passed)
+            status = 1;
+        [tp release];
+    }
+
+    [[NSFileManager defaultManager] removeItemAtPath:directory error:NULL];
+    [p release];
+    return status;
+}
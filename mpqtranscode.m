@@ -0,0 +1,160 @@
+//
+//  mpqtranscode.m
+//  MPQKit
+//
+//  Recompresses the files of one or more MPQ archives with another compressor, in place or to a new archive.
+//  Exits with status 1 if any archive could not be transcoded.
+//
+
+#import <Foundation/Foundation.h>
+#import <MPQKit/MPQKit.h>
+
+#import <getopt.h>
+#import <sys/stat.h>
+#import <zlib.h>
+
+#if defined(__APPLE__)
+CFStringEncoding CFStringFileSystemEncoding(void);
+#endif
+
+static const char* optString = "c:iq:o:";
+static const struct option longOpts[] = {
+    { "compressor", required_argument, NULL, 'c' },
+    { "ignore-header-size-field", no_argument, NULL, 'i' },
+    { "quality", required_argument, NULL, 'q' },
+    { "output", required_argument, NULL, 'o' },
+    { "listfile", required_argument, NULL, 0 },
+    { NULL, no_argument, NULL, 0 }
+};
+
+static void usage(void) {
+    fprintf(stderr, "usage: mpqtranscode [-i] [-c zlib|bzip2|pkware|huffman] [-q quality] [-o output] [--listfile path] archive ...\n");
+}
+
+static NSString* pathWithCString(const char* path) {
+#if defined(__APPLE__)
+    return [NSString stringWithCString:path encoding:CFStringConvertEncodingToNSStringEncoding(CFStringFileSystemEncoding())];
+#else
+    return [NSString stringWithCString:path];
+#endif
+}
+
+static off_t fileSize(const char* path) {
+    struct stat sb;
+    return (stat(path, &sb) == -1) ? 0 : sb.st_size;
+}
+
+int main(int argc, char* argv[]) {
+    NSAutoreleasePool* p = [NSAutoreleasePool new];
+    NSError* error = nil;
+
+    BOOL ignoreHeaderSizeField = NO;
+    MPQCompressorFlag compressor = MPQZLIBCompression;
+    int32_t quality = Z_DEFAULT_COMPRESSION;
+    BOOL hasQuality = NO;
+    const char* output = NULL;
+    NSMutableArray* listfiles = [NSMutableArray arrayWithCapacity:0x10];
+
+    // Parse options
+    int longIndex;
+    int opt = getopt_long(argc, argv, optString, longOpts, &longIndex);
+    while (opt != -1) {
+        switch (opt) {
+            case 'c':
+                if (strcmp(optarg, "zlib") == 0)
+                    compressor = MPQZLIBCompression;
+                else if (strcmp(optarg, "bzip2") == 0)
+                    compressor = MPQBZIP2Compression;
+                else if (strcmp(optarg, "pkware") == 0)
+                    compressor = MPQPKWARECompression;
+                else if (strcmp(optarg, "huffman") == 0)
+                    compressor = MPQHuffmanTreeCompression;
+                else {
+                    fprintf(stderr, "mpqtranscode: unknown compressor %s\n", optarg);
+                    usage();
+                    [p release];
+                    return 2;
+                }
+                break;
+
+            case 'i':
+                ignoreHeaderSizeField = YES;
+                break;
+
+            case 'q':
+                quality = (int32_t)strtol(optarg, NULL, 10);
+                hasQuality = YES;
+                break;
+
+            case 'o':
+                output = optarg;
+                break;
+
+            case 0:
+                if (strcmp("listfile", longOpts[longIndex].name) == 0)
+                    [listfiles addObject:[[NSString stringWithCString:optarg encoding:NSUTF8StringEncoding] stringByStandardizingPath]];
+                break;
+
+            default:
+                usage();
+                [p release];
+                return 2;
+        }
+
+        opt = getopt_long(argc, argv, optString, longOpts, &longIndex);
+    }
+
+    if (optind == argc || (output && argc - optind != 1)) {
+        usage();
+        [p release];
+        return 2;
+    }
+
+    // Each compressor has its own default quality
+    if (!hasQuality && compressor == MPQBZIP2Compression)
+        quality = 9;
+
+    int status = 0;
+    int i = optind;
+    for (; i < argc; i++) {
+        NSAutoreleasePool* ap = [NSAutoreleasePool new];
+
+        NSString* archivePath = pathWithCString(argv[i]);
+        NSString* outputPath = (output) ? pathWithCString(output) : archivePath;
+        MPQArchive* archive = [[MPQArchive alloc] initWithAttributes:[NSDictionary dictionaryWithObjectsAndKeys:archivePath, MPQArchivePath, [NSNumber numberWithBool:ignoreHeaderSizeField], MPQIgnoreHeaderSizeField, nil] error:&error];
+        if (!archive) {
+            printf("%s: INVALID ARCHIVE\n", argv[i]);
+            printf("    %s\n", [[error description] UTF8String]);
+            status = 1;
+            [ap release];
+            continue;
+        }
+
+        // Names are needed to decrypt encrypted files
+        [archive loadInternalListfile:(NSError**)NULL];
+        if ([listfiles count] > 0) {
+            NSEnumerator* listfileEnum = [listfiles objectEnumerator];
+            NSString* listfile;
+            while ((listfile = [listfileEnum nextObject])) [archive addContentsOfFileToFileList:listfile];
+        }
+
+        off_t originalSize = fileSize(argv[i]);
+        NSDate* start = [NSDate date];
+        if ([archive transcodeToPath:outputPath compressor:compressor quality:quality error:&error]) {
+            off_t transcodedSize = fileSize([outputPath fileSystemRepresentation]);
+            printf("%s: %lld -> %lld bytes in %.2f s\n", argv[i], (long long)originalSize, (long long)transcodedSize, -[start timeIntervalSinceNow]);
+        } else {
+            NSNumber* sector = [[error userInfo] objectForKey:MPQErrorSectorIndex];
+            if (sector) printf("%s: ERROR at sector %u: %s\n", argv[i], [sector unsignedIntValue], [[error description] UTF8String]);
+            else printf("%s: ERROR: %s\n", argv[i], [[error description] UTF8String]);
+            status = 1;
+        }
+
+        // We're done with this archive
+        [archive release];
+        [ap release];
+    }
+
+    [p release];
+    return status;
+}
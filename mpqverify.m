@@ -0,0 +1,141 @@
+//
+//  mpqverify.m
+//  MPQKit
+//
+//  Verifies the integrity of every file in one or more MPQ archives.
+//  Exits with status 1 if any archive fails verification.
+//
+
+#import <Foundation/Foundation.h>
+#import <MPQKit/MPQKit.h>
+
+#import <getopt.h>
+
+#if defined(__APPLE__)
+CFStringEncoding CFStringFileSystemEncoding(void);
+#endif
+
+static const char* optString = "iqs";
+static const struct option longOpts[] = {
+    { "ignore-header-size-field", no_argument, NULL, 'i' },
+    { "quiet", no_argument, NULL, 'q' },
+    { "strict", no_argument, NULL, 's' },
+    { "listfile", required_argument, NULL, 0 },
+    { "no-sector-checksums", no_argument, NULL, 0 },
+    { "no-decompression", no_argument, NULL, 0 },
+    { "no-attributes", no_argument, NULL, 0 },
+    { NULL, no_argument, NULL, 0 }
+};
+
+int main(int argc, char* argv[]) {
+    NSAutoreleasePool* p = [NSAutoreleasePool new];
+    NSError* error = nil;
+
+    BOOL ignoreHeaderSizeField = NO;
+    BOOL quiet = NO;
+    BOOL strict = NO;
+    MPQVerificationOptions options = MPQVerifyAll;
+    NSMutableArray* listfiles = [NSMutableArray arrayWithCapacity:0x10];
+
+    // Parse options
+    int longIndex;
+    int opt = getopt_long(argc, argv, optString, longOpts, &longIndex);
+    while (opt != -1) {
+        switch (opt) {
+            case 'i':
+                ignoreHeaderSizeField = YES;
+                break;
+
+            case 'q':
+                quiet = YES;
+                break;
+
+            case 's':
+                strict = YES;
+                break;
+
+            case 0:
+                if (strcmp("listfile", longOpts[longIndex].name) == 0)
+                    [listfiles addObject:[[NSString stringWithCString:optarg encoding:NSUTF8StringEncoding] stringByStandardizingPath]];
+                else if (strcmp("no-sector-checksums", longOpts[longIndex].name) == 0)
+                    options &= ~MPQVerifySectorChecksums;
+                else if (strcmp("no-decompression", longOpts[longIndex].name) == 0)
+                    options &= ~MPQVerifyDecompression;
+                else if (strcmp("no-attributes", longOpts[longIndex].name) == 0)
+                    options &= ~MPQVerifyAttributes;
+                break;
+
+            default:
+                fprintf(stderr, "usage: mpqverify [-iqs] [--listfile path] [--no-sector-checksums] [--no-decompression] [--no-attributes] archive ...\n");
+                [p release];
+                return 2;
+        }
+
+        opt = getopt_long(argc, argv, optString, longOpts, &longIndex);
+    }
+
+    int status = 0;
+    int i = optind;
+    for (; i < argc; i++) {
+        NSAutoreleasePool* ap = [NSAutoreleasePool new];
+
+#if defined(__APPLE__)
+        NSString* archivePath = [NSString stringWithCString:argv[i] encoding:CFStringConvertEncodingToNSStringEncoding(CFStringFileSystemEncoding())];
+#else
+        NSString* archivePath = [NSString stringWithCString:argv[i]];
+#endif
+        MPQArchive* archive = [[MPQArchive alloc] initWithAttributes:[NSDictionary dictionaryWithObjectsAndKeys:archivePath, MPQArchivePath, [NSNumber numberWithBool:ignoreHeaderSizeField], MPQIgnoreHeaderSizeField, nil] error:&error];
+        if (!archive) {
+            printf("%s: INVALID ARCHIVE\n", argv[i]);
+            printf("    %s\n", [[error description] UTF8String]);
+            status = 1;
+            [ap release];
+            continue;
+        }
+
+        [archive loadInternalListfile:(NSError**)NULL];
+        if ([listfiles count] > 0) {
+            NSEnumerator* listfileEnum = [listfiles objectEnumerator];
+            NSString* listfile;
+            while ((listfile = [listfileEnum nextObject])) [archive addContentsOfFileToFileList:listfile];
+        }
+
+        __block uint32_t verified = 0;
+        __block uint32_t failed = 0;
+        __block uint32_t skipped = 0;
+        BOOL valid = [archive verifyIntegrityWithOptions:options progress:^BOOL(NSDictionary* fileInfo, NSError* fileError) {
+            const char* utf8_filename = [[fileInfo objectForKey:MPQFilename] UTF8String];
+            uint32_t hash_position = [[fileInfo objectForKey:MPQFileHashPosition] unsignedIntValue];
+
+            if (!fileError) {
+                verified++;
+                if (!quiet) printf("%08x \"%s\": OK\n", hash_position, utf8_filename);
+            } else if ([[fileError domain] isEqualToString:MPQErrorDomain] && [fileError code] == errFilenameRequired) {
+                skipped++;
+                printf("%08x \"%s\": SKIPPED (unknown encryption key)\n", hash_position, utf8_filename);
+            } else {
+                failed++;
+                NSNumber* sector = [[fileError userInfo] objectForKey:MPQErrorSectorIndex];
+                if (sector) printf("%08x \"%s\": FAILED at sector %u: %s\n", hash_position, utf8_filename, [sector unsignedIntValue], [[fileError localizedDescription] UTF8String]);
+                else printf("%08x \"%s\": FAILED: %s\n", hash_position, utf8_filename, [[fileError localizedDescription] UTF8String]);
+            }
+            return YES;
+        } error:&error];
+
+        if (!valid && failed == 0) {
+            printf("%s: ERROR: %s\n", argv[i], [[error description] UTF8String]);
+            status = 1;
+        }
+
+        printf("%s: %u verified, %u failed, %u skipped\n", argv[i], verified, failed, skipped);
+        if (failed > 0 || (strict && skipped > 0))
+            status = 1;
+
+        // We're done with this archive
+        [archive release];
+        [ap release];
+    }
+
+    [p release];
+    return status;
+}
@@ -11,7 +11,7 @@
 #define __SCOMPRESSION_H__
 
 #include <stdint.h>
-#include <MPQKit/MPQSharedConstants.h>
+#include "MPQSharedConstants.h"
 
 #ifdef __cplusplus
 extern "C" {